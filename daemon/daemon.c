@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include "daemonize.h"
 #include "db_updater.h"
@@ -163,15 +165,14 @@ static int handle_ipc_event(merlin_event *pkt)
 	return mrm_db_update(&ipc, pkt);
 }
 
+/* returns the number of bytes read, 0 if there were none, or < 0 on errors */
 static int ipc_reap_events(void)
 {
 	int len, events = 0;
 	merlin_event *pkt;
 
-	node_log_event_count(&ipc, 0);
-
 	len = node_recv(&ipc);
-	if (len < 0)
+	if (len <= 0)
 		return len;
 
 	while ((pkt = node_get_event(&ipc))) {
@@ -190,30 +191,124 @@ static int ipc_reap_events(void)
 					break;
 				}
 				node_set_state(&ipc, STATE_CONNECTED, "Connected");
-				memcpy(&ipc.info, pkt->body, sizeof(ipc.info));
+				node_set_info(&ipc, pkt);
 				break;
 
 			case CTRL_INACTIVE:
 				/* our naemon instance might be restarting */
 				memset(&ipc.info, 0, sizeof(ipc.info));
 				break;
+
+			case CTRL_RING:
+				/* wakeups need nothing more than the read */
+				ipc_ring_attach(pkt);
+				break;
 			default:
 				break;
 			}
 		}
 
-		free(pkt);
+		slab_free(pkt);
 	}
 
-	return 0;
+	return len;
+}
+
+/*
+ * merlind waits for everything in a single epoll set. The ipc socket
+ * is edge-triggered, so it's read until it runs dry every time, and
+ * commits and the periodic event count log run off timers of their
+ * own rather than whenever a wait happens to time out.
+ */
+#define DAEMON_TICK_SECS 1      /* commit checks and ipc reconnects */
+#define DAEMON_LOG_SECS  60     /* ipc event count log */
+static int epfd = -1, tick_timer = -1, log_timer = -1;
+static int watched_sock = -1, watched_listen = -1;
+static uint32_t watched_events;
+
+static int io_add_timer(int secs)
+{
+	struct itimerspec its = { { secs, 0 }, { secs, 0 } };
+	struct epoll_event ev = { .events = EPOLLIN };
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0 || timerfd_settime(fd, 0, &its, NULL) < 0) {
+		lerr("Failed to create %d second timer: %s", secs, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		lerr("Failed to watch timer %d: %s", fd, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* returns the number of times the timer has expired since the last call */
+static uint64_t io_timer_expired(int fd)
+{
+	uint64_t expirations = 0;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	return expirations;
 }
 
-static int io_poll_sockets(void)
+/*
+ * Keep the epoll set in sync with the ipc sockets, which come and go
+ * as the module connects and disconnects. Closed sockets drop out of
+ * the set by themselves, so failing to remove them is fine. A new
+ * connection tends to get the number of the one it replaces, so
+ * whatever accepts one must call io_forget_sock() to have it added.
+ */
+static void io_watch_sockets(void)
+{
+	struct epoll_event ev = { 0 };
+	int listen_sock = ipc_listen_sock_desc();
+
+	if (listen_sock != watched_listen) {
+		if (watched_listen >= 0)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, watched_listen, &ev);
+		watched_listen = -1;
+		ev.events = EPOLLIN;
+		ev.data.fd = listen_sock;
+		if (listen_sock >= 0 && !epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev))
+			watched_listen = listen_sock;
+	}
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (ipc.sock >= 0 && node_wants_output(&ipc))
+		ev.events |= EPOLLOUT;
+	ev.data.fd = ipc.sock;
+
+	if (ipc.sock != watched_sock) {
+		if (watched_sock >= 0)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, watched_sock, &ev);
+		watched_sock = -1;
+		if (ipc.sock >= 0 && (!epoll_ctl(epfd, EPOLL_CTL_ADD, ipc.sock, &ev) ||
+		                      (errno == EEXIST && !epoll_ctl(epfd, EPOLL_CTL_MOD, ipc.sock, &ev))))
+		{
+			watched_sock = ipc.sock;
+			watched_events = ev.events;
+		}
+	} else if (ipc.sock >= 0 && ev.events != watched_events) {
+		if (!epoll_ctl(epfd, EPOLL_CTL_MOD, ipc.sock, &ev))
+			watched_events = ev.events;
+	}
+}
+
+/* the ipc socket may have been replaced by one with the same number */
+static void io_forget_sock(void)
+{
+	watched_sock = -1;
+}
+
+static void io_tick(void)
 {
-	fd_set rd, wr;
-	int sel_val, ipc_listen_sock, nfound;
-	int sockets = 0;
-	struct timeval tv = { 2, 0 };
 	static time_t last_ipc_reinit = 0;
 
 	/*
@@ -222,37 +317,66 @@ static int io_poll_sockets(void)
 	 */
 	if (ipc.sock < 0 && last_ipc_reinit + 5 < time(NULL)) {
 		ipc_reinit();
+		io_forget_sock();
 		last_ipc_reinit = time(NULL);
 	}
 
-	ipc_listen_sock = ipc_listen_sock_desc();
-	sel_val = max(ipc.sock, ipc_listen_sock);
+	/*
+	 * Try to commit any outstanding queries
+	 */
+	sql_try_commit(0);
+}
+
+static void io_poll_events(const sigset_t *sigmask)
+{
+	struct epoll_event events[8];
+	int nfound, i, msec;
 
-	FD_ZERO(&rd);
-	FD_ZERO(&wr);
-	if (ipc.sock >= 0)
-		FD_SET(ipc.sock, &rd);
-	if (ipc_listen_sock >= 0)
-		FD_SET(ipc_listen_sock, &rd);
+	/*
+	 * Events in the shared memory ring don't make the socket
+	 * readable, so we mustn't sleep for long while there are
+	 * any. If the module puts more in once we've said we're off
+	 * to sleep, it wakes us up through the socket.
+	 */
+	ipc_ring_reap(handle_ipc_event);
+	msec = ipc_ring_timeout();
 
-	if (sel_val < 0)
-		return 0;
+	io_watch_sockets();
 
-	nfound = select(sel_val + 1, &rd, &wr, NULL, &tv);
+	/* signals are only let through while we wait, so none slip by */
+	nfound = epoll_pwait(epfd, events, ARRAY_SIZE(events), msec, sigmask);
 	if (nfound < 0) {
-		lerr("select() returned %d (errno = %d): %s", nfound, errno, strerror(errno));
-		return -1;
+		if (errno == EINTR)
+			return;
+		/* try again rather than leave, but don't spin on it */
+		lerr("epoll_pwait() returned %d (errno = %d): %s", nfound, errno, strerror(errno));
+		usleep(100000);
+		return;
 	}
 
-	if (ipc_listen_sock > 0 && FD_ISSET(ipc_listen_sock, &rd)) {
-		linfo("Accepting inbound connection on ipc socket");
-		ipc_accept();
-	} else if (ipc.sock > 0 && FD_ISSET(ipc.sock, &rd)) {
-		sockets++;
-		ipc_reap_events();
+	for (i = 0; i < nfound; i++) {
+		int fd = events[i].data.fd;
+
+		if (fd == tick_timer) {
+			if (io_timer_expired(fd))
+				io_tick();
+		} else if (fd == log_timer) {
+			if (io_timer_expired(fd))
+				ipc_log_event_count();
+		} else if (fd == watched_listen) {
+			linfo("Accepting inbound connection on ipc socket");
+			ipc_accept();
+			io_forget_sock();
+		} else if (fd == ipc.sock) {
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				/* edge-triggered, so read until there's nothing left */
+				while (ipc.sock == fd && ipc_reap_events() > 0)
+					;
+			}
+			if (ipc.sock == fd && (events[i].events & EPOLLOUT))
+				node_output(&ipc);
+		}
 	}
-
-	return 0;
 }
 
 static void dump_daemon_nodes(void)
@@ -275,34 +399,38 @@ static void dump_daemon_nodes(void)
 
 static void polling_loop(void)
 {
-	for (;!merlind_sig;) {
-		if (user_sig & (1 << SIGUSR1))
-			dump_daemon_nodes();
+	sigset_t block, orig;
 
-		/*
-		 * log the event count. The marker to prevent us from
-		 * spamming the logs is in log_event_count() in logging.c
-		 */
-		ipc_log_event_count();
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		lerr("Failed to create epoll instance: %s", strerror(errno));
+		return;
+	}
+	tick_timer = io_add_timer(DAEMON_TICK_SECS);
+	log_timer = io_add_timer(DAEMON_LOG_SECS);
+	if (tick_timer < 0 || log_timer < 0)
+		return;
 
-		if (merlind_sig)
-			return;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGUSR1);
+	sigaddset(&block, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &block, &orig);
 
-		/*
-		 * io_poll_sockets() is the real worker. It handles network
-		 * and ipc based IO and ships inbound events off to their
-		 * right destination.
-		 */
-		io_poll_sockets();
-
-		if (merlind_sig)
-			return;
+	for (;!merlind_sig;) {
+		if (user_sig & (1 << SIGUSR1))
+			dump_daemon_nodes();
 
 		/*
-		 * Try to commit any outstanding queries
+		 * io_poll_events() is the real worker. It handles ipc
+		 * based IO and ships inbound events off to their right
+		 * destination, and runs whatever timers are due.
 		 */
-		sql_try_commit(0);
+		io_poll_events(&orig);
 	}
+
+	sigprocmask(SIG_SETMASK, &orig, NULL);
 }
 
 
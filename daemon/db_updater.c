@@ -3,14 +3,98 @@
 #include "ipc.h"
 #include "sql.h"
 #include "configuration.h"
+#include "perfdata.h"
 #include <naemon/naemon.h>
 
+/* a limit of a value, as SQL */
+static const char *perf_limit(char *buf, size_t size, const struct perfdata_value *v, int flag, double val)
+{
+	if (!(v->flags & flag))
+		return "NULL";
+	snprintf(buf, size, "%.17g", val);
+	return buf;
+}
+
+/*
+ * Store performance data a value per row. The node that ran the
+ * check sends it parsed along with the result if it can, and we
+ * parse the text for those that don't.
+ */
+static int handle_perf_values(const struct perfdata *sent, const monitored_object_state *st,
+                              const char *host_name, const char *service_description)
+{
+	static char parsed[PERFDATA_MAX_LEN];
+	struct perfdata local;
+	const struct perfdata *pd = sent;
+	char *rows;
+	size_t len = 0, alloc;
+	unsigned int i;
+	int result;
+
+	if (!pd) {
+		uint32_t plen = perfdata_encode(st->perf_data, parsed, sizeof(parsed));
+
+		if (!plen || !perfdata_find(parsed, plen, &local))
+			return 0;
+		pd = &local;
+	}
+
+	/* all of it goes in one query */
+	alloc = pd->num * 256;
+	if (!(rows = malloc(alloc))) {
+		lerr("failed to allocate memory for performance data");
+		return 1;
+	}
+
+	for (i = 0; i < pd->num; i++) {
+		char warn[32], crit[32], min[32], max[32];
+		char *label, *uom, *more;
+		struct perfdata_value v;
+		int n;
+
+		perfdata_get(pd, i, &v);
+		sql_quote(perfdata_string(pd, v.label), &label);
+		sql_quote(perfdata_string(pd, v.uom), &uom);
+		for (;;) {
+			n = snprintf(rows + len, alloc - len, "%s(%lu, %s, %s, %s, %.17g, %s, %s, %s, %s, %s)",
+			             i ? ", " : "", st->last_check, host_name, service_description,
+			             label, v.value, uom,
+			             perf_limit(warn, sizeof(warn), &v, PERFDATA_WARN, v.warn),
+			             perf_limit(crit, sizeof(crit), &v, PERFDATA_CRIT, v.crit),
+			             perf_limit(min, sizeof(min), &v, PERFDATA_MIN, v.min),
+			             perf_limit(max, sizeof(max), &v, PERFDATA_MAX, v.max));
+			if (n < 0 || len + n < alloc)
+				break;
+			alloc = alloc * 2 + n;
+			if (!(more = realloc(rows, alloc))) {
+				lerr("failed to allocate memory for performance data");
+				free(rows);
+				free(label);
+				free(uom);
+				return 1;
+			}
+			rows = more;
+		}
+		if (n > 0)
+			len += n;
+		free(label);
+		free(uom);
+	}
+
+	result = sql_query
+		("INSERT INTO %s(timestamp, host_name, service_description, "
+			"label, value, uom, warn, crit, min, max) VALUES %s",
+			perf_values_table, rows);
+	free(rows);
+	return result;
+}
+
 
-static int handle_host_status(int cb, const merlin_host_status *p)
+static int handle_host_status(int cb, const merlin_host_status *p, const struct perfdata *pd)
 {
 	char *host_name;
 	char *output = NULL, *long_output = NULL, *sql_safe_unescaped_long_output = NULL, *perf_data = NULL;
-	int result = 0, rpt_log = 0, perf_log = 0;
+	int result = 0, rpt_log = 0, perf_log = 0, values_log = 0;
 
 	if (cb == NEBCALLBACK_HOST_CHECK_DATA) {
 		if (db_log_reports && (p->nebattr & (NEBATTR_CHECK_ALERT | NEBATTR_CHECK_FIRST)))
@@ -18,9 +102,11 @@ static int handle_host_status(int cb, const merlin_host_status *p)
 		if (host_perf_table && p->state.perf_data && *p->state.perf_data) {
 			perf_log = 1;
 		}
+		if (perf_values_table && p->state.perf_data && *p->state.perf_data)
+			values_log = 1;
 	}
 
-	if (!rpt_log && !perf_log)
+	if (!rpt_log && !perf_log && !values_log)
 		return 0;
 
 	sql_quote(p->name, &host_name);
@@ -68,6 +154,8 @@ static int handle_host_status(int cb, const merlin_host_status *p)
 				"VALUES(%lu, %s, %s)",
 				host_perf_table, p->state.last_check, host_name, perf_data);
 	}
+	if (values_log)
+		result = handle_perf_values(pd, &p->state, host_name, "NULL");
 
 	free(host_name);
 	safe_free(output);
@@ -77,12 +165,12 @@ static int handle_host_status(int cb, const merlin_host_status *p)
 	return result;
 }
 
-static int handle_service_status(int cb, const merlin_service_status *p)
+static int handle_service_status(int cb, const merlin_service_status *p, const struct perfdata *pd)
 {
 	char *host_name, *service_description;
 	char *output = NULL, *long_output = NULL, *perf_data = NULL;
 	char *sql_safe_unescaped_long_output = NULL;
-	int result = 0, rpt_log = 0, perf_log = 0;
+	int result = 0, rpt_log = 0, perf_log = 0, values_log = 0;
 
 	if (cb == NEBCALLBACK_SERVICE_CHECK_DATA) {
 		if (db_log_reports && (p->nebattr & (NEBATTR_CHECK_ALERT | NEBATTR_CHECK_FIRST)))
@@ -90,9 +178,11 @@ static int handle_service_status(int cb, const merlin_service_status *p)
 
 		if (service_perf_table && p->state.perf_data && *p->state.perf_data)
 			perf_log = 1;
+		if (perf_values_table && p->state.perf_data && *p->state.perf_data)
+			values_log = 1;
 	}
 
-	if (!rpt_log && !perf_log)
+	if (!rpt_log && !perf_log && !values_log)
 		return 0;
 
 	sql_quote(p->host_name, &host_name);
@@ -145,6 +235,8 @@ static int handle_service_status(int cb, const merlin_service_status *p)
 				service_perf_table, p->state.last_check,
 				host_name, service_description, perf_data);
 	}
+	if (values_log)
+		result = handle_perf_values(pd, &p->state, host_name, service_description);
 
 	free(host_name);
 	free(service_description);
@@ -312,7 +404,8 @@ static int handle_contact_notification_method(const nebstruct_contact_notificati
 
 int mrm_db_update(merlin_node *node, merlin_event *pkt)
 {
-	int errors = 0;
+	struct perfdata pd;
+	int errors = 0, has_pd;
 
 	if (!sql_is_connected(1))
 		return 0;
@@ -329,6 +422,7 @@ int mrm_db_update(merlin_node *node, merlin_event *pkt)
 	if (merlin_decode_event(node, pkt)) {
 		return 0;
 	}
+	has_pd = perfdata_find(pkt->body, pkt->hdr.len, &pd);
 
 	switch (pkt->hdr.type) {
 	case NEBCALLBACK_PROCESS_DATA:
@@ -347,11 +441,11 @@ int mrm_db_update(merlin_node *node, merlin_event *pkt)
 		break;
 	case NEBCALLBACK_HOST_CHECK_DATA:
 	case NEBCALLBACK_HOST_STATUS_DATA:
-		errors = handle_host_status((int)pkt->hdr.type, (void *)pkt->body);
+		errors = handle_host_status((int)pkt->hdr.type, (void *)pkt->body, has_pd ? &pd : NULL);
 		break;
 	case NEBCALLBACK_SERVICE_CHECK_DATA:
 	case NEBCALLBACK_SERVICE_STATUS_DATA:
-		errors = handle_service_status((int)pkt->hdr.type, (void *)pkt->body);
+		errors = handle_service_status((int)pkt->hdr.type, (void *)pkt->body, has_pd ? &pd : NULL);
 		break;
 
 	default:
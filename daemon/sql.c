@@ -8,6 +8,7 @@
 /* where to (optionally) stash performance data */
 char *host_perf_table = NULL;
 char *service_perf_table = NULL;
+char *perf_values_table = NULL;
 int sql_table_crashed = 0;
 static long int commit_interval, commit_queries;
 static time_t last_commit;
@@ -575,6 +576,8 @@ int sql_config(const char *key, const char *value)
 		service_perf_table = value_cpy;
 	else if (!strcmp(key, "perfdata_table"))
 		host_perf_table = service_perf_table = value_cpy;
+	else if (!strcmp(key, "perfdata_values_table"))
+		perf_values_table = value_cpy;
 	else if (!strcmp(key, "commit_interval")) {
 		err = grok_seconds(value, &commit_interval);
 		ldebug("DB: commit_interval set to %ld seconds", commit_interval);
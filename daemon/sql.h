@@ -6,6 +6,7 @@
 
 extern char *host_perf_table;
 extern char *service_perf_table;
+extern char *perf_values_table;
 extern unsigned long total_queries;
 extern int sql_table_crashed;
 
@@ -18,7 +18,9 @@ Before do
       "configured_masters" => "0",
       "host_checks_handled" => "4",
       "service_checks_handled" => "92",
-      "monitored_object_state_size" => "408"
+      "monitored_object_state_size" => "408",
+      "capabilities" => "0",
+      "session" => ""
     },
     "NOTIFICATION" => {
       "timestamp" => sprintf("%d.%d", Time.now.to_i, 0),
@@ -623,7 +625,9 @@ Before do
       "configured_masters" => "0",
       "host_checks_handled" => "4",
       "service_checks_handled" => "92",
-      "monitored_object_state_size" => "408"
+      "monitored_object_state_size" => "408",
+      "capabilities" => "0",
+      "session" => ""
     },
     "CTRL_FETCH" => {
       "version" => "1",
@@ -642,7 +646,9 @@ Before do
       "configured_masters" => "0",
       "host_checks_handled" => "4",
       "service_checks_handled" => "92",
-      "monitored_object_state_size" => "408"
+      "monitored_object_state_size" => "408",
+      "capabilities" => "0",
+      "session" => ""
     },
   }
 end
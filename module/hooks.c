@@ -17,6 +17,7 @@
 #include "ipc.h"
 #include "pgroup.h"
 #include "net.h"
+#include "perfdata.h"
 #include <string.h>
 #include <naemon/naemon.h>
 
@@ -63,6 +64,27 @@ static int is_dupe(merlin_event *pkt)
 	return 0;
 }
 
+/* append the parsed performance data of check results, see perfdata.h */
+static uint32_t add_perfdata(merlin_event *pkt, void *data)
+{
+	const char *perf_data;
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+		perf_data = ((merlin_host_status *)data)->state.perf_data;
+		break;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+		perf_data = ((merlin_service_status *)data)->state.perf_data;
+		break;
+	default:
+		return 0;
+	}
+
+	if (!perf_data || !*perf_data)
+		return 0;
+	return perfdata_encode(perf_data, pkt->body + pkt->hdr.len, sizeof(pkt->body) - pkt->hdr.len);
+}
+
 static int send_generic(merlin_event *pkt, void *data)
 {
 	int result = 0;
@@ -86,6 +108,8 @@ static int send_generic(merlin_event *pkt, void *data)
 		lerr("Header len is 0 for callback %d. Update offset in hookinfo.h", pkt->hdr.type);
 		return -1;
 	}
+	if (binary_perfdata)
+		pkt->hdr.len += add_perfdata(pkt, data);
 
 	if (is_dupe(pkt)) {
 		ldebug("ipcfilter: Not sending %s event: Duplicate packet",
@@ -15,6 +15,9 @@
 #include "oconfsplit.h"
 #include "script-helpers.h"
 #include "net.h"
+#include "netthread.h"
+#include "delta.h"
+#include "perfdata.h"
 #include "runcmd.h"
 
 merlin_node **host_check_node = NULL;
@@ -390,7 +393,7 @@ void handle_control(merlin_node *node, merlin_event *pkt)
 		}
 
 		/* node sent info we can use, so do that */
-		memcpy(&node->info, pkt->body, sizeof(node->info));
+		node_set_info(node, pkt);
 		if (prev_state != STATE_CONNECTED) {
 
 			node_set_state(node, STATE_CONNECTED, "Received CTRL_ACTIVE");
@@ -478,7 +481,8 @@ static int handle_host_result(merlin_node *node, merlin_header *hdr, void *buf)
 	merlin_host_status *st_obj = (merlin_host_status *)buf;
 	struct tmp_net2mod_data tmp;
 
-	obj = find_host(st_obj->name);
+	/* interned names come with the host they stand for */
+	obj = node->object ? node->object : find_host(st_obj->name);
 	if (!obj) {
 		lerr("Host '%s' not found. Ignoring %s event",
 		     st_obj->name, callback_name(hdr->type));
@@ -521,7 +525,7 @@ static int handle_service_result(merlin_node *node, merlin_header *hdr, void *bu
 	merlin_service_status *st_obj = (merlin_service_status *)buf;
 	struct tmp_net2mod_data tmp;
 
-	obj = find_service(st_obj->host_name, st_obj->service_description);
+	obj = node->object ? node->object : find_service(st_obj->host_name, st_obj->service_description);
 	if (!obj) {
 		lerr("Service '%s' on host '%s' not found. Ignoring %s event",
 		     st_obj->service_description, st_obj->host_name,
@@ -950,26 +954,31 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 static int ipc_reaper(int sd, __attribute__((unused)) int events, __attribute__((unused)) void *arg)
 {
 	/*
-	 * this function doesn't really do anything anymore,
-	 * but in case we want to handle pingbacks from the daemon,
-	 * this is where they'll end up.
-	 * For now we just empty the socket
+	 * the daemon only writes to us to say its shared memory
+	 * ring has room again, so there's nothing to parse. We
+	 * just empty the socket.
 	 */
 	char buf[4096];
-	int ret;
+	int ret, got = 0;
 
 	do {
 		ret = read(sd, buf, sizeof(buf));
 		if (!ret) {
 			node_disconnect(&ipc, "read() returned zero");
-		} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-			/* ignored. if this happens, the iobroker is busted */
 			return 0;
-		} else {
+		} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* if this happens on the first read, the iobroker is busted */
+			break;
+		} else if (ret < 0) {
 			node_disconnect(&ipc, "read() failed with error %d: %s", errno, strerror(errno));
 			return 0;
 		}
-	} while (ret > 0);
+		got += ret;
+	} while (ret == sizeof(buf));
+
+	/* move what didn't fit in the ring over while there's room */
+	if (got)
+		ipc_ring_resume();
 
 	return 0;
 }
@@ -1144,6 +1153,18 @@ static void grok_module_compound(struct cfg_comp *comp)
 			cluster_update = strdup(v->value);
 			continue;
 		}
+		if (!strcmp(v->key, "net_thread")) {
+			net_thread = strtobool(v->value);
+			continue;
+		}
+		if (!strcmp(v->key, "state_deltas")) {
+			state_deltas = strtobool(v->value);
+			continue;
+		}
+		if (!strcmp(v->key, "binary_perfdata")) {
+			binary_perfdata = strtobool(v->value);
+			continue;
+		}
 
 		if (grok_common_var(comp, v))
 			continue;
@@ -1525,6 +1546,9 @@ static int post_config_init(int cb, void *ds)
 	 	*/
 		merlin_hooks_init(event_mask);
 
+		if (net_thread && num_nodes && netthread_start(net_handle_input) < 0)
+			lwarn("Failed to start the network thread. Doing network I/O in Naemon's thread");
+
 		if (net_init() < 0) {
 			lerr("Failed to initialize networking: %s\n", strerror(errno));
 			return -1;
@@ -1576,6 +1600,7 @@ static int ipc_action_handler(merlin_node *node, int prev_state)
 	 * adds before trying to send.
 	 */
 	node_send_ctrl_active(&ipc, CTRL_GENERIC, &ipc.info);
+	ipc_ring_offer();
 
 	return 0;
 }
@@ -1586,6 +1611,8 @@ static int node_action_handler(merlin_node *node, int prev_state)
 	switch (node->state) {
 	case STATE_CONNECTED:
 		pgroup_assign_peer_ids(node->pgroup);
+		if (netthread_running() && node_thread_attach(node) < 0)
+			lwarn("Failed to hand %s over to the network thread. Doing its I/O in Naemon's thread", node->name);
 		break;
 	case STATE_NEGOTIATING:
 		node_send_ctrl_active(node, 0, &ipc.info);
@@ -1757,6 +1784,12 @@ int nebmodule_init(__attribute__((unused)) int flags, char *arg, nebmodule *hand
 	ipc.info.byte_order = endianness();
 	ipc.info.monitored_object_state_size = sizeof(monitored_object_state);
 	ipc.info.object_structure_version = CURRENT_OBJECT_STRUCTURE_VERSION;
+	ipc.info.capabilities = MERLIN_CAP_FRAMES | MERLIN_CAP_CREDIT | MERLIN_CAP_SEQNONCE | MERLIN_CAP_INTERN |
+	                        MERLIN_CAP_OBJECT_IDS | MERLIN_CAP_DELTA;
+	if (zstream_supported(BINLOG_COMPRESS_LZ4))
+		ipc.info.capabilities |= MERLIN_CAP_LZ4;
+	if (zstream_supported(BINLOG_COMPRESS_ZSTD))
+		ipc.info.capabilities |= MERLIN_CAP_ZSTD;
 	gettimeofday(&ipc.info.start, NULL);
 	ipc.info.last_cfg_change = get_last_cfg_change();
 	get_config_hash(ipc.info.config_hash);
@@ -1790,6 +1823,7 @@ int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused))
 
 	linfo("Unloading Merlin module");
 
+	netthread_stop();
 	ipc_deinit();
 	log_deinit();
 	net_deinit();
@@ -1804,14 +1838,26 @@ int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused))
 	 */
 	nm_bufferqueue_destroy(ipc.bq);
 	free_objectlist(&ipc.ipc_blocked_hostgroups);
+	slab_destroy(&ipc.slab);
 
 	for (i = 0; i < num_nodes; i++) {
 		struct merlin_node *node = node_table[i];
+
+		/* whatever's batched up goes out now, or in the backlog */
+		node_frame_flush(node);
+		safe_free(node->frame_out);
+		slab_free(node->frame_in);
+		node->frame_in = NULL;
+		slab_destroy(&node->slab);
+
 		/* Save nodes binlog to file if binlog persistence is enabled */
 		if (binlog_persist == true) {
 			if (binlog_save(node->binlog) != 0) {
 				lwarn("Couldn't save binlog for persistence");
 			}
+			if (node->prio_binlog && binlog_save(node->prio_binlog) != 0) {
+				lwarn("Couldn't save priority binlog for persistence");
+			}
 		}
 
 		free(node->name);
@@ -1827,6 +1873,8 @@ int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused))
 	g_hash_table_destroy(host_hash_table);
 
 	binlog_wipe(ipc.binlog, BINLOG_UNLINK);
+	ipc_ring_close();
+	binlog_writer_stop();
 
 	pgroup_deinit();
 	free(merlin_config_file);
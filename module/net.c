@@ -116,6 +116,7 @@ static int find_node_uuid(int sd, int ignore, void * ctx_) {
 
 	if (pkt) {
 		handle_event(found_node, pkt);
+		slab_free(pkt);
 	}
 
 	return result;
@@ -232,28 +233,21 @@ int net_is_connected(merlin_node *node)
 
 
 /*
- * Reads input from a particular node and ships it off to
- * the "handle_event()"
+ * Handle the events in the len bytes just read from a node, whether
+ * we read them ourselves or got them from the network thread
  */
-int net_input(int sd, int io_evt, void *node_)
+int net_handle_input(merlin_node *node, int len)
 {
 	merlin_event *pkt;
-	merlin_node *node = (merlin_node *)node_;
-	int len, events = 0;
+	int events = 0;
 
-	errno = 0;
-	ldebug("NETINPUT from %p (%s)", node, node ? node->name : "oops");
-	len = node_recv(node);
-	if (len < 0) {
-		return 0;
-	}
 	node->stats.bytes.read += len;
 	node->last_recv = time(NULL);
 
 	while ((pkt = node_get_event(node))) {
 		events++;
 		handle_event(node, pkt);
-		free(pkt);
+		slab_free(pkt);
 	}
 	ldebug("Read %d events in %s from %s node %s",
 		   events, human_bytes(len), node_type(node), node->name);
@@ -261,6 +255,25 @@ int net_input(int sd, int io_evt, void *node_)
 	return events;
 }
 
+/*
+ * Reads input from a particular node and ships it off to
+ * the "handle_event()"
+ */
+int net_input(int sd, int io_evt, void *node_)
+{
+	merlin_node *node = (merlin_node *)node_;
+	int len;
+
+	errno = 0;
+	ldebug("NETINPUT from %p (%s)", node, node ? node->name : "oops");
+	len = node_recv(node);
+	if (len < 0) {
+		return 0;
+	}
+
+	return net_handle_input(node, len);
+}
+
 
 /*
  * Negotiate which socket to use for communication when the remote
@@ -348,6 +361,13 @@ static int conn_writable(int sd, int events, void *node_)
 	ldebug("CONN: In conn_writable(): node=%s; sd=%d; node->conn_sock=%d", node->name, sd, node->conn_sock);
 	iobroker_unregister(nagios_iobs, sd);
 
+	/* we're connected already, and the network thread has the socket */
+	if (node->netconn) {
+		close(sd);
+		node->conn_sock = -1;
+		return 0;
+	}
+
 	if (node->sock < 0) {
 		/* no inbound connection accept()'ed yet */
 		node->sock = sd;
@@ -749,7 +769,7 @@ int net_sendto(merlin_node *node, merlin_event *pkt)
 	}
 
     /* Do not block in the Naemon event loop, retry on the next iteration. */
-	return node_send_event(node, pkt, 0);
+	return node_send_event(node, pkt);
 }
 
 int net_sendto_many(merlin_node **ntable, uint num, merlin_event *pkt)
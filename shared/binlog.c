@@ -1,50 +1,1661 @@
 /**
  * binary logging functions
+ *
+ * The binlog is a list of segments, each of which is a single mmap()'d
+ * region holding length-prefixed records back to back. Segments start
+ * out as anonymous memory. Once max_mem_size would be exceeded, all
+ * memory segments are moved into the on-disk file and new segments are
+ * mapped straight from it, so the in-memory and on-disk parts of the
+ * log are one continuous stream and adding or reading an entry is a
+ * memcpy() and a pointer bump. File segments that have been fully read
+ * are kept on a freelist and reused, turning the file into a ring.
+ *
+ * If compression is enabled, file segments that are sealed (no longer
+ * written to) and haven't been read from yet are compressed into a
+ * slot of their own and unmapped. They're decompressed into anonymous
+ * memory again once the reader gets to them.
+ *
+ * The file describes itself. Its first page holds the read and write
+ * cursors, every slot starts with a segment header carrying a sequence
+ * number and every record carries a checksum, so a saved (or crashed)
+ * binlog can be adopted in place without an index or any copying.
+ * Everything from the first record that doesn't checksum is discarded.
+ *
+ * Compression and syncing the file to disk are left to a background
+ * thread, so neither holds up whoever is adding entries.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "config.h"
+#ifdef HAVE_LIBLZ4
+# include <lz4.h>
+#endif
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+#endif
 #include "binlog.h"
 #include "logging.h"
 
-struct binlog_entry {
-	unsigned int size;
-	void *data;
+/* default segment size. Must be a multiple of the page size */
+#define BINLOG_SEGMENT_SIZE (1 << 20)
+
+/*
+ * every record is prefixed with this, and padded to 8 bytes. The
+ * checksum covers the segment's sequence number, the length and the
+ * data, so stale records left in a reused slot never validate.
+ * Records superseded by a later one with the same key are flagged
+ * dead in the length field and skipped by readers. The flag isn't
+ * covered by the checksum, since it's set after the fact.
+ * Records in a shared binlog start with a mask of the readers that
+ * have yet to read them, which isn't covered by the checksum either.
+ */
+struct binlog_record {
+	uint32_t len;
+	uint32_t crc;
+};
+#define BINLOG_REC_DEAD 0x80000000U
+#define BINLOG_REC_SHARED 0x40000000U
+#define BINLOG_REC_FLAGS (BINLOG_REC_DEAD | BINLOG_REC_SHARED)
+#define BINLOG_ALIGN(x) (((x) + 7) & ~7)
+#define record_size(len) (sizeof(struct binlog_record) + BINLOG_ALIGN(len))
+#define record_len(rec) ((rec)->len & ~BINLOG_REC_FLAGS)
+#define record_is_dead(rec) ((rec)->len & BINLOG_REC_DEAD)
+#define record_is_shared(rec) ((rec)->len & BINLOG_REC_SHARED)
+#define record_mask(rec) ((uint64_t *)((rec) + 1))
+
+/* first page of the file */
+#define BINLOG_FILE_MAGIC 0x6d626c66
+#define BINLOG_FILE_VERSION 1
+struct binlog_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t read_seq;  /* segment holding the next record to read */
+	uint64_t write_seq; /* segment the last record was written to */
+	uint32_t read_pos;  /* offsets of those records in their segments */
+	uint32_t write_pos;
+	uint32_t reader_id[BINLOG_MAX_READERS]; /* readers of a shared binlog */
+};
+
+/*
+ * start of every file slot. Uncompressed segments are "sealed" once
+ * they're no longer written to, which records what's in them here.
+ */
+#define BINLOG_SEG_MAGIC 0x6d627367
+#define BINLOG_SEG_FREE 0x6d627366
+struct binlog_segment_header {
+	uint32_t magic;     /* BINLOG_SEG_MAGIC, or BINLOG_SEG_FREE when released */
+	uint32_t crc;       /* of everything below */
+	uint64_t seq;       /* segments are read in sequence order */
+	uint32_t size;      /* size of the slot */
+	uint32_t tail;      /* end of the records if sealed or compressed, else 0 */
+	uint32_t entries;   /* number of records if sealed or compressed */
+	uint32_t zsize;     /* compressed size of the records, 0 if uncompressed */
+	uint64_t avail;     /* bytes of record data if sealed or compressed */
+	uint32_t zmethod;   /* BINLOG_COMPRESS_* used for the segment */
+	uint32_t reserved;
+};
+#define BINLOG_SEG_HDR sizeof(struct binlog_segment_header)
+
+struct binlog_segment {
+	char *base;          /* start of the mapping */
+	unsigned int size;   /* size of the mapping */
+	unsigned int head;   /* offset of the next record to read */
+	unsigned int tail;   /* offset where the next record is written */
+	unsigned int entries; /* unread records in this segment */
+	off_t offset;        /* position in the file, or -1 if anonymous */
+	unsigned int zsize;  /* compressed size in the file, 0 if uncompressed */
+	unsigned int zslot;  /* size of the file slot holding compressed data */
+	int zmethod;         /* BINLOG_COMPRESS_* used for the segment */
+	int verify;          /* adopted from disk, so check records when read */
+	int zstate;          /* BINLOG_Z_*, how far compressing it has got */
+	uint64_t seq;
+	struct binlog_segment *next;
+};
+#define BINLOG_Z_NONE 0
+#define BINLOG_Z_QUEUED 1 /* handed to the background writer */
+#define BINLOG_Z_TRIED 2  /* compressed, or not worth trying again */
+#define segment_in_file(seg) ((seg)->offset >= 0)
+#define segment_compressed(seg) ((seg)->zsize > 0)
+#define segment_used(seg) ((seg)->tail - BINLOG_SEG_HDR)
+#define segment_hdr(seg) ((struct binlog_segment_header *)(seg)->base)
+#define segment_rec(seg, pos) ((struct binlog_record *)((seg)->base + (pos)))
+
+/*
+ * where the latest record added with a given key is, so it can be
+ * killed when it's superseded. Entries are checked against the read
+ * position before they're used, so stale ones are harmless. Readers
+ * of a shared binlog also need the one before it, since the latest
+ * one may be where they were merged in.
+ */
+struct binlog_key {
+	uint64_t key;  /* 0 for unused slots */
+	uint64_t seq, prev_seq;
+	struct binlog_segment *seg, *prev_seg;
+	unsigned int pos, prev_pos;
+};
+
+/*
+ * The readers of a shared binlog, by the bit they have in the mask
+ * of each record. Readers are identified by a hash of their name,
+ * which is stored in the file so they get their bits back when it's
+ * adopted.
+ */
+struct binlog_readers {
+	binlog *view[BINLOG_MAX_READERS];
+	uint32_t id[BINLOG_MAX_READERS]; /* 0 if the bit is unused */
+	uint64_t orphans; /* adopted bits no reader has claimed yet */
+	struct binlog_segment *last_seg; /* the latest record, for merging */
+	unsigned int last_pos;
 };
-typedef struct binlog_entry binlog_entry;
-#define entry_size(entry) (entry->size + sizeof(struct binlog_entry))
 
-/*** private helpers ***/
-static int safe_write(binlog *bl, void *buf, int len)
+static const char *compression_names[] = { "none", "lz4", "zstd" };
+
+/*** private helpers ***/
+static unsigned int page_align(unsigned long long int size)
+{
+	static unsigned int page_size;
+
+	if (!page_size)
+		page_size = (unsigned int)sysconf(_SC_PAGESIZE);
+
+	return ((size + page_size - 1) / page_size) * page_size;
+}
+
+/* crc32c (Castagnoli), table driven */
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const unsigned char *p = buf;
+
+	if (!table[1]) {
+		uint32_t i, k, c;
+		for (i = 0; i < 256; i++) {
+			for (c = i, k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* same thing using the SSE4.2 instruction, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned long long c = ~crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		unsigned long long v;
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	static int have_sse42 = -1;
+
+	if (have_sse42 < 0)
+		have_sse42 = __builtin_cpu_supports("sse4.2");
+	if (have_sse42)
+		return crc32c_hw(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+}
+
+static uint32_t record_crc(uint64_t seq, struct binlog_record *rec)
+{
+	uint32_t len = rec->len & ~BINLOG_REC_DEAD;
+	uint32_t crc = crc32c(0, &seq, sizeof(seq));
+	crc = crc32c(crc, &len, sizeof(len));
+	if (record_is_shared(rec))
+		return crc32c(crc, record_mask(rec) + 1, record_len(rec) - sizeof(uint64_t));
+	return crc32c(crc, rec + 1, len);
+}
+
+static uint32_t segment_header_crc(struct binlog_segment_header *sh)
+{
+	return crc32c(0, &sh->seq, BINLOG_SEG_HDR - offsetof(struct binlog_segment_header, seq));
+}
+
+/* describe a segment, sealing it unless it's the one we write to */
+static void segment_header_init(binlog *bl, struct binlog_segment *seg, struct binlog_segment_header *sh)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->magic = BINLOG_SEG_MAGIC;
+	sh->seq = seg->seq;
+	sh->size = segment_compressed(seg) ? seg->zslot : seg->size;
+	if (segment_compressed(seg) || seg != bl->tail) {
+		unsigned int pos;
+
+		sh->tail = seg->tail;
+		for (pos = BINLOG_SEG_HDR; pos < seg->tail; pos += record_size(record_len(segment_rec(seg, pos)))) {
+			if (record_is_dead(segment_rec(seg, pos)))
+				continue;
+			sh->entries++;
+			sh->avail += segment_rec(seg, pos)->len;
+		}
+	}
+	sh->zsize = seg->zsize;
+	sh->zmethod = seg->zmethod;
+	sh->crc = segment_header_crc(sh);
+}
+
+/* write the header of a mapped file segment */
+static void segment_write_header(binlog *bl, struct binlog_segment *seg)
+{
+	struct binlog_segment_header sh;
+
+	segment_header_init(bl, seg, &sh);
+	memcpy(seg->base, &sh, sizeof(sh));
+}
+
+static void update_read_cursor(binlog *bl, struct binlog_segment *seg)
+{
+	if (bl->fhdr && segment_in_file(seg)) {
+		bl->fhdr->read_seq = seg->seq;
+		bl->fhdr->read_pos = seg->head;
+	}
+}
+
+static void update_write_cursor(binlog *bl)
+{
+	if (bl->fhdr && bl->tail && segment_in_file(bl->tail)) {
+		bl->fhdr->write_seq = bl->tail->seq;
+		bl->fhdr->write_pos = bl->tail->tail;
+	}
+}
+
+static int map_file_header(binlog *bl)
+{
+	bl->fhdr = mmap(NULL, page_align(1), PROT_READ | PROT_WRITE, MAP_SHARED, bl->fd, 0);
+	if (bl->fhdr == MAP_FAILED) {
+		lerr("binlog: Failed to map header of %s: %s", bl->path, strerror(errno));
+		bl->fhdr = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open the file. It's started over with a fresh header unless
+ * we already have segments in it.
+ */
+static int binlog_open(binlog *bl)
+{
+	if (bl->fd != -1)
+		return bl->fd;
+
+	if (!bl->path)
+		return BINLOG_ENOPATH;
+
+	bl->fd = open(bl->path, O_RDWR | O_CREAT | (bl->file_end ? 0 : O_TRUNC), 0600);
+	if (bl->fd < 0)
+		return -1;
+
+	if (bl->fhdr)
+		return 0;
+
+	if (posix_fallocate(bl->fd, 0, page_align(1)) || map_file_header(bl) < 0) {
+		binlog_close(bl);
+		return -1;
+	}
+	bl->fhdr->magic = BINLOG_FILE_MAGIC;
+	bl->fhdr->version = BINLOG_FILE_VERSION;
+	if (bl->readers)
+		memcpy(bl->fhdr->reader_id, bl->readers->id, sizeof(bl->fhdr->reader_id));
+	bl->file_end = page_align(1);
+
+	return 0;
+}
+
+/* tell recovery a file slot no longer holds anything useful */
+static void slot_mark_free(binlog *bl, struct binlog_segment *seg)
+{
+	uint32_t magic = BINLOG_SEG_FREE;
+
+	if (seg->base && !segment_compressed(seg)) {
+		segment_hdr(seg)->magic = magic;
+		return;
+	}
+
+	if (binlog_open(bl) < 0 || pwrite(bl->fd, &magic, sizeof(magic), seg->offset) != sizeof(magic)) {
+		lwarn("binlog: Failed to release slot at offset %llu: %s",
+		      (unsigned long long)seg->offset, strerror(errno));
+	}
+}
+
+/*
+ * Find room for 'size' bytes in the file, either in a released slot
+ * or at the end of it. The blocks are reserved up front so running
+ * out of disk makes us fail here rather than SIGBUS when we write to
+ * a mapping of the slot later.
+ */
+static struct binlog_segment *slot_alloc(binlog *bl, unsigned int size)
+{
+	struct binlog_segment **slot, *seg;
+
+	if (binlog_open(bl) < 0)
+		return NULL;
+
+	for (slot = &bl->free_slots; *slot; slot = &(*slot)->next) {
+		if ((*slot)->size >= size) {
+			seg = *slot;
+			*slot = seg->next;
+			return seg;
+		}
+	}
+
+	if (posix_fallocate(bl->fd, bl->file_end, size))
+		return NULL;
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return NULL;
+	seg->offset = bl->file_end;
+	seg->size = size;
+	bl->file_end += size;
+
+	return seg;
+}
+
+/*
+ * Map a new segment with room for at least 'size' bytes of records,
+ * either anonymous or backed by the binlog file.
+ */
+static struct binlog_segment *segment_create(binlog *bl, unsigned int size, int in_file)
+{
+	struct binlog_segment *seg = NULL;
+
+	size = page_align(size + BINLOG_SEG_HDR);
+	if (in_file) {
+		seg = slot_alloc(bl, size);
+		if (!seg)
+			return NULL;
+		seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, bl->fd, seg->offset);
+	} else {
+		seg = calloc(1, sizeof(*seg));
+		if (!seg)
+			return NULL;
+		seg->offset = -1;
+		seg->size = size;
+		seg->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (seg->base == MAP_FAILED) {
+		lerr("binlog: Failed to map %u byte segment: %s", seg->size, strerror(errno));
+		seg->base = NULL;
+		if (in_file) {
+			seg->next = bl->free_slots;
+			bl->free_slots = seg;
+		} else {
+			free(seg);
+		}
+		return NULL;
+	}
+
+	seg->head = seg->tail = BINLOG_SEG_HDR;
+	seg->entries = 0;
+	seg->verify = 0;
+	seg->zstate = BINLOG_Z_NONE;
+	seg->seq = bl->next_seq++;
+	seg->next = NULL;
+	return seg;
+}
+
+/*** compression of sealed file segments ***/
+static unsigned int compress_bound(int method, unsigned int len)
+{
+	switch (method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+	}
+	return 0;
+}
+
+/* returns the compressed size, or 0 on errors */
+static unsigned int compress_buf(int method, const char *src, unsigned int len, char *dst, unsigned int dst_len)
+{
+	switch (method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		return LZ4_compress_default(src, dst, len, dst_len);
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD: {
+		size_t ret = ZSTD_compress(dst, dst_len, src, len, 1);
+		return ZSTD_isError(ret) ? 0 : ret;
+		}
+#endif
+	}
+	return 0;
+}
+
+/* returns 0 if exactly 'len' bytes were restored, -1 otherwise */
+static int decompress_buf(int method, const char *src, unsigned int zlen, char *dst, unsigned int len)
+{
+	switch (method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		return LZ4_decompress_safe(src, dst, zlen, len) == (int)len ? 0 : -1;
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD:
+		return ZSTD_decompress(dst, len, src, zlen) == len ? 0 : -1;
+#endif
+	}
+	return -1;
+}
+
+/*
+ * Store the compressed records of a sealed segment in a file slot of
+ * their own and get rid of the uncompressed copy, which may be either
+ * a file segment or an anonymous one. 'buf' has room for the segment
+ * header in front of the records. Segments that don't shrink are left
+ * as they are; that's not an error.
+ * Returns 0 if the segment was compressed, -1 otherwise.
+ */
+static int segment_store_compressed(binlog *bl, struct binlog_segment *seg, char *buf, unsigned int zsize, int method)
+{
+	struct binlog_segment_header sh;
+	struct binlog_segment *slot;
+
+	if (!zsize || page_align(BINLOG_SEG_HDR + zsize) >= page_align(seg->tail))
+		return -1;
+
+	slot = slot_alloc(bl, page_align(BINLOG_SEG_HDR + zsize));
+	if (!slot)
+		return -1;
+
+	/* the header describes the compressed segment */
+	seg->zsize = zsize;
+	seg->zslot = slot->size;
+	seg->zmethod = method;
+	segment_header_init(bl, seg, &sh);
+	memcpy(buf, &sh, sizeof(sh));
+	if (pwrite(bl->fd, buf, BINLOG_SEG_HDR + zsize, slot->offset) != (ssize_t)(BINLOG_SEG_HDR + zsize)) {
+		seg->zsize = seg->zslot = 0;
+		slot->next = bl->free_slots;
+		bl->free_slots = slot;
+		return -1;
+	}
+
+	if (segment_in_file(seg)) {
+		/* hand the uncompressed slot back for reuse */
+		off_t offset = slot->offset;
+		segment_hdr(seg)->magic = BINLOG_SEG_FREE;
+		slot->offset = seg->offset;
+		slot->size = seg->size;
+		slot->next = bl->free_slots;
+		bl->free_slots = slot;
+		seg->offset = offset;
+		bl->file_size -= segment_used(seg);
+	} else {
+		seg->offset = slot->offset;
+		bl->mem_size -= segment_used(seg);
+		free(slot);
+	}
+	munmap(seg->base, seg->size);
+	seg->base = NULL;
+	bl->file_size += zsize;
+	return 0;
+}
+
+/*
+ * Compress a sealed segment right away. Segments that are partially
+ * read are left as they are.
+ */
+static void segment_compress(binlog *bl, struct binlog_segment *seg)
+{
+	unsigned int bound, zsize;
+	char *buf;
+
+	/* readers of a shared binlog update its records in place */
+	if (!bl->compression || bl->readers || seg->head != BINLOG_SEG_HDR || !seg->entries || segment_compressed(seg))
+		return;
+
+	bound = compress_bound(bl->compression, segment_used(seg));
+	if (!bound || !(buf = malloc(BINLOG_SEG_HDR + bound)))
+		return;
+
+	zsize = compress_buf(bl->compression, seg->base + BINLOG_SEG_HDR, segment_used(seg), buf + BINLOG_SEG_HDR, bound);
+	segment_store_compressed(bl, seg, buf, zsize, bl->compression);
+	free(buf);
+}
+
+/*
+ * Make sure a compressed segment is available in memory so
+ * records can be read from it
+ */
+static int segment_load(binlog *bl, struct binlog_segment *seg)
+{
+	char *zbuf;
+	int ret;
+
+	if (seg->base)
+		return 0;
+
+	if (binlog_open(bl) < 0)
+		return -1;
+
+	zbuf = mmap(NULL, seg->zslot, PROT_READ, MAP_SHARED, bl->fd, seg->offset);
+	if (zbuf == MAP_FAILED) {
+		lerr("binlog: Failed to map %u byte compressed segment: %s", seg->zsize, strerror(errno));
+		return -1;
+	}
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (seg->base == MAP_FAILED) {
+		lerr("binlog: Failed to map %u byte segment: %s", seg->size, strerror(errno));
+		seg->base = NULL;
+		munmap(zbuf, seg->zslot);
+		return -1;
+	}
+
+	ret = decompress_buf(seg->zmethod, zbuf + BINLOG_SEG_HDR, seg->zsize, seg->base + BINLOG_SEG_HDR, segment_used(seg));
+	munmap(zbuf, seg->zslot);
+	if (ret < 0) {
+		lerr("binlog: Failed to decompress %u byte segment using %s",
+		     seg->zsize, binlog_compression_name(seg->zmethod));
+		munmap(seg->base, seg->size);
+		seg->base = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*** background writer ***/
+
+/*
+ * Compressing sealed segments and syncing the file to disk is done by
+ * a thread of our own. Jobs are handed to it and back through a pair
+ * of single-producer, single-consumer rings, which is all it shares
+ * with us. It works on a dup() of the binlog's file descriptor and
+ * never touches the binlog itself, so compressed records are only
+ * installed by us, once we've checked that the segment hasn't been
+ * read from or compacted in the meantime. If the thread can't be
+ * started, segments are compressed on the spot and the file is left
+ * for the kernel to write back.
+ */
+#define BINLOG_WRITER_QUEUE 256 /* must be a power of 2 */
+#define BINLOG_JOB_COMPRESS 1
+#define BINLOG_JOB_SYNC 2
+
+struct binlog_job {
+	int type;          /* BINLOG_JOB_* */
+	int fd;            /* the writer's own copy of the binlog's fd */
+	binlog *bl;
+	uint64_t seq;      /* the segment to compress, as it was then */
+	off_t offset;
+	unsigned int len, entries;
+	int method;
+	char *zbuf;        /* room for a segment header, then the compressed records */
+	unsigned int zsize;
+	int error;         /* errno of a failed fdatasync() */
+	unsigned long long int usecs;
+};
+
+struct binlog_job_ring {
+	struct binlog_job *job[BINLOG_WRITER_QUEUE];
+	unsigned int head; /* only written by the consumer */
+	unsigned int tail; /* only written by the producer */
+};
+
+static struct {
+	struct binlog_job_ring todo, done;
+	pthread_mutex_t lock; /* only used for sleeping and waking up */
+	pthread_cond_t work, finished;
+	pthread_t thread;
+	unsigned int queued;  /* jobs handed out and not reaped yet */
+	int state;            /* 1 when running, -1 if it failed to start */
+	int stop;
+} writer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.finished = PTHREAD_COND_INITIALIZER,
+};
+
+static int ring_push(struct binlog_job_ring *r, struct binlog_job *job)
+{
+	unsigned int tail = r->tail;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == BINLOG_WRITER_QUEUE)
+		return -1;
+	r->job[tail & (BINLOG_WRITER_QUEUE - 1)] = job;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static struct binlog_job *ring_pop(struct binlog_job_ring *r)
+{
+	unsigned int head = r->head;
+	struct binlog_job *job;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	job = r->job[head & (BINLOG_WRITER_QUEUE - 1)];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return job;
+}
+
+static int ring_is_empty(struct binlog_job_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* runs in the writer thread */
+static void writer_run(struct binlog_job *job)
+{
+	struct timespec start, end;
+	unsigned int bound;
+	char *buf;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (job->type == BINLOG_JOB_SYNC) {
+		if (fdatasync(job->fd) < 0)
+			job->error = errno;
+	} else {
+		bound = compress_bound(job->method, job->len);
+		buf = malloc(job->len);
+		job->zbuf = bound ? malloc(BINLOG_SEG_HDR + bound) : NULL;
+		if (buf && job->zbuf && pread(job->fd, buf, job->len, job->offset + BINLOG_SEG_HDR) == (ssize_t)job->len)
+			job->zsize = compress_buf(job->method, buf, job->len, job->zbuf + BINLOG_SEG_HDR, bound);
+		free(buf);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	job->usecs = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static void *writer_main(__attribute__((unused)) void *arg)
+{
+	struct binlog_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&writer.lock);
+		while (!(job = ring_pop(&writer.todo)) && !writer.stop)
+			pthread_cond_wait(&writer.work, &writer.lock);
+		pthread_mutex_unlock(&writer.lock);
+		if (!job)
+			return NULL;
+
+		writer_run(job);
+
+		/* there's room, since no more jobs are handed out than fit */
+		ring_push(&writer.done, job);
+		pthread_mutex_lock(&writer.lock);
+		pthread_cond_signal(&writer.finished);
+		pthread_mutex_unlock(&writer.lock);
+	}
+}
+
+static int writer_start(void)
+{
+	sigset_t all, old;
+	int ret;
+
+	if (writer.state)
+		return writer.state > 0 ? 0 : -1;
+
+	/* signals are for the main thread to handle */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	writer.stop = 0;
+	ret = pthread_create(&writer.thread, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		lerr("binlog: Failed to start background writer: %s", strerror(ret));
+		writer.state = -1;
+		return -1;
+	}
+	writer.state = 1;
+	return 0;
+}
+
+/* hand a job over to the writer. The binlog's file must be open */
+static int writer_submit(binlog *bl, struct binlog_job *job)
+{
+	if (writer.queued >= BINLOG_WRITER_QUEUE || writer_start() < 0)
+		return -1;
+	job->fd = dup(bl->fd);
+	if (job->fd < 0)
+		return -1;
+
+	job->bl = bl;
+	ring_push(&writer.todo, job);
+	writer.queued++;
+	bl->io.queued++;
+	pthread_mutex_lock(&writer.lock);
+	pthread_cond_signal(&writer.work);
+	pthread_mutex_unlock(&writer.lock);
+	return 0;
+}
+
+/*
+ * Hand sealed file segments nobody has read from yet over to the
+ * writer for compression, or compress them right away if there's no
+ * writer. Whatever doesn't fit in the queue is picked up later.
+ */
+static void segment_queue_sealed(binlog *bl)
+{
+	struct binlog_segment *seg;
+
+	if (!bl->compression || bl->readers)
+		return;
+
+	for (seg = bl->head; seg && seg != bl->tail; seg = seg->next) {
+		struct binlog_job *job;
+
+		if (seg->zstate != BINLOG_Z_NONE || !segment_in_file(seg) || segment_compressed(seg) ||
+		    !seg->base || seg->head != BINLOG_SEG_HDR || !seg->entries)
+		{
+			continue;
+		}
+
+		if (writer_start() < 0) {
+			segment_compress(bl, seg);
+			seg->zstate = BINLOG_Z_TRIED;
+			continue;
+		}
+
+		if (binlog_open(bl) < 0 || !(job = calloc(1, sizeof(*job))))
+			return;
+		job->type = BINLOG_JOB_COMPRESS;
+		job->seq = seg->seq;
+		job->offset = seg->offset;
+		job->len = segment_used(seg);
+		job->entries = seg->entries;
+		job->method = bl->compression;
+		if (writer_submit(bl, job) < 0) {
+			free(job);
+			return;
+		}
+		seg->zstate = BINLOG_Z_QUEUED;
+	}
+}
+
+/* have the file synced if it's been a while */
+static void binlog_queue_sync(binlog *bl)
+{
+	struct binlog_job *job;
+	time_t now;
+
+	if (!bl->sync_interval || bl->sync_queued)
+		return;
+
+	now = time(NULL);
+	if (now - bl->last_sync < bl->sync_interval)
+		return;
+	bl->last_sync = now;
+
+	if (binlog_open(bl) < 0 || !(job = calloc(1, sizeof(*job))))
+		return;
+	job->type = BINLOG_JOB_SYNC;
+	if (writer_submit(bl, job) < 0) {
+		free(job);
+		return;
+	}
+	bl->sync_queued = 1;
+}
+
+/* take care of what the writer has finished */
+static void writer_reap(void)
+{
+	struct binlog_job *job;
+
+	while ((job = ring_pop(&writer.done))) {
+		binlog *bl = job->bl;
+
+		close(job->fd);
+		writer.queued--;
+		bl->io.queued--;
+
+		if (job->type == BINLOG_JOB_SYNC) {
+			bl->sync_queued = 0;
+			if (job->error) {
+				lwarn("binlog: Failed to sync %s to disk: %s", bl->path, strerror(job->error));
+			} else {
+				bl->io.syncs++;
+				bl->io.sync_usecs = job->usecs;
+				if (job->usecs > bl->io.sync_usecs_max)
+					bl->io.sync_usecs_max = job->usecs;
+			}
+		} else {
+			struct binlog_segment *seg;
+
+			/*
+			 * The segment may have been read, compacted or released
+			 * since, in which case the result is of no use
+			 */
+			for (seg = bl->head; seg && seg->seq != job->seq; seg = seg->next)
+				;
+			if (seg && seg->zstate == BINLOG_Z_QUEUED) {
+				seg->zstate = BINLOG_Z_TRIED;
+				if (seg != bl->tail && seg->base && seg->offset == job->offset &&
+				    !segment_compressed(seg) && seg->head == BINLOG_SEG_HDR &&
+				    seg->entries == job->entries && segment_used(seg) == job->len &&
+				    !segment_store_compressed(bl, seg, job->zbuf, job->zsize, job->method))
+				{
+					bl->io.compressed++;
+				}
+			}
+			free(job->zbuf);
+			if (!writer.stop)
+				segment_queue_sealed(bl);
+		}
+		free(job);
+	}
+}
+
+/* wait for the writer to finish something, and take care of it */
+static void writer_wait(void)
+{
+	pthread_mutex_lock(&writer.lock);
+	while (ring_is_empty(&writer.done))
+		pthread_cond_wait(&writer.finished, &writer.lock);
+	pthread_mutex_unlock(&writer.lock);
+	writer_reap();
+}
+
+/* unmap a segment, putting its file slot on the freelist */
+static void segment_release(binlog *bl, struct binlog_segment *seg)
+{
+	if (bl->last_read_seg == seg)
+		bl->last_read_seg = NULL;
+
+	if (segment_in_file(seg))
+		slot_mark_free(bl, seg);
+	if (seg->base)
+		munmap(seg->base, seg->size);
+	seg->base = NULL;
+	if (segment_compressed(seg)) {
+		bl->file_size -= seg->zsize;
+		seg->size = seg->zslot;
+		seg->zsize = seg->zslot = 0;
+		seg->next = bl->free_slots;
+		bl->free_slots = seg;
+	} else if (segment_in_file(seg)) {
+		bl->file_size -= segment_used(seg);
+		seg->next = bl->free_slots;
+		bl->free_slots = seg;
+	} else {
+		bl->mem_size -= segment_used(seg);
+		free(seg);
+	}
+}
+
+/* forget about the file and all the slots in it */
+static void binlog_file_reset(binlog *bl)
+{
+	while (bl->free_slots) {
+		struct binlog_segment *seg = bl->free_slots;
+		bl->free_slots = seg->next;
+		free(seg);
+	}
+	if (bl->fhdr) {
+		munmap(bl->fhdr, page_align(1));
+		bl->fhdr = NULL;
+	}
+	binlog_close(bl);
+	if (bl->path)
+		unlink(bl->path);
+	bl->file_size = bl->file_end = 0;
+}
+
+/* the records the key table points to are going away */
+static void binlog_forget_keys(binlog *bl)
+{
+	if (bl->keys)
+		memset(bl->keys, 0, (bl->key_mask + 1) * sizeof(*bl->keys));
+	bl->num_keys = 0;
+}
+
+/* reset the in-memory state, leaving the file untouched */
+static void binlog_forget(binlog *bl)
+{
+	while (bl->head) {
+		struct binlog_segment *seg = bl->head;
+		bl->head = seg->next;
+		if (seg->base)
+			munmap(seg->base, seg->size);
+		free(seg);
+	}
+	bl->tail = NULL;
+	bl->last_read_seg = NULL;
+	bl->entries = 0;
+	bl->avail = 0;
+	bl->mem_size = 0;
+	binlog_forget_keys(bl);
+
+	/* so have the readers of a shared binlog */
+	if (bl->readers) {
+		int i;
+
+		bl->readers->last_seg = NULL;
+		for (i = 0; i < BINLOG_MAX_READERS; i++) {
+			binlog *view = bl->readers->view[i];
+			if (view) {
+				view->cursor_seg = NULL;
+				view->entries = 0;
+				view->avail = 0;
+			}
+		}
+	}
+}
+
+/* drop every segment, read or not */
+static void binlog_release_all(binlog *bl)
+{
+	while (bl->head) {
+		struct binlog_segment *seg = bl->head;
+		bl->head = seg->next;
+		segment_release(bl, seg);
+	}
+	binlog_forget(bl);
+	binlog_file_reset(bl);
+}
+
+/*
+ * Release segments that have been read completely. The last read
+ * segment is kept until now so binlog_unread() can simply rewind it.
+ * Once everything has been read we go back to using memory.
+ */
+static void binlog_release_drained(binlog *bl)
+{
+	if (bl->head && !bl->entries) {
+		binlog_release_all(bl);
+		return;
+	}
+
+	while (bl->head && bl->head != bl->tail && bl->head->head >= bl->head->tail) {
+		struct binlog_segment *seg = bl->head;
+		bl->head = seg->next;
+
+		/* readers have nothing left in it, so they can start over from the head */
+		if (bl->readers) {
+			int i;
+			for (i = 0; i < BINLOG_MAX_READERS; i++) {
+				if (bl->readers->view[i] && bl->readers->view[i]->cursor_seg == seg)
+					bl->readers->view[i]->cursor_seg = NULL;
+			}
+		}
+		segment_release(bl, seg);
+	}
+}
+
+/*
+ * Move all memory segments into the file, keeping their order.
+ * This is a single memcpy() per segment. Sealed ones are compressed
+ * afterwards.
+ */
+static int binlog_spill(binlog *bl)
+{
+	struct binlog_segment *seg;
+
+	for (seg = bl->head; seg; seg = seg->next) {
+		struct binlog_segment *fseg;
+
+		if (segment_in_file(seg))
+			continue;
+
+		fseg = segment_create(bl, seg->size - BINLOG_SEG_HDR, 1);
+		if (!fseg)
+			return BINLOG_EDROPPED;
+
+		/* the segment keeps its place in the sequence */
+		bl->next_seq--;
+		memcpy(fseg->base, seg->base, seg->tail);
+		munmap(seg->base, seg->size);
+		bl->mem_size -= segment_used(seg);
+		bl->file_size += segment_used(seg);
+		seg->base = fseg->base;
+		seg->size = fseg->size;
+		seg->offset = fseg->offset;
+		free(fseg);
+		segment_write_header(bl, seg);
+	}
+
+	if (bl->head)
+		update_read_cursor(bl, bl->head);
+	update_write_cursor(bl);
+	segment_queue_sealed(bl);
+	return 0;
+}
+
+/*
+ * append a record to the tail segment, mapping a new one if needed.
+ * Records in a shared binlog are prefixed with their reader mask.
+ */
+static int binlog_append(binlog *bl, void *buf, unsigned int len, const uint64_t *mask, int in_file)
+{
+	struct binlog_segment *seg = bl->tail;
+	struct binlog_record *rec;
+	unsigned int rsize = record_size(len + (mask ? sizeof(*mask) : 0));
+
+	if (!seg || segment_compressed(seg) || seg->size - seg->tail < rsize) {
+		struct binlog_segment *sealed = bl->tail;
+
+		seg = segment_create(bl, rsize > bl->segment_size ? rsize : bl->segment_size, in_file);
+		if (!seg)
+			return in_file ? BINLOG_ENOSPC : BINLOG_EDROPPED;
+		if (sealed)
+			sealed->next = seg;
+		else
+			bl->head = seg;
+		bl->tail = seg;
+		if (in_file) {
+			segment_write_header(bl, seg);
+			if (sealed && !segment_compressed(sealed)) {
+				segment_write_header(bl, sealed);
+				segment_queue_sealed(bl);
+			}
+			if (bl->head == seg)
+				update_read_cursor(bl, seg);
+		}
+	}
+
+	rec = segment_rec(seg, seg->tail);
+	if (mask) {
+		rec->len = (len + sizeof(*mask)) | BINLOG_REC_SHARED;
+		*record_mask(rec) = *mask;
+		memcpy(record_mask(rec) + 1, buf, len);
+	} else {
+		rec->len = len;
+		memcpy(rec + 1, buf, len);
+	}
+	rec->crc = record_crc(seg->seq, rec);
+	seg->tail += rsize;
+	seg->entries++;
+	bl->entries++;
+	bl->avail += record_len(rec);
+	if (in_file) {
+		bl->file_size += rsize;
+		update_write_cursor(bl);
+		binlog_queue_sync(bl);
+	} else {
+		bl->mem_size += rsize;
+	}
+
+	return 0;
+}
+
+/* add a record, which is prefixed with 'mask' in a shared binlog */
+static int binlog_add_record(binlog *bl, void *buf, unsigned int len, const uint64_t *mask)
 {
+	unsigned int rsize;
 	int result;
-	off_t pos;
 
-	pos = lseek(bl->fd, 0, SEEK_CUR);
-	if (pos != bl->file_size)
-		lseek(bl->fd, 0, SEEK_END);
-	result = write(bl->fd, buf, len);
+	if (writer.queued)
+		writer_reap();
+	binlog_release_drained(bl);
+	rsize = record_size(len + (mask ? sizeof(*mask) : 0));
+
+	/*
+	 * if we've started adding to the file, we must continue
+	 * doing so in order to preserve the parsing order when
+	 * reading the events
+	 */
+	if ((!bl->tail || !segment_in_file(bl->tail)) && bl->mem_size + rsize < bl->max_mem_size) {
+		return binlog_append(bl, buf, len, mask, 0);
+	}
+
+	/* bail out early if there's no room */
+	if (!bl->path || bl->file_size + bl->mem_size + rsize > (unsigned long long)bl->max_file_size)
+		return BINLOG_ENOSPC;
+
+	if (bl->mem_size && (result = binlog_spill(bl)) < 0)
+		return result;
+
+	return binlog_append(bl, buf, len, mask, 1);
+}
+
+/*
+ * Check that a record fits in its segment and, if it was adopted
+ * from disk, that its checksum is right
+ */
+static int record_is_sane(struct binlog_segment *seg, unsigned int pos)
+{
+	struct binlog_record *rec = segment_rec(seg, pos);
 
-	if (result == len) {
-		bl->file_write_pos = lseek(bl->fd, 0, SEEK_CUR);
+	if (seg->tail - pos < sizeof(*rec) || record_size(record_len(rec)) > seg->tail - pos)
 		return 0;
+	if (record_is_shared(rec) && record_len(rec) < sizeof(uint64_t))
+		return 0;
+
+	return !seg->verify || rec->crc == record_crc(seg->seq, rec);
+}
+
+/*
+ * Everything from a broken record and onwards is lost, but what
+ * came before it is fine. We only get here when the broken record
+ * is the first unread one, so that leaves an empty binlog.
+ */
+static void binlog_truncate(binlog *bl, struct binlog_segment *seg, unsigned int pos)
+{
+	lerr("binlog: Corrupt record at offset %u in segment %llu. Discarding it and the %u entries after it",
+	     pos, (unsigned long long)seg->seq, bl->entries - 1);
+	binlog_release_all(bl);
+}
+
+/*
+ * Move the read position past records that have been killed and find
+ * the segment holding the first live one. Segments with nothing live
+ * left in them are skipped without looking at them, and compressed
+ * ones aren't decompressed here, so their head may still be dead.
+ */
+static struct binlog_segment *binlog_skip_dead(binlog *bl)
+{
+	struct binlog_segment *seg;
+
+	for (seg = bl->head; seg; seg = seg->next) {
+		unsigned int head = seg->head;
+
+		if (!seg->entries) {
+			seg->head = seg->tail;
+		} else if (seg->base) {
+			while (seg->head < seg->tail && record_is_sane(seg, seg->head) &&
+			       record_is_dead(segment_rec(seg, seg->head)))
+			{
+				seg->head += record_size(record_len(segment_rec(seg, seg->head)));
+			}
+		}
+		if (seg->head != head)
+			update_read_cursor(bl, seg);
+		if (seg->entries)
+			return seg;
+	}
+
+	return NULL;
+}
+
+/* find the first unread record, making sure it's sane */
+static struct binlog_record *binlog_first(binlog *bl, struct binlog_segment **segp)
+{
+	struct binlog_segment *seg;
+
+	seg = binlog_skip_dead(bl);
+	if (!seg)
+		return NULL;
+
+	if (!seg->base) {
+		if (segment_load(bl, seg) < 0)
+			return NULL;
+		binlog_skip_dead(bl);
+	}
+
+	if (seg->head >= seg->tail || !record_is_sane(seg, seg->head)) {
+		binlog_truncate(bl, seg, seg->head);
+		return NULL;
+	}
+
+	*segp = seg;
+	return segment_rec(seg, seg->head);
+}
+
+/* linear probing; keys are hashes already, so no need to mix them */
+static struct binlog_key *key_find(struct binlog_key *keys, unsigned int mask, uint64_t key)
+{
+	unsigned int i;
+
+	for (i = key & mask; keys[i].key && keys[i].key != key; i = (i + 1) & mask)
+		;
+	return &keys[i];
+}
+
+/* double the size of the key table, keeping it at most 3/4 full */
+static int key_table_grow(binlog *bl)
+{
+	unsigned int i, size = bl->keys ? (bl->key_mask + 1) * 2 : 1024;
+	struct binlog_key *keys;
+
+	keys = calloc(size, sizeof(*keys));
+	if (!keys)
+		return -1;
+
+	if (bl->keys) {
+		for (i = 0; i <= bl->key_mask; i++) {
+			if (bl->keys[i].key)
+				*key_find(keys, size - 1, bl->keys[i].key) = bl->keys[i];
+		}
+		free(bl->keys);
+	}
+	bl->keys = keys;
+	bl->key_mask = size - 1;
+	return 0;
+}
+
+/* flag a record dead, so readers skip it */
+static void record_kill(binlog *bl, struct binlog_segment *seg, struct binlog_record *rec)
+{
+	unsigned int len = record_len(rec);
+
+	rec->len |= BINLOG_REC_DEAD;
+	seg->entries--;
+	bl->entries--;
+	bl->avail -= len;
+
+	/* keep the header of a sealed segment in step */
+	if (segment_in_file(seg) && segment_hdr(seg)->tail) {
+		struct binlog_segment_header *sh = segment_hdr(seg);
+		sh->entries--;
+		sh->avail -= len;
+		sh->crc = segment_header_crc(sh);
+	}
+}
+
+/* find the key table slot for 'key', growing the table if needed */
+static struct binlog_key *key_slot(binlog *bl, uint64_t key)
+{
+	struct binlog_key *k;
+
+	if ((!bl->keys || (bl->num_keys + 1) * 4 > (bl->key_mask + 1) * 3) && key_table_grow(bl) < 0)
+		return NULL;
+
+	k = key_find(bl->keys, bl->key_mask, key);
+	if (!k->key)
+		bl->num_keys++;
+	return k;
+}
+
+/*
+ * Get the record at a position remembered in the key table, provided
+ * it's still unread and comes after the first unread one at 'pos' in
+ * 'first', which may be partially sent already. Records in compressed
+ * segments can't be changed, so they're left alone.
+ */
+static struct binlog_record *key_record(uint64_t seq, struct binlog_segment *seg, unsigned int pos,
+                                        struct binlog_segment *first, unsigned int first_pos)
+{
+	if (!seg || !first || seq < first->seq || (seq == first->seq && pos <= first_pos))
+		return NULL;
+	if (!seg->base || segment_compressed(seg))
+		return NULL;
+	return segment_rec(seg, pos);
+}
+
+/*** shared binlogs ***/
+
+/*
+ * Find the first record a reader has yet to read, moving its cursor
+ * past the ones that aren't for it
+ */
+static struct binlog_record *reader_first(binlog *view, struct binlog_segment **segp)
+{
+	binlog *bl = view->shared;
+	uint64_t bit = 1ULL << view->reader;
+	struct binlog_segment *seg = view->cursor_seg ? view->cursor_seg : bl->head;
+	unsigned int pos = view->cursor_seg ? view->cursor_pos : 0;
+
+	for (; seg; seg = seg->next, pos = 0) {
+		if (pos < seg->head)
+			pos = seg->head;
+		if (!seg->entries || pos >= seg->tail)
+			continue;
+		if (segment_load(bl, seg) < 0)
+			return NULL;
+
+		for (; pos < seg->tail; pos += record_size(record_len(segment_rec(seg, pos)))) {
+			struct binlog_record *rec = segment_rec(seg, pos);
+
+			if (!record_is_sane(seg, pos)) {
+				binlog_truncate(bl, seg, pos);
+				return NULL;
+			}
+			if (!record_is_dead(rec) && record_is_shared(rec) && (*record_mask(rec) & bit)) {
+				view->cursor_seg = seg;
+				view->cursor_pos = pos;
+				*segp = seg;
+				return rec;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a reader's bit out of a record, killing the record once
+ * every reader is done with it
+ */
+static void reader_done(binlog *view, struct binlog_segment *seg, struct binlog_record *rec)
+{
+	*record_mask(rec) &= ~(1ULL << view->reader);
+	view->entries--;
+	view->avail -= record_len(rec) - sizeof(uint64_t);
+	if (!*record_mask(rec))
+		record_kill(view->shared, seg, rec);
+}
+
+/* let go of what the readers are done with */
+static void reader_release(binlog *view)
+{
+	binlog_skip_dead(view->shared);
+	binlog_release_drained(view->shared);
+}
+
+/*
+ * Take the readers of an adopted shared binlog that didn't come back
+ * out of its records, so they can be released
+ */
+static void binlog_drop_orphans(binlog *bl)
+{
+	struct binlog_readers *r = bl->readers;
+	struct binlog_segment *seg;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < BINLOG_MAX_READERS; i++) {
+		if (r->orphans & (1ULL << i)) {
+			r->id[i] = 0;
+			if (bl->fhdr)
+				bl->fhdr->reader_id[i] = 0;
+			n++;
+		}
+	}
+	lwarn("binlog: Dropping what's left for %u readers of %s that are gone", n, bl->path);
+
+	for (seg = bl->head; seg; seg = seg->next) {
+		unsigned int pos;
+
+		if (!seg->entries || segment_load(bl, seg) < 0)
+			continue;
+		for (pos = seg->head; pos < seg->tail; pos += record_size(record_len(segment_rec(seg, pos)))) {
+			struct binlog_record *rec = segment_rec(seg, pos);
+
+			if (!record_is_sane(seg, pos))
+				break;
+			if (record_is_dead(rec) || !record_is_shared(rec) || !(*record_mask(rec) & r->orphans))
+				continue;
+			*record_mask(rec) &= ~r->orphans;
+			if (!*record_mask(rec))
+				record_kill(bl, seg, rec);
+		}
+	}
+	r->orphans = 0;
+	binlog_skip_dead(bl);
+	binlog_release_drained(bl);
+}
+
+/* count the records a reader has yet to read, or drop them all */
+static void reader_scan(binlog *view, int drop)
+{
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
+
+	view->cursor_seg = NULL;
+	view->entries = view->avail = 0;
+	while ((rec = reader_first(view, &seg))) {
+		view->cursor_pos += record_size(record_len(rec));
+		if (drop) {
+			*record_mask(rec) &= ~(1ULL << view->reader);
+			if (!*record_mask(rec))
+				record_kill(view->shared, seg, rec);
+		} else {
+			view->entries++;
+			view->avail += record_len(rec) - sizeof(uint64_t);
+		}
+	}
+	view->cursor_seg = NULL;
+	if (drop) {
+		view->entries = view->avail = 0;
+		reader_release(view);
+	}
+}
+
+/*
+ * Add an event for a reader. If it's the same as the latest record,
+ * as it is when an event is sent to several nodes, the reader is just
+ * added to that record's mask.
+ */
+static int reader_add(binlog *view, void *buf, unsigned int len)
+{
+	binlog *bl = view->shared;
+	struct binlog_readers *r = bl->readers;
+	uint64_t bit = 1ULL << view->reader;
+	struct binlog_record *rec;
+	int result;
+
+	if (r->orphans)
+		binlog_drop_orphans(bl);
+
+	if (r->last_seg) {
+		rec = segment_rec(r->last_seg, r->last_pos);
+		if (!record_is_dead(rec) && record_len(rec) == len + sizeof(uint64_t) &&
+		    !(*record_mask(rec) & bit) && !memcmp(record_mask(rec) + 1, buf, len))
+		{
+			*record_mask(rec) |= bit;
+			view->entries++;
+			view->avail += len;
+			return 0;
+		}
 	}
+
+	result = binlog_add_record(bl, buf, len, &bit);
 	if (result < 0)
 		return result;
+	r->last_seg = bl->tail;
+	r->last_pos = bl->tail->tail - record_size(len + sizeof(uint64_t));
+	view->entries++;
+	view->avail += len;
 
-	/* partial write. this will mess up the sync */
-	if (pos != lseek(bl->fd, pos, SEEK_SET)) {
-		binlog_invalidate(bl);
+	return 0;
+}
+
+/*
+ * Readers can't kill records for each other, so when a reader gets
+ * a newer record for a key it's just taken out of the previous one.
+ * That's the one before the latest if the reader was merged into
+ * the latest.
+ */
+static int reader_add_keyed(binlog *view, void *buf, unsigned int len, uint64_t key)
+{
+	binlog *bl = view->shared;
+	struct binlog_segment *seg, *first;
+	struct binlog_record *rec;
+	struct binlog_key *k;
+	int result;
+
+	result = reader_add(view, buf, len);
+	if (result < 0 || !key)
+		return result;
+
+	seg = bl->readers->last_seg;
+	if (!seg || !(k = key_slot(bl, key)))
+		return 0;
+
+	if (k->key != key) {
+		k->prev_seg = NULL;
+	} else if (k->seg != seg || k->pos != bl->readers->last_pos) {
+		k->prev_seg = k->seg;
+		k->prev_seq = k->seq;
+		k->prev_pos = k->pos;
+	}
+	k->key = key;
+	k->seg = seg;
+	k->seq = seg->seq;
+	k->pos = bl->readers->last_pos;
+
+	if (!reader_first(view, &first))
+		return 0;
+	rec = key_record(k->prev_seq, k->prev_seg, k->prev_pos, first, view->cursor_pos);
+	if (rec && !record_is_dead(rec) && record_is_shared(rec) && (*record_mask(rec) & (1ULL << view->reader))) {
+		result = record_len(rec) - sizeof(uint64_t);
+		reader_done(view, k->prev_seg, rec);
+		return result;
+	}
+
+	return 0;
+}
+
+static int reader_peek(binlog *view, void **buf, unsigned int *len)
+{
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
+
+	reader_release(view);
+	if (!view->entries)
+		return BINLOG_EMPTY;
+
+	rec = reader_first(view, &seg);
+	if (!rec) {
+		if (!view->entries)
+			return BINLOG_EMPTY;
+		binlog_invalidate(view);
+		return BINLOG_EINVALID;
+	}
+
+	*buf = record_mask(rec) + 1;
+	*len = record_len(rec) - sizeof(uint64_t);
+	return 0;
+}
+
+static int reader_consume(binlog *view)
+{
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
+
+	if (!view->entries)
+		return BINLOG_EMPTY;
+
+	rec = reader_first(view, &seg);
+	if (!rec) {
+		if (!view->entries)
+			return BINLOG_EMPTY;
+		binlog_invalidate(view);
+		return BINLOG_EINVALID;
+	}
+
+	view->cursor_pos += record_size(record_len(rec));
+	reader_done(view, seg, rec);
+	return 0;
+}
+
+static int reader_peekv(binlog *view, struct iovec *iov, int max_iov, unsigned int max_bytes)
+{
+	uint64_t bit = 1ULL << view->reader;
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
+	unsigned int pos, bytes = 0;
+	int n = 0;
+
+	reader_release(view);
+	if (!view->entries)
+		return BINLOG_EMPTY;
+
+	if (!reader_first(view, &seg)) {
+		if (!view->entries)
+			return BINLOG_EMPTY;
+		binlog_invalidate(view);
 		return BINLOG_EINVALID;
 	}
 
-	return BINLOG_EINCOMPLETE;
+	for (pos = view->cursor_pos; seg; seg = seg->next, pos = 0) {
+		if (pos < seg->head)
+			pos = seg->head;
+		if (!seg->entries)
+			continue;
+		if (!seg->base)
+			return n;
+
+		for (; pos < seg->tail; pos += record_size(record_len(rec))) {
+			unsigned int len;
+
+			rec = segment_rec(seg, pos);
+			if (!record_is_sane(seg, pos))
+				return n;
+			if (record_is_dead(rec) || !record_is_shared(rec) || !(*record_mask(rec) & bit))
+				continue;
+
+			/* the first entry is always handed out */
+			len = record_len(rec) - sizeof(uint64_t);
+			if (n && bytes + len > max_bytes)
+				return n;
+
+			iov[n].iov_base = record_mask(rec) + 1;
+			iov[n].iov_len = len;
+			bytes += len;
+			if (++n == max_iov)
+				return n;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Give the readers that were registered before a shared binlog was
+ * adopted the bits they had in it. Readers that aren't in the file
+ * get unused bits, and those in the file that haven't been registered
+ * yet are orphans until they are.
+ */
+static void readers_adopt(binlog *bl)
+{
+	struct binlog_readers *r = bl->readers;
+	binlog *view[BINLOG_MAX_READERS];
+	uint32_t *id = bl->fhdr->reader_id;
+	int i, b;
+
+	memset(view, 0, sizeof(view));
+	for (i = 0; i < BINLOG_MAX_READERS; i++) {
+		for (b = 0; r->view[i] && b < BINLOG_MAX_READERS; b++) {
+			if (id[b] == r->id[i]) {
+				view[b] = r->view[i];
+				r->view[i] = NULL;
+			}
+		}
+	}
+	for (i = 0; i < BINLOG_MAX_READERS; i++) {
+		for (b = 0; r->view[i] && b < BINLOG_MAX_READERS; b++) {
+			if (!id[b] && !view[b]) {
+				id[b] = r->id[i];
+				view[b] = r->view[i];
+				r->view[i] = NULL;
+			}
+		}
+		if (r->view[i]) {
+			lerr("binlog: No room for another reader of %s", bl->path);
+			r->view[i]->shared = NULL;
+			binlog_invalidate(r->view[i]);
+		}
+	}
+
+	r->orphans = 0;
+	for (b = 0; b < BINLOG_MAX_READERS; b++) {
+		r->view[b] = view[b];
+		r->id[b] = id[b];
+		if (view[b])
+			view[b]->reader = b;
+		else if (id[b])
+			r->orphans |= 1ULL << b;
+	}
 }
 
 /*** public api ***/
@@ -55,14 +1666,47 @@ int binlog_is_valid(binlog *bl)
 
 void binlog_invalidate(binlog *bl)
 {
-	binlog_close(bl);
+	if (bl->shared)
+		reader_scan(bl, 1);
+	else
+		binlog_release_all(bl);
 	bl->is_valid = 0;
-	unlink(bl->path);
 }
 
 const char *binlog_path(binlog *bl)
 {
-	return bl->path;
+	return bl->shared ? bl->shared->path : bl->path;
+}
+
+int binlog_compression_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(compression_names) / sizeof(compression_names[0])); i++) {
+		if (!strcasecmp(name, compression_names[i]))
+			return compress_bound(i, 1) || i == BINLOG_COMPRESS_NONE ? i : BINLOG_ENOTSUP;
+	}
+
+	return BINLOG_ENOTSUP;
+}
+
+const char *binlog_compression_name(int method)
+{
+	if (method < 0 || method >= (int)(sizeof(compression_names) / sizeof(compression_names[0])))
+		return "unknown";
+	return compression_names[method];
+}
+
+int binlog_set_compression(binlog *bl, int method)
+{
+	if (!bl)
+		return BINLOG_EADDRESS;
+
+	if (method != BINLOG_COMPRESS_NONE && (bl->shared || bl->readers || !compress_bound(method, 1)))
+		return BINLOG_ENOTSUP;
+
+	bl->compression = method;
+	return 0;
 }
 
 int binlog_full_warning(binlog *bl)
@@ -77,6 +1721,7 @@ int binlog_full_warning(binlog *bl)
 binlog *binlog_create(const char *path, unsigned long long int msize, unsigned long long int fsize, int flags)
 {
 	binlog *bl;
+	unsigned long long int max_size;
 
 	/* can't have a max filesize without a path */
 	if (fsize && !path)
@@ -99,11 +1744,14 @@ binlog *binlog_create(const char *path, unsigned long long int msize, unsigned l
 	bl->max_file_size = fsize;
 	bl->is_valid = 1;
 	bl->should_warn_if_full = 1;
+	/* leave room below for segments pushed back by binlog_unread() */
+	bl->next_seq = 1ULL << 32;
 
-	if (asprintf(&bl->file_metadata_path, "%s.meta",path) < 15)
-	{
-		return NULL;
-	}
+	/* no point in mapping more than we're ever allowed to use */
+	max_size = msize > fsize ? msize : fsize;
+	bl->segment_size = max_size < BINLOG_SEGMENT_SIZE ? page_align(max_size) : BINLOG_SEGMENT_SIZE;
+	if (bl->segment_size)
+		bl->segment_size -= BINLOG_SEG_HDR;
 
 	if (asprintf(&bl->file_save_path, "%s.save",path) < 15)
 	{
@@ -116,50 +1764,81 @@ binlog *binlog_create(const char *path, unsigned long long int msize, unsigned l
 	return bl;
 }
 
-void binlog_wipe(binlog *bl, int flags)
+binlog *binlog_create_shared(const char *path, unsigned long long int msize, unsigned long long int fsize, int flags)
 {
-	unsigned long long int max_mem_size, max_file_size;
-	char *path;
+	binlog *bl;
 
+	bl = binlog_create(path, msize, fsize, flags);
 	if (!bl)
-		return;
-
-	max_mem_size = bl->max_mem_size;
-	max_file_size = bl->max_file_size;
-	path = bl->path;
+		return NULL;
 
-	if (!(flags & BINLOG_UNLINK)) {
-		binlog_flush(bl);
+	bl->readers = calloc(1, sizeof(*bl->readers));
+	if (!bl->readers) {
+		binlog_destroy(bl, flags);
+		return NULL;
 	}
 
-	binlog_close(bl);
-
-	if (!(flags & BINLOG_UNLINK) || bl->file_read_pos == bl->file_write_pos) {
-		unlink(bl->path);
-	}
+	return bl;
+}
 
-	if (bl->cache) {
-		unsigned int i;
+binlog *binlog_create_reader(binlog *shared, const char *name)
+{
+	struct binlog_readers *r;
+	binlog *view;
+	uint32_t id;
+	int i;
 
-		for (i = 0; i < bl->write_index; i++) {
-			struct binlog_entry *entry = bl->cache[i];
+	if (!shared || !shared->readers || !name)
+		return NULL;
 
-			if (!entry)
-				continue;
+	/* the bit it had before, if any, or an unused one */
+	r = shared->readers;
+	id = crc32c(0, name, strlen(name)) | 1;
+	for (i = 0; i < BINLOG_MAX_READERS && r->id[i] != id; i++)
+		;
+	if (i == BINLOG_MAX_READERS || r->view[i]) {
+		for (i = 0; i < BINLOG_MAX_READERS && r->id[i]; i++)
+			;
+		if (i == BINLOG_MAX_READERS)
+			return NULL;
+	}
 
-			if (entry->data)
-				free(entry->data);
-			free(entry);
-		}
-		free(bl->cache);
+	view = calloc(1, sizeof(*view));
+	if (!view)
+		return NULL;
+	view->shared = shared;
+	view->reader = i;
+	view->fd = -1;
+	view->is_valid = 1;
+	view->should_warn_if_full = 1;
+	r->view[i] = view;
+	r->id[i] = id;
+	if (shared->fhdr)
+		shared->fhdr->reader_id[i] = id;
+
+	/* it's been adopted already, so it has some catching up to do */
+	if (r->orphans & (1ULL << i)) {
+		r->orphans &= ~(1ULL << i);
+		reader_scan(view, 0);
 	}
 
-	memset(bl, 0, sizeof(*bl));
-	bl->max_mem_size = max_mem_size;
-	bl->max_file_size = max_file_size;
-	bl->path = path;
+	return view;
+}
+
+void binlog_wipe(binlog *bl, __attribute__((unused)) int flags)
+{
+	if (!bl)
+		return;
+
+	/*
+	 * Wiping means we no longer want the contents, so the file
+	 * goes away regardless of flags
+	 */
+	if (bl->shared)
+		reader_scan(bl, 1);
+	else
+		binlog_release_all(bl);
 	bl->is_valid = 1;
-	bl->fd = -1;
 }
 
 void binlog_destroy(binlog *bl, int flags)
@@ -167,289 +1846,314 @@ void binlog_destroy(binlog *bl, int flags)
 	if (!bl)
 		return;
 
+	/* the writer mustn't be left with anything of ours */
+	while (bl->io.queued)
+		writer_wait();
 	binlog_wipe(bl, flags);
 
+	if (bl->shared) {
+		struct binlog_readers *r = bl->shared->readers;
+		r->view[bl->reader] = NULL;
+		r->id[bl->reader] = 0;
+		if (bl->shared->fhdr)
+			bl->shared->fhdr->reader_id[bl->reader] = 0;
+	} else if (bl->readers) {
+		int i;
+		/* whatever readers are left have nothing to read from */
+		for (i = 0; i < BINLOG_MAX_READERS; i++) {
+			if (bl->readers->view[i]) {
+				bl->readers->view[i]->shared = NULL;
+				bl->readers->view[i]->is_valid = 0;
+			}
+		}
+		free(bl->readers);
+	}
+
 	if (bl->path) {
 		free(bl->path);
 		bl->path = NULL;
 	}
-	if (bl->file_metadata_path) {
-		free(bl->file_metadata_path);
-		bl->file_metadata_path = NULL;
-	}
 	if (bl->file_save_path) {
 		free(bl->file_save_path);
 		bl->file_save_path = NULL;
 	}
+	free(bl->keys);
 
 	free(bl);
 }
 
-static int binlog_file_read(binlog *bl, void **buf, unsigned int *len)
+int binlog_peek(binlog *bl, void **buf, unsigned int *len)
 {
-	int result;
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
 
-	/*
-	 * if we're done reading the file fully, close and
-	 * unlink it so we go back to using memory-based
-	 * binlog when we're added to next
-	 */
-	if (bl->file_read_pos >= bl->file_size) {
-		binlog_close(bl);
-		bl->file_read_pos = bl->file_write_pos = bl->file_size = 0;
-		bl->file_entries = 0;
-		unlink(bl->path);
-		return BINLOG_EMPTY;
+	if (!bl || !buf || !len)
+		return BINLOG_EADDRESS;
+
+	/* don't let users read from an invalidated binlog */
+	if (!binlog_is_valid(bl)) {
+		return BINLOG_EINVALID;
 	}
 
-	lseek(bl->fd, bl->file_read_pos, SEEK_SET);
-	result = read(bl->fd, len, sizeof(*len));
-	if(result < 0)
-		return -1;
+	if (bl->shared)
+		return reader_peek(bl, buf, len);
 
-	*buf = malloc(*len);
-	result = read(bl->fd, *buf, *len);
-	if(result < 0)
-		return -1;
+	binlog_release_drained(bl);
+	if (!bl->entries)
+		return BINLOG_EMPTY;
 
-	bl->file_read_pos = lseek(bl->fd, 0, SEEK_CUR);
-	bl->file_entries--;
+	rec = binlog_first(bl, &seg);
+	if (!rec) {
+		if (!bl->entries)
+			return BINLOG_EMPTY;
+		binlog_invalidate(bl);
+		return BINLOG_EINVALID;
+	}
 
+	*buf = rec + 1;
+	*len = rec->len;
 	return 0;
 }
 
-static int binlog_mem_read(binlog *bl, void **buf, unsigned int *len)
+int binlog_consume(binlog *bl)
 {
-	if (!bl->cache || bl->read_index >= bl->write_index) {
-		bl->read_index = bl->write_index = 0;
-		return BINLOG_EMPTY;
-	}
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
+
+	if (!bl)
+		return BINLOG_EADDRESS;
 
-	if (!bl->cache[bl->read_index]) {
-		/* this might cause leaks! */
-		bl->read_index = bl->write_index = 0;
+	if (!binlog_is_valid(bl))
 		return BINLOG_EINVALID;
-	}
 
-	*buf = bl->cache[bl->read_index]->data;
-	*len = bl->cache[bl->read_index]->size;
-	bl->mem_avail -= *len;
+	if (bl->shared)
+		return reader_consume(bl);
 
-	/* free the entry and mark it as empty */
-	free(bl->cache[bl->read_index]);
-	bl->cache[bl->read_index] = NULL;
-	bl->read_index++;
+	if (!bl->entries)
+		return BINLOG_EMPTY;
 
-	/*
-	 * reset the read and write index in case we've read
-	 * all entries. This lets us re-use the entry slot
-	 * later and not just steadily increase the array
-	 * size
-	 */
-	if (bl->read_index >= bl->write_index) {
-		bl->read_index = bl->write_index = 0;
-		bl->mem_avail = 0;
+	rec = binlog_first(bl, &seg);
+	if (!rec) {
+		if (!bl->entries)
+			return BINLOG_EMPTY;
+		binlog_invalidate(bl);
+		return BINLOG_EINVALID;
 	}
 
+	bl->last_read_seg = seg;
+	bl->last_read_pos = seg->head;
+	seg->head += record_size(rec->len);
+	seg->entries--;
+	bl->entries--;
+	bl->avail -= rec->len;
+	update_read_cursor(bl, seg);
+
 	return 0;
 }
 
-int binlog_read(binlog *bl, void **buf, unsigned int *len)
+int binlog_peekv(binlog *bl, struct iovec *iov, int max_iov, unsigned int max_bytes)
 {
-	if (!bl || !buf || !len)
+	struct binlog_segment *seg;
+	unsigned int bytes = 0;
+	int n = 0;
+
+	if (!bl || !iov || max_iov < 1)
 		return BINLOG_EADDRESS;
 
-	/* don't let users read from an invalidated binlog */
-	if (!binlog_is_valid(bl)) {
+	if (!binlog_is_valid(bl))
 		return BINLOG_EINVALID;
-	}
 
-	/*
-	 * reading from memory must come first in order to
-	 * maintain sequential ordering. Otherwise we'd
-	 * have to flush memory-based entries before
-	 * starting to write to file
-	 */
-	if (!binlog_mem_read(bl, buf, len))
-		return 0;
+	if (bl->shared)
+		return reader_peekv(bl, iov, max_iov, max_bytes);
 
-	return binlog_file_read(bl, buf, len);
-}
+	binlog_release_drained(bl);
+	if (!bl->entries)
+		return BINLOG_EMPTY;
 
-/*
- * This is easy. We just reset file_read_pos to point to the start
- * of the old entry and increment the file_entries counter.
- */
-static int binlog_file_unread(binlog *bl, unsigned int len)
-{
-	bl->file_read_pos -= len;
-	bl->file_entries++;
-	return 0;
+	for (seg = bl->head; seg; seg = seg->next) {
+		unsigned int pos;
+
+		if (seg->head >= seg->tail || !seg->entries)
+			continue;
+
+		/* don't decompress more than we have to */
+		if (!seg->base && n)
+			return n;
+		if (segment_load(bl, seg) < 0) {
+			binlog_invalidate(bl);
+			return BINLOG_EINVALID;
+		}
+
+		for (pos = seg->head; pos < seg->tail;) {
+			struct binlog_record *rec = segment_rec(seg, pos);
+
+			/* hand out what's good so far, truncating once we get here */
+			if (!record_is_sane(seg, pos)) {
+				if (n)
+					return n;
+				binlog_truncate(bl, seg, pos);
+				return BINLOG_EMPTY;
+			}
+
+			pos += record_size(record_len(rec));
+			if (record_is_dead(rec))
+				continue;
+
+			/* the first entry is always handed out */
+			if (n && bytes + rec->len > max_bytes)
+				return n;
+
+			iov[n].iov_base = rec + 1;
+			iov[n].iov_len = rec->len;
+			bytes += rec->len;
+			if (++n == max_iov)
+				return n;
+		}
+	}
+
+	return n;
 }
 
-/*
- * This is also fairly straightforward. We basically just add the
- * pointer to the previous entry in the memory list
- */
-static int binlog_mem_unread(binlog *bl, void *buf, unsigned int len)
+int binlog_read(binlog *bl, void **buf, unsigned int *len)
 {
-	binlog_entry *entry;
-
-	/* we can't restore items to an invalid binlog */
-	if (!bl || !bl->cache || !binlog_is_valid(bl))
-		return BINLOG_EDROPPED;
+	void *view;
+	int result;
 
-	/*
-	 * In case the entire filebased backlog gets unread(),
-	 * we can stash one and only one entry on memory stack,
-	 * so return BINLOG_EDROPPED in case bl->read_index is
-	 * already 0 and we've pushed bl->write_index to 1.
-	 * This is because we have no way of finding out which
-	 * slot the entry should have had, so further undo's
-	 * will not be in sequential ordering.
-	 */
-	if (bl->read_index == 0 && bl->write_index == 1)
-		return BINLOG_EDROPPED;
+	result = binlog_peek(bl, &view, len);
+	if (result < 0)
+		return result;
 
-	entry = malloc(sizeof(*entry));
-	if (!entry)
+	*buf = malloc(*len);
+	if (!*buf)
 		return BINLOG_EDROPPED;
+	memcpy(*buf, view, *len);
 
-	bl->mem_avail += len;
-	entry->size = len;
-	entry->data = buf;
-	if (!bl->read_index) {
-		/*
-		 * first entry to be pushed back to memory after
-		 * filebased binlog was emptied. Sequential messages
-		 * can be added later, but we can't handle further
-		 * undo's
-		 */
-		bl->cache[bl->read_index] = entry;
-		bl->write_index = 1;
-	}
-	else {
-		bl->cache[--bl->read_index] = entry;
-	}
-	return 0;
+	return binlog_consume(bl);
 }
 
 int binlog_unread(binlog *bl, void *buf, unsigned int len)
 {
+	struct binlog_segment *seg;
+	struct binlog_record *rec;
+	int in_file;
+
 	if (!bl || !buf || !len) {
 		return BINLOG_EADDRESS;
 	}
 
+	/* we can't restore items to an invalid binlog, or a shared one */
+	if (!binlog_is_valid(bl) || bl->shared)
+		return BINLOG_EDROPPED;
+
+	/*
+	 * The common case is pushing back what was just read, which
+	 * is still in its segment. Just move the read pointer back.
+	 * Anything the reader has skipped since then is dead, so it's
+	 * fine to go back over it.
+	 */
+	seg = bl->last_read_seg;
+	if (seg) {
+		rec = segment_rec(seg, bl->last_read_pos);
+		if (rec->len == len && seg->head >= bl->last_read_pos + record_size(len)) {
+			seg->head = bl->last_read_pos;
+			seg->entries++;
+			bl->entries++;
+			bl->avail += len;
+			bl->last_read_seg = NULL;
+			update_read_cursor(bl, seg);
+			free(buf);
+			return 0;
+		}
+	}
+
 	/*
 	 * if the binlog is empty, adding the entry normally has the
 	 * same effect as fiddling around with pointer manipulation
 	 */
-	if (!binlog_num_entries(bl))
-		return binlog_add(bl, buf, len);
+	if (!binlog_num_entries(bl)) {
+		int result = binlog_add(bl, buf, len);
+		if (!result)
+			free(buf);
+		return result;
+	}
 
 	/*
-	 * if we've started reading from the file, the entry belongs
-	 * there. If we haven't, it belongs on the memory stack
+	 * otherwise it gets a segment of its own in front of the others,
+	 * numbered so it's read before them. Segments that have already
+	 * been read go first, so they can't be mistaken for unread ones.
 	 */
-	if (bl->file_read_pos >= (off_t)len)
-		binlog_file_unread(bl, len);
-
-	return binlog_mem_unread(bl, buf, len);
-}
-
-unsigned int binlog_num_entries(binlog *bl)
-{
-	unsigned int entries = 0;
-
-	if (!bl)
-		return 0;
-
-	if (bl->file_size && bl->file_read_pos < bl->file_size)
-		entries = bl->file_entries;
-	if (bl->cache && bl->read_index < bl->write_index)
-		entries += bl->write_index - bl->read_index;
-
-	return entries;
-}
-
-static int binlog_open(binlog *bl)
-{
-	int flags = O_RDWR | O_APPEND | O_CREAT;
-
-	if (bl->fd != -1)
-		return bl->fd;
-
-	if (!bl->path)
-		return BINLOG_ENOPATH;
-
-	if (!binlog_is_valid(bl)) {
-		bl->file_read_pos = bl->file_write_pos = bl->file_size = 0;
-		flags = O_RDWR | O_CREAT | O_TRUNC;
+	while (bl->head->head >= bl->head->tail) {
+		seg = bl->head;
+		bl->head = seg->next;
+		segment_release(bl, seg);
 	}
-
-	bl->fd = open(bl->path, flags, 0600);
-	if (bl->fd < 0)
-		return -1;
+	in_file = segment_in_file(bl->head);
+	seg = segment_create(bl, record_size(len), in_file);
+	if (!seg)
+		return BINLOG_EDROPPED;
+	/* sequence numbers no longer tell which keyed records are unread */
+	binlog_forget_keys(bl);
+	bl->next_seq--;
+	seg->seq = bl->head->seq - 1;
+	rec = segment_rec(seg, seg->tail);
+	rec->len = len;
+	memcpy(rec + 1, buf, len);
+	rec->crc = record_crc(seg->seq, rec);
+	seg->tail += record_size(len);
+	seg->entries = 1;
+	seg->next = bl->head;
+	bl->head = seg;
+	bl->entries++;
+	bl->avail += len;
+	if (in_file) {
+		bl->file_size += segment_used(seg);
+		segment_write_header(bl, seg);
+		update_read_cursor(bl, seg);
+	} else {
+		bl->mem_size += segment_used(seg);
+	}
+	free(buf);
 
 	return 0;
 }
 
-static int binlog_grow(binlog *bl)
+int binlog_add_keyed(binlog *bl, void *buf, unsigned int len, uint64_t key)
 {
-	bl->alloc = ((bl->alloc + 16) * 3) / 2;
-	bl->cache = realloc(bl->cache, sizeof(binlog_entry *) * bl->alloc);
-	if (!bl->cache)
-		return -1;
-
-	return 0;
-}
+	struct binlog_segment *first;
+	struct binlog_record *rec;
+	struct binlog_key *k;
+	int result;
 
-static int binlog_mem_add(binlog *bl, void *buf, unsigned int len)
-{
-	binlog_entry *entry;
+	if (bl && bl->shared && binlog_is_valid(bl))
+		return reader_add_keyed(bl, buf, len, key);
 
-	if (bl->write_index >= bl->alloc && binlog_grow(bl) < 0)
-		return BINLOG_EDROPPED;
+	result = binlog_add(bl, buf, len);
+	if (result < 0 || !key)
+		return result;
 
-	entry = malloc(sizeof(*entry));
-	if (!entry)
-		return BINLOG_EDROPPED;
+	/* without room for the key we just don't compact */
+	if (!(k = key_slot(bl, key)))
+		return 0;
 
-	entry->data = malloc(len);
-	if (!entry->data) {
-		free(entry);
-		return BINLOG_EDROPPED;
+	if (k->key == key) {
+		first = binlog_skip_dead(bl);
+		rec = key_record(k->seq, k->seg, k->pos, first, first ? first->head : 0);
+		if (rec && !record_is_dead(rec)) {
+			result = record_len(rec);
+			record_kill(bl, k->seg, rec);
+		}
 	}
+	k->key = key;
+	k->seg = bl->tail;
+	k->seq = bl->tail->seq;
+	k->pos = bl->tail->tail - record_size(len);
 
-	entry->size = len;
-	memcpy(entry->data, buf, len);
-	bl->cache[bl->write_index++] = entry;
-	bl->mem_size += entry_size(entry);
-	bl->mem_avail += len;
-
-	return 0;
+	return result;
 }
 
-static int binlog_file_add(binlog *bl, void *buf, unsigned int len)
+unsigned int binlog_num_entries(binlog *bl)
 {
-	int ret;
-
-	/* bail out early if there's no room */
-	if (bl->file_size + (off_t)len > bl->max_file_size)
-		return BINLOG_ENOSPC;
-
-	ret = binlog_open(bl);
-	if (ret < 0)
-		return ret;
-
-	ret = safe_write(bl, &len, sizeof(len));
-	if (ret)
-		return ret;
-	ret = safe_write(bl, buf, len);
-	bl->file_size += len + sizeof(len);
-	bl->file_entries++;
-
-	return ret;
+	return bl ? bl->entries : 0;
 }
 
 int binlog_add(binlog *bl, void *buf, unsigned int len)
@@ -463,16 +2167,10 @@ int binlog_add(binlog *bl, void *buf, unsigned int len)
 		return BINLOG_EINVALID;
 	}
 
-	/*
-	 * if we've started adding to the file, we must continue
-	 * doing so in order to preserve the parsing order when
-	 * reading the events
-	 */
-	if (bl->fd == -1 && bl->mem_size + len < bl->max_mem_size) {
-		return binlog_mem_add(bl, buf, len);
-	}
+	if (bl->shared)
+		return reader_add(bl, buf, len);
 
-	return binlog_file_add(bl, buf, len);
+	return binlog_add_record(bl, buf, len, NULL);
 }
 
 int binlog_close(binlog *bl)
@@ -495,28 +2193,87 @@ int binlog_flush(binlog *bl)
 	if (!bl)
 		return BINLOG_EADDRESS;
 
-	if (bl->cache) {
-		while (bl->read_index < bl->write_index) {
-			binlog_entry *entry = bl->cache[bl->read_index++];
-			binlog_file_add(bl, entry->data, entry->size);
-			free(entry->data);
-			free(entry);
-		}
-		free(bl->cache);
-		bl->cache = NULL;
+	if (bl->shared)
+		bl = bl->shared;
+
+	if (!bl->path || !bl->mem_size)
+		return 0;
+
+	return binlog_spill(bl);
+}
+
+int binlog_sync(binlog *bl)
+{
+	struct binlog_segment *seg;
+
+	if (!bl)
+		return BINLOG_EADDRESS;
+
+	if (bl->shared)
+		bl = bl->shared;
+
+	while (bl->io.queued)
+		writer_wait();
+
+	for (seg = bl->head; seg; seg = seg->next) {
+		if (seg->base && segment_in_file(seg) && !segment_compressed(seg))
+			msync(seg->base, seg->size, MS_SYNC);
 	}
-	bl->mem_size = bl->write_index = bl->read_index = bl->alloc = 0;
+	if (bl->fhdr)
+		msync(bl->fhdr, page_align(1), MS_SYNC);
+	if (bl->fd != -1 && fsync(bl->fd) < 0)
+		return -1;
+
+	return 0;
+}
+
+int binlog_set_sync_interval(binlog *bl, int seconds)
+{
+	if (!bl)
+		return BINLOG_EADDRESS;
+
+	if (bl->shared)
+		bl = bl->shared;
 
+	bl->sync_interval = seconds > 0 ? seconds : 0;
 	return 0;
 }
 
+const struct binlog_io_stats *binlog_io_stats(binlog *bl)
+{
+	if (bl && bl->shared)
+		bl = bl->shared;
+
+	return bl ? &bl->io : NULL;
+}
+
+void binlog_writer_stop(void)
+{
+	if (writer.state > 0) {
+		pthread_mutex_lock(&writer.lock);
+		writer.stop = 1;
+		pthread_cond_signal(&writer.work);
+		pthread_mutex_unlock(&writer.lock);
+
+		/* it finishes what it's been given before it quits */
+		pthread_join(writer.thread, NULL);
+		writer_reap();
+	}
+	writer.state = 0;
+}
+
+/* readers of a shared binlog report the size of what they share */
 unsigned int binlog_msize(binlog *bl)
 {
+	if (bl && bl->shared)
+		bl = bl->shared;
 	return bl ? bl->mem_size : 0;
 }
 
 unsigned int binlog_fsize(binlog *bl)
 {
+	if (bl && bl->shared)
+		bl = bl->shared;
 	return bl ? bl->file_size : 0;
 }
 
@@ -530,89 +2287,326 @@ unsigned int binlog_available(binlog *bl)
 	if (!bl)
 		return 0;
 
-	return (bl->file_size - bl->file_read_pos) + bl->mem_avail;
+	return bl->avail;
 }
 
-static int binlog_write_file_metadata(binlog *bl) {
-	FILE *file;
+/* a live segment found in an adopted file */
+struct adopted_segment {
+	struct binlog_segment *seg;
+	struct binlog_segment_header sh;
+};
 
-	binlog_flush(bl);
-	file = fopen(bl->file_metadata_path, "wb");
-	if (file != NULL) {
-		fwrite(bl, sizeof(binlog), 1, file);
-		fclose(file);
-	} else {
-		return -1;
-	}
+static int adopted_cmp(const void *a_, const void *b_)
+{
+	const struct adopted_segment *a = a_, *b = b_;
 
-	return 0;
+	return a->sh.seq < b->sh.seq ? -1 : a->sh.seq > b->sh.seq;
 }
 
-binlog * binlog_get_saved(binlog * node_binlog) {
-	int ret, elements_read;
-	struct binlog *bl;
-	FILE * file;
+/*
+ * Find the slots of the file at bl->path by their headers. Live ones
+ * at or after the read cursor are returned, the rest are freed.
+ */
+static int binlog_find_segments(binlog *bl, off_t size, struct adopted_segment **ret)
+{
+	struct adopted_segment *live = NULL;
+	unsigned int page = page_align(1);
+	int nlive = 0, i, j;
+	off_t off;
+
+	for (off = page; off + page <= size;) {
+		struct binlog_segment_header sh;
+		struct binlog_segment *seg;
+
+		if (pread(bl->fd, &sh, sizeof(sh), off) != sizeof(sh))
+			break;
+		if ((sh.magic != BINLOG_SEG_MAGIC && sh.magic != BINLOG_SEG_FREE) ||
+		    sh.crc != segment_header_crc(&sh) || !sh.size ||
+		    sh.size != page_align(sh.size) || off + sh.size > size)
+		{
+			off += page;
+			continue;
+		}
+
+		seg = calloc(1, sizeof(*seg));
+		if (!seg)
+			break;
+		seg->offset = off;
+		seg->size = sh.size;
+		off += sh.size;
+		bl->file_end = off;
+
+		if (sh.magic == BINLOG_SEG_FREE || sh.seq < bl->fhdr->read_seq ||
+		    (sh.zsize && (!compress_bound(sh.zmethod, 1) || BINLOG_SEG_HDR + sh.zsize > sh.size)) ||
+		    (sh.tail && (sh.tail < BINLOG_SEG_HDR || (!sh.zsize && sh.tail > sh.size))))
+		{
+			if (sh.magic != BINLOG_SEG_FREE)
+				slot_mark_free(bl, seg);
+			seg->next = bl->free_slots;
+			bl->free_slots = seg;
+			continue;
+		}
 
-	/* Check if there is a saved binlog to read */
-	if( access( node_binlog->file_metadata_path, F_OK ) != 0 ) {
-		return NULL;
+		if (!(nlive & (nlive + 1))) {
+			struct adopted_segment *tmp = realloc(live, (nlive + 1) * 2 * sizeof(*live));
+			if (!tmp) {
+				free(seg);
+				break;
+			}
+			live = tmp;
+		}
+		live[nlive].seg = seg;
+		live[nlive].sh = sh;
+		nlive++;
 	}
 
-	if( access( node_binlog->file_save_path, F_OK ) != 0 ) {
-		/* For some reason we had a metadata file, but no save file. */
-		/* Delete the metadata file */
-		unlink(node_binlog->file_metadata_path);
-		return NULL;
+	qsort(live, nlive, sizeof(*live), adopted_cmp);
+
+	/*
+	 * A crash while a segment was being compressed leaves both of its
+	 * copies behind. The uncompressed one was whole before we began,
+	 * while the compressed one may not have made it to disk, so we
+	 * keep the former. Replaying both would send everything twice.
+	 */
+	for (i = j = 0; i < nlive; i++) {
+		struct adopted_segment drop = live[i];
+
+		if (j && live[j - 1].sh.seq == drop.sh.seq) {
+			if (live[j - 1].sh.zsize && !drop.sh.zsize) {
+				drop = live[j - 1];
+				live[j - 1] = live[i];
+			}
+			slot_mark_free(bl, drop.seg);
+			drop.seg->next = bl->free_slots;
+			bl->free_slots = drop.seg;
+			continue;
+		}
+		live[j++] = live[i];
 	}
 
-	file = fopen(node_binlog->file_metadata_path, "rb");
-	/* Make sure we could open the file correctly */
-	if (file == NULL) {
-		return NULL;
+	*ret = live;
+	return j;
+}
+
+/*
+ * Count and check the records of an adopted segment from its head
+ * and on, up to 'limit'. The tail ends up after the last good one.
+ */
+static void segment_scan(binlog *bl, struct binlog_segment *seg, unsigned int limit)
+{
+	unsigned int pos;
+
+	seg->verify = 1;
+	seg->tail = limit;
+	seg->entries = 0;
+	for (pos = seg->head; pos < limit; pos += record_size(record_len(segment_rec(seg, pos)))) {
+		if (!record_is_sane(seg, pos))
+			break;
+		if (record_is_dead(segment_rec(seg, pos)))
+			continue;
+		seg->entries++;
+		bl->avail += segment_rec(seg, pos)->len;
 	}
+	seg->tail = pos;
+}
 
-	/* free'd either here (binlog_destroy) or by the caller (node_binlog_read_saved) */
-	bl = malloc(sizeof(struct binlog));
-	if (bl == NULL) {
-		fclose(file);
-		return NULL;
+/*
+ * Hook up the live segments of the file at bl->path in sequence
+ * order, starting at the read cursor. Sealed and compressed segments
+ * describe themselves, so only the one with the read cursor and the
+ * one that was still being written to are scanned here. Records in
+ * the others are checked as they're read.
+ */
+static int binlog_recover(binlog *bl)
+{
+	struct adopted_segment *live = NULL;
+	unsigned int page = page_align(1);
+	int i, nlive, truncated = 0;
+	uint64_t max_seq = 0;
+	struct stat st;
+
+	bl->fd = open(bl->path, O_RDWR);
+	if (bl->fd < 0)
+		return BINLOG_ESTAT;
+	if (fstat(bl->fd, &st) < 0 || st.st_size < page || map_file_header(bl) < 0)
+		return BINLOG_EINVALID;
+	if (bl->fhdr->magic != BINLOG_FILE_MAGIC || bl->fhdr->version != BINLOG_FILE_VERSION) {
+		lerr("binlog: %s has an unknown format", bl->path);
+		return BINLOG_EINVALID;
 	}
-	memset(bl, 0, sizeof(struct binlog));
+	bl->file_end = page;
+	if (bl->readers)
+		readers_adopt(bl);
+
+	nlive = binlog_find_segments(bl, st.st_size, &live);
+	for (i = 0; i < nlive; i++) {
+		struct binlog_segment_header *sh = &live[i].sh;
+		struct binlog_segment *seg = live[i].seg;
+		unsigned int expected;
+
+		if (sh->seq > max_seq)
+			max_seq = sh->seq;
+
+		/* nothing after a broken record is trusted */
+		if (truncated) {
+			slot_mark_free(bl, seg);
+			seg->next = bl->free_slots;
+			bl->free_slots = seg;
+			continue;
+		}
+
+		seg->seq = sh->seq;
+		seg->head = BINLOG_SEG_HDR;
+		seg->tail = sh->tail;
+		seg->verify = 1;
+		if (sh->zsize) {
+			seg->zsize = sh->zsize;
+			seg->zslot = sh->size;
+			seg->zmethod = sh->zmethod;
+			seg->size = page_align(sh->tail);
+		}
 
-	elements_read = fread(bl, sizeof(struct binlog), 1, file);
-	fclose(file);
+		if (sh->tail && sh->seq != bl->fhdr->read_seq) {
+			/* sealed and unread, so it can be taken at face value */
+			seg->entries = sh->entries;
+			bl->avail += sh->avail;
+			if (!segment_compressed(seg)) {
+				seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, bl->fd, seg->offset);
+				if (seg->base == MAP_FAILED) {
+					seg->base = NULL;
+					break;
+				}
+			}
+		} else {
+			if (segment_compressed(seg)) {
+				if (segment_load(bl, seg) < 0)
+					break;
+			} else {
+				seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, bl->fd, seg->offset);
+				if (seg->base == MAP_FAILED) {
+					seg->base = NULL;
+					break;
+				}
+			}
+
+			if (sh->seq == bl->fhdr->read_seq && bl->fhdr->read_pos > BINLOG_SEG_HDR &&
+			    bl->fhdr->read_pos <= (sh->tail ? sh->tail : seg->size))
+			{
+				seg->head = BINLOG_ALIGN(bl->fhdr->read_pos);
+			}
+			expected = sh->tail;
+			if (!expected && sh->seq == bl->fhdr->write_seq)
+				expected = bl->fhdr->write_pos;
+			segment_scan(bl, seg, sh->tail ? sh->tail : seg->size);
+			if (seg->tail < expected) {
+				lerr("binlog: Corrupt record at offset %u in segment %llu of %s. Discarding everything from there on",
+				     seg->tail, (unsigned long long)seg->seq, bl->path);
+				truncated = 1;
+			}
+		}
 
-	/* Make sure we sucessfully read one binlog struct */
-	if (elements_read != 1) {
-		unlink(node_binlog->file_save_path);
-		unlink(node_binlog->file_metadata_path);
-		free(bl);
-		bl = NULL;
-		return NULL;																														
+		if (bl->tail)
+			bl->tail->next = seg;
+		else
+			bl->head = seg;
+		bl->tail = seg;
+		bl->entries += seg->entries;
+		bl->file_size += segment_compressed(seg) ? seg->zsize : segment_used(seg);
 	}
 
-	bl->file_metadata_path = strdup(node_binlog->file_metadata_path);
-	bl->path = strdup(node_binlog->file_save_path);
-	/* Need to reset the file descriptor as it won't be valid anymore */
-	bl->fd = -1;
-	ret = binlog_open(bl);
-	if (ret < 0) {
-		binlog_destroy(bl, BINLOG_UNLINK);
-		return NULL;
+	if (i < nlive) {
+		/* the linked ones are released by our caller */
+		for (; i < nlive; i++)
+			free(live[i].seg);
+		free(live);
+		return BINLOG_EINVALID;
 	}
-	/* get rid of the metadata file now */
-	unlink(node_binlog->file_metadata_path);
-	return bl;
+	free(live);
+
+	if (max_seq >= bl->next_seq)
+		bl->next_seq = max_seq + 1;
+	if (bl->tail && !segment_compressed(bl->tail)) {
+		/* it's written to again, so unseal it */
+		segment_write_header(bl, bl->tail);
+	}
+	if (bl->head)
+		update_read_cursor(bl, bl->head);
+	update_write_cursor(bl);
+
+	return 0;
 }
 
-int binlog_save(binlog *bl) {
-	if (bl && binlog_num_entries(bl) > 0) {
-		if (binlog_write_file_metadata(bl) != 0) {
-			return -1;
-		}
-		if (rename(bl->path, bl->file_save_path) != 0) {
-			return -1;
+int binlog_adopt_saved(binlog *bl)
+{
+	int result;
+
+	if (!bl)
+		return BINLOG_EADDRESS;
+
+	/*
+	 * Readers adopt the shared binlog when the first of them gets
+	 * here, and then find out how much of it is theirs
+	 */
+	if (bl->shared) {
+		binlog *shared = bl->shared;
+
+		if (!shared->head && !shared->file_end && (result = binlog_adopt_saved(shared)) < 0)
+			return result;
+		if (!bl->shared)
+			return BINLOG_EINVALID;
+		reader_scan(bl, 0);
+		return bl->entries;
+	}
+
+	if (!bl->path)
+		return BINLOG_ENOPATH;
+
+	/* there's nowhere to put it if we're already using the file */
+	if (bl->head || bl->file_end)
+		return BINLOG_EINVALID;
+
+	/*
+	 * A saved binlog takes precedence over whatever a crash may
+	 * have left behind, which is adopted if there's nothing saved
+	 */
+	if (!access(bl->file_save_path, F_OK)) {
+		if (rename(bl->file_save_path, bl->path) < 0) {
+			lerr("binlog: Failed to rename %s to %s: %s", bl->file_save_path, bl->path, strerror(errno));
+			unlink(bl->file_save_path);
+			return BINLOG_ESTAT;
 		}
+	} else if (access(bl->path, F_OK)) {
+		return 0;
 	}
+
+	result = binlog_recover(bl);
+	if (result < 0 || !bl->entries) {
+		binlog_release_all(bl);
+		return result;
+	}
+
+	return bl->entries;
+}
+
+int binlog_save(binlog *bl)
+{
+	/* the first reader to get here saves it for all of them */
+	if (bl && bl->shared)
+		bl = bl->shared;
+
+	if (!bl || !binlog_num_entries(bl))
+		return 0;
+
+	if (!bl->path || binlog_flush(bl) < 0 || binlog_sync(bl) < 0)
+		return -1;
+
+	if (rename(bl->path, bl->file_save_path) != 0) {
+		return -1;
+	}
+
+	/* the entries live on in the saved file */
+	binlog_forget(bl);
+	binlog_file_reset(bl);
+
 	return 0;
 }
@@ -1,6 +1,9 @@
 #ifndef INCLUDE_binlog_h
 #define INCLUDE_binlog_h
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 
 /**
  * @file binlog.h
@@ -10,19 +13,65 @@
  * @{
  */
 
-/** A binary log. */
+/**
+ * A binary log.
+ * Events are stored as length-prefixed records in a list of fixed-size
+ * mmap()'d segments. Segments are anonymous memory until max_mem_size
+ * is reached, after which they're windows onto the on-disk file at
+ * path, so reading and writing records never does more than a memcpy().
+ * The file is self-describing and checksummed, so it can be adopted
+ * in place after a restart.
+ * A shared binlog stores each event once for up to BINLOG_MAX_READERS
+ * readers, which are binlogs of their own that only hold a cursor into
+ * it. All the functions below work the same for readers, except that
+ * binlog_unread() isn't supported.
+ * Compressing the on-disk part and syncing it to disk is done by a
+ * background thread, which is shared by all binlogs.
+ */
+#define BINLOG_MAX_READERS 64
+struct binlog_segment;
+struct binlog_file_header;
+struct binlog_key;
+struct binlog_readers;
+
+/** what the background writer has done for a binlog */
+struct binlog_io_stats {
+	unsigned int queued;                    /* jobs not finished yet */
+	unsigned long long int compressed;      /* segments compressed */
+	unsigned long long int syncs;           /* completed fdatasync()s */
+	unsigned long long int sync_usecs;      /* how long the last one took */
+	unsigned long long int sync_usecs_max;  /* and the slowest one */
+};
+
 struct binlog {
-	struct binlog_entry **cache;
-	unsigned int write_index, read_index, file_entries;
-	unsigned int alloc;
-	unsigned int mem_size;
+	struct binlog_segment *head;       /* oldest segment, read from here */
+	struct binlog_segment *tail;       /* newest segment, written to here */
+	struct binlog_segment *free_slots; /* released file segments, for reuse */
+	struct binlog_segment *last_read_seg; /* so unread() can rewind */
+	struct binlog_file_header *fhdr;   /* mapped first page of the file */
+	struct binlog_key *keys;           /* latest record per key, for compaction */
+	unsigned int key_mask, num_keys;
+	struct binlog *shared;             /* the binlog a reader reads from */
+	struct binlog_readers *readers;    /* the readers of a shared binlog */
+	struct binlog_segment *cursor_seg; /* where a reader has got to */
+	unsigned int cursor_pos;
+	unsigned int reader;               /* a reader's bit in the shared binlog */
+	unsigned long long int next_seq;   /* sequence number of the next segment */
+	unsigned int last_read_pos;
+	unsigned int entries;
+	unsigned int segment_size;
+	unsigned long long int mem_size;
 	unsigned long long int max_mem_size;
-	unsigned int mem_avail;
-	off_t max_file_size, file_size, file_read_pos, file_write_pos;
+	unsigned long long int avail;
+	off_t max_file_size, file_size, file_end;
+	int compression; /* BINLOG_COMPRESS_* for sealed file segments */
+	int sync_interval; /* seconds between syncs of the file, 0 for never */
+	int sync_queued;
+	time_t last_sync;
+	struct binlog_io_stats io;
 	int is_valid;
 	int should_warn_if_full;
 	char *path;
-	char *file_metadata_path;
 	char *file_save_path;
 	int fd;
 };
@@ -31,6 +80,11 @@ typedef struct binlog binlog;
 #define BINLOG_APPEND 1
 #define BINLOG_UNLINK 2
 
+/** compression methods for the on-disk part of the binlog */
+#define BINLOG_COMPRESS_NONE 0
+#define BINLOG_COMPRESS_LZ4  1
+#define BINLOG_COMPRESS_ZSTD 2
+
 /**
  * Check if binlog is valid.
  * "valid" in this case means "has it escaped being invalidated"?
@@ -54,6 +108,62 @@ extern void binlog_invalidate(binlog *bl);
  */
 extern const char *binlog_path(binlog *bl);
 
+/**
+ * Look up a compression method by name ("none", "lz4" or "zstd")
+ * @param name The name of the compression method
+ * @return The BINLOG_COMPRESS_* value on success, BINLOG_ENOTSUP if
+ *         the method is unknown or merlin was built without it.
+ */
+extern int binlog_compression_by_name(const char *name);
+
+/**
+ * Get the name of a compression method
+ * @param method The BINLOG_COMPRESS_* value
+ * @return The name of the method
+ */
+extern const char *binlog_compression_name(int method);
+
+/**
+ * Set the compression method used for the on-disk part of the
+ * binlog. Only file segments that are full and haven't been read
+ * from are compressed. They're transparently decompressed when
+ * read. Segments compressed with another method remain readable.
+ * @param bl The binary log to operate on
+ * @param method The BINLOG_COMPRESS_* value to use
+ * @return 0 on success, < 0 on failure
+ */
+extern int binlog_set_compression(binlog *bl, int method);
+
+/**
+ * Have the file synced to disk in the background every so often
+ * while entries are being added to it.
+ * @param bl The binary log to operate on
+ * @param seconds Seconds between syncs. 0 turns syncing off.
+ * @return 0 on success, < 0 on failure
+ */
+extern int binlog_set_sync_interval(binlog *bl, int seconds);
+
+/**
+ * Get what the background writer has done for a binlog
+ * @param bl The binary log to examine
+ * @return Statistics, which stay valid as long as the binlog does
+ */
+extern const struct binlog_io_stats *binlog_io_stats(binlog *bl);
+
+/**
+ * Wait for the background writer to finish everything it has to
+ * do for the binlog, and make sure the file is on disk.
+ * @param bl The binary log object.
+ * @return 0 on success. < 0 on failure.
+ */
+extern int binlog_sync(binlog *bl);
+
+/**
+ * Stop the background writer once it has finished what it's doing.
+ * It's started again if there's more for it to do.
+ */
+extern void binlog_writer_stop(void);
+
 /**
  * Check to make sure that only one warning is logged when
  * the binlog is full, so the log isn't spammed.
@@ -73,6 +183,26 @@ extern int binlog_full_warning(binlog *bl);
  */
 extern binlog *binlog_create(const char *path, unsigned long long int msize, unsigned long long int fsize, int flags);
 
+/**
+ * Create a binary log that's shared by several readers. Events are
+ * added through the readers, and an event that's added by several
+ * readers in a row is only stored once. Compression isn't supported.
+ * Parameters are the same as for binlog_create().
+ * @return A binlog object on success, NULL on errors.
+ */
+extern binlog *binlog_create_shared(const char *path, unsigned long long int msize, unsigned long long int fsize, int flags);
+
+/**
+ * Create a reader of a shared binlog. Readers are told apart by
+ * name, so a reader gets back what it had left in a saved binlog
+ * once it's adopted. Readers must be destroyed before the binlog
+ * they share.
+ * @param shared The shared binlog to read from
+ * @param name The name of the reader
+ * @return A binlog object on success, NULL if there are too many readers
+ */
+extern binlog *binlog_create_reader(binlog *shared, const char *name);
+
 /**
  * Get the number of unread entries in the binlog
  * @param bl The binary log to examine
@@ -109,6 +239,42 @@ extern void binlog_destroy(binlog *bl, int flags);
  */
 extern int binlog_read(binlog *bl, void **buf, unsigned int *len);
 
+/**
+ * Borrow the first (sequential) event from the binary log without
+ * copying it. The returned buffer points into the binlog's own
+ * storage and stays valid until the entry is consumed or anything
+ * else is done to the binlog. The entry isn't removed from the log
+ * until binlog_consume() is called, so a failed send requires no
+ * further action.
+ * @param bl The binary log object.
+ * @param buf A pointer to the pointer that will point to the entry.
+ * @param len A pointer to where the size of the logged event will be stored.
+ * @return 0 on success. < 0 on failure.
+ */
+extern int binlog_peek(binlog *bl, void **buf, unsigned int *len);
+
+/**
+ * Borrow a batch of events from the start of the binary log, for
+ * sending them with a single writev(2) or sendmsg(2). The entries
+ * stay valid under the same rules as for binlog_peek() and must be
+ * removed one by one with binlog_consume().
+ * @param bl The binary log object.
+ * @param iov Array the entries are stored in.
+ * @param max_iov Maximum number of entries to hand out.
+ * @param max_bytes Soft limit for the total size of the entries. The
+ *                  first entry is always handed out regardless.
+ * @return The number of entries stored in iov. < 0 on failure.
+ */
+extern int binlog_peekv(binlog *bl, struct iovec *iov, int max_iov, unsigned int max_bytes);
+
+/**
+ * Remove the first event from the binary log, typically after it
+ * has been borrowed with binlog_peek() and successfully handled.
+ * @param bl The binary log object.
+ * @return 0 on success. < 0 on failure.
+ */
+extern int binlog_consume(binlog *bl);
+
 /**
  * "unread" one entry from the binlog. This lets one maintain
  * sequential reading from the binlog even when event processing
@@ -127,7 +293,8 @@ extern int binlog_unread(binlog *bl, void *buf, unsigned int len);
  * Add an event to the binary log.
  * If maximum memory size for the in-memory cache has been, or
  * would have been exceeded by adding the new event, all in-memory
- * events are flushed to disk and the mem-cache is reset.
+ * segments are moved to disk and the log stays on disk until it
+ * has been fully read.
  * @param bl The binary log object.
  * @param buf A pointer to the data involved in the event.
  * @param len The size of the data to store.
@@ -135,6 +302,23 @@ extern int binlog_unread(binlog *bl, void *buf, unsigned int len);
  */
 extern int binlog_add(binlog *bl, void *buf, unsigned int len);
 
+/**
+ * Add an event to the binary log, superseding the previous event
+ * added with the same key. The previous one is killed, so readers
+ * never see it, unless it has been read already, is the next one
+ * to be read or lives in a compressed segment. This bounds the size
+ * of a backlog of periodic updates by the number of keys rather than
+ * by how long it's been since it was last drained.
+ * @param bl The binary log object.
+ * @param buf A pointer to the data involved in the event.
+ * @param len The size of the data to store.
+ * @param key Identifies what the event updates. 0 means it doesn't
+ *            supersede anything, same as binlog_add().
+ * @return The size of the event that was superseded if one was, else
+ *         0 on success. < 0 on failure.
+ */
+extern int binlog_add_keyed(binlog *bl, void *buf, unsigned int len, uint64_t key);
+
 /**
  * Close a file associated to a binary log. In normal circum-
  * stances, files are kept open until binary log is flushed
@@ -148,7 +332,7 @@ extern int binlog_close(binlog *bl);
 
 /**
  * Flush in-memory events to disk, releasing all the memory
- * allocated to the events.
+ * allocated to the events. Ordering is preserved.
  * @param bl The binary log object.
  * @return 0 on success. < 0 on failure.
  */
@@ -183,14 +367,19 @@ extern unsigned int binlog_size(binlog *bl);
 extern unsigned int binlog_available(binlog *bl);
 
 /**
- * Creates a new binlog from a binlog that was persistently saved on disk.
- * @param bl the normal binlog for a node
- * @return the persistently saved binlog
+ * Adopt a binlog that was saved by binlog_save(), or left behind
+ * by a crash, as the contents of bl. The file is used in place, so
+ * this takes no longer for a large backlog than for a small one.
+ * Should a record turn out to be damaged, it and everything after it
+ * is discarded, either here or when it's about to be read.
+ * @param bl An empty binlog with the same path as the saved one
+ * @return The number of adopted entries. < 0 on failure.
  */
-extern binlog * binlog_get_saved(binlog * node_binlog); 
+extern int binlog_adopt_saved(binlog *bl);
 
 /**
- * Saves a binlog persistently on disk.
+ * Saves a binlog persistently on disk. The entries are moved to
+ * the saved file, leaving bl empty.
  * @param bl the binlog to save
  * @return 0 on success -1 otherwise
  */
@@ -229,5 +418,8 @@ extern int binlog_save(binlog *bl);
 /** A NULL pointer was passed when a pointer was expected */
 #define BINLOG_EADDRESS (-9)
 
+/** The requested compression method isn't available */
+#define BINLOG_ENOTSUP (-10)
+
 /** @} */
 #endif
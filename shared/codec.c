@@ -2,183 +2,64 @@
 #include "codec.h"
 #include <string.h>
 
-/**
- * Conversion table to encode and decode data-structs sent from
- * Nagios to event broker modules.
+/*
+ * The layout of every event we encode, and the only place it's
+ * described. Each entry names the callback, a name for it, the
+ * struct that's sent and, in order, the char * members of that
+ * struct. The encoder and decoder for each struct are generated
+ * from this below, so every callback gets straight-line code with
+ * its string offsets known at compile time.
  *
- * To add more checks here, first go check in nagios/include/nebcallbacks.h
+ * To add more events here, first go check in naemon/nebcallbacks.h
  * to figure out the thing you want to add stuff to. Then find the
- * corresponding data struct in nagios/include/nebstructs.h and add the
- * necessary info.
- *
- * 'strings' is the number of dynamic strings (char *)
- * 'offset' is 'sizeof(nebstruct_something_data)'
- * 'ptrs[]' are the offsets of each char *. use the offsetof() macro
+ * corresponding data struct in naemon/nebstructs.h and add it and
+ * its strings. Callbacks that aren't listed encode to nothing.
+ * Packets of our own that aren't callbacks go in CODEC_PACKETS.
  */
+#define CODEC_SCHEMA(EVENT, S) \
+	EVENT(NEBCALLBACK_PROCESS_DATA, process, nebstruct_process_data, ) \
+	EVENT(NEBCALLBACK_TIMED_EVENT_DATA, timed_event, nebstruct_timed_event_data, ) \
+	EVENT(NEBCALLBACK_LOG_DATA, log, nebstruct_log_data, \
+		S(data)) \
+	EVENT(NEBCALLBACK_SYSTEM_COMMAND_DATA, system_command, nebstruct_system_command_data, \
+		S(command_line) S(output)) \
+	EVENT(NEBCALLBACK_EVENT_HANDLER_DATA, event_handler, nebstruct_event_handler_data, \
+		S(host_name) S(service_description) S(command_line) S(output)) \
+	EVENT(NEBCALLBACK_NOTIFICATION_DATA, notification, nebstruct_notification_data, \
+		S(host_name) S(service_description) S(output) S(ack_author) S(ack_data)) \
+	EVENT(NEBCALLBACK_SERVICE_CHECK_DATA, service_check, merlin_service_status, \
+		S(host_name) S(service_description) S(state.plugin_output) \
+		S(state.long_plugin_output) S(state.perf_data)) \
+	EVENT(NEBCALLBACK_HOST_CHECK_DATA, host_check, merlin_host_status, \
+		S(name) S(state.plugin_output) S(state.long_plugin_output) S(state.perf_data)) \
+	EVENT(NEBCALLBACK_COMMENT_DATA, comment, nebstruct_comment_data, \
+		S(host_name) S(service_description) S(author_name) S(comment_data)) \
+	EVENT(NEBCALLBACK_DOWNTIME_DATA, downtime, nebstruct_downtime_data, \
+		S(host_name) S(service_description) S(author_name) S(comment_data)) \
+	EVENT(NEBCALLBACK_FLAPPING_DATA, flapping, nebstruct_flapping_data, \
+		S(host_name) S(service_description)) \
+	EVENT(NEBCALLBACK_PROGRAM_STATUS_DATA, program_status, nebstruct_program_status_data, \
+		S(global_host_event_handler) S(global_service_event_handler)) \
+	EVENT(NEBCALLBACK_HOST_STATUS_DATA, host_status, merlin_host_status, \
+		S(name) S(state.plugin_output) S(state.long_plugin_output) S(state.perf_data)) \
+	EVENT(NEBCALLBACK_SERVICE_STATUS_DATA, service_status, merlin_service_status, \
+		S(host_name) S(service_description) S(state.plugin_output) \
+		S(state.long_plugin_output) S(state.perf_data)) \
+	EVENT(NEBCALLBACK_EXTERNAL_COMMAND_DATA, external_command, nebstruct_external_command_data, \
+		S(command_string) S(command_args)) \
+	EVENT(NEBCALLBACK_CONTACT_NOTIFICATION_DATA, contact_notification, nebstruct_contact_notification_data, \
+		S(host_name) S(service_description) S(contact_name) S(output) S(ack_author) S(ack_data)) \
+	EVENT(NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA, contact_notification_method, nebstruct_contact_notification_method_data, \
+		S(host_name) S(service_description) S(contact_name) S(command_name) \
+		S(output) S(ack_author) S(ack_data)) \
+	EVENT(NEBCALLBACK_ACKNOWLEDGEMENT_DATA, acknowledgement, nebstruct_acknowledgement_data, \
+		S(host_name) S(service_description) S(author_name) S(comment_data)) \
+	EVENT(NEBCALLBACK_STATE_CHANGE_DATA, state_change, nebstruct_statechange_data, \
+		S(host_name) S(service_description) S(output))
 
-static struct hook_info_struct {
-	int cb_type;
-	int strings;
-	off_t offset, ptrs[7];
-} hook_info[NEBCALLBACK_NUMITEMS] = {
-	{ NEBCALLBACK_PROCESS_DATA, 0, sizeof(nebstruct_process_data),
-		{ 0, 0, 0, 0, 0 },
-	},
-	{ NEBCALLBACK_TIMED_EVENT_DATA, 0, sizeof(nebstruct_timed_event_data),
-		{ 0, 0, 0, 0, 0 },
-	},
-	{ NEBCALLBACK_LOG_DATA, 1, sizeof(nebstruct_log_data),
-		{
-			offsetof(nebstruct_log_data, data),
-			0, 0, 0, 0
-		},
-	},
-	{ NEBCALLBACK_SYSTEM_COMMAND_DATA, 2, sizeof(nebstruct_system_command_data),
-		{
-			offsetof(nebstruct_system_command_data, command_line),
-			offsetof(nebstruct_system_command_data, output),
-			0, 0, 0
-		},
-	},
-	{ NEBCALLBACK_EVENT_HANDLER_DATA, 4, sizeof(nebstruct_event_handler_data),
-		{
-			offsetof(nebstruct_event_handler_data, host_name),
-			offsetof(nebstruct_event_handler_data, service_description),
-			offsetof(nebstruct_event_handler_data, command_line),
-			offsetof(nebstruct_event_handler_data, output),
-			0
-		},
-	},
-	{ NEBCALLBACK_NOTIFICATION_DATA, 5, sizeof(nebstruct_notification_data),
-		{
-			offsetof(nebstruct_notification_data, host_name),
-			offsetof(nebstruct_notification_data, service_description),
-			offsetof(nebstruct_notification_data, output),
-			offsetof(nebstruct_notification_data, ack_author),
-			offsetof(nebstruct_notification_data, ack_data),
-		},
-	},
-	{ NEBCALLBACK_SERVICE_CHECK_DATA, 5, sizeof(merlin_service_status),
-		{
-			offsetof(merlin_service_status, host_name),
-			offsetof(merlin_service_status, service_description),
-			offsetof(merlin_service_status, state.plugin_output),
-			offsetof(merlin_service_status, state.long_plugin_output),
-			offsetof(merlin_service_status, state.perf_data),
-		}
-	},
-	{ NEBCALLBACK_HOST_CHECK_DATA, 4, sizeof(merlin_host_status),
-		{
-			offsetof(merlin_host_status, name),
-			offsetof(merlin_host_status, state.plugin_output),
-			offsetof(merlin_host_status, state.long_plugin_output),
-			offsetof(merlin_host_status, state.perf_data),
-			0
-		},
-	},
-	{ NEBCALLBACK_COMMENT_DATA, 4, sizeof(nebstruct_comment_data),
-		{
-			offsetof(nebstruct_comment_data, host_name),
-			offsetof(nebstruct_comment_data, service_description),
-			offsetof(nebstruct_comment_data, author_name),
-			offsetof(nebstruct_comment_data, comment_data),
-			0,
-		},
-	},
-	{ NEBCALLBACK_DOWNTIME_DATA, 4, sizeof(nebstruct_downtime_data),
-		{
-			offsetof(nebstruct_downtime_data, host_name),
-			offsetof(nebstruct_downtime_data, service_description),
-			offsetof(nebstruct_downtime_data, author_name),
-			offsetof(nebstruct_downtime_data, comment_data),
-			0,
-		},
-	},
-	{ NEBCALLBACK_FLAPPING_DATA, 2, sizeof(nebstruct_flapping_data),
-		{
-			offsetof(nebstruct_flapping_data, host_name),
-			offsetof(nebstruct_flapping_data, service_description),
-			0, 0, 0
-		},
-	},
-	{ NEBCALLBACK_PROGRAM_STATUS_DATA, 2, sizeof(nebstruct_program_status_data),
-		{
-			offsetof(nebstruct_program_status_data, global_host_event_handler),
-			offsetof(nebstruct_program_status_data, global_service_event_handler),
-			0, 0, 0
-		},
-	},
-	{ NEBCALLBACK_HOST_STATUS_DATA, 4, sizeof(merlin_host_status),
-		{
-			offsetof(merlin_host_status, name),
-			offsetof(merlin_host_status, state.plugin_output),
-			offsetof(merlin_host_status, state.long_plugin_output),
-			offsetof(merlin_host_status, state.perf_data),
-			0
-		},
-	},
-	{ NEBCALLBACK_SERVICE_STATUS_DATA, 5, sizeof(merlin_service_status),
-		{
-			offsetof(merlin_service_status, host_name),
-			offsetof(merlin_service_status, service_description),
-			offsetof(merlin_service_status, state.plugin_output),
-			offsetof(merlin_service_status, state.long_plugin_output),
-			offsetof(merlin_service_status, state.perf_data),
-		}
-	},
-	{ NEBCALLBACK_ADAPTIVE_PROGRAM_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-	{ NEBCALLBACK_ADAPTIVE_HOST_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-	{ NEBCALLBACK_ADAPTIVE_SERVICE_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-	{ NEBCALLBACK_EXTERNAL_COMMAND_DATA, 2, sizeof(nebstruct_external_command_data),
-		{
-			offsetof(nebstruct_external_command_data, command_string),
-			offsetof(nebstruct_external_command_data, command_args),
-			0, 0, 0
-		},
-	},
-	{ NEBCALLBACK_AGGREGATED_STATUS_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-	{ NEBCALLBACK_RETENTION_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-	{ NEBCALLBACK_CONTACT_NOTIFICATION_DATA, 6, sizeof(nebstruct_contact_notification_data),
-		{
-			offsetof(nebstruct_contact_notification_data, host_name),
-			offsetof(nebstruct_contact_notification_data, service_description),
-			offsetof(nebstruct_contact_notification_data, contact_name),
-			offsetof(nebstruct_contact_notification_data, output),
-			offsetof(nebstruct_contact_notification_data, ack_author),
-			offsetof(nebstruct_contact_notification_data, ack_data),
-		},
-	},
-	{ NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA, 7, sizeof(nebstruct_contact_notification_method_data),
-		{
-			offsetof(nebstruct_contact_notification_method_data, host_name),
-			offsetof(nebstruct_contact_notification_method_data, service_description),
-			offsetof(nebstruct_contact_notification_method_data, contact_name),
-			offsetof(nebstruct_contact_notification_method_data, command_name),
-			offsetof(nebstruct_contact_notification_method_data, output),
-			offsetof(nebstruct_contact_notification_method_data, ack_author),
-			offsetof(nebstruct_contact_notification_method_data, ack_data),
-		},
-	},
-	{ NEBCALLBACK_ACKNOWLEDGEMENT_DATA, 4, sizeof(nebstruct_acknowledgement_data),
-		{
-			offsetof(nebstruct_acknowledgement_data, host_name),
-			offsetof(nebstruct_acknowledgement_data, service_description),
-			offsetof(nebstruct_acknowledgement_data, author_name),
-			offsetof(nebstruct_acknowledgement_data, comment_data),
-			0
-		},
-	},
-	{ NEBCALLBACK_STATE_CHANGE_DATA, 3, sizeof(nebstruct_statechange_data),
-		{
-			offsetof(nebstruct_statechange_data, host_name),
-			offsetof(nebstruct_statechange_data, service_description),
-			offsetof(nebstruct_statechange_data, output),
-			0, 0
-		},
-	},
-	{ NEBCALLBACK_CONTACT_STATUS_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-	{ NEBCALLBACK_ADAPTIVE_CONTACT_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
-};
+#define CODEC_PACKETS(EVENT, S) \
+	EVENT(RUNCMD_PACKET, runcmd, merlin_runcmd, \
+		S(content))
 
 /*
  * Both of these conversions involve a fair deal of Black Magic.
@@ -211,107 +92,164 @@ static struct hook_info_struct {
  */
 
 /*
- * Fixed-length variables are simply memcpy()'d.
- * Each string allocated is stuck in a memory area at the end of
- * the object. The pointer offset is then set to reflect the start
- * of the string relative to the beginning of the memory chunk.
+ * Copy a string to the end of the encoded event at "offset" and
+ * put the offset where the pointer to it was, which is "ptr" bytes
+ * into the event. NULL pointers remain NULL pointers, and once the
+ * buffer is full the rest of the strings are skipped.
  */
-int merlin_encode(void *data, int cb_type, char *buf, int buflen)
+static inline void codec_put_string(char *buf, int buflen, off_t *offset, int *skipped,
+                                    off_t ptr, const char *sp)
 {
-	int i, len, num_strings;
-	off_t offset, *ptrs;
+	size_t len;
 
-	if (cb_type == RUNCMD_PACKET && data != NULL) {
-		offset = sizeof(merlin_runcmd);
-		num_strings = 1;
+	if (!sp)
+		return;
 
-		/* calloc to ensure we 0 initialize */
-		ptrs = calloc(7,sizeof(off_t));
-		ptrs[0] = offsetof(merlin_runcmd, content);
+	if (*offset >= buflen) {
+		memset(buf + ptr, 0, sizeof(char *));
+		(*skipped)++;
+		return;
 	}
-	else if (!data || cb_type < 0 || cb_type >= NEBCALLBACK_NUMITEMS)
-		return 0;
-	else {
-		/*
-		 * offset points to where we should write, based off of
-		 * the base location of the block we're writing into.
-		 * Here, we set it to write to the first byte in pkt->body
-		 * not occupied with the binary data that makes up the
-		 * struct itself.
-		 */
-		offset = hook_info[cb_type].offset;
-		num_strings = hook_info[cb_type].strings;
-		ptrs = hook_info[cb_type].ptrs;
-	}
-	/*
-	 * copy the base struct first. We'll overwrite the string
-	 * positions later on.
-	 */
-	memcpy(buf, data, offset);
-
-	for(i = 0; i < num_strings; i++) {
-		char *sp = NULL;
-
-		/* get the pointer to the real string */
-		memcpy(&sp, (char *)buf + ptrs[i], sizeof(sp));
-		if (!sp) {	/* NULL pointers remain NULL pointers */
-			continue;
-		}
-
-		/* check this after !sp. No need to log a warning if only
-		 * NULL-strings remain */
-		if (buflen <= offset) {
-			lwarn("No space remaining in buffer. Skipping remaining %d strings",
-				  num_strings - i);
-			for (; i < num_strings; i++) {
-				memset(buf + ptrs[i], 0, sizeof(char *));
-			}
-			break;
-		}
-		len = strlen(sp);
-
-		if (len > buflen - offset - 1) {
-			linfo("String is too long (%d bytes, %lu remaining). Truncating",
-				  len, buflen - offset - 1);
-			len = buflen - offset - 1;
-		}
-
-		/* set the destination pointer */
-		if (len)
-			memcpy(buf + offset, sp, len);
-
-		/* nul-terminate the string. This way we can determine
-		 * the difference between NULL pointers and nul-strings */
-		buf[offset + len] = '\0';
-
-		/* write the correct location back to the block */
-		memcpy(buf + ptrs[i], &offset, sizeof(offset));
-
-		/* increment offset pointers and decrement remaining space */
-		offset += len + 1;
+
+	len = strlen(sp);
+	if (len > (size_t)(buflen - *offset - 1)) {
+		linfo("String is too long (%lu bytes, %lu remaining). Truncating",
+			  (unsigned long)len, (unsigned long)(buflen - *offset - 1));
+		len = buflen - *offset - 1;
 	}
 
-	/*
-	 * offset now holds the total length of the packet, including
-	 * the last nul-terminator, regardless of how many strings we
-	 * actually stashed in there.
-	 */
+	/* nul-terminated, so we can tell NULL pointers from nul-strings */
+	memcpy(buf + *offset, sp, len);
+	buf[*offset + len] = '\0';
+	memcpy(buf + ptr, offset, sizeof(*offset));
+	*offset += len + 1;
+}
+
+/*
+ * Turn the offset "ptr" bytes into a decoded event back into a
+ * pointer. Returns 0 on success and the bit for string "i" if the
+ * offset points past the end of the event.
+ */
+static inline int codec_get_string(void *ds, off_t len, off_t ptr, int i, int cb_type)
+{
+	char *sp;
 
-	/* offset must be multiple of 8 to avoid memory alignment issues on SPARC */
-	if (offset % 8)
-		offset += 8 - offset % 8;
+	memcpy(&sp, (char *)ds + ptr, sizeof(sp));
+	if (!sp) /* ignore null pointers from original struct */
+		return 0;
 
-	if (cb_type == RUNCMD_PACKET) {
-		free(ptrs);
+	/* make sure we don't overshoot the buffer */
+	if ((off_t)sp > len) {
+		lerr("Nulling OOB ptr %u. cb: %s; type: %d; offset: %p; len: %lu; overshot with %lu bytes",
+			 i, callback_name(cb_type), *(int *)ds, sp, len, (off_t)sp - len);
+		memset((char *)ds + ptr, 0, sizeof(sp));
+		return 1 << i;
 	}
-	return offset;
+
+	sp += (off_t)ds;
+	memcpy((char *)ds + ptr, &sp, sizeof(sp));
+	return 0;
 }
 
+/*
+ * Fixed-length variables are simply memcpy()'d by merlin_encode(),
+ * and the encoder takes care of the strings. The length is padded
+ * to a multiple of 8 to avoid memory alignment issues on SPARC.
+ */
+#define CODEC_ENCODE_STRING(member) \
+	codec_put_string(buf, buflen, &offset, &skipped, offsetof(codec_t, member), \
+	                 ((const codec_t *)data)->member);
+#define CODEC_ENCODER(cb, name, type, strings) \
+static int encode_##name(const void *data, char *buf, int buflen) \
+{ \
+	typedef type codec_t __attribute__((unused)); \
+	off_t offset = sizeof(codec_t); \
+	int skipped = 0; \
+\
+	strings \
+	if (skipped) \
+		lwarn("No space remaining in buffer. Skipped %d strings", skipped); \
+	/* zero the padding, so leftovers are never taken for a perfdata trailer */ \
+	while (offset < buflen && (offset & 7)) \
+		buf[offset++] = 0; \
+	return (offset + 7) & ~(off_t)7; \
+}
 
 /*
  * Undo the pointer mangling done above (well, not exactly, but the
  * string pointers will point to the location of the string in the
  * block anyways, and thus "work").
+ */
+#define CODEC_DECODE_STRING(member) \
+	ret |= codec_get_string(ds, len, offsetof(codec_t, member), i++, cb_type);
+#define CODEC_DECODER(cb, name, type, strings) \
+static int decode_##name(void *ds, off_t len) \
+{ \
+	typedef type codec_t __attribute__((unused)); \
+	__attribute__((unused)) const int cb_type = cb; \
+	__attribute__((unused)) int i = 0; \
+	int ret = 0; \
+\
+	strings \
+	return ret; \
+}
+
+CODEC_SCHEMA(CODEC_ENCODER, CODEC_ENCODE_STRING)
+CODEC_SCHEMA(CODEC_DECODER, CODEC_DECODE_STRING)
+CODEC_PACKETS(CODEC_ENCODER, CODEC_ENCODE_STRING)
+CODEC_PACKETS(CODEC_DECODER, CODEC_DECODE_STRING)
+
+/*
+ * The size is looked up rather than built into the encoders, since
+ * compilers tend to turn a fixed-size copy of a large struct into
+ * something slower than a call to memcpy()
+ */
+struct codec {
+	int type;
+	size_t size;
+	int (*encode)(const void *data, char *buf, int buflen);
+	int (*decode)(void *ds, off_t len);
+};
+
+#define CODEC_ENTRY(cb, name, type, strings) \
+	{ cb, sizeof(type), encode_##name, decode_##name },
+#define CODEC_NEB_ENTRY(cb, name, type, strings) \
+	[cb] = CODEC_ENTRY(cb, name, type, strings)
+#define CODEC_NO_STRINGS(member)
+static const struct codec neb_codec[NEBCALLBACK_NUMITEMS] = {
+	CODEC_SCHEMA(CODEC_NEB_ENTRY, CODEC_NO_STRINGS)
+};
+static const struct codec packet_codec[] = {
+	CODEC_PACKETS(CODEC_ENTRY, CODEC_NO_STRINGS)
+};
+
+static const struct codec *codec_find(int cb_type)
+{
+	unsigned int i;
+
+	if (cb_type >= 0 && cb_type < NEBCALLBACK_NUMITEMS)
+		return neb_codec[cb_type].encode ? &neb_codec[cb_type] : NULL;
+
+	for (i = 0; i < ARRAY_SIZE(packet_codec); i++) {
+		if (packet_codec[i].type == cb_type)
+			return &packet_codec[i];
+	}
+	return NULL;
+}
+
+int merlin_encode(void *data, int cb_type, char *buf, int buflen)
+{
+	const struct codec *c;
+
+	if (!data || !(c = codec_find(cb_type)))
+		return 0;
+
+	/* copy the base struct first. The strings overwrite their pointers */
+	memcpy(buf, data, c->size);
+	return c->encode(data, buf, buflen);
+}
+
+/*
  * Note that strings still cannot be free()'d, since the memory
  * they reside in is a single continuous block making up the entire
  * event.
@@ -320,53 +258,128 @@ int merlin_encode(void *data, int cb_type, char *buf, int buflen)
  */
 int merlin_decode(void *ds, off_t len, int cb_type)
 {
-	off_t *ptrs;
-	int num_strings, i, ret = 0;
+	const struct codec *c;
+
+	if (!ds || !len)
+		return -1;
+	if (!(c = codec_find(cb_type)))
+		return cb_type >= 0 && cb_type < NEBCALLBACK_NUMITEMS ? 0 : -1;
 
-	if (cb_type == RUNCMD_PACKET && ds && len) {
-		num_strings = 1;
+	return c->decode(ds, len);
+}
 
-		/* calloc to ensure we 0 initialize */
-		ptrs = calloc(7,sizeof(off_t));
-		ptrs[0] = offsetof(merlin_runcmd, content);
+/*
+ * Compact headers (see MERLIN_COMPACT_MAGIC) store numbers as
+ * LEB128 varints; seven bits at a time, least significant first,
+ * with the high bit set on every byte but the last.
+ */
+static unsigned char *put_varint(unsigned char *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (val & 0x7f) | 0x80;
+		val >>= 7;
 	}
-	else if (!ds || !len || cb_type < 0 || cb_type >= NEBCALLBACK_NUMITEMS)
-		return -1;
-	else {
-		num_strings = hook_info[cb_type].strings;
-		ptrs = hook_info[cb_type].ptrs;
+	*p++ = val;
+	return p;
+}
+
+/*
+ * Returns the number of bytes read, 0 if buf ends before the
+ * varint does and -1 if it's longer than any uint64_t
+ */
+static int get_varint(const unsigned char *buf, size_t len, uint64_t *val)
+{
+	unsigned int i;
+
+	*val = 0;
+	for (i = 0; i < len; i++) {
+		if (i == 10)
+			return -1;
+		*val |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+		if (!(buf[i] & 0x80))
+			return i + 1;
 	}
 
-	for (i = 0; i < num_strings; i++) {
-		char *ptr;
+	return 0;
+}
 
-		if (!ptrs[i]) {
-			lwarn("!ptrs[%d]; strings == %d. Fix the hook_info struct", i, num_strings);
-			continue;
-		}
+int merlin_encode_header(const merlin_header *hdr, unsigned int flags, unsigned char *buf)
+{
+	unsigned char *p = buf;
 
-		/* get the relative offset */
-		memcpy(&ptr, (char *)ds + ptrs[i], sizeof(ptr));
+	*p++ = MERLIN_COMPACT_MAGIC;
+	*p++ = flags;
+	p = put_varint(p, hdr->type);
+	p = put_varint(p, hdr->code);
+	p = put_varint(p, hdr->selection);
+	p = put_varint(p, hdr->len);
+	p = put_varint(p, hdr->sent.tv_sec);
+	p = put_varint(p, hdr->sent.tv_usec);
+	if (flags & MERLIN_COMPACT_CRYPT) {
+		memcpy(p, hdr->authtag, sizeof(hdr->authtag));
+		p += sizeof(hdr->authtag);
+	}
+	if ((flags & MERLIN_COMPACT_CRYPT) && !(flags & MERLIN_COMPACT_SEQ)) {
+		memcpy(p, hdr->nonce, sizeof(hdr->nonce));
+		p += sizeof(hdr->nonce);
+	}
 
-		if (!ptr) /* ignore null pointers from original struct */
-			continue;
+	return p - buf;
+}
 
-		/* make sure we don't overshoot the buffer */
-		if ((off_t)ptr > len) {
-			lerr("Nulling OOB ptr %u. cb: %s; type: %d; offset: %p; len: %lu; overshot with %lu bytes",
-				 i, callback_name(cb_type), *(int *)ds, ptr, len, (off_t)ptr - len);
+int merlin_decode_header(const unsigned char *buf, size_t len, merlin_header *hdr)
+{
+	uint64_t val[6];
+	size_t off = 2;
+	unsigned int i;
 
-			ptr = NULL;
-			ret |= (1 << i);
-		}
-		else
-			ptr += (off_t)ds;
+	if (len < off)
+		return 0;
+	if (buf[0] != MERLIN_COMPACT_MAGIC ||
+	    (buf[1] & ~(MERLIN_COMPACT_CRYPT | MERLIN_COMPACT_SEQ | MERLIN_COMPACT_ZBODY)))
+	{
+		return -1;
+	}
+	/* only encrypted events have nonces to leave out, or bodies compressed on their own */
+	if ((buf[1] & (MERLIN_COMPACT_SEQ | MERLIN_COMPACT_ZBODY)) && !(buf[1] & MERLIN_COMPACT_CRYPT))
+		return -1;
+
+	/* type, code, selection, len, sent.tv_sec, sent.tv_usec */
+	for (i = 0; i < ARRAY_SIZE(val); i++) {
+		int ret = get_varint(buf + off, len - off, &val[i]);
+		if (ret <= 0)
+			return ret;
+		off += ret;
+	}
+	if (val[0] > 0xffff || val[1] > 0xffff || val[2] > 0xffff ||
+	    val[3] > sizeof(((merlin_event *)0)->body) || val[5] >= 1000000)
+	{
+		return -1;
+	}
 
-		/* now write it back to the proper location */
-		memcpy((char *)ds + ptrs[i], &ptr, sizeof(ptr));
+	memset(hdr, 0, sizeof(*hdr));
+	if (buf[1] & MERLIN_COMPACT_CRYPT) {
+		if (len - off < sizeof(hdr->authtag))
+			return 0;
+		memcpy(hdr->authtag, buf + off, sizeof(hdr->authtag));
+		off += sizeof(hdr->authtag);
 	}
-	if (cb_type == RUNCMD_PACKET) {
-		free(ptrs);
+	/* the caller knows which counter nonce comes next */
+	if ((buf[1] & MERLIN_COMPACT_CRYPT) && !(buf[1] & MERLIN_COMPACT_SEQ)) {
+		if (len - off < sizeof(hdr->nonce))
+			return 0;
+		memcpy(hdr->nonce, buf + off, sizeof(hdr->nonce));
+		off += sizeof(hdr->nonce);
 	}
-	return ret;
+
+	hdr->sig.id = MERLIN_SIGNATURE;
+	hdr->protocol = MERLIN_PROTOCOL_COMPACT;
+	hdr->type = val[0];
+	hdr->code = val[1];
+	hdr->selection = val[2];
+	hdr->len = val[3];
+	hdr->sent.tv_sec = val[4];
+	hdr->sent.tv_usec = val[5];
+
+	return off;
 }
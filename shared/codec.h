@@ -8,6 +8,21 @@
 
 int merlin_encode(void *data, int cb_type, char *buf, int buflen);
 int merlin_decode(void *ds, off_t len, int cb_type);
+
+/*
+ * Write the compact version of hdr, with MERLIN_COMPACT_* flags, to
+ * buf, which must have room for MERLIN_COMPACT_HDR_MAX bytes.
+ * Returns the number of bytes written.
+ */
+int merlin_encode_header(const merlin_header *hdr, unsigned int flags, unsigned char *buf);
+
+/*
+ * Fill in hdr from the len bytes of compact header at buf. Returns
+ * the size of the compact header, 0 if more data is needed to tell
+ * or -1 if it's not a valid compact header. With MERLIN_COMPACT_SEQ
+ * the nonce is left zeroed for the caller to fill in.
+ */
+int merlin_decode_header(const unsigned char *buf, size_t len, merlin_header *hdr);
 static inline int merlin_encode_event(merlin_event *pkt, void *data)
 {
 	return merlin_encode(data, pkt->hdr.type, pkt->body, sizeof(pkt->body));
@@ -130,6 +130,41 @@ static int grok_binlog_var(const char *key, const char *value)
 		return read_positive_number(value, &binlog_max_file_size);
 	}
 
+	if (!strcmp(key, "binlog_compression")) {
+		int method = binlog_compression_by_name(value);
+		if (method < 0)
+			return 0;
+		binlog_compression = method;
+		return 1;
+	}
+
+	if (!strcmp(key, "binlog_compact")) {
+		binlog_compact = strtobool(value);
+		return 1;
+	}
+
+	if (!strcmp(key, "binlog_shared")) {
+		binlog_shared = strtobool(value);
+		return 1;
+	}
+
+	if (!strcmp(key, "binlog_sync_interval")) {
+		unsigned long long int secs;
+		if (!read_positive_number(value, &secs) || secs > 86400)
+			return 0;
+		binlog_sync_interval = (int)secs;
+		return 1;
+	}
+
+	if (!strcmp(key, "binlog_outbuf_size")) {
+		return read_positive_number(value, &binlog_outbuf_size);
+	}
+
+	if (!strcmp(key, "binlog_priority")) {
+		binlog_priority = strtobool(value);
+		return 1;
+	}
+
 	if (!strcmp(key, "binlog_persist")) {
 		int binlog_val = atoi(value);
 		if (binlog_val == 0) {
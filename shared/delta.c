@@ -0,0 +1,487 @@
+/*
+ * status updates sent as the fields that changed
+ *
+ * A check result carries some 400 bytes of monitored_object_state,
+ * of which usually only the check times, the latency and the output
+ * change from one result to the next. Both ends of a connection keep
+ * the last state of each object they've sent or received, so only
+ * the fields that changed need to cross it.
+ *
+ * The sender keeps hashes of the strings rather than the strings
+ * themselves. The receiver needs the strings to put back the ones
+ * that didn't change, so it keeps copies.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "shared.h"
+#include "intern.h"
+#include "delta.h"
+#include "perfdata.h"
+
+int state_deltas;
+
+/* what one end knows of an object */
+struct delta_entry {
+	monitored_object_state state; /* the sender's has no strings */
+	uint64_t hash[3];             /* the sender's hashes of the strings */
+};
+
+/* the states of one kind of object, by id, for one kind of ids */
+struct delta_kind {
+	struct delta_entry **entry;
+	uint32_t alloc;
+};
+
+/* hosts and services, with connection ids and then object ids */
+#define DELTA_KINDS (INTERN_KINDS * 2)
+
+struct delta_table {
+	struct delta_kind kind[DELTA_KINDS];
+};
+
+struct delta_field {
+	uint16_t offset, size;
+};
+
+#define STATE_FIELD(f) { offsetof(monitored_object_state, f), sizeof(((monitored_object_state *)0)->f) }
+static const struct delta_field fields[] = {
+	STATE_FIELD(initial_state),
+	STATE_FIELD(flap_detection_enabled),
+	STATE_FIELD(low_flap_threshold),
+	STATE_FIELD(high_flap_threshold),
+	STATE_FIELD(check_freshness),
+	STATE_FIELD(freshness_threshold),
+	STATE_FIELD(process_performance_data),
+	STATE_FIELD(checks_enabled),
+	STATE_FIELD(accept_passive_checks),
+	STATE_FIELD(event_handler_enabled),
+	STATE_FIELD(obsess),
+	STATE_FIELD(problem_has_been_acknowledged),
+	STATE_FIELD(acknowledgement_type),
+	STATE_FIELD(check_type),
+	STATE_FIELD(current_state),
+	STATE_FIELD(last_state),
+	STATE_FIELD(last_hard_state),
+	STATE_FIELD(state_type),
+	STATE_FIELD(current_attempt),
+	STATE_FIELD(hourly_value),
+	STATE_FIELD(current_event_id),
+	STATE_FIELD(last_event_id),
+	STATE_FIELD(current_problem_id),
+	STATE_FIELD(last_problem_id),
+	STATE_FIELD(latency),
+	STATE_FIELD(execution_time),
+	STATE_FIELD(notifications_enabled),
+	STATE_FIELD(last_notification),
+	STATE_FIELD(next_notification),
+	STATE_FIELD(next_check),
+	STATE_FIELD(should_be_scheduled),
+	STATE_FIELD(last_check),
+	STATE_FIELD(last_state_change),
+	STATE_FIELD(last_hard_state_change),
+	STATE_FIELD(last_time_up),
+	STATE_FIELD(last_time_down),
+	STATE_FIELD(last_time_unreachable),
+	STATE_FIELD(has_been_checked),
+	STATE_FIELD(current_notification_number),
+	STATE_FIELD(current_notification_id),
+	STATE_FIELD(check_flapping_recovery_notification),
+	STATE_FIELD(scheduled_downtime_depth),
+	STATE_FIELD(pending_flex_downtime),
+	STATE_FIELD(state_history),
+	STATE_FIELD(state_history_index),
+	STATE_FIELD(is_flapping),
+	STATE_FIELD(flapping_comment_id),
+	STATE_FIELD(percent_state_change),
+	STATE_FIELD(modified_attributes),
+	STATE_FIELD(notified_on),
+	/* the strings come last */
+	STATE_FIELD(plugin_output),
+	STATE_FIELD(long_plugin_output),
+	STATE_FIELD(perf_data),
+};
+#define NUM_FIELDS ARRAY_SIZE(fields)
+#define FIRST_STRING (NUM_FIELDS - 3)
+#define SNAPSHOT ((1ULL << NUM_FIELDS) - 1)
+
+/* the mask has a bit per field */
+typedef char delta_fields_fit[NUM_FIELDS < 64 ? 1 : -1];
+
+/* where the names and the state are in the events we make deltas of */
+struct delta_layout {
+	uint32_t size;    /* of the struct the strings follow */
+	int names;        /* 1 for hosts, 2 for services */
+	uint32_t name[2]; /* slots of the host name and service description */
+	uint32_t state;   /* where the monitored_object_state is */
+};
+
+static const struct delta_layout host_layout = {
+	sizeof(merlin_host_status), 1,
+	{ offsetof(merlin_host_status, name) },
+	offsetof(merlin_host_status, state),
+};
+
+static const struct delta_layout service_layout = {
+	sizeof(merlin_service_status), 2,
+	{ offsetof(merlin_service_status, host_name), offsetof(merlin_service_status, service_description) },
+	offsetof(merlin_service_status, state),
+};
+
+static const struct delta_layout *delta_layout(unsigned int type)
+{
+	switch (type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		return &host_layout;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		return &service_layout;
+	}
+	return NULL;
+}
+
+static inline uint64_t slot_get(const char *body, uint32_t slot)
+{
+	uint64_t val;
+
+	memcpy(&val, body + slot, sizeof(val));
+	return val;
+}
+
+static inline void slot_set(char *body, uint32_t slot, uint64_t val)
+{
+	memcpy(body + slot, &val, sizeof(val));
+}
+
+/* the length of the string at off in body, or -1 if it isn't all there */
+static int delta_strlen(const char *body, uint32_t len, uint64_t off)
+{
+	const char *end;
+
+	if (!off || off >= len || !(end = memchr(body + off, 0, len - off)))
+		return -1;
+	return end - (body + off);
+}
+
+/* FNV-1a, with 0 for no string at all */
+static uint64_t delta_hash(const char *str)
+{
+	uint64_t key = 14695981039346656037ULL;
+
+	if (!str)
+		return 0;
+	for (; *str; str++)
+		key = (key ^ (unsigned char)*str) * 1099511628211ULL;
+	return key | 1;
+}
+
+static struct delta_entry **delta_slot(delta_table *t, int numbered, int names, uint32_t id)
+{
+	struct delta_kind *k = &t->kind[(numbered ? INTERN_KINDS : 0) + names - 1];
+	struct delta_entry **entry;
+	uint32_t alloc = k->alloc ? k->alloc : 256;
+
+	if (!id || id > INTERN_MAX_IDS)
+		return NULL;
+	if (id <= k->alloc)
+		return &k->entry[id - 1];
+
+	while (alloc < id)
+		alloc *= 2;
+	if (!(entry = realloc(k->entry, alloc * sizeof(*entry))))
+		return NULL;
+	memset(entry + k->alloc, 0, (alloc - k->alloc) * sizeof(*entry));
+	k->entry = entry;
+	k->alloc = alloc;
+	return &k->entry[id - 1];
+}
+
+delta_table *delta_create(void)
+{
+	return calloc(1, sizeof(delta_table));
+}
+
+static void delta_free_strings(monitored_object_state *st)
+{
+	unsigned int i;
+
+	for (i = FIRST_STRING; i < NUM_FIELDS; i++) {
+		char *str;
+
+		memcpy(&str, (char *)st + fields[i].offset, sizeof(str));
+		free(str);
+	}
+}
+
+void delta_destroy(delta_table *t)
+{
+	unsigned int i, k;
+
+	if (!t)
+		return;
+
+	for (k = 0; k < DELTA_KINDS; k++) {
+		for (i = 0; i < t->kind[k].alloc; i++) {
+			if (t->kind[k].entry[i]) {
+				delta_free_strings(&t->kind[k].entry[i]->state);
+				free(t->kind[k].entry[i]);
+			}
+		}
+		free(t->kind[k].entry);
+	}
+	free(t);
+}
+
+uint32_t delta_encode(delta_table *t, int numbered, unsigned int type,
+                      const char *body, uint32_t len, char *out, uint32_t room)
+{
+	const struct delta_layout *l = delta_layout(type);
+	struct delta_entry **slot, *e, sent;
+	struct delta_header hdr;
+	const char *str[3];
+	uint32_t offset, i, tlen;
+	int n;
+
+	if (!t || !l || len < l->size)
+		return 0;
+	tlen = perfdata_trailer_len(body, len);
+	len -= tlen;
+	if (!(slot = delta_slot(t, numbered, l->names, INTERN_REF_ID(slot_get(body, l->name[l->names - 1])))))
+		return 0;
+	e = *slot;
+
+	memset(&sent, 0, sizeof(sent));
+	memcpy(&sent.state, body + l->state, sizeof(sent.state));
+	for (i = 0; i < ARRAY_SIZE(str); i++) {
+		uint64_t off;
+
+		memcpy(&off, (char *)&sent.state + fields[FIRST_STRING + i].offset, sizeof(off));
+		str[i] = off && delta_strlen(body, len, off) >= 0 ? body + off : NULL;
+		sent.hash[i] = delta_hash(str[i]);
+		memset((char *)&sent.state + fields[FIRST_STRING + i].offset, 0, sizeof(char *));
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	for (i = 0; i < (uint32_t)l->names; i++)
+		hdr.name[i] = slot_get(body, l->name[i]);
+	memcpy(&hdr.nebattr, body, sizeof(hdr.nebattr));
+	hdr.trailer = tlen;
+
+	/* which fields changed, and how much room they take */
+	offset = sizeof(hdr);
+	for (i = 0; i < NUM_FIELDS; i++) {
+		const struct delta_field *f = &fields[i];
+
+		if (e && i < FIRST_STRING && !memcmp((char *)&sent.state + f->offset, (char *)&e->state + f->offset, f->size))
+			continue;
+		if (e && i >= FIRST_STRING && sent.hash[i - FIRST_STRING] == e->hash[i - FIRST_STRING])
+			continue;
+		hdr.mask |= 1ULL << i;
+		offset += f->size;
+	}
+	if (offset > room)
+		return 0;
+
+	/* names given along with their ids come first among the strings */
+	for (i = 0; i < (uint32_t)l->names; i++) {
+		uint32_t off = INTERN_REF_OFF(hdr.name[i]);
+
+		if (!off)
+			continue;
+		if ((n = delta_strlen(body, len, off)) < 0 || offset + n + 1 > room)
+			return 0;
+		memcpy(out + offset, body + off, n + 1);
+		hdr.name[i] = INTERN_REF(INTERN_REF_ID(hdr.name[i]), offset);
+		offset += n + 1;
+	}
+
+	memcpy(out, &hdr, sizeof(hdr));
+	n = sizeof(hdr);
+	for (i = 0; i < NUM_FIELDS; i++) {
+		const struct delta_field *f = &fields[i];
+		const char *s;
+		uint64_t off = 0;
+
+		if (!(hdr.mask & (1ULL << i)))
+			continue;
+		if (i < FIRST_STRING) {
+			memcpy(out + n, (char *)&sent.state + f->offset, f->size);
+			n += f->size;
+			continue;
+		}
+		if ((s = str[i - FIRST_STRING])) {
+			size_t slen = strlen(s) + 1;
+
+			if (offset + slen > room)
+				return 0;
+			memcpy(out + offset, s, slen);
+			off = offset;
+			offset += slen;
+		}
+		memcpy(out + n, &off, sizeof(off));
+		n += sizeof(off);
+	}
+
+	if (((offset + 7) & ~7) + tlen > room)
+		return 0;
+	memset(out + offset, 0, ((offset + 7) & ~7) - offset);
+	offset = (offset + 7) & ~7;
+	memcpy(out + offset, body + len, tlen);
+	offset += tlen;
+
+	/* the event is bound to be sent now, so this is what the other end has */
+	if (!e && !(e = *slot = malloc(sizeof(*e))))
+		return 0;
+	*e = sent;
+	return offset;
+}
+
+int delta_lookup(delta_table *t, int numbered, unsigned int type, const char *body,
+                 uint32_t len, const struct monitored_object_state **state)
+{
+	const struct delta_layout *l = delta_layout(type);
+	struct delta_entry **slot, *e;
+	struct delta_header hdr;
+	monitored_object_state st;
+	char *fresh[3] = { NULL, NULL, NULL };
+	uint32_t pos, expanded, i;
+	int n;
+
+	if (!t || !l || len < sizeof(hdr))
+		return -1;
+	memcpy(&hdr, body, sizeof(hdr));
+	if (hdr.mask & ~SNAPSHOT)
+		return -1;
+	if (hdr.trailer && (perfdata_trailer_len(body, len) != hdr.trailer || len - hdr.trailer < sizeof(hdr)))
+		return -1;
+	len -= hdr.trailer;
+	if (!(slot = delta_slot(t, numbered, l->names, INTERN_REF_ID(hdr.name[l->names - 1]))))
+		return -1;
+	if (!(e = *slot) && hdr.mask != SNAPSHOT)
+		return -1;
+
+	expanded = l->size;
+	for (i = 0; i < (uint32_t)l->names; i++) {
+		uint32_t off = INTERN_REF_OFF(hdr.name[i]);
+
+		if (!off)
+			continue;
+		if ((n = delta_strlen(body, len, off)) < 0)
+			return -1;
+		expanded += n + 1;
+	}
+
+	/* check all of it before changing anything */
+	for (i = 0, pos = sizeof(hdr); i < NUM_FIELDS; i++) {
+		uint64_t off;
+
+		if (!(hdr.mask & (1ULL << i)))
+			continue;
+		if (pos + fields[i].size > len)
+			return -1;
+		if (i >= FIRST_STRING) {
+			memcpy(&off, body + pos, sizeof(off));
+			if (off && delta_strlen(body, len, off) < 0)
+				return -1;
+		}
+		pos += fields[i].size;
+	}
+
+	/* copy the new strings before changing anything */
+	for (i = 0, pos = sizeof(hdr); i < NUM_FIELDS; i++) {
+		uint64_t off;
+
+		if (!(hdr.mask & (1ULL << i)))
+			continue;
+		if (i >= FIRST_STRING) {
+			memcpy(&off, body + pos, sizeof(off));
+			if (off && !(fresh[i - FIRST_STRING] = strdup(body + off)))
+				goto fail;
+		}
+		pos += fields[i].size;
+	}
+	if (!e && !(e = *slot = calloc(1, sizeof(*e))))
+		goto fail;
+
+	st = e->state;
+	for (i = 0, pos = sizeof(hdr); i < NUM_FIELDS; i++) {
+		char *old;
+
+		if (!(hdr.mask & (1ULL << i)))
+			continue;
+		if (i < FIRST_STRING) {
+			memcpy((char *)&st + fields[i].offset, body + pos, fields[i].size);
+		} else {
+			memcpy(&old, (char *)&st + fields[i].offset, sizeof(old));
+			free(old);
+			memcpy((char *)&st + fields[i].offset, &fresh[i - FIRST_STRING], sizeof(char *));
+		}
+		pos += fields[i].size;
+	}
+	for (i = FIRST_STRING; i < NUM_FIELDS; i++) {
+		const char *str;
+
+		memcpy(&str, (char *)&st + fields[i].offset, sizeof(str));
+		if (str)
+			expanded += strlen(str) + 1;
+	}
+
+	e->state = st;
+	*state = &e->state;
+	return ((expanded + 7) & ~7) + hdr.trailer;
+
+fail:
+	for (i = 0; i < ARRAY_SIZE(fresh); i++)
+		free(fresh[i]);
+	return -1;
+}
+
+void delta_expand(unsigned int type, const char *body, uint32_t len,
+                  const struct monitored_object_state *state, char *out)
+{
+	const struct delta_layout *l = delta_layout(type);
+	struct delta_header hdr;
+	monitored_object_state st;
+	uint32_t offset, i;
+
+	memcpy(&hdr, body, sizeof(hdr));
+	memset(out, 0, l->size);
+	memcpy(out, &hdr.nebattr, sizeof(hdr.nebattr));
+	offset = l->size;
+
+	for (i = 0; i < (uint32_t)l->names; i++) {
+		uint32_t off = INTERN_REF_OFF(hdr.name[i]);
+		size_t n;
+
+		if (!off) {
+			slot_set(out, l->name[i], hdr.name[i]);
+			continue;
+		}
+		n = strlen(body + off) + 1;
+		memcpy(out + offset, body + off, n);
+		slot_set(out, l->name[i], INTERN_REF(INTERN_REF_ID(hdr.name[i]), offset));
+		offset += n;
+	}
+
+	st = *state;
+	for (i = FIRST_STRING; i < NUM_FIELDS; i++) {
+		const char *s;
+		uint64_t off = 0;
+
+		memcpy(&s, (const char *)state + fields[i].offset, sizeof(s));
+		if (s) {
+			size_t n = strlen(s) + 1;
+
+			memcpy(out + offset, s, n);
+			off = offset;
+			offset += n;
+		}
+		memcpy((char *)&st + fields[i].offset, &off, sizeof(off));
+	}
+	memcpy(out + l->state, &st, sizeof(st));
+	memset(out + offset, 0, ((offset + 7) & ~7) - offset);
+	offset = (offset + 7) & ~7;
+	memcpy(out + offset, body + len - hdr.trailer, hdr.trailer);
+}
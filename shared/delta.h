@@ -0,0 +1,104 @@
+#ifndef INCLUDE_delta_h
+#define INCLUDE_delta_h
+#include <stdint.h>
+
+/**
+ * @file delta.h
+ * @brief status updates sent as the fields that changed
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * With state_deltas set, we send nodes that announce MERLIN_CAP_DELTA
+ * host and service check results and status updates as deltas of
+ * the one we last sent them for the same object. A delta holds the
+ * fields of the monitored_object_state that changed, along with a
+ * bitmap of which ones they are. The first event for an object on a
+ * connection is a snapshot with all the fields. Both ends remember
+ * the last state of each object, the sender to know what changed
+ * and the receiver to put back what didn't, and forget it all when
+ * the connection goes down, so snapshots are sent again once it's
+ * back up.
+ *
+ * Deltas are made from interned events (see intern.h), which have
+ * ids to remember objects by. A delta has MAGIC_INTERNED_DELTA or
+ * MAGIC_OBJECT_IDS_DELTA as its code, depending on the ids it uses,
+ * and a body made up of a struct delta_header, the changed fields
+ * in the order they have in monitored_object_state, each at its own
+ * size and strings as offsets in the body, followed by the strings.
+ * Names given along with ids are among the strings. The perfdata
+ * trailer of the event, if any (see perfdata.h), comes last.
+ */
+struct delta_header {
+	uint64_t name[2]; /* the name slots of the interned event. The second is 0 for hosts */
+	int32_t nebattr;
+	uint32_t trailer; /* the length of the perfdata trailer at the end, or 0 */
+	uint64_t mask;    /* the fields that follow. Snapshots have all of them */
+};
+
+/** send deltas to nodes that take them */
+extern int state_deltas;
+
+struct monitored_object_state;
+typedef struct delta_table delta_table;
+
+/**
+ * Create a table of object states for one direction of a connection
+ * @return The table, or NULL on errors
+ */
+extern delta_table *delta_create(void);
+
+/**
+ * Destroy a table, forgetting every state in it
+ * @param t The table. NULL is fine
+ */
+extern void delta_destroy(delta_table *t);
+
+/**
+ * Make a delta of an interned event against what we last sent for
+ * its object, writing it to out. The event becomes what we last
+ * sent for the object, so it has to be sent.
+ * @param t The table of states we send
+ * @param numbered 1 if the event has object ids, 0 if not
+ * @param type The type of the event
+ * @param body The interned event
+ * @param len Its length
+ * @param out Where to write the delta
+ * @param room The room there is at out
+ * @return The length of the delta, or 0 if the event isn't one we
+ *         make deltas of or it doesn't fit, in which case it has to
+ *         be sent as it is
+ */
+extern uint32_t delta_encode(delta_table *t, int numbered, unsigned int type,
+                             const char *body, uint32_t len, char *out, uint32_t room);
+
+/**
+ * Apply a received delta to the state we have for its object
+ * @param t The table of states we receive
+ * @param numbered 1 if the delta has object ids, 0 if not
+ * @param type The type of the event
+ * @param body The delta
+ * @param len Its length
+ * @param state Set to the state of the object, delta applied
+ * @return The length of the interned event with the state put back,
+ *         as delta_expand() writes it, or -1 if the delta is broken
+ *         or for an object we have no state for
+ */
+extern int delta_lookup(delta_table *t, int numbered, unsigned int type, const char *body,
+                        uint32_t len, const struct monitored_object_state **state);
+
+/**
+ * Write the interned event a delta delta_lookup() has accepted
+ * stands for
+ * @param type The type of the event
+ * @param body The delta
+ * @param len Its length
+ * @param state What delta_lookup() set
+ * @param out Where to write the event, with room for as many bytes
+ *            as delta_lookup() returned
+ */
+extern void delta_expand(unsigned int type, const char *body, uint32_t len,
+                         const struct monitored_object_state *state, char *out);
+/** @} */
+#endif
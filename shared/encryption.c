@@ -47,18 +47,57 @@ int init_sodium() {
 	return 0;
 }
 
-int encrypt_pkt(merlin_event * pkt, merlin_node * recv) {
+/*
+ * A counter nonce is the session followed by the packet's counter,
+ * little-endian so both ends agree on it whatever they run on.
+ */
+static void seq_nonce(unsigned char * nonce, const unsigned char * session, uint64_t seq) {
+	unsigned int i;
+
+	memcpy(nonce, session, MERLIN_SESSION_SIZE);
+	for (i = 0; i < sizeof(seq); i++)
+		nonce[MERLIN_SESSION_SIZE + i] = (seq >> (i * 8)) & 0xff;
+}
+
+int seq_nonces(const merlin_node * node) {
+	return node->encrypted && (node->info.capabilities & MERLIN_CAP_SEQNONCE) &&
+		!sodium_is_zero(node->info.session, sizeof(node->info.session));
+}
+
+int seq_session(merlin_node * node, merlin_nodeinfo * info) {
+	if (sodium_is_zero(node->seq.session, sizeof(node->seq.session))) {
+		if (init_sodium() == -1) {
+			return -1;
+		}
+		randombytes_buf(node->seq.session, sizeof(node->seq.session));
+		node->seq.next = 0;
+		node->seq.seen = 0;
+	}
+
+	memcpy(info->session, node->seq.session, sizeof(info->session));
+	return 0;
+}
+
+void seq_next_nonce(const merlin_node * node, unsigned char * nonce) {
+	seq_nonce(nonce, node->seq.session, node->seq.next);
+}
+
+int encrypt_body(const void * plain, uint32_t len, merlin_header * hdr, unsigned char * body, merlin_node * recv) {
 	ldebug("Encrypting pkt for node: %s", recv->name);
 	if (init_sodium() == -1) {
 		return -1;
 	}
 
-	randombytes_buf(pkt->hdr.nonce, sizeof(pkt->hdr.nonce));
+	if (seq_nonces(recv)) {
+		seq_nonce(hdr->nonce, recv->info.session, recv->seq.sent++);
+	} else {
+		randombytes_buf(hdr->nonce, sizeof(hdr->nonce));
+	}
 
 	if (crypto_box_detached_afternm(
-				(unsigned char *)pkt->body, pkt->hdr.authtag,
-				(unsigned char *)pkt->body, pkt->hdr.len,
-				pkt->hdr.nonce, recv->sharedkey) != 0) {
+				body, hdr->authtag,
+				(const unsigned char *)plain, len,
+				hdr->nonce, recv->sharedkey) != 0) {
 		lerr("could not encrypt msg!\n");
 		return -1;
 	}
@@ -68,12 +107,39 @@ int encrypt_pkt(merlin_event * pkt, merlin_node * recv) {
 	return 0;
 }
 
+int encrypt_pkt(merlin_event * pkt, merlin_node * recv) {
+	return encrypt_body(pkt->body, pkt->hdr.len, &pkt->hdr, (unsigned char *)pkt->body, recv);
+}
+
 int decrypt_pkt(merlin_event * pkt, merlin_node * sender) {
+	int seq;
+
 	ldebug("Decrypting pkt from node: %s", sender->name);
 	if (init_sodium() == -1) {
 		return -1;
 	}
 
+	/*
+	 * Once the node has our session, its packets must come with the
+	 * next counter nonce. Until then only control packets, such as
+	 * its CTRL_ACTIVE, may have random ones.
+	 */
+	seq = !sodium_is_zero(sender->seq.session, sizeof(sender->seq.session)) &&
+		!memcmp(pkt->hdr.nonce, sender->seq.session, MERLIN_SESSION_SIZE);
+	if (seq) {
+		unsigned char nonce[sizeof(pkt->hdr.nonce)];
+
+		seq_next_nonce(sender, nonce);
+		if (memcmp(nonce, pkt->hdr.nonce, sizeof(nonce))) {
+			lerr("Replayed or reordered packet from node: %s", sender->name);
+			return -1;
+		}
+	} else if (sender->seq.seen ||
+	           (pkt->hdr.type != CTRL_PACKET && (sender->info.capabilities & MERLIN_CAP_SEQNONCE))) {
+		lerr("Packet from node: %s isn't from this session. Replayed?", sender->name);
+		return -1;
+	}
+
 	if (crypto_box_open_detached_afternm(
 				(unsigned char *)pkt->body,
 				(const unsigned char *)pkt->body,
@@ -83,6 +149,11 @@ int decrypt_pkt(merlin_event * pkt, merlin_node * sender) {
 		return -1;
 	}
 
+	if (seq) {
+		sender->seq.next++;
+		sender->seq.seen = 1;
+	}
+
 	ldebug("Pkt decryption from node: %s succeeded", sender->name);
 
 	return 0;
@@ -4,7 +4,19 @@
 #include "shared.h"
 
 int encrypt_pkt(merlin_event * pkt, merlin_node * sender);
+/*
+ * Encrypt the len bytes at "plain" into "body", leaving them alone.
+ * The nonce and authtag go in hdr, which is what's sent along with it.
+ */
+int encrypt_body(const void * plain, uint32_t len, merlin_header * hdr, unsigned char * body, merlin_node * recv);
 int decrypt_pkt(merlin_event * pkt, merlin_node * recv);
 int open_encryption_key(const char * path, unsigned char * target, size_t size);
 
+/* true if what we encrypt for node gets counter nonces, see MERLIN_CAP_SEQNONCE */
+int seq_nonces(const merlin_node * node);
+/* put the session node should use in the nodeinfo of our CTRL_ACTIVE to it */
+int seq_session(merlin_node * node, merlin_nodeinfo * info);
+/* the nonce of the next packet node may send us */
+void seq_next_nonce(const merlin_node * node, unsigned char * nonce);
+
 #endif
@@ -0,0 +1,544 @@
+/*
+ * per-connection ids for host and service names
+ *
+ * Most of what a busy master receives is check results, and every
+ * one of them used to carry the full name of its host and service.
+ * The receiver then had to hash those to find the object, once per
+ * event, although the names repeat endlessly. With interning, each
+ * name crosses a connection once, after which the sender refers to
+ * it by id and the receiver keeps the object it resolved to.
+ *
+ * The sender's table maps names to ids through an open-addressed
+ * hash. The receiver's is a plain array indexed by id, since the
+ * ids are handed out from 1 and up.
+ *
+ * Numbered tables keep nothing, since both ends already know the
+ * ids of all objects. They only take the callbacks that map names
+ * to object ids and back.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "shared.h"
+#include "intern.h"
+#include "perfdata.h"
+
+struct intern_entry {
+	char *name;      /* the host name, and for services a nul and the description */
+	uint32_t len;    /* of all of name, nuls included */
+	uint32_t split;  /* where a service's description starts in name */
+	uint64_t hash;   /* of name, for the sender's lookups */
+	void *object;    /* what the receiver resolved the name to */
+	int sent;        /* the sender has given the other end the name */
+};
+
+struct intern_kind {
+	struct intern_entry *entry; /* by id - 1 */
+	uint32_t num, alloc;        /* highest id in use, and room for ids */
+	uint32_t *slot;             /* the sender's hash of ids */
+	uint32_t mask;
+};
+
+struct intern_table {
+	intern_resolver resolve;
+	intern_numberer number; /* numbered tables have these two instead */
+	intern_finder find;
+	int numbered;
+	struct intern_kind kind[INTERN_KINDS];
+};
+
+/* where the names and the rest of the strings are in the events we intern */
+struct intern_layout {
+	uint32_t size;    /* of the struct the strings follow */
+	int names;        /* 1 for hosts, 2 for services */
+	uint32_t name[2]; /* slots of the host name and service description, by kind */
+	uint32_t state;   /* where the monitored_object_state is */
+};
+
+static const uint32_t state_strings[] = {
+	offsetof(monitored_object_state, plugin_output),
+	offsetof(monitored_object_state, long_plugin_output),
+	offsetof(monitored_object_state, perf_data),
+};
+
+static const struct intern_layout host_layout = {
+	sizeof(merlin_host_status), 1,
+	{ offsetof(merlin_host_status, name) },
+	offsetof(merlin_host_status, state),
+};
+
+static const struct intern_layout service_layout = {
+	sizeof(merlin_service_status), 2,
+	{ offsetof(merlin_service_status, host_name), offsetof(merlin_service_status, service_description) },
+	offsetof(merlin_service_status, state),
+};
+
+static const struct intern_layout *intern_layout(unsigned int type)
+{
+	switch (type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		return &host_layout;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		return &service_layout;
+	}
+	return NULL;
+}
+
+int intern_type(unsigned int type)
+{
+	return intern_layout(type) != NULL;
+}
+
+/* string slots hold offsets, or references, the size of a pointer */
+static inline uint64_t slot_get(const char *body, uint32_t slot)
+{
+	uint64_t val;
+
+	memcpy(&val, body + slot, sizeof(val));
+	return val;
+}
+
+static inline void slot_set(char *body, uint32_t slot, uint64_t val)
+{
+	memcpy(body + slot, &val, sizeof(val));
+}
+
+/* the length of the string at off in body, or -1 if it isn't all there */
+static int intern_strlen(const char *body, uint32_t len, uint64_t off)
+{
+	const char *end;
+
+	if (!off || off >= len || !(end = memchr(body + off, 0, len - off)))
+		return -1;
+	return end - (body + off);
+}
+
+/* FNV-1a over the host name and, for services, a nul and the description */
+static uint64_t intern_hash(const char *hname, uint32_t hlen, const char *desc, uint32_t dlen)
+{
+	uint64_t key = 14695981039346656037ULL;
+	uint32_t i;
+
+	for (i = 0; i < hlen; i++)
+		key = (key ^ (unsigned char)hname[i]) * 1099511628211ULL;
+	if (desc) {
+		key *= 1099511628211ULL;
+		for (i = 0; i < dlen; i++)
+			key = (key ^ (unsigned char)desc[i]) * 1099511628211ULL;
+	}
+	return key;
+}
+
+static int intern_set_name(struct intern_entry *e, const char *hname, uint32_t hlen,
+                           const char *desc, uint32_t dlen)
+{
+	uint32_t len = hlen + 1 + (desc ? dlen + 1 : 0);
+	char *name;
+
+	if (!(name = malloc(len)))
+		return -1;
+	memcpy(name, hname, hlen);
+	name[hlen] = 0;
+	if (desc) {
+		memcpy(name + hlen + 1, desc, dlen);
+		name[len - 1] = 0;
+	}
+	free(e->name);
+	e->name = name;
+	e->len = len;
+	e->split = desc ? hlen + 1 : 0;
+	return 0;
+}
+
+/* make room for ids up to num */
+static int intern_grow(struct intern_kind *k, uint32_t num)
+{
+	struct intern_entry *entry;
+	uint32_t alloc = k->alloc ? k->alloc : 256;
+
+	if (num <= k->alloc)
+		return 0;
+	while (alloc < num)
+		alloc *= 2;
+	if (!(entry = realloc(k->entry, alloc * sizeof(*entry))))
+		return -1;
+	memset(entry + k->alloc, 0, (alloc - k->alloc) * sizeof(*entry));
+	k->entry = entry;
+	k->alloc = alloc;
+	return 0;
+}
+
+/* double the sender's hash, keeping it at most half full */
+static int intern_rehash(struct intern_kind *k)
+{
+	uint32_t size = k->slot ? (k->mask + 1) * 2 : 1024, i;
+	uint32_t *slot;
+
+	if (!(slot = calloc(size, sizeof(*slot))))
+		return -1;
+	for (i = 0; i < k->num; i++) {
+		uint32_t s = k->entry[i].hash & (size - 1);
+
+		while (slot[s])
+			s = (s + 1) & (size - 1);
+		slot[s] = i + 1;
+	}
+	free(k->slot);
+	k->slot = slot;
+	k->mask = size - 1;
+	return 0;
+}
+
+/* the sender's id for a name, handing out a new one if need be, or 0 */
+static uint32_t intern_id(struct intern_kind *k, const char *hname, uint32_t hlen,
+                          const char *desc, uint32_t dlen)
+{
+	uint64_t hash = intern_hash(hname, hlen, desc, dlen);
+	uint32_t len = hlen + 1 + (desc ? dlen + 1 : 0);
+	uint32_t split = desc ? hlen + 1 : 0;
+	uint32_t s;
+
+	if (!k->slot || (k->num < INTERN_MAX_IDS && (k->num + 1) * 2 > k->mask + 1)) {
+		if (intern_rehash(k) < 0)
+			return 0;
+	}
+
+	for (s = hash & k->mask; k->slot[s]; s = (s + 1) & k->mask) {
+		struct intern_entry *e = &k->entry[k->slot[s] - 1];
+
+		if (e->hash == hash && e->len == len && e->split == split &&
+		    !memcmp(e->name, hname, hlen) && (!desc || !memcmp(e->name + split, desc, dlen)))
+		{
+			return k->slot[s];
+		}
+	}
+
+	if (k->num >= INTERN_MAX_IDS || intern_grow(k, k->num + 1) < 0)
+		return 0;
+	if (intern_set_name(&k->entry[k->num], hname, hlen, desc, dlen) < 0)
+		return 0;
+	k->entry[k->num].hash = hash;
+	k->slot[s] = ++k->num;
+	return k->num;
+}
+
+/* what the other end has told us an id stands for */
+static int intern_learn(intern_table *t, int kind, uint32_t id, const char *hname, uint32_t hlen,
+                        const char *desc, uint32_t dlen)
+{
+	struct intern_kind *k = &t->kind[kind];
+	struct intern_entry *e;
+
+	if (intern_grow(k, id) < 0)
+		return -1;
+	e = &k->entry[id - 1];
+	if (intern_set_name(e, hname, hlen, desc, dlen) < 0)
+		return -1;
+	if (id > k->num)
+		k->num = id;
+	e->object = NULL;
+	if (t->resolve)
+		e->object = t->resolve(kind, e->name, desc ? e->name + e->split : NULL);
+	return 0;
+}
+
+static struct intern_entry *intern_get(intern_table *t, int kind, uint32_t id)
+{
+	struct intern_kind *k = &t->kind[kind];
+
+	if (!id || id > k->num || !k->entry[id - 1].name)
+		return NULL;
+	return &k->entry[id - 1];
+}
+
+/*
+ * Copy the strings of the monitored_object_state to "out" from
+ * "offset" on, pointing their slots at the copies. Returns where
+ * they end, or 0 if they don't fit in "room" bytes.
+ */
+static uint32_t intern_copy_state(const struct intern_layout *l, const char *body, uint32_t len,
+                                  char *out, uint32_t offset, uint32_t room)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(state_strings); i++) {
+		uint32_t slot = l->state + state_strings[i];
+		uint64_t off = slot_get(body, slot);
+		int n;
+
+		if (!off || (n = intern_strlen(body, len, off)) < 0) {
+			slot_set(out, slot, 0);
+			continue;
+		}
+		if (offset + n + 1 > room)
+			return 0;
+		memcpy(out + offset, body + off, n + 1);
+		slot_set(out, slot, offset);
+		offset += n + 1;
+	}
+	return offset;
+}
+
+/* events are padded to 8 bytes, like merlin_encode() does */
+static uint32_t intern_pad(char *out, uint32_t offset)
+{
+	uint32_t end = (offset + 7) & ~7;
+
+	memset(out + offset, 0, end - offset);
+	return end;
+}
+
+/* pad the event and put back the perfdata trailer of tlen bytes it had */
+static uint32_t intern_finish(char *out, uint32_t offset, const char *body, uint32_t len, uint32_t tlen)
+{
+	offset = intern_pad(out, offset);
+	memcpy(out + offset, body + len - tlen, tlen);
+	return offset + tlen;
+}
+
+intern_table *intern_create(intern_resolver resolve)
+{
+	intern_table *t = calloc(1, sizeof(*t));
+
+	if (t)
+		t->resolve = resolve;
+	return t;
+}
+
+intern_table *intern_create_numbered(intern_numberer number, intern_finder find)
+{
+	intern_table *t = calloc(1, sizeof(*t));
+
+	if (t) {
+		t->number = number;
+		t->find = find;
+		t->numbered = 1;
+	}
+	return t;
+}
+
+int intern_numbered(const intern_table *t)
+{
+	return t && t->numbered;
+}
+
+void intern_destroy(intern_table *t)
+{
+	unsigned int i, k;
+
+	if (!t)
+		return;
+
+	for (k = 0; k < INTERN_KINDS; k++) {
+		for (i = 0; i < t->kind[k].num; i++)
+			free(t->kind[k].entry[i].name);
+		free(t->kind[k].entry);
+		free(t->kind[k].slot);
+	}
+	free(t);
+}
+
+/* only the object's own name slot holds its id, and no names are sent */
+static uint32_t intern_encode_numbered(intern_table *t, const struct intern_layout *l,
+                                       const char *body, uint32_t len, char *out)
+{
+	const char *name[2] = { NULL, NULL };
+	uint32_t offset, tlen = perfdata_trailer_len(body, len);
+	int i, id;
+
+	len -= tlen;
+
+	for (i = 0; i < l->names; i++) {
+		uint64_t off = slot_get(body, l->name[i]);
+
+		if (intern_strlen(body, len, off) < 0)
+			return 0;
+		name[i] = body + off;
+	}
+	if (!t->number || (id = t->number(l->names - 1, name[0], name[1])) < 0)
+		return 0;
+
+	memcpy(out, body, l->size);
+	for (i = 0; i < l->names; i++)
+		slot_set(out, l->name[i], i == l->names - 1 ? INTERN_REF((uint32_t)id + 1, 0) : 0);
+
+	offset = intern_copy_state(l, body, len, out, l->size, len);
+	if (!offset || ((offset + 7) & ~7) > len)
+		return 0;
+	return intern_finish(out, offset, body, len + tlen, tlen);
+}
+
+uint32_t intern_encode(intern_table *t, unsigned int type, const char *body, uint32_t len, char *out)
+{
+	const struct intern_layout *l = intern_layout(type);
+	const char *name[2] = { NULL, NULL };
+	int name_len[2] = { 0, 0 }, give[2] = { 0, 0 }, i;
+	uint32_t id[2] = { 0, 0 }, offset, tlen;
+
+	if (!t || !l || len < l->size)
+		return 0;
+	if (t->numbered)
+		return intern_encode_numbered(t, l, body, len, out);
+	tlen = perfdata_trailer_len(body, len);
+	len -= tlen;
+
+	for (i = 0; i < l->names; i++) {
+		uint64_t off = slot_get(body, l->name[i]);
+
+		if ((name_len[i] = intern_strlen(body, len, off)) < 0)
+			return 0;
+		name[i] = body + off;
+	}
+
+	/* out of ids or memory, so the names go as they are */
+	if (!(id[INTERN_HOST] = intern_id(&t->kind[INTERN_HOST], name[0], name_len[0], NULL, 0)))
+		return 0;
+	if (l->names > 1 && !(id[INTERN_SERVICE] = intern_id(&t->kind[INTERN_SERVICE],
+	                                                     name[0], name_len[0], name[1], name_len[1])))
+	{
+		return 0;
+	}
+
+	memcpy(out, body, l->size);
+	offset = l->size;
+	for (i = 0; i < l->names; i++) {
+		uint32_t off = 0;
+
+		if (!t->kind[i].entry[id[i] - 1].sent) {
+			if (offset + name_len[i] + 1 > len)
+				return 0;
+			memcpy(out + offset, name[i], name_len[i] + 1);
+			off = offset;
+			offset += name_len[i] + 1;
+			give[i] = 1;
+		}
+		slot_set(out, l->name[i], INTERN_REF(id[i], off));
+	}
+
+	offset = intern_copy_state(l, body, len, out, offset, len);
+	if (!offset || ((offset + 7) & ~7) > len)
+		return 0;
+
+	/* the event is bound to be sent now, so the names count as given */
+	for (i = 0; i < l->names; i++) {
+		if (give[i])
+			t->kind[i].entry[id[i] - 1].sent = 1;
+	}
+	return intern_finish(out, offset, body, len + tlen, tlen);
+}
+
+/* the length of an event once names of name_len bytes, nuls and all, are put back */
+static int intern_expanded_len(const struct intern_layout *l, const char *body, uint32_t len,
+                               uint32_t name_len)
+{
+	uint32_t expanded = l->size + name_len, tlen = perfdata_trailer_len(body, len);
+	unsigned int i;
+	int n;
+
+	len -= tlen;
+
+	for (i = 0; i < ARRAY_SIZE(state_strings); i++) {
+		uint64_t off = slot_get(body, l->state + state_strings[i]);
+
+		if (!off)
+			continue;
+		if ((n = intern_strlen(body, len, off)) < 0)
+			return -1;
+		expanded += n + 1;
+	}
+
+	return ((expanded + 7) & ~7) + tlen;
+}
+
+static int intern_lookup_numbered(intern_table *t, const struct intern_layout *l,
+                                  const char *body, uint32_t len, struct intern_names *names)
+{
+	uint64_t ref = slot_get(body, l->name[l->names - 1]);
+	uint32_t name_len;
+
+	if (!t->find || !INTERN_REF_ID(ref) || INTERN_REF_OFF(ref))
+		return -1;
+	if (l->names > 1 && slot_get(body, l->name[0]))
+		return -1;
+
+	names->service_description = NULL;
+	if (!(names->object = t->find(l->names - 1, INTERN_REF_ID(ref) - 1, names)))
+		return -1;
+	if (!names->host_name || (l->names > 1) != !!names->service_description)
+		return -1;
+
+	name_len = strlen(names->host_name) + 1;
+	if (names->service_description)
+		name_len += strlen(names->service_description) + 1;
+	return intern_expanded_len(l, body, len, name_len);
+}
+
+int intern_lookup(intern_table *t, unsigned int type, const char *body, uint32_t len,
+                  struct intern_names *names)
+{
+	const struct intern_layout *l = intern_layout(type);
+	struct intern_entry *e;
+	uint32_t id[2] = { 0, 0 };
+	unsigned int i;
+	int n;
+
+	if (!t || !l || len < l->size)
+		return -1;
+	if (t->numbered)
+		return intern_lookup_numbered(t, l, body, len, names);
+
+	/* the host comes first, so services can be given along with it */
+	for (i = 0; i < (unsigned int)l->names; i++) {
+		uint64_t ref = slot_get(body, l->name[i]);
+		uint32_t off = INTERN_REF_OFF(ref);
+
+		id[i] = INTERN_REF_ID(ref);
+		if (!id[i] || id[i] > INTERN_MAX_IDS)
+			return -1;
+		if (!off)
+			continue;
+		if ((n = intern_strlen(body, len, off)) < 0)
+			return -1;
+
+		if (i == INTERN_HOST) {
+			if (intern_learn(t, INTERN_HOST, id[i], body + off, n, NULL, 0) < 0)
+				return -1;
+		} else {
+			if (!(e = intern_get(t, INTERN_HOST, id[INTERN_HOST])))
+				return -1;
+			if (intern_learn(t, INTERN_SERVICE, id[i], e->name, e->len - 1, body + off, n) < 0)
+				return -1;
+		}
+	}
+
+	if (!(e = intern_get(t, l->names > 1 ? INTERN_SERVICE : INTERN_HOST, id[l->names - 1])))
+		return -1;
+	names->host_name = e->name;
+	names->service_description = e->split ? e->name + e->split : NULL;
+	names->object = e->object;
+	return intern_expanded_len(l, body, len, e->len);
+}
+
+void intern_expand(unsigned int type, const char *body, uint32_t len,
+                   const struct intern_names *names, char *out)
+{
+	const struct intern_layout *l = intern_layout(type);
+	const char *name[2] = { names->host_name, names->service_description };
+	uint32_t offset, tlen = perfdata_trailer_len(body, len);
+	int i;
+
+	memcpy(out, body, l->size);
+	offset = l->size;
+	for (i = 0; i < l->names; i++) {
+		size_t n = strlen(name[i]) + 1;
+
+		memcpy(out + offset, name[i], n);
+		slot_set(out, l->name[i], offset);
+		offset += n;
+	}
+	offset = intern_copy_state(l, body, len - tlen, out, offset, UINT32_MAX);
+	intern_finish(out, offset, body, len, tlen);
+}
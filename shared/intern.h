@@ -0,0 +1,162 @@
+#ifndef INCLUDE_intern_h
+#define INCLUDE_intern_h
+#include <stdint.h>
+
+/**
+ * @file intern.h
+ * @brief per-connection ids for host and service names
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * Nodes that both announce MERLIN_CAP_INTERN send each other host
+ * and service check results and status updates with the names
+ * swapped for small integer ids. The sender hands out ids as it
+ * comes across names, and sends the name along with its id the
+ * first time the id is used on a connection. The receiver remembers
+ * what each id stands for, down to the host or service it is, so
+ * it needn't look the names up again. Both ends forget all ids when
+ * the connection goes down.
+ *
+ * An interned event has MAGIC_INTERNED as its code and the body it
+ * would otherwise have, except that the slot of each name holds an
+ * INTERN_REF() of its id and either 0 or, the first time around,
+ * the offset of the name in the body. Service events carry the id
+ * of their host in place of the host name and that of the service
+ * in place of its description. Hosts and services have ids of
+ * their own.
+ *
+ * Nodes that have the same object config number their hosts and
+ * services the same way, so if they both announce
+ * MERLIN_CAP_OBJECT_IDS as well they use the object ids instead,
+ * through a numbered table. Numbered events have MAGIC_OBJECT_IDS
+ * as their code. Names are never sent along with object ids, and
+ * only the slot of the service description of a service event
+ * holds one, the host name slot being 0.
+ */
+#define INTERN_REF(id, off) (((uint64_t)(id) << 32) | (uint32_t)(off))
+#define INTERN_REF_ID(ref) ((uint32_t)((ref) >> 32))
+#define INTERN_REF_OFF(ref) ((uint32_t)(ref))
+
+/** the most ids of each kind a connection uses. Later names are sent as is */
+#define INTERN_MAX_IDS (1 << 22)
+
+enum { INTERN_HOST, INTERN_SERVICE, INTERN_KINDS };
+
+/**
+ * Find the object a name stands for on the receiving end
+ * @param kind INTERN_HOST or INTERN_SERVICE
+ * @param host_name The host, or the service's host
+ * @param service_description The service, or NULL for hosts
+ * @return The host or service, or NULL if there's no such thing
+ */
+typedef void *(*intern_resolver)(int kind, const char *host_name, const char *service_description);
+
+/** what the ids in a received event stand for */
+struct intern_names {
+	const char *host_name;
+	const char *service_description; /* NULL for host events */
+	void *object; /* the host or service, or NULL if it's unknown here */
+};
+
+/**
+ * Find the object id a name has on the sending end
+ * @param kind INTERN_HOST or INTERN_SERVICE
+ * @param host_name The host, or the service's host
+ * @param service_description The service, or NULL for hosts
+ * @return The id, or -1 if there's no such object
+ */
+typedef int (*intern_numberer)(int kind, const char *host_name, const char *service_description);
+
+/**
+ * Find the object with an object id on the receiving end
+ * @param kind INTERN_HOST or INTERN_SERVICE
+ * @param id The object id
+ * @param names Filled in with the names of the object
+ * @return The host or service, or NULL if there's no such thing
+ */
+typedef void *(*intern_finder)(int kind, uint32_t id, struct intern_names *names);
+
+typedef struct intern_table intern_table;
+
+/**
+ * Create a table of ids for one direction of a connection
+ * @param resolve Finds the objects of received names, or NULL for
+ *                a table of names we send
+ * @return The table, or NULL on errors
+ */
+extern intern_table *intern_create(intern_resolver resolve);
+
+/**
+ * Create a table of object ids for one direction of a connection
+ * between nodes that number their objects the same way
+ * @param number Finds the ids of names we send, or NULL
+ * @param find Finds the objects of ids we receive, or NULL
+ * @return The table, or NULL on errors
+ */
+extern intern_table *intern_create_numbered(intern_numberer number, intern_finder find);
+
+/**
+ * @param t A table
+ * @return 1 if it's a table of object ids, 0 if not
+ */
+extern int intern_numbered(const intern_table *t);
+
+/**
+ * Destroy a table, forgetting every id in it
+ * @param t The table. NULL is fine
+ */
+extern void intern_destroy(intern_table *t);
+
+/**
+ * @param type An event type
+ * @return 1 if events of that type have names to intern, 0 if not
+ */
+extern int intern_type(unsigned int type);
+
+/**
+ * Swap the names in an encoded event for ids, writing the result
+ * to out. Names the other end hasn't been given the id of are
+ * included and counted as given, so the event has to be sent.
+ * @param t The table of names we send
+ * @param type The type of the event
+ * @param body The encoded event
+ * @param len Its length
+ * @param out Where to write the interned event, with room for len bytes
+ * @return The length of the interned event, or 0 if it isn't one
+ *         that can be interned or, for numbered tables, has no
+ *         object id, in which case out is garbage
+ */
+extern uint32_t intern_encode(intern_table *t, unsigned int type,
+                              const char *body, uint32_t len, char *out);
+
+/**
+ * Learn the names given along with ids in a received event, and
+ * find out what all of its ids stand for
+ * @param t The table of names we receive
+ * @param type The type of the event
+ * @param body The interned event
+ * @param len Its length
+ * @param names Filled in with what the ids stand for
+ * @return The length of the event with the names put back, as
+ *         intern_expand() writes it, or -1 if the event is broken
+ *         or uses ids we haven't been given
+ */
+extern int intern_lookup(intern_table *t, unsigned int type,
+                         const char *body, uint32_t len, struct intern_names *names);
+
+/**
+ * Put the names back into an event intern_lookup() has accepted,
+ * making it the event it was before it was interned
+ * @param type The type of the event
+ * @param body The interned event
+ * @param len Its length
+ * @param names What intern_lookup() filled in
+ * @param out Where to write the event, with room for as many bytes
+ *            as intern_lookup() returned
+ */
+extern void intern_expand(unsigned int type, const char *body, uint32_t len,
+                          const struct intern_names *names, char *out);
+/** @} */
+#endif
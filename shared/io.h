@@ -4,10 +4,11 @@
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define io_read_ok(fd, msec) io_poll(fd, POLLIN, msec)
 #define io_write_ok(fd, msec) io_poll(fd, POLLOUT, msec)
 extern int io_poll(int fd, int events, int msec);
-extern int io_send_all(int fd, const void *buf, size_t len);
+extern ssize_t io_sendv(int fd, struct iovec *iov, int iovcnt);
 
 #endif /* INCLUDE_io_h__ */
@@ -9,11 +9,27 @@
 #include "node.h"
 #include "encryption.h"
 #include "pgroup.h"
+#include "shmring.h"
+#include "intern.h"
 
 static int listen_sock = -1; /* for bind() and such */
 static char *ipc_sock_path;
 merlin_node ipc; /* the ipc node */
 
+/*
+ * The module creates the ring and keeps using it for as long as it
+ * runs, stashing what doesn't fit in ring_backlog, so events reach
+ * merlind in the order they were sent even across reconnects.
+ * merlind attaches to whatever ring the module offers it.
+ */
+static unsigned long long ipc_ring_size; /* MiB, 0 to use the socket */
+static shmring *ring;
+static binlog *ring_backlog;
+static unsigned long long ring_wakeups;
+static unsigned int ring_naps;
+#define IPC_RING_NAPS 10
+#define IPC_RING_NAP_MSEC 10
+
 /*
  * this lives here since both daemon and module needs it, but
  * none of the apps should have it
@@ -22,6 +38,9 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 {
 	merlin_nodeinfo *i;
 	merlin_node_stats *s = &n->stats;
+	static const struct binlog_io_stats no_io;
+	const struct binlog_io_stats *io;
+	const struct slab_stats *sl = slab_stats(&n->slab);
 	struct merlin_assigned_objects aso;
 	merlin_peer_group *pg;
 
@@ -29,6 +48,7 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 	pg = n->pgroup;
 	aso.hosts = n->assigned.current.hosts + n->assigned.extra.hosts;
 	aso.services = n->assigned.current.services + n->assigned.extra.services;
+	io = n->binlog ? binlog_io_stats(n->binlog) : &no_io;
 
 	nsock_printf(sd, "instance_id=%d;name=%s;source_name=%s;socket=%d;type=%s;"
 				 "state=%s;peer_id=%u;flags=%d;"
@@ -60,7 +80,26 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 "csync_last_attempt=%lu;"
 				 "csync_push_cmd=%s;csync_push_is_running=%d;"
 				 "csync_fetch_cmd=%s;csync_fetch_is_running=%d;"
-				 "encrypted=%d;uuid=%s"
+				 "encrypted=%d;uuid=%s;"
+				 "drain_events=%llu;drain_bytes=%llu;"
+				 "drain_batches=%llu;drain_usecs=%llu;"
+				 "drain_bytes_per_sec=%llu;"
+				 "binlog_queued=%u;binlog_compressed=%llu;"
+				 "binlog_syncs=%llu;binlog_sync_usecs=%llu;"
+				 "binlog_sync_usecs_max=%llu;"
+				 "binlog_priority_entries=%u;"
+				 "slab_allocs=%llu;slab_frees=%llu;"
+				 "slab_fallbacks=%llu;slab_in_use=%zu;"
+				 "slab_mapped=%zu;slab_chunks=%u;"
+				 "outbuf_bytes=%zu;"
+				 "frames_sent=%llu;frames_read=%llu;"
+				 "protocol=%d;"
+				 "compression=%s;compress_raw_bytes=%llu;compress_wire_bytes=%llu;"
+				 "decompress_wire_bytes=%llu;decompress_raw_bytes=%llu;"
+				 "credit_sent=%llu;credit_limit=%llu;credit_read=%llu;credit_granted=%llu;"
+				 "interned_sent=%llu;interned_saved_bytes=%llu;interned_read=%llu;object_ids=%d;"
+				 "delta_sent=%llu;delta_saved_bytes=%llu;delta_read=%llu;"
+				 "ring_size=%zu;ring_used=%zu;ring_backlog=%u;ring_wakeups=%llu"
 				 "\n",
 				 instance_id,
 				 n->name, n->source_name, n->sock, node_type(n),
@@ -68,7 +107,7 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 inet_ntoa(n->sain.sin_addr), ntohs(n->sain.sin_port),
 				 n->data_timeout, n->last_recv, n->last_sent,
 				 n->last_conn_attempt, n->last_action, n->latency,
-				 binlog_size(n->binlog), nm_bufferqueue_get_available(n->bq),
+				 binlog_size(n->binlog) + binlog_size(n->prio_binlog), nm_bufferqueue_get_available(n->bq),
 				 s->events.sent, s->events.read,
 				 s->events.logged, s->events.dropped,
 				 s->bytes.sent, s->bytes.read,
@@ -94,7 +133,32 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 n->csync_last_attempt,
 				 n->csync.push.cmd ? n->csync.push.cmd : "", n->csync.push.is_running,
 				 n->csync.fetch.cmd ? n->csync.fetch.cmd : "", n->csync.fetch.is_running,
-				 n->encrypted, n->uuid
+				 n->encrypted, n->uuid,
+				 s->drain.events, s->drain.bytes,
+				 s->drain.batches, s->drain.usecs,
+				 s->drain.usecs ? s->drain.bytes * 1000000 / s->drain.usecs : 0,
+				 io->queued, io->compressed,
+				 io->syncs, io->sync_usecs,
+				 io->sync_usecs_max,
+				 binlog_num_entries(n->prio_binlog),
+				 sl->allocs, sl->frees,
+				 sl->fallbacks, sl->in_use,
+				 sl->mapped, sl->chunks,
+				 node_outbuf_pending(n),
+				 s->frames.sent, s->frames.read,
+				 n->protocol,
+				 binlog_compression_name(n->zout ? n->compression : BINLOG_COMPRESS_NONE),
+				 s->compress.raw, s->compress.wire,
+				 s->decompress.wire, s->decompress.raw,
+				 (unsigned long long)n->credit.sent, (unsigned long long)n->credit.limit,
+				 (unsigned long long)n->credit.read, (unsigned long long)n->credit.granted,
+				 s->intern.sent, s->intern.saved, s->intern.read,
+				 intern_numbered(n->intern_out),
+				 s->delta.sent, s->delta.saved, s->delta.read,
+				 n == &ipc && ring ? shmring_size(ring) : 0,
+				 n == &ipc && ring ? shmring_used(ring) : 0,
+				 n == &ipc ? binlog_num_entries(ring_backlog) : 0,
+				 n == &ipc ? ring_wakeups : 0
 				);
 	return 0;
 }
@@ -149,6 +213,8 @@ int ipc_accept(void)
 		return -1;
 	}
 
+	/* merlind reads until EAGAIN, so it mustn't block while negotiating */
+	merlin_set_socket_options(ipc.sock, 0);
 	node_set_state(&ipc, STATE_NEGOTIATING, "Accepted");
 
 	return ipc.sock;
@@ -236,6 +302,13 @@ int ipc_grok_var(char *var, char *val)
 		return 1;
 	}
 
+	if (!strcmp(var, "ipc_shm_ring")) {
+		char *endp;
+
+		ipc_ring_size = strtoull(val, &endp, 10);
+		return *val != '-' && endp != val && !*endp;
+	}
+
 	if (!strcmp(var, "ipc_binlog")) {
 		lwarn("%s is deprecated. The name will always be computed.", var);
 		lwarn("   Set binlog_dir to control where the file will be created");
@@ -354,8 +427,13 @@ void ipc_deinit(void)
 
 	listen_sock = -1;
 
-	if (!is_module)
+	if (!is_module) {
 		unlink(ipc_sock_path);
+
+		/* the module offers its ring again once it's back */
+		shmring_destroy(ring, 0);
+		ring = NULL;
+	}
 }
 
 
@@ -401,6 +479,134 @@ int ipc_ctrl(int code, uint sel, void *data, uint32_t len)
 	return node_ctrl(&ipc, code, sel, data, len);
 }
 
+static int ipc_ring_create(void)
+{
+	char *path = NULL;
+
+	if (asprintf(&path, "%s.ring", ipc_sock_path) < 0) {
+		lerr("Failed to create shared memory ring: asprintf() failed");
+		ipc_ring_size = 0;
+		return -1;
+	}
+	ring = shmring_create(path, ipc_ring_size * 1024 * 1024);
+	if (!ring) {
+		lerr("Failed to create shared memory ring '%s': %s. Using the ipc socket instead",
+		     path, strerror(errno));
+		free(path);
+		ipc_ring_size = 0;
+		return -1;
+	}
+	free(path);
+
+	if (asprintf(&path, "%s/module.ipc.ring.binlog", binlog_dir ? binlog_dir : BINLOGDIR) < 0)
+		path = NULL;
+	if (path)
+		ring_backlog = binlog_create(path, binlog_max_memory_size * 1024 * 1024, binlog_max_file_size * 1024 * 1024, BINLOG_UNLINK);
+	free(path);
+	if (!ring_backlog) {
+		lerr("Failed to create backlog for the shared memory ring. Using the ipc socket instead");
+		shmring_destroy(ring, 1);
+		ring = NULL;
+		ipc_ring_size = 0;
+		return -1;
+	}
+
+	linfo("Handing events to merlind through shared memory ring '%s' of %lluMiB",
+	      shmring_path(ring), ipc_ring_size);
+	return 0;
+}
+
+/*
+ * Called when the module connects to merlind. The ring is only
+ * created once everything sent through the socket before it has
+ * gone out, since merlind won't look at the ring until it has
+ * read the offer.
+ */
+int ipc_ring_offer(void)
+{
+	const char *path;
+
+	if (!ipc_ring_size || ipc.state != STATE_CONNECTED)
+		return 0;
+
+	if (!ring && (node_wants_output(&ipc) || ipc_ring_create() < 0))
+		return 0;
+
+	path = shmring_path(ring);
+	return node_ctrl(&ipc, CTRL_RING, IPC_RING_OFFER, (void *)path, strlen(path) + 1);
+}
+
+/* move what didn't fit in the ring before into it */
+void ipc_ring_resume(void)
+{
+	void *buf;
+	unsigned int len;
+
+	if (!ring)
+		return;
+
+	while (!binlog_peek(ring_backlog, &buf, &len)) {
+		if (shmring_put(ring, buf, len) < 0) {
+			shmring_block(ring);
+			break;
+		}
+		binlog_consume(ring_backlog);
+		ipc.stats.events.sent++;
+		ipc.stats.bytes.sent += len;
+	}
+}
+
+void ipc_ring_close(void)
+{
+	binlog_destroy(ring_backlog, BINLOG_UNLINK);
+	ring_backlog = NULL;
+	shmring_destroy(ring, is_module);
+	ring = NULL;
+}
+
+static int ipc_ring_send(merlin_event *pkt)
+{
+	unsigned int len = packet_size(pkt);
+
+	pkt->hdr.sig.id = MERLIN_SIGNATURE;
+	pkt->hdr.protocol = MERLIN_PROTOCOL_VERSION;
+
+	node_log_event_count(&ipc, 0);
+
+	if (len > MAX_PKT_SIZE) {
+		lerr("Error in communication with %s: header is invalid, or packet is too large. aborting", ipc.name);
+		return -1;
+	}
+
+	if (binlog_has_entries(ring_backlog))
+		ipc_ring_resume();
+
+	if (binlog_has_entries(ring_backlog) || shmring_put(ring, pkt, len) < 0) {
+		shmring_block(ring);
+		if (binlog_add(ring_backlog, pkt, len) < 0) {
+			ipc.stats.events.dropped++;
+			ipc.stats.bytes.dropped += len;
+			return -1;
+		}
+		ipc.stats.events.logged++;
+		ipc.stats.bytes.logged += len;
+		return 0;
+	}
+
+	ipc.stats.events.sent++;
+	ipc.stats.bytes.sent += len;
+	if (pkt->hdr.type < ARRAY_SIZE(ipc.stats.cb_count))
+		ipc.stats.cb_count[pkt->hdr.type].out++;
+
+	/* merlind is busy with the ring anyway unless it said it's off to sleep */
+	if (shmring_wake(ring) && ipc.state == STATE_CONNECTED) {
+		ring_wakeups++;
+		node_ctrl(&ipc, CTRL_RING, IPC_RING_WAKEUP, NULL, 0);
+	}
+
+	return 0;
+}
+
 int ipc_send_event(merlin_event *pkt)
 {
 	ipc_is_connected(0);
@@ -409,9 +615,99 @@ int ipc_send_event(merlin_event *pkt)
 	if (is_module)
 		gettimeofday(&pkt->hdr.sent, NULL);
 
-	if (node_send_event(&ipc, pkt, 0) < 0) {
+	if (is_module && pkt->hdr.type != CTRL_PACKET) {
+		if (!ring && ipc_ring_size)
+			ipc_ring_offer();
+		if (ring)
+			return ipc_ring_send(pkt);
+	}
+
+	if (node_send_event(&ipc, pkt) < 0) {
 		return -1;
 	}
 
 	return 0;
 }
+
+int ipc_ring_attach(merlin_event *pkt)
+{
+	if (pkt->hdr.selection != IPC_RING_OFFER)
+		return 0;
+
+	if (!pkt->hdr.len || pkt->body[pkt->hdr.len - 1]) {
+		lerr("Ignoring shared memory ring offer with a malformed path");
+		return -1;
+	}
+
+	/* anything left in the old one is lost along with its module */
+	shmring_destroy(ring, 0);
+	ring = shmring_attach(pkt->body);
+	if (!ring) {
+		lerr("Failed to attach to shared memory ring '%s': %s", pkt->body, strerror(errno));
+		return -1;
+	}
+
+	linfo("Reading events from shared memory ring '%s'", pkt->body);
+	return 0;
+}
+
+/* hand events in the ring to handler, returning how many there were */
+int ipc_ring_reap(int (*handler)(merlin_event *pkt))
+{
+	merlin_event *pkt;
+	unsigned int len;
+	int events = 0;
+
+	if (!ring)
+		return 0;
+
+	/* leave some time for the socket and the database */
+	while (events < 10000 && !shmring_peek(ring, (void **)&pkt, &len)) {
+		if (len < HDR_SIZE || (unsigned int)packet_size(pkt) != len || pkt->hdr.sig.id != MERLIN_SIGNATURE) {
+			lerr("Shared memory ring '%s' is corrupt. Detaching from it", shmring_path(ring));
+			shmring_destroy(ring, 0);
+			ring = NULL;
+			break;
+		}
+
+		events++;
+		ipc.stats.events.read++;
+		ipc.stats.bytes.read += len;
+		if (pkt->hdr.type < ARRAY_SIZE(ipc.stats.cb_count))
+			ipc.stats.cb_count[pkt->hdr.type].in++;
+		handler(pkt);
+		shmring_consume(ring);
+		ring_naps = 0;
+	}
+
+	if (ring && shmring_unblock(ring))
+		node_ctrl(&ipc, CTRL_RING, IPC_RING_ROOM, NULL, 0);
+
+	return events;
+}
+
+/*
+ * How long merlind may wait for the ipc socket, in milliseconds, or
+ * -1 for as long as it likes. Having run out of events it naps for a
+ * while before asking to be woken up, or a busy module would have to
+ * wake it up for nearly every event.
+ */
+int ipc_ring_timeout(void)
+{
+	if (!ring)
+		return -1;
+
+	if (shmring_used(ring)) {
+		ring_naps = 0;
+		return 0;
+	}
+	if (ring_naps < IPC_RING_NAPS) {
+		ring_naps++;
+		return IPC_RING_NAP_MSEC;
+	}
+	if (shmring_sleep(ring) < 0) {
+		ring_naps = 0;
+		return 0;
+	}
+	return -1;
+}
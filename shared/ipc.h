@@ -22,5 +22,24 @@ extern int ipc_reinit(void);
 extern int ipc_accept(void);
 extern void ipc_log_event_count(void);
 
+/*
+ * With ipc_shm_ring set, the module hands events to merlind through
+ * a ring in shared memory rather than the ipc socket, which is left
+ * with control packets and wakeups. The selection of a CTRL_RING
+ * says what it's about.
+ */
+#define IPC_RING_OFFER  1 /* module: body is the path of the ring to attach to */
+#define IPC_RING_WAKEUP 2 /* module: there are events in the ring */
+#define IPC_RING_ROOM   3 /* merlind: the ring has room for more again */
+
+/* module */
+extern int ipc_ring_offer(void);
+extern void ipc_ring_resume(void);
+extern void ipc_ring_close(void);
+/* merlind */
+extern int ipc_ring_attach(merlin_event *pkt);
+extern int ipc_ring_reap(int (*handler)(merlin_event *pkt));
+extern int ipc_ring_timeout(void);
+
 #define ipc_send_ctrl(code, sel) ipc_ctrl(code, sel, NULL, 0)
 #endif /* INCLUDE_ipc_h__ */
@@ -0,0 +1,65 @@
+/*
+ * lock-free multi-producer, single-consumer queue
+ *
+ * Producers swap themselves in as the new head and then link the
+ * entry they replaced to their own, so the list runs from "tail" to
+ * "head". The consumer keeps a stub entry around so the list never
+ * runs empty, which means the last real entry can be handed out
+ * without racing whoever is pushing the next one.
+ */
+
+#include <stddef.h>
+#include "mpscq.h"
+
+void mpscq_init(mpscq *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+void mpscq_push(mpscq *q, struct mpscq_entry *e)
+{
+	struct mpscq_entry *prev;
+
+	__atomic_store_n(&e->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, e, __ATOMIC_SEQ_CST);
+	/* until this is stored, the consumer can't get past prev */
+	__atomic_store_n(&prev->next, e, __ATOMIC_RELEASE);
+}
+
+struct mpscq_entry *mpscq_pop(mpscq *q)
+{
+	struct mpscq_entry *tail = q->tail;
+	struct mpscq_entry *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* a producer is between swapping in the head and linking it up */
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* tail is the last entry, so put the stub behind it to take its place */
+	mpscq_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+int mpscq_empty(mpscq *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == q->tail;
+}
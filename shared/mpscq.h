@@ -0,0 +1,62 @@
+#ifndef INCLUDE_mpscq_h
+#define INCLUDE_mpscq_h
+
+/**
+ * @file mpscq.h
+ * @brief lock-free multi-producer, single-consumer queue
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * An intrusive queue of linked entries. Any number of threads may
+ * push entries, each with a single atomic exchange, while one
+ * thread pops them in the order they were pushed. Nobody ever
+ * waits for anybody else, so a producer can't be held up by a slow
+ * consumer or vice versa. Entries are embedded in whatever is being
+ * queued, and the queue neither allocates nor frees anything.
+ *
+ * A producer that's been interrupted halfway through a push hides
+ * whatever comes after its entry until it's done, so mpscq_pop()
+ * may come up empty while mpscq_empty() says otherwise. Consumers
+ * that go to sleep must check mpscq_empty() before they do.
+ */
+struct mpscq_entry {
+	struct mpscq_entry *next;
+};
+
+typedef struct mpscq {
+	struct mpscq_entry *head __attribute__((aligned(64))); /* pushed to by producers */
+	struct mpscq_entry *tail __attribute__((aligned(64))); /* popped from by the consumer */
+	struct mpscq_entry stub;
+} mpscq;
+
+/**
+ * Make a queue ready for use
+ * @param q The queue
+ */
+extern void mpscq_init(mpscq *q);
+
+/**
+ * Add an entry to the end of the queue. Safe to call from any thread.
+ * @param q The queue
+ * @param e The entry, which mustn't be in any queue already
+ */
+extern void mpscq_push(mpscq *q, struct mpscq_entry *e);
+
+/**
+ * Take the oldest entry off the queue (consumer only)
+ * @param q The queue
+ * @return The entry, or NULL if there's nothing to take right now
+ */
+extern struct mpscq_entry *mpscq_pop(mpscq *q);
+
+/**
+ * Check if there's anything in the queue, including entries that
+ * are still being pushed (consumer only)
+ * @param q The queue
+ * @return 1 if the queue is empty, 0 otherwise
+ */
+extern int mpscq_empty(mpscq *q);
+/** @} */
+#endif
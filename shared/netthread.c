@@ -0,0 +1,634 @@
+/*
+ * the module's network I/O thread
+ *
+ * Messages go to the thread in one queue and come back in another.
+ * Either side only sleeps after saying so, and whoever pushes a
+ * message checks that before writing to the sleeper's eventfd, so
+ * a busy thread costs nothing more than the queue operations.
+ *
+ * A connection lives from netthread_attach() until Naemon's thread
+ * has seen it come back as NET_DETACHED, which is the last message
+ * the thread sends about it. The messages needed to get there are
+ * part of the connection, so detaching never fails.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "shared.h"
+#include "logging.h"
+#include "mpscq.h"
+#include "netthread.h"
+
+#define NET_READ_SIZE (64 << 10)
+#define NET_IOV_MAX 64
+#define NET_REAP_MAX 1024 /* messages handled per wakeup */
+
+enum {
+	/* to the thread */
+	NET_ATTACH,
+	NET_SEND,
+	NET_DETACH,
+	NET_RESUME,
+	NET_STOP,
+	/* back from it */
+	NET_DATA,
+	NET_ROOM,
+	NET_LOST,
+	NET_DETACHED,
+};
+
+struct net_msg {
+	struct mpscq_entry entry; /* first, so entries are messages */
+	int type;
+	int error;                /* errno for NET_LOST, 0 if the peer hung up */
+	struct net_conn *conn;
+	struct net_msg *next;     /* in the thread's list of data to write */
+	size_t len;
+	char *data;               /* right after the message, if there is any */
+};
+
+struct net_conn {
+	merlin_node *node;        /* only ever looked at by Naemon's thread */
+	int sock;
+	size_t limit;             /* bytes queued before the backlog is used */
+	size_t queued;            /* handed to the thread and not yet written */
+	size_t inbound;           /* read and not yet handled */
+	int want_room;            /* Naemon's thread wants a NET_ROOM */
+	int paused;               /* reading is paused until a NET_RESUME */
+	struct net_msg lost, detach;
+	/* only used by the network thread */
+	int dead;                 /* NET_LOST has been sent */
+	int dirty;                /* on the list of connections to write to */
+	struct net_msg *out_head, *out_tail;
+	size_t out_offset;        /* how much of out_head has been written */
+	struct net_conn *prev, *next, *next_dirty;
+};
+
+int net_thread;
+
+static struct {
+	mpscq to_thread, to_main;
+	int thread_fd, main_fd;   /* eventfds to wake either side up */
+	int thread_sleeping, main_notified;
+	int epfd;
+	pthread_t thread;
+	int running;
+	int (*input)(merlin_node *node, int len);
+	struct net_conn *conns, *dirty; /* only used by the thread */
+	struct net_msg stop_msg;
+} nt = { .thread_fd = -1, .main_fd = -1, .epfd = -1 };
+
+static struct net_msg *msg_create(int type, struct net_conn *conn, size_t len)
+{
+	struct net_msg *msg = malloc(sizeof(*msg) + len);
+
+	if (!msg)
+		return NULL;
+	memset(msg, 0, sizeof(*msg));
+	msg->type = type;
+	msg->conn = conn;
+	msg->len = len;
+	msg->data = len ? (char *)(msg + 1) : NULL;
+	return msg;
+}
+
+static void to_thread(struct net_msg *msg)
+{
+	mpscq_push(&nt.to_thread, &msg->entry);
+	if (__atomic_load_n(&nt.thread_sleeping, __ATOMIC_SEQ_CST))
+		eventfd_write(nt.thread_fd, 1);
+}
+
+static void notify_main(void)
+{
+	if (!__atomic_exchange_n(&nt.main_notified, 1, __ATOMIC_SEQ_CST))
+		eventfd_write(nt.main_fd, 1);
+}
+
+static void to_main(struct net_msg *msg)
+{
+	mpscq_push(&nt.to_main, &msg->entry);
+	notify_main();
+}
+
+static void post_room(struct net_conn *conn)
+{
+	struct net_msg *msg;
+
+	if (!__atomic_exchange_n(&conn->want_room, 0, __ATOMIC_SEQ_CST))
+		return;
+	if (!(msg = msg_create(NET_ROOM, conn, 0))) {
+		/* try again once more has been written */
+		__atomic_store_n(&conn->want_room, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	to_main(msg);
+}
+
+/*
+ * Everything below, up to netthread_start(), runs in the network thread
+ */
+static void conn_drop_output(struct net_conn *conn)
+{
+	struct net_msg *msg;
+
+	while ((msg = conn->out_head)) {
+		conn->out_head = msg->next;
+		__atomic_sub_fetch(&conn->queued, msg->len - conn->out_offset, __ATOMIC_SEQ_CST);
+		conn->out_offset = 0;
+		free(msg);
+	}
+	conn->out_tail = NULL;
+}
+
+/* let Naemon's thread know the connection is gone, which it then detaches */
+static void conn_lost(struct net_conn *conn, int error)
+{
+	if (conn->dead)
+		return;
+	conn->dead = 1;
+	epoll_ctl(nt.epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	conn_drop_output(conn);
+	conn->lost.error = error;
+	to_main(&conn->lost);
+}
+
+static void conn_write(struct net_conn *conn)
+{
+	while (conn->out_head && !conn->dead) {
+		struct iovec iov[NET_IOV_MAX];
+		struct msghdr mh;
+		struct net_msg *msg;
+		ssize_t sent;
+		int n = 0;
+
+		for (msg = conn->out_head; msg && n < NET_IOV_MAX; msg = msg->next, n++) {
+			iov[n].iov_base = msg->data;
+			iov[n].iov_len = msg->len;
+		}
+		iov[0].iov_base = conn->out_head->data + conn->out_offset;
+		iov[0].iov_len -= conn->out_offset;
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		sent = sendmsg(conn->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				conn_lost(conn, errno);
+			break;
+		}
+
+		__atomic_sub_fetch(&conn->queued, sent, __ATOMIC_SEQ_CST);
+		while ((msg = conn->out_head) && (size_t)sent >= msg->len - conn->out_offset) {
+			sent -= msg->len - conn->out_offset;
+			conn->out_offset = 0;
+			conn->out_head = msg->next;
+			free(msg);
+		}
+		if (!conn->out_head)
+			conn->out_tail = NULL;
+		else
+			conn->out_offset += sent;
+	}
+
+	if (__atomic_load_n(&conn->queued, __ATOMIC_SEQ_CST) <= conn->limit / 2)
+		post_room(conn);
+}
+
+/* pause reading if Naemon's thread has too much to handle already */
+static int conn_pause(struct net_conn *conn)
+{
+	if (__atomic_load_n(&conn->inbound, __ATOMIC_SEQ_CST) < NETTHREAD_INBOUND_MAX)
+		return 0;
+
+	__atomic_store_n(&conn->paused, 1, __ATOMIC_SEQ_CST);
+	/* it may have caught up before it could see we paused */
+	if (__atomic_load_n(&conn->inbound, __ATOMIC_SEQ_CST) < NETTHREAD_INBOUND_MAX / 2 &&
+	    __atomic_exchange_n(&conn->paused, 0, __ATOMIC_SEQ_CST))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+static void conn_read(struct net_conn *conn)
+{
+	struct net_msg *msg;
+	ssize_t len;
+
+	while (!conn->dead && !conn_pause(conn)) {
+		if (!(msg = msg_create(NET_DATA, conn, NET_READ_SIZE)))
+			return;
+
+		len = read(conn->sock, msg->data, NET_READ_SIZE);
+		if (len <= 0) {
+			int error = len < 0 ? errno : 0;
+
+			free(msg);
+			if (error == EINTR)
+				continue;
+			if (error != EAGAIN && error != EWOULDBLOCK)
+				conn_lost(conn, error);
+			return;
+		}
+
+		/* don't keep more memory around than what we read */
+		if (len < NET_READ_SIZE) {
+			struct net_msg *smaller = realloc(msg, sizeof(*msg) + len);
+
+			if (smaller)
+				msg = smaller;
+			msg->data = (char *)(msg + 1);
+		}
+		msg->len = len;
+		__atomic_add_fetch(&conn->inbound, len, __ATOMIC_SEQ_CST);
+		to_main(msg);
+	}
+}
+
+static void conn_attach(struct net_conn *conn)
+{
+	struct epoll_event ev;
+
+	conn->next = nt.conns;
+	if (nt.conns)
+		nt.conns->prev = conn;
+	nt.conns = conn;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(nt.epfd, EPOLL_CTL_ADD, conn->sock, &ev) < 0)
+		conn_lost(conn, errno);
+}
+
+static void conn_detach(struct net_conn *conn)
+{
+	struct net_conn **pp;
+
+	/* it's not to be written to after this */
+	if (conn->dirty) {
+		for (pp = &nt.dirty; *pp != conn; pp = &(*pp)->next_dirty)
+			;
+		*pp = conn->next_dirty;
+		conn->dirty = 0;
+	}
+
+	if (!conn->dead)
+		epoll_ctl(nt.epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	conn->dead = 1;
+	close(conn->sock);
+	conn_drop_output(conn);
+
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		nt.conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	conn->detach.type = NET_DETACHED;
+	to_main(&conn->detach);
+}
+
+static void conn_queue(struct net_conn *conn, struct net_msg *msg)
+{
+	if (conn->dead) {
+		__atomic_sub_fetch(&conn->queued, msg->len, __ATOMIC_SEQ_CST);
+		free(msg);
+		return;
+	}
+
+	msg->next = NULL;
+	if (conn->out_tail)
+		conn->out_tail->next = msg;
+	else
+		conn->out_head = msg;
+	conn->out_tail = msg;
+
+	/* written once we've got everything that's been queued so far */
+	if (!conn->dirty) {
+		conn->dirty = 1;
+		conn->next_dirty = nt.dirty;
+		nt.dirty = conn;
+	}
+}
+
+/* returns 1 when it's time to stop */
+static int thread_handle_messages(void)
+{
+	struct mpscq_entry *e;
+	struct net_conn *conn;
+	int stop = 0;
+
+	while ((e = mpscq_pop(&nt.to_thread))) {
+		struct net_msg *msg = (struct net_msg *)e;
+
+		switch (msg->type) {
+		case NET_ATTACH:
+			conn_attach(msg->conn);
+			free(msg);
+			break;
+		case NET_SEND:
+			conn_queue(msg->conn, msg);
+			break;
+		case NET_DETACH:
+			conn_detach(msg->conn);
+			break;
+		case NET_RESUME:
+			conn_read(msg->conn);
+			free(msg);
+			break;
+		case NET_STOP:
+			stop = 1;
+			break;
+		}
+	}
+
+	while ((conn = nt.dirty)) {
+		nt.dirty = conn->next_dirty;
+		conn->dirty = 0;
+		conn_write(conn);
+	}
+
+	return stop;
+}
+
+static void *thread_main(__attribute__((unused)) void *arg)
+{
+	struct epoll_event ev[64];
+	struct net_conn *conn;
+	eventfd_t val;
+	int i, n;
+
+	for (;;) {
+		if (thread_handle_messages())
+			break;
+
+		/* a message pushed after this is followed by a wakeup */
+		__atomic_store_n(&nt.thread_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!mpscq_empty(&nt.to_thread)) {
+			__atomic_store_n(&nt.thread_sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		n = epoll_wait(nt.epfd, ev, ARRAY_SIZE(ev), -1);
+		__atomic_store_n(&nt.thread_sleeping, 0, __ATOMIC_SEQ_CST);
+
+		for (i = 0; i < n; i++) {
+			if (!(conn = ev[i].data.ptr)) {
+				eventfd_read(nt.thread_fd, &val);
+				continue;
+			}
+			if (ev[i].events & (EPOLLOUT | EPOLLERR))
+				conn_write(conn);
+			if (ev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				conn_read(conn);
+		}
+	}
+
+	/* nobody will read what's left after this */
+	for (conn = nt.conns; conn; conn = conn->next)
+		conn_drop_output(conn);
+	nt.conns = NULL;
+	return NULL;
+}
+
+/*
+ * Everything below runs in Naemon's thread
+ */
+static void main_handle_message(struct net_msg *msg)
+{
+	struct net_conn *conn = msg->conn;
+	merlin_node *node = conn->node;
+	int current = node->netconn == conn;
+
+	switch (msg->type) {
+	case NET_DATA:
+		if (current && nt.running && node_feed(node, msg->data, msg->len) == 0)
+			nt.input(node, msg->len);
+
+		/* let the thread read more if it's been waiting for us to catch up */
+		if (__atomic_sub_fetch(&conn->inbound, msg->len, __ATOMIC_SEQ_CST) < NETTHREAD_INBOUND_MAX / 2 &&
+		    __atomic_exchange_n(&conn->paused, 0, __ATOMIC_SEQ_CST) &&
+		    node->netconn == conn && nt.running)
+		{
+			struct net_msg *resume = msg_create(NET_RESUME, conn, 0);
+
+			if (resume)
+				to_thread(resume);
+			else
+				__atomic_store_n(&conn->paused, 1, __ATOMIC_SEQ_CST);
+		}
+		break;
+	case NET_ROOM:
+		if (current && nt.running)
+			node_output(node);
+		break;
+	case NET_LOST:
+		/* part of conn, which may be gone once the node is disconnected */
+		if (!current)
+			return;
+		if (msg->error)
+			node_disconnect(node, "Connection lost: %s", strerror(msg->error));
+		else
+			node_disconnect(node, "recv() returned zero");
+		return;
+	case NET_DETACHED:
+		free(conn);
+		return;
+	}
+
+	free(msg);
+}
+
+static int main_reap(int fd, __attribute__((unused)) int events, __attribute__((unused)) void *arg)
+{
+	struct mpscq_entry *e;
+	eventfd_t val;
+	int i;
+
+	eventfd_read(fd, &val);
+	/* an exchange, so we see whatever was pushed before it was set */
+	__atomic_exchange_n(&nt.main_notified, 0, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < NET_REAP_MAX && (e = mpscq_pop(&nt.to_main)); i++)
+		main_handle_message((struct net_msg *)e);
+
+	/* don't starve everything else, but come back for the rest */
+	if (i == NET_REAP_MAX)
+		notify_main();
+	return 0;
+}
+
+int netthread_start(int (*input)(merlin_node *node, int len))
+{
+	sigset_t all, old;
+	struct epoll_event ev;
+	int ret;
+
+	if (nt.running)
+		return 0;
+
+	mpscq_init(&nt.to_thread);
+	mpscq_init(&nt.to_main);
+	nt.input = input;
+	nt.thread_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	nt.main_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	nt.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (nt.thread_fd < 0 || nt.main_fd < 0 || nt.epfd < 0) {
+		lerr("netthread: Failed to set up wakeups: %s", strerror(errno));
+		goto fail;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(nt.epfd, EPOLL_CTL_ADD, nt.thread_fd, &ev) < 0) {
+		lerr("netthread: Failed to poll for wakeups: %s", strerror(errno));
+		goto fail;
+	}
+	ret = iobroker_register(nagios_iobs, nt.main_fd, NULL, main_reap);
+	if (ret < 0) {
+		lerr("IOB: Failed to register network thread wakeups: %s", iobroker_strerror(ret));
+		goto fail;
+	}
+
+	/* signals are for the main thread to handle */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&nt.thread, NULL, thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		lerr("netthread: Failed to start network thread: %s", strerror(ret));
+		iobroker_unregister(nagios_iobs, nt.main_fd);
+		goto fail;
+	}
+
+	nt.running = 1;
+	linfo("Network I/O is done by a thread of its own");
+	return 0;
+
+fail:
+	if (nt.thread_fd >= 0)
+		close(nt.thread_fd);
+	if (nt.main_fd >= 0)
+		close(nt.main_fd);
+	if (nt.epfd >= 0)
+		close(nt.epfd);
+	nt.thread_fd = nt.main_fd = nt.epfd = -1;
+	return -1;
+}
+
+void netthread_stop(void)
+{
+	struct mpscq_entry *e;
+
+	if (!nt.running)
+		return;
+
+	nt.stop_msg.type = NET_STOP;
+	to_thread(&nt.stop_msg);
+	pthread_join(nt.thread, NULL);
+	nt.running = 0;
+
+	/* the thread is gone, so anything still attached is ours now */
+	while ((e = mpscq_pop(&nt.to_main)))
+		main_handle_message((struct net_msg *)e);
+	while ((e = mpscq_pop(&nt.to_thread))) {
+		struct net_msg *msg = (struct net_msg *)e;
+
+		if (msg->type == NET_DETACH) {
+			close(msg->conn->sock);
+			free(msg->conn);
+		} else if (msg->type != NET_STOP) {
+			free(msg);
+		}
+	}
+
+	iobroker_close(nagios_iobs, nt.main_fd);
+	close(nt.thread_fd);
+	close(nt.epfd);
+	nt.thread_fd = nt.main_fd = nt.epfd = -1;
+}
+
+int netthread_running(void)
+{
+	return nt.running;
+}
+
+struct net_conn *netthread_attach(merlin_node *node)
+{
+	struct net_conn *conn;
+	struct net_msg *msg;
+
+	if (!nt.running || node->sock < 0)
+		return NULL;
+
+	conn = calloc(1, sizeof(*conn));
+	msg = msg_create(NET_ATTACH, conn, 0);
+	if (!conn || !msg) {
+		free(conn);
+		free(msg);
+		return NULL;
+	}
+	conn->node = node;
+	conn->sock = node->sock;
+	conn->limit = binlog_outbuf_size * 1024;
+	conn->lost.type = NET_LOST;
+	conn->lost.conn = conn;
+	conn->detach.type = NET_DETACH;
+	conn->detach.conn = conn;
+
+	iobroker_unregister(nagios_iobs, node->sock);
+	to_thread(msg);
+	return conn;
+}
+
+void netthread_detach(struct net_conn *conn)
+{
+	if (!nt.running) {
+		close(conn->sock);
+		free(conn);
+		return;
+	}
+	to_thread(&conn->detach);
+}
+
+int netthread_send(struct net_conn *conn, const void *buf, size_t len)
+{
+	struct net_msg *msg;
+
+	if (!len)
+		return 0;
+	if (!nt.running || !(msg = msg_create(NET_SEND, conn, len)))
+		return -1;
+
+	memcpy(msg->data, buf, len);
+	__atomic_add_fetch(&conn->queued, len, __ATOMIC_SEQ_CST);
+	to_thread(msg);
+	return 0;
+}
+
+size_t netthread_queued(const struct net_conn *conn)
+{
+	return __atomic_load_n(&conn->queued, __ATOMIC_SEQ_CST);
+}
+
+void netthread_want_room(struct net_conn *conn)
+{
+	__atomic_store_n(&conn->want_room, 1, __ATOMIC_SEQ_CST);
+
+	/* the thread may have written everything before it could see this */
+	if (netthread_queued(conn) <= conn->limit / 2)
+		post_room(conn);
+}
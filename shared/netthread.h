@@ -0,0 +1,107 @@
+#ifndef INCLUDE_netthread_h
+#define INCLUDE_netthread_h
+#include <stddef.h>
+#include "node.h"
+
+/**
+ * @file netthread.h
+ * @brief the module's network I/O thread
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * With net_thread enabled, reading from and writing to the sockets
+ * of connected network nodes is done by a thread of its own, so a
+ * busy or slow peer no longer holds up Naemon's event loop.
+ *
+ * The split is by what's touched, not by what's done:
+ *
+ * - Naemon's thread keeps everything that makes up a merlin_node.
+ *   It connects, accepts and negotiates as before, encodes events
+ *   into what goes on the wire (frames, compression and encryption
+ *   included), keeps the backlogs, and runs handle_event() on what
+ *   comes back.
+ * - The network thread only ever sees a net_conn: a socket, the
+ *   bytes waiting to be written to it and a few counters. It never
+ *   touches a merlin_node and never logs.
+ *
+ * Once a node is connected, node_thread_attach() hands its socket
+ * to the thread, and from then on only the thread reads, writes or
+ * closes it. What Naemon's thread would have written goes in a
+ * lock-free queue instead (see mpscq.h), so NEB hooks never make a
+ * syscall for a network node. What the thread reads is handed back
+ * through another one, and the thread wakes Naemon's I/O broker up
+ * with an eventfd so the handler given to netthread_start() can
+ * process it, in Naemon's thread. Errors go the same way, so a node
+ * is only ever disconnected by Naemon's thread, which then detaches
+ * the socket and leaves it to the thread to close.
+ *
+ * Both directions are bounded. Once binlog_outbuf_size KiB are
+ * waiting to be written, events go to the backlog as usual, and the
+ * thread says when there's room to drain it. The thread stops
+ * reading from a node that has NETTHREAD_INBOUND_MAX bytes waiting
+ * to be handled until Naemon's thread has caught up.
+ */
+#define NETTHREAD_INBOUND_MAX (4 << 20)
+
+struct net_conn;
+
+/** set from the module's config, 1 to run the network thread */
+extern int net_thread;
+
+/**
+ * Start the network thread. Naemon's I/O broker must be up.
+ * @param input Called in Naemon's thread with the number of bytes
+ *              just added to a node's input, like net_input() does
+ * @return 0 on success, -1 on errors
+ */
+extern int netthread_start(int (*input)(merlin_node *node, int len));
+
+/**
+ * Stop the network thread. Sockets still attached are closed when
+ * their nodes are disconnected, and whatever wasn't written is lost.
+ */
+extern void netthread_stop(void);
+
+/** @return 1 if the network thread is running, 0 otherwise */
+extern int netthread_running(void);
+
+/**
+ * Hand a node's socket over to the network thread, after
+ * unregistering it from Naemon's I/O broker. Use node_thread_attach()
+ * rather than calling this directly.
+ * @param node The node, which must have a socket
+ * @return The connection, or NULL on errors
+ */
+extern struct net_conn *netthread_attach(merlin_node *node);
+
+/**
+ * Have the network thread close the socket and forget about it
+ * @param conn The connection, which mustn't be used after this
+ */
+extern void netthread_detach(struct net_conn *conn);
+
+/**
+ * Queue data to be written to the socket
+ * @param conn The connection
+ * @param buf The data
+ * @param len The length of the data
+ * @return 0 on success, -1 if it couldn't be queued
+ */
+extern int netthread_send(struct net_conn *conn, const void *buf, size_t len);
+
+/**
+ * @param conn The connection
+ * @return The number of bytes queued and not yet written
+ */
+extern size_t netthread_queued(const struct net_conn *conn);
+
+/**
+ * Ask to have node_output() called once there's room to write more,
+ * because there's a backlog to drain
+ * @param conn The connection
+ */
+extern void netthread_want_room(struct net_conn *conn);
+/** @} */
+#endif
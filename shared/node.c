@@ -5,8 +5,13 @@
 #include "io.h"
 #include "compat.h"
 #include "node.h"
+#include "codec.h"
 #include "encryption.h"
+#include "netthread.h"
+#include "intern.h"
+#include "delta.h"
 #include <arpa/inet.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <netdb.h>
@@ -21,6 +26,8 @@ static int num_selections;
 static node_selection *selection_table;
 unsigned int uuid_nodes = 0;
 
+static void node_update_output(merlin_node *node);
+
 static void node_log_info(const merlin_node *node, const merlin_nodeinfo *info)
 {
 	ldebug("Node info for %s", node->name);
@@ -145,6 +152,9 @@ void node_set_state(merlin_node *node, int state, const char *reason)
 		getsockopt(node->sock, SOL_SOCKET, SO_SNDBUF, &rcv, &size);
 		ldebug("send / receive buffers are %s / %s for node %s",
 			   human_bytes(snd), human_bytes(rcv), node->name);
+
+		/* start draining the backlog as soon as the socket allows */
+		node_update_output(node);
 	}
 }
 
@@ -467,6 +477,7 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 	/* some sane defaults */
 	node->data_timeout = pulse_interval * 2;
 	node->encrypted = false;
+	node->compression = BINLOG_COMPRESS_NONE;
 	node->auto_delete = 0;
 
 	for (i = 0; i < c->vars; i++) {
@@ -505,6 +516,10 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 			} else {
 				node->encrypted=false;
 			}
+		} else if (!strcmp(v->key, "compression")) {
+			node->compression = binlog_compression_by_name(v->value);
+			if (node->compression < 0)
+				cfg_error(c, v, "Unknown or unsupported compression method: %s\n", v->value);
 		} else if (!strcmp(v->key, "publickey")) {
 			unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
 			if ( open_encryption_key(v->value, pubkey,
@@ -672,7 +687,8 @@ void node_log_event_count(merlin_node *node, int force)
 		  s->events.sent, human_bytes(s->bytes.sent),
 		  s->events.dropped, human_bytes(s->bytes.dropped),
 		  s->events.logged, human_bytes(s->bytes.logged),
-		  binlog_entries(node->binlog), human_bytes(binlog_size(node->binlog)));
+		  binlog_entries(node->binlog) + binlog_entries(node->prio_binlog),
+		  human_bytes(binlog_size(node->binlog) + binlog_size(node->prio_binlog)));
 }
 
 const char *node_state(const merlin_node *node)
@@ -709,6 +725,345 @@ const char *node_type(const merlin_node *node)
 	return "Unknown node-type";
 }
 
+/*
+ * Outbound data is written straight to the socket as long as nothing
+ * is queued ahead of it. Whatever the socket won't take right away is
+ * kept in the node's output buffer, and a dup() of the socket is
+ * polled for writability until the buffer has been flushed, so we
+ * never sit around waiting for a slow node. Once binlog_outbuf_size
+ * KiB are queued, new events go to the backlog instead. The daemon
+ * has no iobroker and polls for writability in its own loop.
+ */
+struct node_outbuf {
+	char *buf;
+	size_t head, tail, size; /* buf[head..tail) is waiting to be sent */
+	int stream;              /* the socket the queued data is meant for */
+	int poll_sock;           /* dup() of stream polled for POLLOUT, or -1 */
+};
+
+size_t node_outbuf_pending(const merlin_node *node)
+{
+	const struct node_outbuf *ob = node->outbuf;
+	size_t pending = node->netconn ? netthread_queued(node->netconn) : 0;
+
+	/* data queued for a socket that's since been replaced is never sent */
+	if (!ob || ob->stream != node->sock)
+		return pending;
+
+	return pending + ob->tail - ob->head;
+}
+
+/* true if we and the node grant each other credit, see MERLIN_CREDIT_WINDOW */
+static int node_uses_credit(const merlin_node *node)
+{
+	/* our own nodeinfo sits in ipc.info, so we know nothing of the daemon's */
+	return is_module && node != &ipc && (node->info.capabilities & MERLIN_CAP_CREDIT);
+}
+
+/* how many more events we may send to a node */
+static int64_t node_credit_left(const merlin_node *node)
+{
+	uint64_t limit;
+
+	if (!node_uses_credit(node))
+		return INT64_MAX;
+
+	limit = node->credit.limit ? node->credit.limit : MERLIN_CREDIT_WINDOW;
+	return (int64_t)(limit - node->credit.sent);
+}
+
+/* count an event that's gone out, unless it's a control packet */
+static inline void node_credit_use(merlin_node *node, const merlin_event *pkt)
+{
+	if (pkt->hdr.type != CTRL_PACKET)
+		node->credit.sent++;
+}
+
+/*
+ * Let the node send another window's worth of events once it's used
+ * up half of the last one. We only get here when we're done with
+ * what we've read, so credit is granted as fast as we process events.
+ * The grant is only counted as given if it could be sent, so one that
+ * doesn't fit in the output buffer is retried once that's flushed.
+ */
+static void node_credit_grant(merlin_node *node)
+{
+	uint64_t granted = node->credit.granted ? node->credit.granted : MERLIN_CREDIT_WINDOW;
+	uint64_t limit = node->credit.read + MERLIN_CREDIT_WINDOW;
+
+	if (!node_uses_credit(node) || node->state != STATE_CONNECTED ||
+	    granted - node->credit.read > MERLIN_CREDIT_WINDOW / 2)
+	{
+		return;
+	}
+
+	if (node_ctrl(node, CTRL_CREDIT, 0, &limit, sizeof(limit)) > 0)
+		node->credit.granted = limit;
+}
+
+/* the node has granted us more credit, so send what's been waiting for it */
+static void node_credit_update(merlin_node *node, const merlin_event *pkt)
+{
+	uint64_t limit;
+
+	if (pkt->hdr.len < sizeof(limit)) {
+		lwarn("%s sent a CTRL_CREDIT with %u bytes of body. Ignoring it", node->name, pkt->hdr.len);
+		return;
+	}
+	memcpy(&limit, pkt->body, sizeof(limit));
+	if (limit <= node->credit.limit)
+		return;
+
+	node->credit.limit = limit;
+	if (binlog_has_entries(node->binlog) || binlog_has_entries(node->prio_binlog))
+		node_output(node);
+}
+
+int node_wants_output(const merlin_node *node)
+{
+	if (node->sock < 0)
+		return 0;
+
+	if (node_outbuf_pending(node))
+		return 1;
+
+	/* a half-sent entry is finished whether we have credit or not */
+	if (node->drain_offset)
+		return 1;
+
+	return node->state == STATE_CONNECTED && node_credit_left(node) > 0 &&
+		(binlog_has_entries(node->binlog) || binlog_has_entries(node->prio_binlog));
+}
+
+/* drop everything queued, since the stream it was meant for is gone */
+static void node_outbuf_reset(merlin_node *node)
+{
+	struct node_outbuf *ob = node->outbuf;
+
+	if (!ob)
+		return;
+
+	if (ob->poll_sock >= 0)
+		iobroker_close(nagios_iobs, ob->poll_sock);
+	ob->poll_sock = -1;
+	safe_free(ob->buf);
+	ob->head = ob->tail = ob->size = 0;
+	ob->stream = node->sock;
+}
+
+static struct node_outbuf *node_outbuf_get(merlin_node *node)
+{
+	struct node_outbuf *ob = node->outbuf;
+
+	if (!ob) {
+		if (!(ob = calloc(1, sizeof(*ob))))
+			return NULL;
+		ob->poll_sock = -1;
+		ob->stream = node->sock;
+		node->outbuf = ob;
+	} else if (ob->stream != node->sock) {
+		node_outbuf_reset(node);
+	}
+
+	return ob;
+}
+
+int node_output(merlin_node *node)
+{
+	if (!node_flush(node) && node_wants_output(node))
+		node_send_binlog(node, NULL);
+
+	/* a grant that didn't fit in the output buffer may fit now */
+	node_credit_grant(node);
+
+	node_update_output(node);
+	return 0;
+}
+
+static int node_output_ready(int sd, int events, void *node_)
+{
+	return node_output((merlin_node *)node_);
+}
+
+/* poll the node's socket for writability for as long as we need to */
+static void node_update_output(merlin_node *node)
+{
+	struct node_outbuf *ob;
+	int want, result;
+
+	if (!is_module)
+		return;
+
+	/* the network thread lets us know when there's room for the backlog */
+	if (node->netconn) {
+		if (node->state == STATE_CONNECTED && node_credit_left(node) > 0 &&
+		    (binlog_has_entries(node->binlog) || binlog_has_entries(node->prio_binlog)))
+		{
+			netthread_want_room(node->netconn);
+		}
+		return;
+	}
+
+	want = node_wants_output(node);
+	if (!want && !node->outbuf)
+		return;
+
+	if (!(ob = node_outbuf_get(node)))
+		return;
+
+	if (!want && ob->poll_sock >= 0) {
+		iobroker_close(nagios_iobs, ob->poll_sock);
+		ob->poll_sock = -1;
+	}
+
+	if (!want || ob->poll_sock >= 0)
+		return;
+
+	/* the socket itself is already registered for input */
+	ob->poll_sock = dup(node->sock);
+	if (ob->poll_sock < 0) {
+		lerr("Failed to dup() socket %d of %s for output polling: %s",
+		     node->sock, node->name, strerror(errno));
+		return;
+	}
+
+	result = iobroker_register_out(nagios_iobs, ob->poll_sock, node, node_output_ready);
+	if (result < 0) {
+		lerr("IOB: Failed to register %s(%d) for output events: %s",
+		     node->name, ob->poll_sock, iobroker_strerror(result));
+		close(ob->poll_sock);
+		ob->poll_sock = -1;
+	}
+}
+
+/*
+ * Make room for len more bytes at the end of the output buffer and
+ * return where they go. Nothing is queued until the caller moves the
+ * buffer's tail past them.
+ */
+static unsigned char *node_outbuf_reserve(merlin_node *node, size_t len)
+{
+	struct node_outbuf *ob;
+
+	if (!(ob = node_outbuf_get(node)))
+		return NULL;
+
+	if (ob->tail + len > ob->size && ob->head) {
+		memmove(ob->buf, ob->buf + ob->head, ob->tail - ob->head);
+		ob->tail -= ob->head;
+		ob->head = 0;
+	}
+
+	if (ob->tail + len > ob->size) {
+		size_t size = ob->size ? ob->size : PKT_SIZE;
+		char *buf;
+
+		while (size < ob->tail + len)
+			size *= 2;
+		if (!(buf = realloc(ob->buf, size)))
+			return NULL;
+		ob->buf = buf;
+		ob->size = size;
+	}
+
+	return (unsigned char *)ob->buf + ob->tail;
+}
+
+static int node_outbuf_add(merlin_node *node, const void *data, size_t len)
+{
+	unsigned char *buf;
+
+	if (!(buf = node_outbuf_reserve(node, len)))
+		return -1;
+
+	memcpy(buf, data, len);
+	node->outbuf->tail += len;
+	node_update_output(node);
+
+	return 0;
+}
+
+/* queue what's left of iov once the first "skip" bytes have been sent */
+static int node_outbuf_addv(merlin_node *node, const struct iovec *iov, int iovcnt, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		if (node_outbuf_add(node, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip) < 0)
+			return -1;
+		skip = 0;
+	}
+
+	return 0;
+}
+
+/* hand the output buffer over to the network thread, which writes it */
+static int node_flush_thread(merlin_node *node)
+{
+	struct node_outbuf *ob = node->outbuf;
+	size_t len;
+
+	if (!ob || ob->stream != node->sock || ob->head == ob->tail)
+		return 0;
+
+	len = ob->tail - ob->head;
+	if (netthread_send(node->netconn, ob->buf + ob->head, len) < 0) {
+		node_disconnect(node, "Failed to hand %lu bytes over to the network thread", (unsigned long)len);
+		return -1;
+	}
+
+	ob->head = ob->tail = 0;
+	node->stats.bytes.sent += len;
+	node->last_action = node->last_sent = time(NULL);
+	return 0;
+}
+
+/*
+ * Write as much of the output buffer as the socket will take.
+ * Returns the number of bytes still queued, or -1 if the node
+ * had to be disconnected. Whatever the network thread has been
+ * handed counts as written.
+ */
+int node_flush(merlin_node *node)
+{
+	struct node_outbuf *ob;
+
+	if (node->netconn)
+		return node_flush_thread(node);
+
+	if (!node_outbuf_pending(node))
+		return 0;
+
+	ob = node->outbuf;
+	while (ob->head < ob->tail) {
+		ssize_t sent = send(node->sock, ob->buf + ob->head, ob->tail - ob->head,
+		                    MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			node_disconnect(node, "Failed to flush %lu queued bytes: %s",
+			                (unsigned long)(ob->tail - ob->head), strerror(errno));
+			return -1;
+		}
+
+		ob->head += sent;
+		node->stats.bytes.sent += sent;
+		node->last_action = node->last_sent = time(NULL);
+	}
+
+	if (ob->head == ob->tail)
+		ob->head = ob->tail = 0;
+
+	return ob->tail - ob->head;
+}
+
 /* close down the connection to a node and mark it as down */
 void node_disconnect(merlin_node *node, const char *fmt, ...)
 {
@@ -718,8 +1073,22 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 	if (node->state == STATE_CONNECTED)
 		node_log_event_count(node, 1);
 
-	iobroker_close(nagios_iobs, node->sock);
+	if (node->netconn) {
+		/* the network thread closes the socket once it's done with it */
+		netthread_detach(node->netconn);
+		node->netconn = NULL;
+	} else {
+		iobroker_close(nagios_iobs, node->sock);
+	}
 	node->sock = -1;
+	node_outbuf_reset(node);
+
+	/* batched events go in the backlog, the rest of a received frame is lost */
+	node_frame_flush(node);
+	slab_free(node->frame_in);
+	node->frame_in = NULL;
+	/* the cache's spare chunks aren't needed until it's back */
+	slab_destroy(&node->slab);
 
 	if (fmt) {
 		va_start(ap, fmt);
@@ -739,9 +1108,54 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 
 	nm_bufferqueue_destroy(node->bq);
 	node->bq = nm_bufferqueue_create();
+
+	/* a half-sent backlog entry gets sent in full on reconnect */
+	node->drain_offset = 0;
+
+	/* the next connection starts out with full headers, uncompressed */
+	node->protocol = 0;
+	zstream_destroy(node->zout);
+	zstream_destroy(node->zin);
+	zstream_destroy(node->zbody_in);
+	node->zout = node->zin = node->zbody_in = NULL;
+	memset(&node->credit, 0, sizeof(node->credit));
+	memset(&node->seq, 0, sizeof(node->seq));
+	intern_destroy(node->intern_out);
+	intern_destroy(node->intern_in);
+	node->intern_out = node->intern_in = NULL;
+	delta_destroy(node->delta_out);
+	delta_destroy(node->delta_in);
+	node->delta_out = node->delta_in = NULL;
+	node->object = NULL;
+}
+
+/* the backlog network nodes share when binlog_shared is set */
+static binlog *shared_binlog;
+
+static int node_create_shared_binlog(void)
+{
+	char *path = NULL;
+
+	if (shared_binlog)
+		return 0;
+
+	if (asprintf(&path, "%s/shared.module.binlog", binlog_dir ? binlog_dir : BINLOGDIR) < 15) {
+		lerr("ERROR: Failed to create on-disk binlog: asprintf() failed");
+		return -1;
+	}
+	linfo("Creating shared binary backlog. On-disk location: %s", path);
+	shared_binlog = binlog_create_shared(path, binlog_max_memory_size * 1024 * 1024, binlog_max_file_size * 1024 * 1024, binlog_persist ? 0 : BINLOG_UNLINK);
+	free(path);
+	if (!shared_binlog) {
+		lerr("Failed to allocate memory for shared binary backlog: %s", strerror(errno));
+		return -1;
+	}
+	binlog_set_sync_interval(shared_binlog, binlog_sync_interval);
+	return 0;
 }
 
-int node_create_binlog(merlin_node *node) {
+static int node_create_bulk_binlog(merlin_node *node)
+{
 	if (!node->binlog) {
 		char *path = NULL;
 
@@ -754,6 +1168,19 @@ int node_create_binlog(merlin_node *node) {
 			return -1;
 		}
 
+		/*
+		 * Network nodes get a cursor into the shared backlog, so
+		 * events that are for several of them are stored once
+		 */
+		if (binlog_shared && is_module && (node->type & (MODE_NOC | MODE_PEER | MODE_POLLER)) &&
+		    !node_create_shared_binlog())
+		{
+			node->binlog = binlog_create_reader(shared_binlog, node->name);
+			if (node->binlog)
+				return 0;
+			lwarn("Too many nodes share the binary backlog. %s gets one of its own", node->name);
+		}
+
 		if (asprintf(&path, "%s/%s.%s.binlog",
 		             binlog_dir ? binlog_dir : BINLOGDIR,
 		             is_module ? "module" : "daemon",
@@ -765,7 +1192,11 @@ int node_create_binlog(merlin_node *node) {
 		linfo("Creating binary backlog for %s. On-disk location: %s",
 			  node->name, path);
 
-		node->binlog = binlog_create(path, binlog_max_memory_size * 1024 * 1024, binlog_max_file_size * 1024 * 1024, BINLOG_UNLINK);
+		/*
+		 * with persistence enabled, a binlog left behind by a crash
+		 * is kept for node_binlog_read_saved() to adopt
+		 */
+		node->binlog = binlog_create(path, binlog_max_memory_size * 1024 * 1024, binlog_max_file_size * 1024 * 1024, binlog_persist ? 0 : BINLOG_UNLINK);
 		if (!node->binlog) {
 			free(path);
 			lerr("Failed to allocate memory for binary backlog for %s: %s",
@@ -773,103 +1204,525 @@ int node_create_binlog(merlin_node *node) {
 			return -1;
 		}
 		free(path);
+		binlog_set_compression(node->binlog, binlog_compression);
+		binlog_set_sync_interval(node->binlog, binlog_sync_interval);
 	}
 	return 0;
 }
 
-static int node_binlog_add(merlin_node *node, merlin_event *pkt)
-{
-	int result;
+/*
+ * Backlogs of network nodes have two lanes. Control packets,
+ * notifications, comments, downtime and external commands go in the
+ * priority lane, which is sent before the rest, so acknowledgements
+ * and downtime don't have to wait for a large backlog of check
+ * results to drain. Check results carry the acknowledgement, downtime
+ * and notification state of their object though, so events for a host
+ * that still has events in the bulk lane go there too, to stay in
+ * order with them. Which hosts do is tracked by a count per hash of
+ * the host name, which is started over each time the bulk lane is
+ * empty. Collisions and results dropped by compaction only make us
+ * keep more events in order than we have to.
+ */
+#define NODE_LANE_SLOTS 16384 /* must be a power of 2 */
+struct node_lanes {
+	unsigned int epoch; /* bumped when the bulk lane has emptied */
+	int uncounted;      /* the bulk lane holds events adopted from disk */
+	struct {
+		unsigned int epoch;
+		unsigned int count;
+	} host[NODE_LANE_SLOTS];
+};
 
-	/*
-	 * we skip stashing some packet types in the binlog. Typically
-	 * those that get generated immediately upon reconnect anyway
-	 * since they would just cause unnecessary overhead and might
-	 * trigger a lot of unnecessary actions if stashed.
-	 */
-	if (pkt->hdr.type == CTRL_PACKET) {
-		if (pkt->hdr.code == CTRL_ACTIVE || pkt->hdr.code == CTRL_INACTIVE)
-			return 0;
+static int node_create_priority_binlog(merlin_node *node)
+{
+	char *path = NULL;
+
+	if (asprintf(&path, "%s/%s.%s.priority.binlog",
+	             binlog_dir ? binlog_dir : BINLOGDIR,
+	             is_module ? "module" : "daemon",
+	             node->name) < 15)
+	{
+		lerr("ERROR: Failed to create on-disk binlog: asprintf() failed");
+		return -1;
 	}
-
-	if (node_create_binlog(node) != 0)
+	node->prio_binlog = binlog_create(path, binlog_max_memory_size * 1024 * 1024, binlog_max_file_size * 1024 * 1024, binlog_persist ? 0 : BINLOG_UNLINK);
+	free(path);
+	node->lanes = calloc(1, sizeof(*node->lanes));
+	if (!node->prio_binlog || !node->lanes) {
+		lwarn("Failed to create priority backlog for %s: %s", node->name, strerror(errno));
+		binlog_destroy(node->prio_binlog, BINLOG_UNLINK);
+		node->prio_binlog = NULL;
+		safe_free(node->lanes);
 		return -1;
+	}
+	binlog_set_sync_interval(node->prio_binlog, binlog_sync_interval);
+	return 0;
+}
 
-	result = binlog_add(node->binlog, pkt, packet_size(pkt));
+int node_create_binlog(merlin_node *node)
+{
+	if (node_create_bulk_binlog(node) < 0)
+		return -1;
 
-	/* If the binlog is full we should not wipe it, just stop writing to it. */
-	if (result == BINLOG_ENOSPC) {
-		if (binlog_full_warning(node->binlog)) {
-			lwarn("WARNING: Maximum binlog size reached for node %s", node->name);
-		}
-		return 0;
-	} else if (result < 0) {
-		binlog_wipe(node->binlog, BINLOG_UNLINK);
-		/* XXX should mark node as unsynced here */
-		node->stats.events.dropped += node->stats.events.logged + 1;
-		node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
-		node->stats.events.logged = 0;
-		node->stats.bytes.logged = 0;
-	} else {
-		node->stats.events.logged++;
-		node->stats.bytes.logged += packet_size(pkt);
+	/* without a priority lane, everything goes in the same one */
+	if (!node->prio_binlog && binlog_priority && is_module &&
+	    (node->type & (MODE_NOC | MODE_PEER | MODE_POLLER)))
+	{
+		node_create_priority_binlog(node);
 	}
+	return 0;
+}
 
-	node_log_event_count(node, 0);
+/* FNV-1a over a string in an encoded packet, up to a nul or 'stop' */
+static uint64_t pkt_str_hash(uint64_t key, merlin_event *pkt, uintptr_t off, int stop)
+{
+	unsigned int i;
+	const char *p;
 
-	return result;
+	for (p = pkt->body + off, i = off; i < pkt->hdr.len && *p && *p != stop; i++, p++)
+		key = (key ^ (unsigned char)*p) * 1099511628211ULL;
+	return key;
 }
 
-int node_binlog_read_saved(merlin_node *node)
+/*
+ * Hash the name of the host an event is about, or return 0 if it
+ * isn't about one. Service events count as events for their host.
+ */
+static uint64_t node_pkt_host(merlin_event *pkt)
 {
-	binlog * saved_binlog;
-	merlin_event *temp_pkt;
-	unsigned int len, msec;
-	clock_t start = clock(), diff;
-
-	/* Don't do anything if binlog persistence is disabled */
-	if (binlog_persist == false) {
+	uint64_t key = 14695981039346656037ULL;
+	unsigned int size, field;
+	uintptr_t off;
+	int stop = 0;
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		size = sizeof(merlin_host_status);
+		field = offsetof(merlin_host_status, name);
+		break;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		size = sizeof(merlin_service_status);
+		field = offsetof(merlin_service_status, host_name);
+		break;
+	case NEBCALLBACK_NOTIFICATION_DATA:
+		size = sizeof(nebstruct_notification_data);
+		field = offsetof(nebstruct_notification_data, host_name);
+		break;
+	case NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA:
+		size = sizeof(nebstruct_contact_notification_method_data);
+		field = offsetof(nebstruct_contact_notification_method_data, host_name);
+		break;
+	case NEBCALLBACK_COMMENT_DATA:
+		size = sizeof(nebstruct_comment_data);
+		field = offsetof(nebstruct_comment_data, host_name);
+		break;
+	case NEBCALLBACK_DOWNTIME_DATA:
+		size = sizeof(nebstruct_downtime_data);
+		field = offsetof(nebstruct_downtime_data, host_name);
+		break;
+	case NEBCALLBACK_FLAPPING_DATA:
+		size = sizeof(nebstruct_flapping_data);
+		field = offsetof(nebstruct_flapping_data, host_name);
+		break;
+	case NEBCALLBACK_EXTERNAL_COMMAND_DATA:
+		/* commands for a host or service have the host first */
+		size = sizeof(nebstruct_external_command_data);
+		field = offsetof(nebstruct_external_command_data, command_args);
+		stop = ';';
+		break;
+	default:
 		return 0;
 	}
 
-	ldebug("Reading saved binlog for node: %s:", node->name);
+	/* the name is an offset into the encoded body */
+	if (pkt->hdr.len < size)
+		return 0;
+	memcpy(&off, pkt->body + field, sizeof(off));
+	if (!off || off >= pkt->hdr.len || !pkt->body[off] || pkt->body[off] == stop)
+		return 0;
 
-	if (node_create_binlog(node) != 0) {
-		/* Something went wrong when creating the binlog */
-		return -1;
-	}
+	key = pkt_str_hash(key, pkt, off, stop);
+	return key ? key : 1;
+}
 
-	saved_binlog = binlog_get_saved(node->binlog);
-	/* There is no saved binlog to read this is normal in most cases */
-	if (saved_binlog == NULL) {
-		ldebug("No saved binlog for node: %s", node->name);
-		return 0;
+static int node_pkt_is_priority(merlin_event *pkt)
+{
+	switch (pkt->hdr.type) {
+	case CTRL_PACKET:
+	case NEBCALLBACK_NOTIFICATION_DATA:
+	case NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA:
+	case NEBCALLBACK_COMMENT_DATA:
+	case NEBCALLBACK_DOWNTIME_DATA:
+	case NEBCALLBACK_EXTERNAL_COMMAND_DATA:
+		return 1;
 	}
+	return 0;
+}
 
-	ldebug("Reading saved backlog for %s (%u entries, %s)", node->name,
-		   binlog_num_entries(saved_binlog), human_bytes(binlog_available(saved_binlog)));
+#define node_lane_slot(l, hash) (&(l)->host[(hash) & (NODE_LANE_SLOTS - 1)])
 
-	while (!binlog_read(saved_binlog, (void **)&temp_pkt, &len)) {
-		if (!temp_pkt || packet_size(temp_pkt) != (int)len ||
-		    !len || !packet_size(temp_pkt) || packet_size(temp_pkt) > MAX_PKT_SIZE)
-		{
-			if (!temp_pkt) {
-				lerr("BACKLOG-SAVED: binlog returned 0 but presented no data");
-			} else {
-				lerr("BACKLOG-SAVED: binlog returned a packet claiming to be of size %d", packet_size(temp_pkt));
-			}
-			lerr("BACKLOG-SAVED: binlog claims the data length is %u", len);
-			lerr("BACKLOG-SAVED: wiping backlog. %s is now out of sync", node->name);
-			binlog_destroy(node->binlog, BINLOG_UNLINK);
-			return -1;
+/* count an event that's about to go in the bulk lane */
+static void node_lanes_add(merlin_node *node, merlin_event *pkt)
+{
+	struct node_lanes *l = node->lanes;
+	uint64_t hash;
+
+	if (!l)
+		return;
+
+	/* nothing's pending, so whatever we've counted is stale */
+	if (!binlog_has_entries(node->binlog)) {
+		l->epoch++;
+		l->uncounted = 0;
+	}
+
+	if ((hash = node_pkt_host(pkt))) {
+		if (node_lane_slot(l, hash)->epoch != l->epoch) {
+			node_lane_slot(l, hash)->epoch = l->epoch;
+			node_lane_slot(l, hash)->count = 0;
 		}
-		errno = 0;
-		ldebug("BACKLOG-SAVED: Read event of type : %d", temp_pkt->hdr.type);
-		binlog_add(node->binlog, (void *)temp_pkt, len);
+		node_lane_slot(l, hash)->count++;
+	}
+}
+
+/* uncount an event that's about to be consumed from the bulk lane */
+static void node_lanes_remove(merlin_node *node, merlin_event *pkt)
+{
+	struct node_lanes *l = node->lanes;
+	uint64_t hash;
+
+	if (!l || !(hash = node_pkt_host(pkt)))
+		return;
+
+	if (node_lane_slot(l, hash)->epoch == l->epoch && node_lane_slot(l, hash)->count)
+		node_lane_slot(l, hash)->count--;
+}
+
+/* the backlog lane an event goes in */
+static binlog *node_binlog_lane(merlin_node *node, merlin_event *pkt)
+{
+	struct node_lanes *l = node->lanes;
+	uint64_t hash;
+
+	if (!node->prio_binlog || !l || !node_pkt_is_priority(pkt))
+		return node->binlog;
+
+	/* stay behind what's pending for the same host */
+	if (binlog_has_entries(node->binlog) && (hash = node_pkt_host(pkt))) {
+		if (l->uncounted)
+			return node->binlog;
+		if (node_lane_slot(l, hash)->epoch == l->epoch && node_lane_slot(l, hash)->count)
+			return node->binlog;
+	}
+
+	return node->prio_binlog;
+}
+
+/* the backlog can no longer be kept in sync, so drop all of it */
+static void node_binlog_wipe(merlin_node *node)
+{
+	binlog_wipe(node->binlog, BINLOG_UNLINK);
+	if (node->prio_binlog)
+		binlog_wipe(node->prio_binlog, BINLOG_UNLINK);
+}
+
+/*
+ * In compacting mode, check results and status updates that leave
+ * their object in the same hard state are superseded by the next one
+ * for the same object, so they're keyed on the packet type and the
+ * object's name. Everything else, state changes, alerts and first
+ * checks included, gets 0 and is always kept.
+ */
+static uint64_t node_binlog_key(merlin_event *pkt)
+{
+	monitored_object_state *st;
+	uintptr_t name, desc = 0;
+	uint64_t key = 14695981039346656037ULL; /* FNV-1a */
+	int nebattr;
+
+	if (!binlog_compact)
+		return 0;
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		if (pkt->hdr.len < sizeof(merlin_host_status))
+			return 0;
+		st = &((merlin_host_status *)pkt->body)->state;
+		name = (uintptr_t)((merlin_host_status *)pkt->body)->name;
+		nebattr = ((merlin_host_status *)pkt->body)->nebattr;
+		break;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		if (pkt->hdr.len < sizeof(merlin_service_status))
+			return 0;
+		st = &((merlin_service_status *)pkt->body)->state;
+		name = (uintptr_t)((merlin_service_status *)pkt->body)->host_name;
+		desc = (uintptr_t)((merlin_service_status *)pkt->body)->service_description;
+		nebattr = ((merlin_service_status *)pkt->body)->nebattr;
+		break;
+	default:
+		return 0;
+	}
+
+	/* alerts and first checks end up in the report data */
+	if (nebattr & (NEBATTR_CHECK_ALERT | NEBATTR_CHECK_FIRST))
+		return 0;
+
+	if (st->state_type != HARD_STATE || st->current_state != st->last_state ||
+	    st->current_state != st->last_hard_state)
+	{
+		return 0;
+	}
+
+	/* the names are offsets into the encoded body */
+	if (!name || name >= pkt->hdr.len || desc >= pkt->hdr.len)
+		return 0;
+
+	key = (key ^ pkt->hdr.type) * 1099511628211ULL;
+	key = pkt_str_hash(key, pkt, name, 0);
+	if (desc) {
+		key = (key ^ ';') * 1099511628211ULL;
+		key = pkt_str_hash(key, pkt, desc, 0);
+	}
+
+	return key ? key : 1;
+}
+
+static int node_binlog_add(merlin_node *node, merlin_event *pkt)
+{
+	binlog *bl;
+	int result;
+
+	/*
+	 * we skip stashing some packet types in the binlog. Typically
+	 * those that get generated immediately upon reconnect anyway
+	 * since they would just cause unnecessary overhead and might
+	 * trigger a lot of unnecessary actions if stashed.
+	 */
+	if (pkt->hdr.type == CTRL_PACKET) {
+		if (pkt->hdr.code == CTRL_ACTIVE || pkt->hdr.code == CTRL_INACTIVE)
+			return 0;
+	}
+
+	if (node_create_binlog(node) != 0)
+		return -1;
+
+	/*
+	 * records are sent straight from the backlog and must never be
+	 * written to once they're in it, since they're checksummed
+	 */
+	strcpy(pkt->hdr.from_uuid, ipc.uuid);
+	bl = node_binlog_lane(node, pkt);
+	if (bl == node->binlog)
+		node_lanes_add(node, pkt);
+	result = binlog_add_keyed(bl, pkt, packet_size(pkt), node_binlog_key(pkt));
+
+	/* If the binlog is full we should not wipe it, just stop writing to it. */
+	if (result == BINLOG_ENOSPC) {
+		if (binlog_full_warning(bl)) {
+			lwarn("WARNING: Maximum binlog size reached for node %s", node->name);
+		}
+		return 0;
+	} else if (result < 0) {
+		if (node->drain_offset)
+			node_disconnect(node, "Backlog wiped with an event partially sent");
+		node_binlog_wipe(node);
+		/* XXX should mark node as unsynced here */
+		node->stats.events.dropped += node->stats.events.logged + 1;
+		node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
+		node->stats.events.logged = 0;
+		node->stats.bytes.logged = 0;
+	} else {
+		node->stats.events.logged++;
+		node->stats.bytes.logged += packet_size(pkt);
+		/* the event it superseded, for the same host, will never be sent */
+		if (result > 0) {
+			if (bl == node->binlog)
+				node_lanes_remove(node, pkt);
+			node->stats.events.logged--;
+			node->stats.bytes.logged -= result;
+			result = 0;
+		}
+		node_update_output(node);
+	}
+
+	node_log_event_count(node, 0);
+
+	return result;
+}
+
+/*
+ * Nodes that announce MERLIN_CAP_FRAMES get small events batched up
+ * into FRAME_PACKETs, saving a 128-byte header (and a send()) per
+ * event. The batch is sent once the event loop has handled whatever
+ * generated the events, or as soon as something that can't go in
+ * it has to be sent, so nothing is reordered.
+ */
+static int frame_flush_scheduled;
+
+static void node_frame_flush_all(struct nm_event_execution_properties *evprop)
+{
+	unsigned int i;
+
+	frame_flush_scheduled = 0;
+	if (evprop->execution_type != EVENT_EXEC_NORMAL)
+		return;
+
+	for (i = 0; i < num_nodes; i++)
+		node_frame_flush(node_table[i]);
+}
+
+static int node_frame_ok(const merlin_node *node, merlin_event *pkt)
+{
+	/* our own nodeinfo sits in ipc.info, so we know nothing of the daemon's */
+	if (!is_module || node == &ipc || !(node->info.capabilities & MERLIN_CAP_FRAMES))
+		return 0;
+
+	/* priority events are sent on their own to keep the lanes apart */
+	return pkt->hdr.len <= MERLIN_FRAME_MAX_EVENT && !node_pkt_is_priority(pkt);
+}
+
+static int node_frame_add(merlin_node *node, merlin_event *pkt)
+{
+	merlin_event *frame;
+	struct merlin_frame_entry entry;
+
+	if (node->frame_out_events && node->frame_out->hdr.len + sizeof(entry) + pkt->hdr.len > MERLIN_FRAME_SIZE)
+		node_frame_flush(node);
+
+	if (!(frame = node->frame_out)) {
+		if (!(frame = malloc(HDR_SIZE + MERLIN_FRAME_SIZE)))
+			return -1;
+		memset(&frame->hdr, 0, HDR_SIZE);
+		frame->hdr.sig.id = MERLIN_SIGNATURE;
+		frame->hdr.protocol = MERLIN_PROTOCOL_VERSION;
+		frame->hdr.type = FRAME_PACKET;
+		node->frame_out = frame;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	entry.type = pkt->hdr.type;
+	entry.code = pkt->hdr.code;
+	entry.selection = pkt->hdr.selection;
+	entry.len = pkt->hdr.len;
+	memcpy(frame->body + frame->hdr.len, &entry, sizeof(entry));
+	memcpy(frame->body + frame->hdr.len + sizeof(entry), pkt->body, pkt->hdr.len);
+	frame->hdr.len += sizeof(entry) + pkt->hdr.len;
+	node->frame_out_events++;
+
+	if (!frame_flush_scheduled) {
+		schedule_event(0, node_frame_flush_all, NULL);
+		frame_flush_scheduled = 1;
+	}
+
+	return 0;
+}
+
+/* put the events of a frame we couldn't send in the backlog */
+static void node_frame_stash(merlin_node *node, merlin_event *frame)
+{
+	merlin_event *pkt;
+	unsigned int offset = 0;
+
+	if (!(pkt = slab_alloc(&node->slab, HDR_SIZE + MERLIN_FRAME_MAX_EVENT))) {
+		lerr("Failed to allocate memory to stash frame for %s", node->name);
+		return;
+	}
+
+	memcpy(&pkt->hdr, &frame->hdr, HDR_SIZE);
+	while (offset < frame->hdr.len) {
+		struct merlin_frame_entry entry;
+
+		memcpy(&entry, frame->body + offset, sizeof(entry));
+		pkt->hdr.type = entry.type;
+		pkt->hdr.code = entry.code;
+		pkt->hdr.selection = entry.selection;
+		pkt->hdr.len = entry.len;
+		memcpy(pkt->body, frame->body + offset + sizeof(entry), entry.len);
+		offset += sizeof(entry) + entry.len;
+		node_binlog_add(node, pkt);
+	}
+	slab_free(pkt);
+}
+
+/*
+ * Send the events batched up for a node, or put them in its backlog
+ * if that can't be done right now.
+ */
+int node_frame_flush(merlin_node *node)
+{
+	merlin_event *frame = node->frame_out;
+	unsigned int events = node->frame_out_events;
+	int result = 0;
+
+	if (!events)
+		return 0;
+
+	/* node_send() flushes the frame first, so make sure it's empty */
+	node->frame_out_events = 0;
+
+	if (node->sock >= 0 && node->state == STATE_CONNECTED && node_credit_left(node) > 0) {
+		gettimeofday(&frame->hdr.sent, NULL);
+		result = node_send(node, frame, packet_size(frame), MSG_DONTWAIT);
+	}
+
+	if (result == packet_size(frame)) {
+		node->stats.events.sent += events;
+		node->stats.frames.sent++;
+	} else {
+		node_frame_stash(node, frame);
+	}
+	frame->hdr.len = 0;
+
+	return result == packet_size(frame) ? 0 : -1;
+}
+
+int node_binlog_read_saved(merlin_node *node)
+{
+	int result;
+	unsigned int msec;
+	clock_t start = clock(), diff;
+
+	/* Don't do anything if binlog persistence is disabled */
+	if (binlog_persist == false) {
+		return 0;
+	}
+
+	ldebug("Reading saved binlog for node: %s:", node->name);
+
+	if (node_create_binlog(node) != 0) {
+		/* Something went wrong when creating the binlog */
+		return -1;
+	}
 
+	/* the priority lane is sent first, so adopt it regardless */
+	if (node->prio_binlog && binlog_adopt_saved(node->prio_binlog) < 0) {
+		lerr("BACKLOG-SAVED: Failed to adopt saved priority backlog for %s. %s is now out of sync",
+		     node->name, node->name);
 	}
-	/* wipe the binlog and free memory */
-	binlog_destroy(saved_binlog, BINLOG_UNLINK);
+
+	/* The saved file becomes the node's binlog, without copying anything */
+	result = binlog_adopt_saved(node->binlog);
+	if (result < 0) {
+		lerr("BACKLOG-SAVED: Failed to adopt saved binlog for %s: %d. %s is now out of sync",
+		     node->name, result, node->name);
+		return -1;
+	}
+	/* There is no saved binlog to read this is normal in most cases */
+	if (!result) {
+		ldebug("No saved binlog for node: %s", node->name);
+		return 0;
+	}
+
+	/* we don't know which hosts the adopted events are for */
+	if (node->lanes)
+		node->lanes->uncounted = 1;
+
+	ldebug("Adopted saved backlog for %s (%u entries, %s)", node->name,
+		   binlog_num_entries(node->binlog), human_bytes(binlog_available(node->binlog)));
 
 	/* Timing information */
 	diff = clock() - start;
@@ -879,6 +1732,129 @@ int node_binlog_read_saved(merlin_node *node)
 	return 0;
 }
 
+/*
+ * Feed compressed data read from a node to its decompressor, which
+ * passes the events on to the node's bufferqueue.
+ */
+static int node_decompress(merlin_node *node, const void *buf, size_t len)
+{
+	size_t before = nm_bufferqueue_get_available(node->bq);
+
+	if (zstream_decompress(node->zin, buf, len, node->bq) < 0) {
+		node_disconnect(node, "Corrupt compressed data");
+		return -1;
+	}
+
+	node->stats.decompress.wire += len;
+	node->stats.decompress.raw += nm_bufferqueue_get_available(node->bq) - before;
+	return 0;
+}
+
+/*
+ * A node compresses everything it sends from some point after it
+ * has seen our CTRL_ACTIVE, and the first block tells us where.
+ * What's left in the bufferqueue from there on is compressed.
+ */
+static int node_start_decompression(merlin_node *node, int method)
+{
+	size_t len = nm_bufferqueue_get_available(node->bq);
+	char *buf;
+	int ret;
+
+	if (node->zin) {
+		node_disconnect(node, "Compressed data inside compressed data");
+		return -1;
+	}
+	if (!zstream_supported(method) || !(node->zin = zstream_create(method, 1))) {
+		node_disconnect(node, "Unable to decompress %s data", binlog_compression_name(method));
+		return -1;
+	}
+	ldebug("%s started compressing with %s", node->name, binlog_compression_name(method));
+
+	if (!(buf = malloc(len)) || nm_bufferqueue_unshift(node->bq, len, buf)) {
+		free(buf);
+		node_disconnect(node, "Failed to set up decompression");
+		return -1;
+	}
+	ret = node_decompress(node, buf, len);
+	free(buf);
+	return ret;
+}
+
+/*
+ * An encrypted node compresses the body of each event on its own,
+ * before it's encrypted, so it's decompressed once it's decrypted.
+ * Returns the decompressed event, or NULL if the node had to be
+ * disconnected. pkt is left for the caller to free either way.
+ */
+static merlin_event *node_decompress_body(merlin_node *node, merlin_event *pkt)
+{
+	struct zstream_block blk;
+	merlin_event *out;
+	int len;
+
+	if (pkt->hdr.len < sizeof(blk)) {
+		node_disconnect(node, "Truncated compressed event");
+		return NULL;
+	}
+	memcpy(&blk, pkt->body, sizeof(blk));
+	if (!node->zbody_in) {
+		if (!zstream_supported(blk.method) || !(node->zbody_in = zstream_create(blk.method, 1))) {
+			node_disconnect(node, "Unable to decompress %s data", binlog_compression_name(blk.method));
+			return NULL;
+		}
+		ldebug("%s started compressing with %s", node->name, binlog_compression_name(blk.method));
+	}
+
+	if (blk.len > sizeof(pkt->body) || !(out = slab_alloc(&node->slab, HDR_SIZE + blk.len))) {
+		node_disconnect(node, "Failed to allocate %u bytes for a compressed event", blk.len);
+		return NULL;
+	}
+	len = zstream_decompress_block(node->zbody_in, pkt->body, pkt->hdr.len, out->body, blk.len);
+	if (len < 0) {
+		slab_free(out);
+		node_disconnect(node, "Corrupt compressed data");
+		return NULL;
+	}
+
+	memcpy(&out->hdr, &pkt->hdr, HDR_SIZE);
+	out->hdr.len = len;
+	node->stats.decompress.wire += pkt->hdr.len;
+	node->stats.decompress.raw += len;
+	return out;
+}
+
+/*
+ * Start compressing what we send to a node that has told us it can
+ * decompress it, if we're configured to
+ */
+static void node_start_compression(merlin_node *node)
+{
+	int cap = 0;
+
+	if (node->zout || node->compression == BINLOG_COMPRESS_NONE)
+		return;
+
+	if (node->compression == BINLOG_COMPRESS_LZ4)
+		cap = MERLIN_CAP_LZ4;
+	else if (node->compression == BINLOG_COMPRESS_ZSTD)
+		cap = MERLIN_CAP_ZSTD;
+	if (!(node->info.capabilities & cap)) {
+		lwarn("%s can't decompress %s. Sending uncompressed data",
+		      node->name, binlog_compression_name(node->compression));
+		return;
+	}
+
+	/* whatever's already queued is sent uncompressed, ahead of it */
+	if (!(node->zout = zstream_create(node->compression, 0))) {
+		lerr("Failed to set up %s compression for %s. Sending uncompressed data",
+		     binlog_compression_name(node->compression), node->name);
+		return;
+	}
+	linfo("Compressing data sent to %s with %s",
+	      node->name, binlog_compression_name(node->compression));
+}
+
 /*
  * Read as much data as we possibly can from the node so
  * that whatever parsing code there is can handle it later.
@@ -893,12 +1869,23 @@ int node_recv(merlin_node *node)
 {
 	int bytes_read;
 	nm_bufferqueue *bq = node->bq;
+	char buf[64 << 10];
 
 	if (!node || node->sock < 0) {
 		return -1;
 	}
 
-	bytes_read = nm_bufferqueue_read(bq, node->sock);
+	/* so a zero-read isn't mistaken for EAGAIN from an earlier call */
+	errno = 0;
+
+	/* compressed data goes to the bufferqueue by way of the decompressor */
+	if (node->zin) {
+		bytes_read = read(node->sock, buf, sizeof(buf));
+		if (bytes_read > 0 && node_decompress(node, buf, bytes_read) < 0)
+			return -1;
+	} else {
+		bytes_read = nm_bufferqueue_read(bq, node->sock);
+	}
 
 	/*
 	 * If we read something, update the stat counter
@@ -935,20 +1922,314 @@ int node_recv(merlin_node *node)
 }
 
 /*
- * wraps io_send_all() and adds proper error handling when we run
- * into sending errors. It's up to the caller to poll the socket
- * for writability, or pass the proper flags and ignore errors
+ * Take data the network thread has read from a node, the way
+ * node_recv() takes what it reads itself. Returns 0 on success
+ * and -1 if the node had to be disconnected.
+ */
+int node_feed(merlin_node *node, const void *buf, size_t len)
+{
+	if (node->zin) {
+		if (node_decompress(node, buf, len) < 0)
+			return -1;
+	} else if (nm_bufferqueue_push(node->bq, buf, len)) {
+		node_disconnect(node, "Failed to queue %lu bytes of input", (unsigned long)len);
+		return -1;
+	}
+
+	node->last_action = node->last_recv = time(NULL);
+	node->stats.bytes.read += len;
+	return 0;
+}
+
+/*
+ * Hand the socket of a connected node over to the network thread.
+ * What's in the output buffer goes with it, so the buffer no longer
+ * needs polling.
+ */
+int node_thread_attach(merlin_node *node)
+{
+	struct node_outbuf *ob = node->outbuf;
+
+	if (node->netconn || node->sock < 0)
+		return 0;
+
+	if (!(node->netconn = netthread_attach(node)))
+		return -1;
+
+	if (ob && ob->poll_sock >= 0) {
+		iobroker_close(nagios_iobs, ob->poll_sock);
+		ob->poll_sock = -1;
+	}
+	node_flush(node);
+	return 0;
+}
+
+/*
+ * Nodes that speak protocol version 4 or later get compact headers,
+ * except in CTRL_ACTIVE (and CTRL_INVALID_CLUSTER, which is sent in
+ * its place), since that's how they find out who we are.
+ */
+static int node_wants_compact(const merlin_node *node, const merlin_header *hdr)
+{
+	if (node->protocol < MERLIN_PROTOCOL_COMPACT)
+		return 0;
+
+	return hdr->type != CTRL_PACKET ||
+		(hdr->code != CTRL_ACTIVE && hdr->code != CTRL_INVALID_CLUSTER);
+}
+
+/*
+ * Write "hdr" to buf the way it goes out on the wire to "node".
+ * buf must have room for HDR_SIZE bytes. The size of what's written
+ * depends on the header's fields, but not on its nonce or authtag.
+ * zbody marks the body as compressed, which only compact headers can.
+ * Returns the number of bytes written.
+ */
+static unsigned int node_wire_header(const merlin_node *node, const merlin_header *hdr,
+                                     int zbody, unsigned char *buf)
+{
+	if (node_wants_compact(node, hdr)) {
+		unsigned int flags = 0;
+
+		if (node->encrypted)
+			flags = MERLIN_COMPACT_CRYPT | (seq_nonces(node) ? MERLIN_COMPACT_SEQ : 0);
+		if (zbody)
+			flags |= MERLIN_COMPACT_ZBODY;
+		return merlin_encode_header(hdr, flags, buf);
+	}
+
+	memcpy(buf, hdr, HDR_SIZE);
+	strcpy(((merlin_header *)buf)->from_uuid, ipc.uuid);
+	return HDR_SIZE;
+}
+
+/*
+ * Point iov at "pkt" as it goes out on the wire to "node", with the
+ * header written to hdr, which must have room for HDR_SIZE bytes.
+ * The event itself is left alone, since it may well be borrowed
+ * from the backlog. Returns the number of bytes to send.
+ */
+static unsigned int node_wire_iov(const merlin_node *node, merlin_event *pkt,
+                                  unsigned char *hdr, struct iovec *iov)
+{
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = node_wire_header(node, &pkt->hdr, 0, hdr);
+	iov[1].iov_base = pkt->body;
+	iov[1].iov_len = pkt->hdr.len;
+
+	return iov[0].iov_len + iov[1].iov_len;
+}
+
+/*
+ * Encrypt an event straight into the node's output buffer. The
+ * plaintext is only read, so an event sent to many nodes is encoded
+ * once and then encrypted once per node, without being copied.
+ * Encrypted data doesn't compress, so if we're compressing what we
+ * send to the node, the body is compressed first.
+ * Returns 0 on success and -1 if the node had to be disconnected.
+ */
+static int node_send_encrypted(merlin_node *node, const merlin_event *pkt)
+{
+	merlin_header hdr;
+	unsigned int hdr_len;
+	unsigned char *buf;
+	const void *body = pkt->body;
+	int zbody = 0;
+
+	memcpy(&hdr, &pkt->hdr, HDR_SIZE);
+
+	/* bodies that are at most a frame always fit in one once compressed */
+	if (node->zout && hdr.len && hdr.len <= MERLIN_FRAME_SIZE && node_wants_compact(node, &hdr)) {
+		struct iovec iov = { (void *)pkt->body, hdr.len };
+		int zlen = zstream_compress(node->zout, &iov, 1, &body);
+
+		if (zlen < 0) {
+			node_disconnect(node, "Failed to compress %u bytes of output", hdr.len);
+			return -1;
+		}
+		node->stats.compress.raw += hdr.len;
+		node->stats.compress.wire += zlen;
+		hdr.len = zlen;
+		zbody = 1;
+	}
+
+	if (!(buf = node_outbuf_reserve(node, HDR_SIZE + hdr.len))) {
+		node_disconnect(node, "Failed to queue %u bytes of output", packet_size(pkt));
+		return -1;
+	}
+
+	/* the header goes in front of the body, so find out how big it is first */
+	hdr_len = node_wire_header(node, &hdr, zbody, buf);
+	if (encrypt_body(body, hdr.len, &hdr, buf + hdr_len, node) < 0) {
+		node_disconnect(node, "Failed to encrypt packet");
+		return -1;
+	}
+	node_wire_header(node, &hdr, zbody, buf);
+	node->outbuf->tail += hdr_len + hdr.len;
+
+	if (node_flush(node) < 0)
+		return -1;
+	node_update_output(node);
+	return 0;
+}
+
+/*
+ * Queue the rest of a backlog entry that a batched drain only got
+ * partway through, so something else can be sent after it.
+ */
+static int node_send_binlog_rest(merlin_node *node)
+{
+	merlin_event *temp_pkt;
+	unsigned char hdr[HDR_SIZE];
+	struct iovec iov[2];
+	unsigned int len;
+
+	if (binlog_peek(node->drain_binlog, (void **)&temp_pkt, &len) < 0 ||
+	    (len = node_wire_iov(node, temp_pkt, hdr, iov)) <= node->drain_offset)
+	{
+		node_disconnect(node, "Partially sent backlog entry has gone missing");
+		return -1;
+	}
+
+	len -= node->drain_offset;
+	if (node_outbuf_addv(node, iov, 2, node->drain_offset) < 0) {
+		node_disconnect(node, "Failed to queue the rest of a partially sent backlog entry");
+		return -1;
+	}
+
+	node->stats.drain.bytes += len;
+	node->stats.events.sent++;
+	node_credit_use(node, temp_pkt);
+	node->stats.events.logged--;
+	node->stats.bytes.logged -= packet_size(temp_pkt);
+	node->stats.drain.events++;
+	node->drain_offset = 0;
+	if (node->drain_binlog == node->binlog)
+		node_lanes_remove(node, temp_pkt);
+	binlog_consume(node->drain_binlog);
+	return 0;
+}
+
+/*
+ * Intern one event to dst, as a delta of what we last sent the node
+ * for the same object if it takes those. Returns the length of what
+ * was written, with its code in *code, or 0 if the event goes as it
+ * is. dst has room for len bytes, which is all it takes.
+ */
+static uint32_t node_intern_event(merlin_node *node, unsigned int type, const char *body,
+                                  uint32_t len, char *dst, uint16_t *code)
+{
+	int numbered = intern_numbered(node->intern_out);
+	uint32_t ilen, dlen = 0;
+	char *tmp;
+
+	*code = numbered ? MAGIC_OBJECT_IDS : MAGIC_INTERNED;
+	if (!node->delta_out || !(tmp = slab_alloc(&node->slab, len)))
+		return intern_encode(node->intern_out, type, body, len, dst);
+
+	if ((ilen = intern_encode(node->intern_out, type, body, len, tmp)))
+		dlen = delta_encode(node->delta_out, numbered, type, tmp, ilen, dst, ilen);
+	if (dlen) {
+		*code = numbered ? MAGIC_OBJECT_IDS_DELTA : MAGIC_INTERNED_DELTA;
+		node->stats.delta.sent++;
+		node->stats.delta.saved += ilen - dlen;
+	} else if (ilen) {
+		memcpy(dst, tmp, ilen);
+	}
+	slab_free(tmp);
+	return dlen ? dlen : ilen;
+}
+
+/*
+ * The event or frame as it goes to a node that takes interned
+ * names, in a buffer from the node's slab, or NULL if it goes as
+ * it is. The names and states in it count as given to the node,
+ * so this may only be called once the event is bound to be sent.
+ */
+static merlin_event *node_intern(merlin_node *node, const merlin_event *pkt)
+{
+	merlin_event *out;
+	unsigned int offset = 0, out_len = 0, interned = 0;
+	uint16_t code;
+
+	if (pkt->hdr.type != FRAME_PACKET && (pkt->hdr.code || !intern_type(pkt->hdr.type)))
+		return NULL;
+	if (!(out = slab_alloc(&node->slab, packet_size(pkt))))
+		return NULL;
+	memcpy(&out->hdr, &pkt->hdr, HDR_SIZE);
+
+	if (pkt->hdr.type != FRAME_PACKET) {
+		out_len = node_intern_event(node, pkt->hdr.type, pkt->body, pkt->hdr.len, out->body, &code);
+		if (out_len) {
+			out->hdr.code = code;
+			node->stats.intern.saved += pkt->hdr.len - out_len;
+			interned++;
+		}
+	}
+
+	/* frames are interned event by event */
+	while (pkt->hdr.type == FRAME_PACKET && offset < pkt->hdr.len) {
+		struct merlin_frame_entry entry;
+		const char *body = pkt->body + offset + sizeof(entry);
+		char *dst = out->body + out_len + sizeof(entry);
+		uint32_t len = 0;
+
+		memcpy(&entry, pkt->body + offset, sizeof(entry));
+		offset += sizeof(entry) + entry.len;
+		if (!entry.code && intern_type(entry.type))
+			len = node_intern_event(node, entry.type, body, entry.len, dst, &code);
+		if (len) {
+			node->stats.intern.saved += entry.len - len;
+			entry.code = code;
+			entry.len = len;
+			interned++;
+		} else {
+			memcpy(dst, body, entry.len);
+		}
+		memcpy(out->body + out_len, &entry, sizeof(entry));
+		out_len += sizeof(entry) + entry.len;
+	}
+
+	if (!interned) {
+		slab_free(out);
+		return NULL;
+	}
+	out->hdr.len = out_len;
+	node->stats.intern.sent += interned;
+	return out;
+}
+
+/*
+ * Send an event of len bytes to a node without blocking, with
+ * whatever header the node has agreed to. Whatever the socket won't
+ * take right now is queued and sent once it's writable, so a return
+ * value of len means the data is on its way. 0 means the output
+ * buffer is full (or the node isn't connected) and the caller should
+ * hang on to the data, and < 0 that the node had to be disconnected.
  */
 int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 {
-	merlin_event *pkt = (merlin_event *)data;
-	merlin_event *encrypted_pkt = NULL;
-	int sent, sd = 0;
+	merlin_event *pkt = (merlin_event *)data, *interned = NULL;
+	unsigned char hdr[HDR_SIZE];
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned int wire_len, iovcnt = ARRAY_SIZE(iov);
+	ssize_t sent = 0;
+	int result = len;
 
 	if (!node || node->sock < 0)
 		return 0;
 
-	strcpy(pkt->hdr.from_uuid, ipc.uuid);
+	/* events batched up before this go first */
+	if (node->frame_out_events)
+		node_frame_flush(node);
+
+	if (node->drain_offset && node_send_binlog_rest(node) < 0)
+		return 0;
+
+	/* leave it to the caller to stash the event until we've caught up */
+	if (node_outbuf_pending(node) >= binlog_outbuf_size * 1024)
+		return 0;
 
 	if (len >= HDR_SIZE && pkt->hdr.type == CTRL_PACKET) {
 		ldebug("Sending %s to %s", ctrl_name(pkt->hdr.code), node->name);
@@ -961,99 +2242,422 @@ int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 		}
 	}
 
-	if (node->encrypted) {
-		/* allocate memory and copy the pkt */
-		encrypted_pkt = malloc(sizeof *encrypted_pkt);
-		memcpy(encrypted_pkt, pkt, packet_size(pkt));
+	/* from here on, the event goes out unless the node is disconnected */
+	if (node->intern_out && len >= HDR_SIZE && (interned = node_intern(node, pkt)))
+		pkt = interned;
 
-		if (encrypt_pkt(encrypted_pkt, node) == -1) {
-			node_disconnect(node, "Failed to encrypt packet");
+	if (node->encrypted) {
+		if (node_send_encrypted(node, pkt) < 0) {
+			result = -1;
+			goto out;
 		}
-		/* Make sure we set the encrypted pkt as the pkt to send */
-		pkt = encrypted_pkt;
-
+		node_credit_use(node, pkt);
+		goto out;
 	}
 
-	sent = io_send_all(node->sock, (void *) pkt, len);
+	wire_len = node_wire_iov(node, pkt, hdr, iov);
 
-	if (encrypted_pkt != NULL) {
-		free(encrypted_pkt);
+	/* compression works on the stream, since it isn't encrypted */
+	if (node->zout) {
+		const void *block;
+		int zlen = zstream_compress(node->zout, iov, iovcnt, &block);
+
+		if (zlen < 0) {
+			node_disconnect(node, "Failed to compress %u bytes of output", wire_len);
+			result = -1;
+			goto out;
+		}
+		node->stats.compress.raw += wire_len;
+		node->stats.compress.wire += zlen;
+		iov[0].iov_base = (void *)block;
+		iov[0].iov_len = wire_len = zlen;
+		iovcnt = 1;
+	}
+
+	/* anything already queued must go out first */
+	if (!node->netconn && !node_outbuf_pending(node)) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		sent = sendmsg(node->sock, &msg, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			lerr("Failed to send(%d, %p, %d, %d) to %s: %s",
+				 node->sock, data, len, flags, node->name, strerror(errno));
+			node_disconnect(node, "Failed write(): %s", strerror(errno));
+			result = -1;
+			goto out;
+		}
+		if (sent < 0)
+			sent = 0;
+		if (sent) {
+			node->stats.bytes.sent += sent;
+			node->last_action = node->last_sent = time(NULL);
+		}
 	}
 
-	/* success. Should be the normal case */
-	if (sent == (int)len) {
-		node->stats.bytes.sent += sent;
-		node->last_action = node->last_sent = time(NULL);
-		return sent;
+	/* whatever the socket didn't take gets sent once it's writable */
+	if ((size_t)sent < wire_len && node_outbuf_addv(node, iov, iovcnt, sent) < 0) {
+		node_disconnect(node, "Failed to queue %lu bytes of output", (unsigned long)(wire_len - sent));
+		result = -1;
+		goto out;
+	}
+	if (node->netconn && node_flush(node) < 0) {
+		result = -1;
+		goto out;
 	}
 
-	/*
-	 * partial writes and complete failures can only be handled
-	 * by disconnecting and re-syncing the stream
-	 */
-	sd = node->sock;
-	node_disconnect(node, "Partial or failed write() (sent=%d; len=%d): %s",
-				   sent, len, strerror(errno));
+	if (len >= HDR_SIZE)
+		node_credit_use(node, pkt);
+out:
+	if (interned)
+		slab_free(interned);
+	return result;
+}
+
+/*
+ * Peek at the header of the next packet in the node's iocache.
+ * flags is set to its MERLIN_COMPACT_* flags, or 0 if it's a full
+ * header.
+ * Returns the size it has on the wire, 0 if we need more data
+ * and -1 if the node had to be disconnected.
+ */
+static int node_read_header(merlin_node *node, merlin_header *hdr, unsigned int *flags)
+{
+	unsigned char buf[MERLIN_COMPACT_HDR_MAX];
+	nm_bufferqueue *bq = node->bq;
+	size_t len;
+	int ret;
+
+	len = nm_bufferqueue_get_available(bq);
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+	if (!len || nm_bufferqueue_peek(bq, len, buf))
+		return 0;
+
+	/* the rest of the stream is compressed, so decompress what we have */
+	if (buf[0] == ZSTREAM_MAGIC) {
+		if (len < 2)
+			return 0;
+		if (node_start_decompression(node, buf[1]) < 0)
+			return -1;
+		return node_read_header(node, hdr, flags);
+	}
 
-	if (sent < 0) {
-		/* if we would have blocked, we simply return 0 */
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+	*flags = 0;
+	if (buf[0] != MERLIN_COMPACT_MAGIC) {
+		if (nm_bufferqueue_peek(bq, HDR_SIZE, (void *)hdr))
 			return 0;
+		if (hdr->sig.id != MERLIN_SIGNATURE) {
+			lerr("Invalid signature on packet from '%s'. Disconnecting node", node->name);
+			node_disconnect(node, "Invalid signature");
+			return -1;
+		}
+		return HDR_SIZE;
+	}
 
-		/* otherwise we log the error and disconnect the node */
-		lerr("Failed to send(%d, %p, %d, %d) to %s: %s",
-			 sd, data, len, flags, node->name, strerror(errno));
-		return sent;
+	ret = merlin_decode_header(buf, len, hdr);
+	if (ret < 0 || (!ret && len == sizeof(buf))) {
+		lerr("Invalid compact header on packet from '%s'. Disconnecting node", node->name);
+		node_disconnect(node, "Invalid compact header");
+		return -1;
 	}
 
-	/* partial write. ugh... */
-	lerr("Partial send() to %s. %d of %d bytes sent",
-		 node->name, sent, len);
-	return -1;
+	/* the sender's UUID was only sent along with its CTRL_ACTIVE */
+	if (ret)
+		strcpy(hdr->from_uuid, node->uuid);
+	if (ret && (buf[1] & MERLIN_COMPACT_SEQ))
+		seq_next_nonce(node, hdr->nonce);
+	*flags = buf[1];
+	return ret;
 }
 
-/*
- * Fetch one event from the node's iocache. If the cache is
- * exhausted, we handle partial events and iocache resets and
- * return NULL
- */
-merlin_event *node_get_event(merlin_node *node)
+/* read one packet off the wire */
+static merlin_event *node_read_event(merlin_node *node)
 {
 	merlin_header hdr;
 	merlin_event *pkt;
 	nm_bufferqueue *bq = node->bq;
+	unsigned int flags;
+	int hdr_len;
 
-	if (nm_bufferqueue_peek(bq, HDR_SIZE, (void *)&hdr))
+	if ((hdr_len = node_read_header(node, &hdr, &flags)) <= 0)
 		return NULL;
 
 	/*
 	 * If buffer is smaller than expected, leave the header
 	 * and wait for more data
 	 */
-	if (HDR_SIZE + hdr.len > nm_bufferqueue_get_available(bq)) {
-		ldebug("IOC: packet is longer (%i) than remaining data (%lu) from %s - will read more and try again", hdr.len, nm_bufferqueue_get_available(bq) - HDR_SIZE, node->name);
+	if (hdr_len + hdr.len > nm_bufferqueue_get_available(bq)) {
+		ldebug("IOC: packet is longer (%i) than remaining data (%lu) from %s - will read more and try again", hdr.len, nm_bufferqueue_get_available(bq) - hdr_len, node->name);
 		return NULL;
 	}
 
-	if (hdr.sig.id != MERLIN_SIGNATURE) {
-		lerr("Invalid signature on packet from '%s'. Disconnecting node", node->name);
-		node_disconnect(node, "Invalid signature");
+	pkt = slab_alloc(&node->slab, HDR_SIZE + hdr.len);
+	if (!pkt) {
+		lerr("IOC: Failed to allocate %lu bytes for packet from '%s'", (unsigned long)(HDR_SIZE + hdr.len), node->name);
 		return NULL;
 	}
-	node->stats.events.read++;
-
-	pkt = calloc(1, HDR_SIZE + hdr.len);
-	if (nm_bufferqueue_unshift(bq, HDR_SIZE + hdr.len, (void *)pkt)) {
+	memcpy(&pkt->hdr, &hdr, HDR_SIZE);
+	if (nm_bufferqueue_drop(bq, hdr_len) || nm_bufferqueue_unshift(bq, hdr.len, (void *)pkt->body)) {
 		lerr("IOC: Reading from '%s' failed, after checking that enough data was available. Disconnecting node", node->name);
 		node_disconnect(node, "IOC error");
+		slab_free(pkt);
 		return NULL;
 	}
 
 	if (node->encrypted) {
 		if (decrypt_pkt(pkt, node) == -1) {
 			node_disconnect(node, "Failed to decrypt package from: %s", node->name);
+			slab_free(pkt);
+			return NULL;
+		}
+	}
+
+	/* only bodies that are encrypted are compressed on their own */
+	if (flags & MERLIN_COMPACT_ZBODY) {
+		merlin_event *out;
+
+		if (!node->encrypted) {
+			node_disconnect(node, "Compressed event from unencrypted node %s", node->name);
+			slab_free(pkt);
+			return NULL;
+		}
+		out = node_decompress_body(node, pkt);
+		slab_free(pkt);
+		pkt = out;
+	}
+
+	return pkt;
+}
+
+/*
+ * Hand out the next event of the frame we're unpacking, or NULL
+ * once it's exhausted (or turns out to be garbage).
+ */
+static merlin_event *node_frame_next(merlin_node *node)
+{
+	merlin_event *frame = node->frame_in, *pkt;
+	struct merlin_frame_entry entry;
+	unsigned int left = frame->hdr.len - node->frame_in_offset;
+
+	if (!left) {
+		slab_free(frame);
+		node->frame_in = NULL;
+		return NULL;
+	}
+
+	if (left < sizeof(entry)) {
+		node_disconnect(node, "Truncated event in frame from %s", node->name);
+		return NULL;
+	}
+	memcpy(&entry, frame->body + node->frame_in_offset, sizeof(entry));
+	if (entry.len > left - sizeof(entry) || entry.type == FRAME_PACKET) {
+		node_disconnect(node, "Invalid event in frame from %s", node->name);
+		return NULL;
+	}
+
+	if (!(pkt = slab_alloc(&node->slab, HDR_SIZE + entry.len))) {
+		lerr("IOC: Failed to allocate %lu bytes for packet from '%s'", (unsigned long)(HDR_SIZE + entry.len), node->name);
+		return NULL;
+	}
+	memcpy(&pkt->hdr, &frame->hdr, HDR_SIZE);
+	pkt->hdr.type = entry.type;
+	pkt->hdr.code = entry.code;
+	pkt->hdr.selection = entry.selection;
+	pkt->hdr.len = entry.len;
+	memcpy(pkt->body, frame->body + node->frame_in_offset + sizeof(entry), entry.len);
+	node->frame_in_offset += sizeof(entry) + entry.len;
+
+	return pkt;
+}
+
+/*
+ * Nodes with the same object config number their hosts and services
+ * the same way we do, so they can send and take object ids
+ */
+static int node_same_objects(const merlin_node *node)
+{
+	return (node->info.capabilities & MERLIN_CAP_OBJECT_IDS) &&
+		!memcmp(node->info.config_hash, ipc.info.config_hash, sizeof(ipc.info.config_hash));
+}
+
+/* the object id of a name we send to such a node */
+static int node_object_id(int kind, const char *host_name, const char *service_description)
+{
+	struct host *h;
+	struct service *s;
+
+	if (kind == INTERN_SERVICE)
+		return (s = find_service(host_name, service_description)) ? (int)s->id : -1;
+	return (h = find_host(host_name)) ? (int)h->id : -1;
+}
+
+/* the object such a node has sent us the id of, if it's one we have */
+static void *node_find_object(int kind, uint32_t id, struct intern_names *names)
+{
+	if (kind == INTERN_SERVICE) {
+		if (id >= num_objects.services || !service_ary[id])
+			return NULL;
+		names->host_name = service_ary[id]->host_name;
+		names->service_description = service_ary[id]->description;
+		return service_ary[id];
+	}
+	if (id >= num_objects.hosts || !host_ary[id])
+		return NULL;
+	names->host_name = host_ary[id]->name;
+	return host_ary[id];
+}
+
+/* what a name a node has given us an id for stands for here */
+static void *node_intern_resolve(int kind, const char *host_name, const char *service_description)
+{
+	if (kind == INTERN_SERVICE)
+		return find_service(host_name, service_description);
+	return find_host(host_name);
+}
+
+/*
+ * Put the names back into an event with interned names, so it can
+ * be handled and passed on like any other, and note the host or
+ * service it's about in node->object. Returns the event, or NULL
+ * if it had to be dropped.
+ */
+static merlin_event *node_intern_expand(merlin_node *node, merlin_event *pkt)
+{
+	static intern_table *objects_in;
+	struct intern_names names;
+	intern_table *t;
+	merlin_event *out;
+	int len = -1;
+
+	/* object ids need no memory of the connection, so all nodes share a table */
+	if (pkt->hdr.code == MAGIC_OBJECT_IDS) {
+		if (!node_same_objects(node)) {
+			node_disconnect(node, "Object ids in %s event from %s, whose object config differs from ours",
+			                callback_name(pkt->hdr.type), node->name);
+			slab_free(pkt);
+			return NULL;
+		}
+		if (!objects_in)
+			objects_in = intern_create_numbered(NULL, node_find_object);
+		t = objects_in;
+	} else {
+		if (!node->intern_in)
+			node->intern_in = intern_create(node_intern_resolve);
+		t = node->intern_in;
+	}
+	if (t)
+		len = intern_lookup(t, pkt->hdr.type, pkt->body, pkt->hdr.len, &names);
+	if (len < 0 || HDR_SIZE + len > PKT_SIZE) {
+		node_disconnect(node, "Invalid interned names in %s event from %s",
+		                callback_name(pkt->hdr.type), node->name);
+		slab_free(pkt);
+		return NULL;
+	}
+
+	if (!(out = slab_alloc(&node->slab, HDR_SIZE + len))) {
+		lerr("IOC: Failed to allocate %lu bytes for packet from '%s'", (unsigned long)(HDR_SIZE + len), node->name);
+		slab_free(pkt);
+		return NULL;
+	}
+	memcpy(&out->hdr, &pkt->hdr, HDR_SIZE);
+	out->hdr.code = 0;
+	out->hdr.len = len;
+	intern_expand(pkt->hdr.type, pkt->body, pkt->hdr.len, &names, out->body);
+	slab_free(pkt);
+
+	node->object = names.object;
+	node->stats.intern.read++;
+	return out;
+}
+
+/*
+ * Put the state back into a delta, making it the interned event it
+ * was made from. Returns the event, or NULL if it had to be dropped.
+ */
+static merlin_event *node_delta_expand(merlin_node *node, merlin_event *pkt)
+{
+	const struct monitored_object_state *state;
+	int numbered = pkt->hdr.code == MAGIC_OBJECT_IDS_DELTA;
+	merlin_event *out;
+	int len = -1;
+
+	if (!node->delta_in)
+		node->delta_in = delta_create();
+	if (node->delta_in)
+		len = delta_lookup(node->delta_in, numbered, pkt->hdr.type, pkt->body, pkt->hdr.len, &state);
+	if (len < 0 || HDR_SIZE + len > PKT_SIZE) {
+		node_disconnect(node, "Invalid state delta in %s event from %s",
+		                callback_name(pkt->hdr.type), node->name);
+		slab_free(pkt);
+		return NULL;
+	}
+
+	if (!(out = slab_alloc(&node->slab, HDR_SIZE + len))) {
+		lerr("IOC: Failed to allocate %lu bytes for packet from '%s'", (unsigned long)(HDR_SIZE + len), node->name);
+		slab_free(pkt);
+		return NULL;
+	}
+	memcpy(&out->hdr, &pkt->hdr, HDR_SIZE);
+	out->hdr.code = numbered ? MAGIC_OBJECT_IDS : MAGIC_INTERNED;
+	out->hdr.len = len;
+	delta_expand(pkt->hdr.type, pkt->body, pkt->hdr.len, state, out->body);
+	slab_free(pkt);
+
+	node->stats.delta.read++;
+	return out;
+}
+
+/*
+ * Fetch one event from the node's iocache. If the cache is
+ * exhausted, we handle partial events and iocache resets and
+ * return NULL. Frames are unpacked and their events handed
+ * out one at a time.
+ * The event comes from the node's slab cache and must be
+ * released with slab_free() once handled.
+ */
+merlin_event *node_get_event(merlin_node *node)
+{
+	merlin_event *pkt;
+
+	for (;;) {
+		if (node->frame_in && (pkt = node_frame_next(node)))
+			break;
+		/* out of memory, so leave the rest of the frame for later */
+		if (node->frame_in)
+			return NULL;
+
+		if (!(pkt = node_read_event(node))) {
+			node_credit_grant(node);
+			return NULL;
+		}
+		if (pkt->hdr.type != CTRL_PACKET)
+			node->credit.read++;
+		if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_CREDIT) {
+			node_credit_update(node, pkt);
+			slab_free(pkt);
+			continue;
 		}
+		if (pkt->hdr.type != FRAME_PACKET)
+			break;
+
+		node->stats.frames.read++;
+		node->frame_in = pkt;
+		node->frame_in_offset = 0;
+	}
+
+	node->object = NULL;
+	if ((pkt->hdr.code == MAGIC_INTERNED_DELTA || pkt->hdr.code == MAGIC_OBJECT_IDS_DELTA) &&
+	    intern_type(pkt->hdr.type) && !(pkt = node_delta_expand(node, pkt)))
+	{
+		return NULL;
+	}
+	if ((pkt->hdr.code == MAGIC_INTERNED || pkt->hdr.code == MAGIC_OBJECT_IDS) &&
+	    intern_type(pkt->hdr.type) && !(pkt = node_intern_expand(node, pkt)))
+	{
+		return NULL;
 	}
+	node->stats.events.read++;
 
 	/* debug log these transitions */
 	if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_ACTIVE) {
@@ -1070,9 +2674,10 @@ merlin_event *node_get_event(merlin_node *node)
  * actions on the node itself in case sending fails.
  * Returns 0 on success, and < 0 otherwise.
  */
-int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
+int node_send_event(merlin_node *node, merlin_event *pkt)
 {
 	int result;
+	binlog *bl;
 
 	pkt->hdr.sig.id = MERLIN_SIGNATURE;
 	pkt->hdr.protocol = MERLIN_PROTOCOL_VERSION;
@@ -1085,24 +2690,33 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 	}
 
 	if (node->sock < 0 || node->state != STATE_CONNECTED) {
+		node_frame_flush(node);
 		return node_binlog_add(node, pkt);
 	}
 
+	/* if binlog has entries, we must send those first */
+	if (binlog_has_entries(node->binlog) || binlog_has_entries(node->prio_binlog))
+		node_send_binlog(node, pkt);
+
 	/*
-	 * msec less than zero means the caller has already polled the
-	 * socket, which should also mean it's connected
+	 * binlog may still have entries. If so, add to it and return.
+	 * Priority events only have to wait for the priority lane.
 	 */
-	if (msec >= 0 && !io_write_ok(node->sock, msec)) {
+	bl = node_binlog_lane(node, pkt);
+	if (binlog_has_entries(node->prio_binlog) || (bl == node->binlog && binlog_has_entries(node->binlog)))
 		return node_binlog_add(node, pkt);
-	}
 
-	/* if binlog has entries, we must send those first */
-	if (binlog_has_entries(node->binlog))
-		node_send_binlog(node, pkt);
-
-	/* binlog may still have entries. If so, add to it and return */
-	if (binlog_has_entries(node->binlog))
+	/* the node can't take any more right now */
+	if (pkt->hdr.type != CTRL_PACKET && node_credit_left(node) <= 0) {
+		node_frame_flush(node);
 		return node_binlog_add(node, pkt);
+	}
+
+	if (node_frame_ok(node, pkt) && !node_frame_add(node, pkt)) {
+		if (pkt->hdr.type < ARRAY_SIZE(node->stats.cb_count))
+			node->stats.cb_count[pkt->hdr.type].out++;
+		return 0;
+	}
 
 	result = node_send(node, pkt, packet_size(pkt), MSG_DONTWAIT);
 
@@ -1126,14 +2740,48 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 	return -1;
 }
 
-int node_send_binlog(merlin_node *node, merlin_event *pkt)
+/* wipe the backlog when the stream can no longer be kept in sync */
+static int node_drain_failed(merlin_node *node, merlin_event *pkt)
+{
+	if (node->drain_offset)
+		node_disconnect(node, "Backlog wiped with an event partially sent");
+	lerr("Wiping binlog for %s node %s", node_type(node), node->name);
+	node_binlog_wipe(node);
+	if (pkt) {
+		node->stats.events.dropped += node->stats.events.logged + 1;
+		node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
+	}
+	node_log_event_count(node, 0);
+	return -1;
+}
+
+/*
+ * True if we can send more to the node right now. The network
+ * thread takes anything up to binlog_outbuf_size KiB, while a
+ * socket of our own has to be writable and have nothing queued.
+ */
+static int node_writable(merlin_node *node)
+{
+	if (node->netconn)
+		return node_outbuf_pending(node) < binlog_outbuf_size * 1024;
+
+	return !node_outbuf_pending(node) && io_write_ok(node->sock, 0);
+}
+
+/*
+ * Send the backlog one event at a time. Encrypted nodes need this,
+ * since every event gets its own nonce and so must be copied anyway,
+ * and so do compressed ones, since each event goes through the
+ * compressor. So do nodes whose socket the network thread has,
+ * since we can't write to it ourselves.
+ */
+static int node_send_binlog_single(merlin_node *node, binlog *bl, merlin_event *pkt)
 {
 	merlin_event *temp_pkt;
 	unsigned int len;
 
-	ldebug("Emptying backlog for %s (%u entries, %s)", node->name,
-		   binlog_num_entries(node->binlog), human_bytes(binlog_available(node->binlog)));
-	while (io_write_ok(node->sock, 10) && !binlog_read(node->binlog, (void **)&temp_pkt, &len)) {
+	while (node_writable(node) && !binlog_peek(bl, (void **)&temp_pkt, &len))
+	{
 		int result;
 		if (!temp_pkt || packet_size(temp_pkt) != (int)len ||
 		    !len || !packet_size(temp_pkt) || packet_size(temp_pkt) > MAX_PKT_SIZE)
@@ -1145,9 +2793,11 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 			}
 			lerr("BACKLOG: binlog claims the data length is %u", len);
 			lerr("BACKLOG: wiping backlog. %s is now out of sync", node->name);
-			binlog_wipe(node->binlog, BINLOG_UNLINK);
+			node_binlog_wipe(node);
 			return -1;
 		}
+		if (temp_pkt->hdr.type != CTRL_PACKET && node_credit_left(node) <= 0)
+			return 0;
 		errno = 0;
 		result = node_send(node, temp_pkt, packet_size(temp_pkt), MSG_DONTWAIT);
 
@@ -1156,51 +2806,170 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 			node->stats.events.sent++;
 			node->stats.events.logged--;
 			node->stats.bytes.logged -= packet_size(temp_pkt);
+			node->stats.drain.events++;
+			node->stats.drain.bytes += packet_size(temp_pkt);
 
-			/*
-			 * binlog duplicates the memory, so we must release it
-			 * when we've sent and counted it
-			 */
-			free(temp_pkt);
+			/* temp_pkt is only borrowed, so drop it from the binlog */
+			if (bl == node->binlog)
+				node_lanes_remove(node, temp_pkt);
+			binlog_consume(bl);
 			continue;
 		}
 
-		if (result == BINLOG_EMPTY || !binlog_num_entries(node->binlog))
-			binlog_wipe(node->binlog, BINLOG_UNLINK);
+		/*
+		 * total failures leave the entry in the binlog, and the
+		 * caller will add the new event after it in the hopes
+		 * that we'll get a connection up and running again
+		 * before it's time to send more data to this node
+		 */
+		if (result <= 0)
+			return 0;
 
 		/*
-		 * we can recover from total failures by unread()'ing
-		 * the entry we just read and then adding the new entry
-		 * to the binlog in the hopes that we'll get a
-		 * connection up and running again before it's time to
-		 * send more data to this node
+		 * we wrote a partial event, so this node is now out of
+		 * sync. We must wipe the binlog and possibly mark this
+		 * node as being out of sync.
 		 */
-		if (result <= 0) {
-			if (!binlog_unread(node->binlog, temp_pkt, len)) {
-				if (pkt)
-					return node_binlog_add(node, pkt);
-				return 0;
-			} else {
-				free(temp_pkt);
+		return node_drain_failed(node, pkt);
+	}
+
+	return 0;
+}
+
+/*
+ * Send as much of the backlog as the socket buffer will take, in
+ * batches of one sendmsg() each. If the socket only takes part of
+ * an event we remember how much of it was sent and pick up from
+ * there next time, so short writes don't cost us the backlog.
+ */
+static int node_send_binlog_vectored(merlin_node *node, binlog *bl, merlin_event *pkt)
+{
+	static unsigned char hdr[IOV_MAX / 2][HDR_SIZE];
+	struct iovec ent[IOV_MAX / 2], iov[IOV_MAX];
+	int sndbuf = 0;
+	socklen_t optlen = sizeof(sndbuf);
+
+	if (getsockopt(node->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0 || sndbuf <= 0)
+		sndbuf = MAX_PKT_SIZE;
+
+	for (;;) {
+		unsigned int offset = node->drain_offset;
+		int64_t credit = node_credit_left(node);
+		int i, n;
+		ssize_t sent;
+
+		n = binlog_peekv(bl, ent, ARRAY_SIZE(ent), sndbuf);
+		if (n == BINLOG_EMPTY)
+			return 0;
+		if (n < 0)
+			return node_drain_failed(node, pkt);
+
+		/* each event goes out as its header and its body */
+		for (i = 0; i < n; i++) {
+			merlin_event *temp_pkt = ent[i].iov_base;
+
+			if (packet_size(temp_pkt) != (int)ent[i].iov_len || ent[i].iov_len < HDR_SIZE ||
+			    packet_size(temp_pkt) > MAX_PKT_SIZE)
+			{
+				lerr("BACKLOG: binlog returned a packet claiming to be of size %d", packet_size(temp_pkt));
+				lerr("BACKLOG: binlog claims the data length is %zu", ent[i].iov_len);
+				lerr("BACKLOG: wiping backlog. %s is now out of sync", node->name);
+				return node_drain_failed(node, pkt);
 			}
+			/* a half-sent event has credit, since it's only counted once it's sent */
+			if (temp_pkt->hdr.type != CTRL_PACKET && credit-- <= 0 && !(i == 0 && offset))
+				break;
+			node_wire_iov(node, temp_pkt, hdr[i], &iov[i * 2]);
 		}
+		if (!(n = i))
+			return 0;
 
-		/*
-		 * we wrote a partial event or failed to unread the event,
-		 * so this node is now out of sync. We must wipe the binlog
-		 * and possibly mark this node as being out of sync.
-		 */
-		lerr("Wiping binlog for %s node %s", node_type(node), node->name);
-		binlog_wipe(node->binlog, BINLOG_UNLINK);
-		if (pkt) {
-			node->stats.events.dropped += node->stats.events.logged + 1;
-			node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
+		/* the start of a half-sent event is already on its way */
+		if (offset >= iov[0].iov_len) {
+			iov[1].iov_base = (char *)iov[1].iov_base + offset - iov[0].iov_len;
+			iov[1].iov_len -= offset - iov[0].iov_len;
+			iov[0].iov_len = 0;
+		} else {
+			iov[0].iov_base = (char *)iov[0].iov_base + offset;
+			iov[0].iov_len -= offset;
 		}
-		node_log_event_count(node, 0);
-		return -1;
+
+		sent = io_sendv(node->sock, iov, n * 2);
+		if (sent < 0) {
+			node_disconnect(node, "Failed to send backlog: %s", strerror(errno));
+			return 0;
+		}
+		if (!sent)
+			return 0;
+
+		node->stats.bytes.sent += sent;
+		node->stats.drain.bytes += sent;
+		node->stats.drain.batches++;
+		node->last_action = node->last_sent = time(NULL);
+
+		for (i = 0; i < n && sent > 0; i++) {
+			size_t left = iov[i * 2].iov_len + iov[i * 2 + 1].iov_len;
+
+			if ((size_t)sent < left) {
+				node->drain_offset += sent;
+				node->drain_binlog = bl;
+				return 0;
+			}
+			sent -= left;
+			node->drain_offset = 0;
+			node->stats.events.sent++;
+			node_credit_use(node, ent[i].iov_base);
+			node->stats.events.logged--;
+			node->stats.bytes.logged -= ent[i].iov_len;
+			node->stats.drain.events++;
+			if (bl == node->binlog)
+				node_lanes_remove(node, ent[i].iov_base);
+			binlog_consume(bl);
+		}
+
+		/* the socket buffer is full, so try again later */
+		if (i < n)
+			return 0;
 	}
+}
 
-	return 0;
+/* send what we can from one lane of the backlog */
+static int node_send_lane(merlin_node *node, binlog *bl, merlin_event *pkt)
+{
+	if (!binlog_has_entries(bl))
+		return 0;
+
+	/* the rest of an event half-sent from the other lane goes first */
+	if (node->drain_offset && node->drain_binlog != bl && node_send_binlog_rest(node) < 0)
+		return 0;
+
+	if (node->encrypted || node->zout || node->netconn)
+		return node_send_binlog_single(node, bl, pkt);
+	return node_send_binlog_vectored(node, bl, pkt);
+}
+
+int node_send_binlog(merlin_node *node, merlin_event *pkt)
+{
+	struct timeval start, stop;
+	int result;
+
+	ldebug("Emptying backlog for %s (%u entries, %s, %u priority entries)", node->name,
+		   binlog_num_entries(node->binlog), human_bytes(binlog_available(node->binlog)),
+		   binlog_num_entries(node->prio_binlog));
+
+	/* whatever's in the output buffer was sent before anything in the backlog */
+	if (node_flush(node))
+		return 0;
+
+	gettimeofday(&start, NULL);
+	/* the bulk lane only gets a go once the priority lane is empty */
+	result = node_send_lane(node, node->prio_binlog, pkt);
+	if (!result && node->sock >= 0 && !binlog_has_entries(node->prio_binlog))
+		result = node_send_lane(node, node->binlog, pkt);
+	gettimeofday(&stop, NULL);
+	node->stats.drain.usecs += (stop.tv_sec - start.tv_sec) * 1000000 + (stop.tv_usec - start.tv_usec);
+
+	return result;
 }
 
 /*
@@ -1235,9 +3004,24 @@ int node_ctrl(merlin_node *node, int code, uint selection, void *data,
 	if (data)
 		memcpy(&pkt.body, data, len);
 
+	/* each connection to an encrypted node gets a session of its own */
+	if (code == CTRL_ACTIVE && node->encrypted && len >= sizeof(merlin_nodeinfo) &&
+	    seq_session(node, (merlin_nodeinfo *)pkt.body) < 0)
+	{
+		return -1;
+	}
+
 	return node_send(node, &pkt, packet_size(&pkt), MSG_DONTWAIT);
 }
 
+/* the protocol version to use with a node that sent us "pkt" */
+static int node_protocol(const merlin_event *pkt)
+{
+	if (pkt->hdr.protocol < MERLIN_PROTOCOL_VERSION)
+		return pkt->hdr.protocol;
+	return MERLIN_PROTOCOL_VERSION;
+}
+
 /*
  * Checks a node for compatibility once it has sent its
  * nodeinfo data (a CTRL_ACTIVE packet).
@@ -1264,7 +3048,7 @@ int node_compat_cmp(const merlin_node *node, const merlin_event *pkt)
 	 */
 	if (len < MERLIN_NODEINFO_MINSIZE) {
 		lerr("FATAL: %s: incompatible nodeinfo body size %d. Ours is %d. Required: %d",
-			 node->name, len, sizeof(node->info), MERLIN_NODEINFO_MINSIZE);
+			 node->name, len, sizeof(node->info), (int)MERLIN_NODEINFO_MINSIZE);
 		lerr("FATAL: Completely incompatible");
 		return ESYNC_EPROTO;
 	}
@@ -1281,10 +3065,19 @@ int node_compat_cmp(const merlin_node *node, const merlin_event *pkt)
 		return ESYNC_EVERSION;
 	}
 
+	/*
+	 * The protocol version is in the header, so it can be bumped
+	 * without touching the nodeinfo. We talk the older of the two.
+	 */
+	if (node_protocol(pkt) < MERLIN_PROTOCOL_VERSION) {
+		ldebug("%s: speaks protocol version %d. Ours is %d. Using full headers",
+		       node->name, pkt->hdr.protocol, MERLIN_PROTOCOL_VERSION);
+	}
+
+	/* older nodes don't send capabilities, so they get none */
 	if (len < sizeof(node->info)) {
-		lwarn("%s: info-size too small (%d < %d), incompatible version?",
-		      node->name, len, sizeof(node->info));
-		return ESYNC_EVERSION;
+		ldebug("%s: info-size %d is smaller than ours (%d). Assuming it lacks the rest",
+		       node->name, len, sizeof(node->info));
 	}
 
 	if (info->word_size != COMPAT_WORDSIZE) {
@@ -1309,6 +3102,60 @@ int node_compat_cmp(const merlin_node *node, const merlin_event *pkt)
 	return 0;
 }
 
+/*
+ * Store the nodeinfo from a CTRL_ACTIVE packet that has passed
+ * node_compat_cmp(), along with the protocol version we've agreed
+ * on. Whatever an older node didn't send is zeroed.
+ */
+void node_set_info(merlin_node *node, const merlin_event *pkt)
+{
+	size_t len = pkt->hdr.len < sizeof(node->info) ? pkt->hdr.len : sizeof(node->info);
+	unsigned char session[MERLIN_SESSION_SIZE];
+
+	memcpy(session, node->info.session, sizeof(session));
+	memset(&node->info, 0, sizeof(node->info));
+	memcpy(&node->info, pkt->body, len);
+
+	/* a node only changes its session when it reconnects */
+	if (memcmp(session, node->info.session, sizeof(session)))
+		node->seq.sent = 0;
+
+	/* a half-sent backlog entry must be finished with the header it started with */
+	if (node->drain_offset && node_send_binlog_rest(node) < 0)
+		return;
+	node->protocol = node_protocol(pkt);
+	node_start_compression(node);
+
+	/*
+	 * ids are only good for the connection they're given on, while
+	 * object ids are good for as long as the object config is the same
+	 */
+	if (is_module && node != &ipc && (node->info.capabilities & MERLIN_CAP_INTERN)) {
+		int numbered = node_same_objects(node);
+
+		/* states are remembered by id, so they go with the ids */
+		if (node->intern_out && intern_numbered(node->intern_out) != numbered) {
+			intern_destroy(node->intern_out);
+			delta_destroy(node->delta_out);
+			node->intern_out = NULL;
+			node->delta_out = NULL;
+		}
+		if (!node->intern_out) {
+			node->intern_out = numbered ? intern_create_numbered(node_object_id, NULL) : intern_create(NULL);
+			if (!node->intern_out)
+				lerr("Failed to create intern table for %s. Sending names as they are", node->name);
+			else if (numbered)
+				ldebug("%s %s has our object config. Sending object ids", node_type(node), node->name);
+		}
+		if (state_deltas && node->intern_out && !node->delta_out &&
+		    (node->info.capabilities & MERLIN_CAP_DELTA) &&
+		    !(node->delta_out = delta_create()))
+		{
+			lerr("Failed to create delta table for %s. Sending full states", node->name);
+		}
+	}
+}
+
 /*
  * Compares merlin configuration (node config, basically)
  * and returns:
@@ -2,11 +2,14 @@
 #define INCLUDE_node_h__
 
 #include <sys/types.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <naemon/naemon.h>
 #include "cfgfile.h"
 #include "binlog.h"
+#include "slab.h"
+#include "zstream.h"
 #include "pgroup.h"
 #include <sodium.h>
 #include <stdbool.h>
@@ -17,7 +20,32 @@
 # define MERLIN_SIGNATURE (uint64_t)0x005456454e4c524dLL /* "MRLNEVT\0" */
 #endif
 
-#define MERLIN_PROTOCOL_VERSION 3
+#define MERLIN_PROTOCOL_VERSION 4
+
+/*
+ * From protocol version 4 on, nodes that have announced it in the
+ * header of their CTRL_ACTIVE get events with a compact header in
+ * place of the merlin_header. It starts with MERLIN_COMPACT_MAGIC,
+ * which never starts a merlin_header, so the two can be told apart
+ * on the wire. Then comes a byte of MERLIN_COMPACT_* flags, the
+ * type, code, selection, len and sent fields as varints and, for
+ * encrypted events, the authtag and nonce. The sender's UUID is
+ * only needed to tell who's connecting, so it's left out; the
+ * CTRL_ACTIVE that carries it always gets a full header.
+ * Encrypted data doesn't compress, so nodes that compress what they
+ * send to an encrypted node do it to each event's body before it's
+ * encrypted, making it a zstream block, and mark it with
+ * MERLIN_COMPACT_ZBODY. Only events with compact headers can be
+ * marked, so only those are compressed.
+ */
+#define MERLIN_PROTOCOL_COMPACT 4
+#define MERLIN_COMPACT_MAGIC 0xc4
+#define MERLIN_COMPACT_CRYPT (1 << 0) /* authtag and nonce follow */
+#define MERLIN_COMPACT_SEQ   (1 << 1) /* the nonce is the next counter nonce, so it's left out */
+#define MERLIN_COMPACT_ZBODY (1 << 2) /* the body is a zstream block, compressed before it was encrypted */
+/* magic, flags, 3 16-bit, 1 32-bit and 2 64-bit varints, crypto */
+#define MERLIN_COMPACT_HDR_MAX (2 + 3 * 3 + 5 + 2 * 10 + \
+	crypto_secretbox_MACBYTES + crypto_secretbox_NONCEBYTES)
 
 /*
  * flags for node options. Must be powers of 2
@@ -48,6 +76,7 @@
 #define ACK_PACKET    0xfffe  /* ACK ("I understood") (not used) */
 #define NAK_PACKET    0xfffd  /* NAK ("I don't understand") (not used) */
 #define RUNCMD_PACKET 0xfffc  /* Used from runcmd pkts for "test this" */
+#define FRAME_PACKET  0xfffb  /* several events under one header */
 
 /* If "type" is CTRL_PACKET, then "code" is one of the following */
 #define CTRL_GENERIC		0  /* generic control packet */
@@ -55,16 +84,22 @@
 #define CTRL_INACTIVE		2  /* signals that a slave went offline */
 #define CTRL_ACTIVE		3  /* signals that a slave went online */
 #define CTRL_PATHS		4  /* body contains paths to import */
-#define CTRL_STALL		5  /* (deprecated) signal that we can't accept events for a while */
-#define CTRL_RESUME		6  /* (deprecated) now we can accept events again */
+#define CTRL_STALL		5  /* (deprecated, see CTRL_CREDIT) signal that we can't accept events for a while */
+#define CTRL_RESUME		6  /* (deprecated, see CTRL_CREDIT) now we can accept events again */
 #define CTRL_STOP		7  /* exit() immediately (only accepted via ipc) */
 #define CTRL_INVALID_CLUSTER	8  /* signals to a node that it's cluster cfg is invalid */
 #define CTRL_FETCH		9  /* signals to remote node that it should do a mon fetch */
+#define CTRL_CREDIT		10 /* body is how many events the sender may have sent us */
+#define CTRL_RING		11 /* shared memory ring to merlind, see ipc.h (ipc only) */
 /* some margin for later CTRL commands */
 #define RUNCMD_CMD		20  /* Used for requesting a command to be run */
 #define RUNCMD_RESP		21  /* response of a command execution */
 /* the following magic entries can be used for the "code" entry */
 #define MAGIC_NONET 0xffff /* don't forward to the network */
+#define MAGIC_INTERNED 0xfffe /* names are swapped for ids, see intern.h */
+#define MAGIC_OBJECT_IDS 0xfffd /* names are swapped for object ids, see intern.h */
+#define MAGIC_INTERNED_DELTA 0xfffc /* MAGIC_INTERNED, with the state as a delta. See delta.h */
+#define MAGIC_OBJECT_IDS_DELTA 0xfffb /* MAGIC_OBJECT_IDS, with the state as a delta */
 
 /*
  * Mark "selection" with this to generate broadcast-ish
@@ -114,8 +149,41 @@ struct merlin_event {
 } __attribute__((packed));
 typedef struct merlin_event merlin_event;
 
+/*
+ * The body of a FRAME_PACKET is a sequence of events, each made up
+ * of this followed by the event's body. The rest of each event's
+ * header is taken from the frame's.
+ */
+struct merlin_frame_entry {
+	uint16_t type;
+	uint16_t code;
+	uint16_t selection;
+	uint16_t padding;
+	uint32_t len;
+} __attribute__((packed));
+
+/* largest frame body we build, and the largest event we put in one */
+#define MERLIN_FRAME_SIZE (64 << 10)
+#define MERLIN_FRAME_MAX_EVENT (MERLIN_FRAME_SIZE / 4)
+
+/*
+ * Nodes that both announce MERLIN_CAP_CREDIT only send each other
+ * as many events as the receiving end has granted with CTRL_CREDIT.
+ * Each end counts the non-control packets (a frame counts as one)
+ * sent or read since the connection came up, and the receiver grants
+ * another window's worth whenever it has processed half of the last
+ * one. Until the first grant comes in, the sender may send one window.
+ * Events we have no credit for wait in the backlog.
+ */
+#define MERLIN_CREDIT_WINDOW 1024
+
 /* forward declaration */
 struct merlin_node;
+struct node_lanes;
+struct node_outbuf;
+struct net_conn;
+struct intern_table;
+struct delta_table;
 typedef struct merlin_node merlin_node;
 
 
@@ -136,7 +204,28 @@ typedef struct merlin_node merlin_node;
 /* change this macro when nodeinfo is rearranged */
 #define MERLIN_NODEINFO_VERSION 1
  /* change this macro when the struct grows incompatibly */
-#define MERLIN_NODEINFO_MINSIZE sizeof(struct merlin_nodeinfo)
+#define MERLIN_NODEINFO_MINSIZE offsetof(struct merlin_nodeinfo, capabilities)
+
+/* capabilities a node announces in its nodeinfo */
+#define MERLIN_CAP_FRAMES (1 << 0) /* understands FRAME_PACKET */
+#define MERLIN_CAP_LZ4    (1 << 1) /* can decompress lz4 zstream blocks */
+#define MERLIN_CAP_ZSTD   (1 << 2) /* can decompress zstd zstream blocks */
+#define MERLIN_CAP_CREDIT (1 << 3) /* grants CTRL_CREDIT and waits for it */
+#define MERLIN_CAP_SEQNONCE (1 << 4) /* takes counter nonces, see MERLIN_SESSION_SIZE */
+#define MERLIN_CAP_INTERN (1 << 5) /* takes ids for host and service names, see intern.h */
+#define MERLIN_CAP_OBJECT_IDS (1 << 6) /* takes object ids from nodes with the same config */
+#define MERLIN_CAP_DELTA  (1 << 7) /* takes status updates as deltas, see delta.h */
+
+/*
+ * Encrypted nodes that announce MERLIN_CAP_SEQNONCE make up a random
+ * session for each connection and send it in the nodeinfo of their
+ * CTRL_ACTIVE. Everything encrypted for them from then on has that
+ * session as the start of its nonce, followed by a 64-bit counter
+ * that starts at 0 and goes up by one for each packet, so no nonce
+ * has to be drawn at random or sent along. A packet with any other
+ * nonce is a replay, whether from this connection or an earlier one.
+ */
+#define MERLIN_SESSION_SIZE (crypto_secretbox_NONCEBYTES - sizeof(uint64_t))
 struct merlin_nodeinfo {
 	uint32_t version;       /* version of this structure */
 	uint32_t word_size;     /* bits per register (sizeof(void *) * 8) */
@@ -155,6 +244,8 @@ struct merlin_nodeinfo {
 	uint32_t host_checks_handled;
 	uint32_t service_checks_handled;
 	uint32_t monitored_object_state_size;
+	uint32_t capabilities;  /* MERLIN_CAP_* bits. Zero from older nodes */
+	unsigned char session[MERLIN_SESSION_SIZE]; /* nonce prefix for what's sent to us */
 	/* new entries have to come LAST */
 } __attribute__((packed));
 typedef struct merlin_nodeinfo merlin_nodeinfo;
@@ -182,8 +273,28 @@ struct statistics_vars {
 struct callback_count {
 	unsigned int in, out;
 };
+struct drain_statistics {
+	unsigned long long events, bytes, batches, usecs;
+};
+struct frame_statistics {
+	unsigned long long sent, read;
+};
+struct compress_statistics {
+	unsigned long long raw, wire; /* bytes of the event stream, and on the wire */
+};
+struct intern_statistics {
+	unsigned long long sent, saved, read; /* events with interned names, and bytes saved sending them */
+};
+struct delta_statistics {
+	unsigned long long sent, saved, read; /* events sent as deltas, and bytes saved over interning alone */
+};
 struct merlin_node_stats {
 	struct statistics_vars events, bytes;
+	struct drain_statistics drain; /* backlog drained after reconnect */
+	struct frame_statistics frames; /* FRAME_PACKETs, not the events in them */
+	struct compress_statistics compress, decompress; /* of the byte stream, or of bodies if encrypted */
+	struct intern_statistics intern;
+	struct delta_statistics delta;
 	time_t last_logged;     /* when we logged the event-count last */
 	struct callback_count cb_count[NEBCALLBACK_NUMITEMS + 1];
 };
@@ -254,7 +365,38 @@ struct merlin_node {
 	merlin_nodeinfo expected; /* what we expect from this node (incomplete) */
 	int last_action;        /* LA_CONNECT | LA_DISCONNECT | LA_HANDLED */
 	binlog *binlog;         /* binary backlog for this node */
+	binlog *prio_binlog;    /* backlog lane that's sent before the one above */
+	struct node_lanes *lanes; /* which hosts have events in the binlog */
+	binlog *drain_binlog;   /* the backlog lane drain_offset refers to */
+	unsigned int drain_offset; /* bytes of the first binlog entry already sent */
+	struct node_outbuf *outbuf; /* data the socket hasn't taken yet */
+	struct net_conn *netconn; /* set while the network thread has the socket */
+	merlin_event *frame_out; /* events batched up for this node */
+	unsigned int frame_out_events; /* how many, 0 when there's nothing batched */
+	merlin_event *frame_in;  /* frame received events are handed out from */
+	unsigned int frame_in_offset; /* where in frame_in's body the next event is */
+	int protocol;           /* protocol version agreed on, 0 until negotiated */
+	int compression;        /* BINLOG_COMPRESS_* method to send with, if the node can take it */
+	zstream *zout;          /* compresses what we send, once negotiated */
+	zstream *zin;           /* decompresses what we read, once the node starts compressing */
+	zstream *zbody_in;      /* decompresses the event bodies an encrypted node compresses */
+	struct {
+		uint64_t sent, limit;   /* events sent, and the most the node has let us send */
+		uint64_t read, granted; /* events read, and the most we've let the node send */
+	} credit;               /* flow control, see MERLIN_CREDIT_WINDOW */
+	struct {
+		unsigned char session[MERLIN_SESSION_SIZE]; /* what we told the node to use */
+		uint64_t next;          /* counter of the next packet we'll accept */
+		uint64_t sent;          /* counter of the next packet we send */
+		int seen;               /* the node has started using our session */
+	} seq;                  /* counter nonces, see MERLIN_CAP_SEQNONCE */
+	struct intern_table *intern_out; /* ids we've given names sent to the node */
+	struct intern_table *intern_in;  /* what the ids the node sends us stand for */
+	struct delta_table *delta_out;   /* object states last sent to the node */
+	struct delta_table *delta_in;    /* object states last received from it */
+	void *object;           /* host or service the event last read is about, if known */
 	merlin_node_stats stats; /* event/data statistics */
+	slab_cache slab;        /* buffers for events read from or sent to this node */
 	nm_bufferqueue *bq;     /* I/O cache for bulk reads */
 	merlin_confsync csync; /* config synchronization configuration */
 	unsigned int csync_num_attempts;
@@ -302,8 +444,16 @@ extern void node_grok_config(struct cfg_comp *config);
 extern void node_log_event_count(merlin_node *node, int force);
 extern void node_disconnect(merlin_node *node, const char *fmt, ...);
 extern int node_send(merlin_node *node, void *data, unsigned int len, int flags);
-extern int node_send_event(merlin_node *node, merlin_event *pkt, int msec);
+extern int node_send_event(merlin_node *node, merlin_event *pkt);
+extern int node_flush(merlin_node *node);
+extern int node_frame_flush(merlin_node *node);
+extern void node_set_info(merlin_node *node, const merlin_event *pkt);
+extern int node_output(merlin_node *node);
+extern int node_wants_output(const merlin_node *node);
+extern size_t node_outbuf_pending(const merlin_node *node);
 extern int node_recv(merlin_node *node);
+extern int node_feed(merlin_node *node, const void *buf, size_t len);
+extern int node_thread_attach(merlin_node *node);
 extern merlin_event *node_get_event(merlin_node *node);
 extern int node_send_binlog(merlin_node *node, merlin_event *pkt);
 extern const char *node_state(const merlin_node *node);
@@ -0,0 +1,215 @@
+/*
+ * performance data parsed where the check ran
+ *
+ * Performance data used to travel as the text the plugin printed,
+ * to be parsed again by whatever wanted the numbers, usually once
+ * per result on a master that takes results from every poller. The
+ * node that ran the check has to look at the text anyway, so it
+ * parses it once and sends the numbers along in a trailer.
+ *
+ * Labels and units are kept as strings rather than ids, since the
+ * ends of a connection don't share a table of them. Each trailer
+ * has each of them only once though, so a value takes up its fixed
+ * size and little more.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "perfdata.h"
+
+int binary_perfdata;
+
+struct perfdata_strings {
+	char buf[PERFDATA_MAX_STRINGS];
+	uint32_t len;
+};
+
+/* the offset of a string among the trailer's, adding it if need be, or -1 */
+static int perfdata_add_string(struct perfdata_strings *s, const char *str, uint32_t n)
+{
+	uint32_t off, slen;
+
+	for (off = 0; off < s->len; off += slen + 1) {
+		slen = strlen(s->buf + off);
+		if (slen == n && !memcmp(s->buf + off, str, n))
+			return off;
+	}
+	if (s->len + n + 1 > sizeof(s->buf))
+		return -1;
+	memcpy(s->buf + s->len, str, n);
+	s->buf[s->len + n] = 0;
+	off = s->len;
+	s->len += n + 1;
+	return off;
+}
+
+/* parse a limit that ends at ';' or a space, setting flag if it's a number */
+static const char *perfdata_limit(const char *p, double *val, uint16_t *flags, uint16_t flag)
+{
+	const char *end = p;
+	char *num_end;
+	double d;
+
+	while (*end && *end != ';' && !isspace((unsigned char)*end))
+		end++;
+	if (end > p) {
+		d = strtod(p, &num_end);
+		/* ranges such as "10:20" and "@5" aren't numbers */
+		if (num_end == end && isfinite(d)) {
+			*val = d;
+			*flags |= flag;
+		}
+	}
+	return end;
+}
+
+/*
+ * Parse the performance data the way the plugin guidelines have it:
+ * 'label'=value[UOM];[warn];[crit];[min];[max], separated by spaces.
+ * Values that aren't numbers, such as "U", are left out, and so are
+ * limits that are ranges rather than numbers.
+ */
+static unsigned int perfdata_parse(const char *p, struct perfdata_value *values,
+                                   struct perfdata_strings *s)
+{
+	unsigned int num = 0;
+
+	while (p && *p && num < PERFDATA_MAX_VALUES) {
+		struct perfdata_value *v = &values[num];
+		char label[256];
+		uint32_t label_len = 0;
+		const char *uom;
+		char *end;
+		int off;
+
+		while (isspace((unsigned char)*p))
+			p++;
+		if (!*p)
+			break;
+
+		if (*p == '\'') {
+			/* quoted labels have '' for a quote */
+			for (p++; *p; p++) {
+				if (*p == '\'' && *++p != '\'')
+					break;
+				if (label_len < sizeof(label))
+					label[label_len++] = *p;
+			}
+		} else {
+			for (; *p && *p != '=' && !isspace((unsigned char)*p); p++) {
+				if (label_len < sizeof(label))
+					label[label_len++] = *p;
+			}
+		}
+
+		memset(v, 0, sizeof(*v));
+		if (*p != '=' || !label_len || label_len == sizeof(label))
+			goto skip;
+		v->value = strtod(++p, &end);
+		if (end == p || !isfinite(v->value))
+			goto skip;
+		for (uom = p = end; *p && *p != ';' && !isspace((unsigned char)*p); p++)
+			;
+		if ((off = perfdata_add_string(s, label, label_len)) < 0)
+			break;
+		v->label = off;
+		if ((off = perfdata_add_string(s, uom, p - uom)) < 0)
+			break;
+		v->uom = off;
+
+		if (*p == ';')
+			p = perfdata_limit(p + 1, &v->warn, &v->flags, PERFDATA_WARN);
+		if (*p == ';')
+			p = perfdata_limit(p + 1, &v->crit, &v->flags, PERFDATA_CRIT);
+		if (*p == ';')
+			p = perfdata_limit(p + 1, &v->min, &v->flags, PERFDATA_MIN);
+		if (*p == ';')
+			p = perfdata_limit(p + 1, &v->max, &v->flags, PERFDATA_MAX);
+		num++;
+
+	skip:
+		while (*p && !isspace((unsigned char)*p))
+			p++;
+	}
+
+	return num;
+}
+
+uint32_t perfdata_encode(const char *perf_data, char *out, uint32_t room)
+{
+	struct perfdata_value values[PERFDATA_MAX_VALUES];
+	struct perfdata_strings s;
+	struct perfdata_trailer t;
+	uint32_t offset, end;
+	unsigned int num;
+
+	s.len = 0;
+	if (!(num = perfdata_parse(perf_data, values, &s)))
+		return 0;
+
+	offset = num * sizeof(*values);
+	end = ((offset + s.len + 7) & ~7) + sizeof(t);
+	if (end > room)
+		return 0;
+
+	memcpy(out, values, offset);
+	memcpy(out + offset, s.buf, s.len);
+	offset += s.len;
+	memset(out + offset, 0, end - sizeof(t) - offset);
+
+	t.values = num;
+	t.strings = s.len;
+	t.len = end;
+	t.magic = PERFDATA_MAGIC;
+	memcpy(out + end - sizeof(t), &t, sizeof(t));
+	return end;
+}
+
+int perfdata_find(const char *body, uint32_t len, struct perfdata *pd)
+{
+	struct perfdata_trailer t;
+	struct perfdata_value v;
+	uint64_t need;
+	const char *start;
+	unsigned int i;
+
+	if (!body || len < sizeof(t))
+		return 0;
+	memcpy(&t, body + len - sizeof(t), sizeof(t));
+	if (t.magic != PERFDATA_MAGIC || t.len > len || t.len & 7)
+		return 0;
+
+	/* check it all, so a stray magic isn't taken for a trailer */
+	need = (uint64_t)t.values * sizeof(v) + t.strings;
+	if (!t.values || !t.strings || ((need + 7) & ~7) + sizeof(t) != t.len)
+		return 0;
+	start = body + len - t.len;
+	pd->values = start;
+	pd->num = t.values;
+	pd->strings = start + t.values * sizeof(v);
+	pd->strings_len = t.strings;
+	pd->len = t.len;
+	if (pd->strings[pd->strings_len - 1])
+		return 0;
+	for (i = 0; i < pd->num; i++) {
+		perfdata_get(pd, i, &v);
+		if (v.label >= pd->strings_len || v.uom >= pd->strings_len)
+			return 0;
+	}
+
+	return 1;
+}
+
+uint32_t perfdata_trailer_len(const char *body, uint32_t len)
+{
+	struct perfdata pd;
+
+	return perfdata_find(body, len, &pd) ? pd.len : 0;
+}
+
+void perfdata_get(const struct perfdata *pd, unsigned int i, struct perfdata_value *v)
+{
+	memcpy(v, pd->values + i * sizeof(*v), sizeof(*v));
+}
@@ -0,0 +1,112 @@
+#ifndef INCLUDE_perfdata_h
+#define INCLUDE_perfdata_h
+#include <stdint.h>
+
+/**
+ * @file perfdata.h
+ * @brief performance data parsed where the check ran
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * With binary_perfdata set, the module parses the performance data
+ * of the check results it sends and appends the numbers to the event
+ * as a trailer, so merlind and whatever else handles the event can
+ * use them without parsing the text. Events without a trailer are
+ * handled as they always were.
+ *
+ * The trailer follows the padded strings of the event. It is made up
+ * of an array of struct perfdata_value, the labels and units they
+ * refer to as nul-terminated strings, padding to 8 bytes and, last
+ * of all, a struct perfdata_trailer, which is how it's found. Events
+ * without a trailer end with a nul byte, which a trailer never does,
+ * and all of a trailer is checked before it's taken for one.
+ */
+#define PERFDATA_MAGIC 0x9e7fda7aU
+
+/* which of the limits of a value are set */
+#define PERFDATA_WARN (1 << 0)
+#define PERFDATA_CRIT (1 << 1)
+#define PERFDATA_MIN  (1 << 2)
+#define PERFDATA_MAX  (1 << 3)
+
+struct perfdata_value {
+	uint16_t label;   /* offset of the label among the trailer's strings */
+	uint16_t uom;     /* and of the unit of measurement, "" if there's none */
+	uint16_t flags;   /* PERFDATA_* bits for the limits that are set */
+	uint16_t padding;
+	double value;
+	double warn, crit, min, max; /* 0 unless set */
+};
+
+struct perfdata_trailer {
+	uint32_t values;  /* how many there are */
+	uint32_t strings; /* bytes of labels and units */
+	uint32_t len;     /* of the whole trailer, this included */
+	uint32_t magic;   /* PERFDATA_MAGIC */
+};
+
+/* how much a trailer holds, at most */
+#define PERFDATA_MAX_VALUES 256
+#define PERFDATA_MAX_STRINGS 8192
+#define PERFDATA_MAX_LEN (PERFDATA_MAX_VALUES * sizeof(struct perfdata_value) + \
+                          PERFDATA_MAX_STRINGS + sizeof(struct perfdata_trailer))
+
+/** the trailer of an event, as perfdata_find() finds it */
+struct perfdata {
+	const char *values;   /* may not be aligned, so use perfdata_get() */
+	unsigned int num;
+	const char *strings;
+	uint32_t strings_len;
+	uint32_t len;         /* of the whole trailer */
+};
+
+/** add a trailer to the check results we send */
+extern int binary_perfdata;
+
+/**
+ * Parse performance data into a trailer
+ * @param perf_data The performance data of a check result
+ * @param out Where to write the trailer
+ * @param room The room there is at out
+ * @return The length of the trailer, or 0 if there are no values
+ *         to be had or they don't fit
+ */
+extern uint32_t perfdata_encode(const char *perf_data, char *out, uint32_t room);
+
+/**
+ * Find the trailer of an encoded event
+ * @param body The event
+ * @param len Its length
+ * @param pd Filled in with where the trailer is
+ * @return 1 if the event has a trailer, 0 if not
+ */
+extern int perfdata_find(const char *body, uint32_t len, struct perfdata *pd);
+
+/**
+ * @param body An encoded event
+ * @param len Its length
+ * @return The length of its trailer, or 0 if it has none
+ */
+extern uint32_t perfdata_trailer_len(const char *body, uint32_t len);
+
+/**
+ * Get a value from a trailer
+ * @param pd The trailer
+ * @param i Which value, from 0 and up to pd->num
+ * @param v Where to put it
+ */
+extern void perfdata_get(const struct perfdata *pd, unsigned int i, struct perfdata_value *v);
+
+/**
+ * @param pd The trailer
+ * @param off The offset of a label or unit
+ * @return The label or unit
+ */
+static inline const char *perfdata_string(const struct perfdata *pd, uint16_t off)
+{
+	return pd->strings + off;
+}
+/** @} */
+#endif
@@ -565,7 +565,7 @@ int pgroup_send_event(merlin_peer_group *pg, merlin_event *pkt)
 
 	for (i = 0; i < pg->total_nodes; i++) {
 		merlin_node *node = pg->nodes[i];
-		ret |= node_send_event(node, pkt, 0);
+		ret |= node_send_event(node, pkt);
 	}
 
 	return ret;
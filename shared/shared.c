@@ -21,6 +21,12 @@ char *binlog_dir = NULL;
 bool binlog_persist = true;
 unsigned long long int binlog_max_memory_size = 500;
 unsigned long long int binlog_max_file_size = 5000;
+int binlog_compression = 0; /* BINLOG_COMPRESS_NONE */
+int binlog_compact = 0;
+int binlog_shared = 0;
+int binlog_sync_interval = 1;
+int binlog_priority = 1;
+unsigned long long int binlog_outbuf_size = 256;
 
 char *next_word(char *str)
 {
@@ -279,6 +285,8 @@ static const char *control_names[] = {
 	CTRL_ENTRY(STOP),
 	CTRL_ENTRY(INVALID_CLUSTER),
 	CTRL_ENTRY(FETCH),
+	CTRL_ENTRY(CREDIT),
+	CTRL_ENTRY(RING),
 };
 const char *ctrl_name(uint code)
 {
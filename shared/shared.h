@@ -59,6 +59,12 @@ extern bool binlog_persist;
 extern char *merlin_config_file;
 extern unsigned long long int binlog_max_memory_size;
 extern unsigned long long int binlog_max_file_size;
+extern int binlog_compression;
+extern int binlog_compact;
+extern int binlog_shared;
+extern int binlog_sync_interval;
+extern int binlog_priority;
+extern unsigned long long int binlog_outbuf_size;
 
 extern int use_database;
 
@@ -0,0 +1,272 @@
+/*
+ * single-producer, single-consumer ring in shared memory
+ *
+ * The file starts with a page holding struct shmring_hdr, followed
+ * by "size" bytes of entries. Each entry is a struct shmring_entry
+ * followed by the data, padded to 8 bytes. An entry that doesn't fit
+ * before the end of the ring is preceded by a SHMRING_WRAP entry that
+ * tells the consumer to start over at the beginning.
+ *
+ * "head" and "tail" count bytes ever put in and taken out, so the
+ * ring is empty when they're equal and never needs a wasted slot.
+ * Only the producer writes "head" and only the consumer "tail", and
+ * they live on cache lines of their own so the two ends don't keep
+ * stealing them from each other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+#define SHMRING_MAGIC 0x4d52494e /* "MRIN" */
+#define SHMRING_VERSION 1
+#define SHMRING_DATA 4096 /* offset of the entries in the file */
+#define SHMRING_WRAP 0xffffffff
+#define SHMRING_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+struct shmring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t sleeping __attribute__((aligned(64))); /* set by the consumer */
+	uint32_t blocked;                               /* set by the producer */
+};
+
+struct shmring_entry {
+	uint32_t len;
+	uint32_t pad;
+};
+
+struct shmring {
+	char *path;
+	struct shmring_hdr *hdr;
+	char *data;
+	size_t size;
+	size_t map_len;
+};
+
+static shmring *shmring_map(const char *path, int fd, size_t map_len)
+{
+	shmring *r;
+	void *map;
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (!(r = calloc(1, sizeof(*r))) || !(r->path = strdup(path))) {
+		free(r);
+		munmap(map, map_len);
+		return NULL;
+	}
+	r->hdr = map;
+	r->data = (char *)map + SHMRING_DATA;
+	r->size = map_len - SHMRING_DATA;
+	r->map_len = map_len;
+
+	return r;
+}
+
+shmring *shmring_create(const char *path, size_t size)
+{
+	shmring *r;
+	int fd;
+
+	size = SHMRING_ALIGN(size);
+	if (size < 4096) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/*
+	 * a new file rather than a truncated one, since a consumer
+	 * touching a mapping that's been truncated gets SIGBUS
+	 */
+	if (unlink(path) < 0 && errno != ENOENT)
+		return NULL;
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, SHMRING_DATA + size) < 0) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	if (!(r = shmring_map(path, fd, SHMRING_DATA + size))) {
+		unlink(path);
+		return NULL;
+	}
+	r->hdr->version = SHMRING_VERSION;
+	r->hdr->size = size;
+	__atomic_store_n(&r->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+	return r;
+}
+
+shmring *shmring_attach(const char *path)
+{
+	struct stat st;
+	shmring *r;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size <= SHMRING_DATA) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(r = shmring_map(path, fd, st.st_size)))
+		return NULL;
+	if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+	    r->hdr->version != SHMRING_VERSION || r->hdr->size != r->size ||
+	    r->size != SHMRING_ALIGN(r->size))
+	{
+		shmring_destroy(r, 0);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return r;
+}
+
+void shmring_destroy(shmring *r, int unlink_it)
+{
+	if (!r)
+		return;
+
+	if (unlink_it)
+		unlink(r->path);
+	munmap(r->hdr, r->map_len);
+	free(r->path);
+	free(r);
+}
+
+const char *shmring_path(shmring *r)
+{
+	return r->path;
+}
+
+size_t shmring_size(shmring *r)
+{
+	return r->size;
+}
+
+size_t shmring_used(shmring *r)
+{
+	return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+}
+
+int shmring_put(shmring *r, const void *buf, unsigned int len)
+{
+	uint64_t head = r->hdr->head;
+	uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+	size_t need = sizeof(struct shmring_entry) + SHMRING_ALIGN(len);
+	size_t off = head % r->size, skip = 0;
+	struct shmring_entry *e;
+
+	if (len == SHMRING_WRAP)
+		return -1;
+	if (off + need > r->size)
+		skip = r->size - off;
+	if (head + skip + need - tail > r->size)
+		return -1;
+
+	if (skip) {
+		e = (struct shmring_entry *)(r->data + off);
+		e->len = SHMRING_WRAP;
+		off = 0;
+	}
+	e = (struct shmring_entry *)(r->data + off);
+	e->len = len;
+	if (len)
+		memcpy(e + 1, buf, len);
+	__atomic_store_n(&r->hdr->head, head + skip + need, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int shmring_peek(shmring *r, void **buf, unsigned int *len)
+{
+	uint64_t tail = r->hdr->tail;
+	uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+	struct shmring_entry *e;
+	size_t off;
+
+	if (tail == head)
+		return -1;
+
+	off = tail % r->size;
+	e = (struct shmring_entry *)(r->data + off);
+	if (e->len == SHMRING_WRAP) {
+		tail += r->size - off;
+		__atomic_store_n(&r->hdr->tail, tail, __ATOMIC_RELEASE);
+		if (tail == head)
+			return -1;
+		e = (struct shmring_entry *)r->data;
+		off = 0;
+	}
+
+	/* the producer is the only one that can make a mess of it */
+	if (off + sizeof(*e) + SHMRING_ALIGN((size_t)e->len) > r->size ||
+	    tail + sizeof(*e) + SHMRING_ALIGN((size_t)e->len) > head)
+	{
+		return -1;
+	}
+
+	*buf = e + 1;
+	*len = e->len;
+	return 0;
+}
+
+void shmring_consume(shmring *r)
+{
+	uint64_t tail = r->hdr->tail;
+	struct shmring_entry *e = (struct shmring_entry *)(r->data + tail % r->size);
+
+	tail += sizeof(*e) + SHMRING_ALIGN((size_t)e->len);
+	__atomic_store_n(&r->hdr->tail, tail, __ATOMIC_RELEASE);
+}
+
+int shmring_sleep(shmring *r)
+{
+	__atomic_store_n(&r->hdr->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->hdr->head, __ATOMIC_SEQ_CST) != r->hdr->tail) {
+		__atomic_store_n(&r->hdr->sleeping, 0, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+int shmring_wake(shmring *r)
+{
+	/* the head stored by shmring_put() must be visible before we look */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&r->hdr->sleeping, __ATOMIC_RELAXED))
+		return 0;
+	return __atomic_exchange_n(&r->hdr->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+void shmring_block(shmring *r)
+{
+	__atomic_store_n(&r->hdr->blocked, 1, __ATOMIC_RELEASE);
+}
+
+int shmring_unblock(shmring *r)
+{
+	if (!__atomic_load_n(&r->hdr->blocked, __ATOMIC_ACQUIRE))
+		return 0;
+	return __atomic_exchange_n(&r->hdr->blocked, 0, __ATOMIC_ACQ_REL);
+}
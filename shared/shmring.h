@@ -0,0 +1,129 @@
+#ifndef INCLUDE_shmring_h
+#define INCLUDE_shmring_h
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file shmring.h
+ * @brief single-producer, single-consumer ring in shared memory
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * The ring is a file that both processes map. One of them (the
+ * module) creates it and puts entries in, and the other (merlind)
+ * attaches to it and takes them out in the same order. Entries are
+ * 8-byte aligned so the consumer can work on them in place, and stay
+ * put until they're consumed.
+ * Neither end ever waits for the other. A consumer that's about to
+ * go to sleep says so with shmring_sleep(), and the producer learns
+ * from shmring_wake() that it needs to wake it up, which lets a busy
+ * consumer go without wakeups altogether. A producer that found the
+ * ring full likewise marks it blocked, so the consumer knows to tell
+ * it once there's room again.
+ */
+struct shmring;
+typedef struct shmring shmring;
+
+/**
+ * Create a ring to put entries in. An existing file at path is
+ * replaced, without disturbing whoever might still have it mapped.
+ * @param path Where to create the ring
+ * @param size The number of bytes entries may take up
+ * @return The ring, or NULL on errors
+ */
+extern shmring *shmring_create(const char *path, size_t size);
+
+/**
+ * Attach to a ring created with shmring_create() to take entries
+ * out of it
+ * @param path The path of the ring
+ * @return The ring, or NULL if it couldn't be opened or isn't valid
+ */
+extern shmring *shmring_attach(const char *path);
+
+/**
+ * Unmap a ring. NULL is ignored.
+ * @param r The ring
+ * @param unlink_it 1 to also remove the file
+ */
+extern void shmring_destroy(shmring *r, int unlink_it);
+
+/**
+ * @param r The ring
+ * @return The path the ring was created at or attached to
+ */
+extern const char *shmring_path(shmring *r);
+
+/**
+ * @param r The ring
+ * @return The number of bytes entries may take up
+ */
+extern size_t shmring_size(shmring *r);
+
+/**
+ * @param r The ring
+ * @return The number of bytes taken up by entries not yet consumed
+ */
+extern size_t shmring_used(shmring *r);
+
+/**
+ * Put an entry in the ring (producer only)
+ * @param r The ring
+ * @param buf The data to put in
+ * @param len The length of the data
+ * @return 0 on success, -1 if there's no room for it
+ */
+extern int shmring_put(shmring *r, const void *buf, unsigned int len);
+
+/**
+ * Borrow the oldest entry in the ring (consumer only). The entry is
+ * 8-byte aligned and may be modified in place. It stays valid until
+ * it's consumed.
+ * @param r The ring
+ * @param buf Set to point to the entry
+ * @param len Set to the length of the entry
+ * @return 0 on success, -1 if the ring is empty or corrupt
+ */
+extern int shmring_peek(shmring *r, void **buf, unsigned int *len);
+
+/**
+ * Remove the entry returned by shmring_peek() (consumer only)
+ * @param r The ring
+ */
+extern void shmring_consume(shmring *r);
+
+/**
+ * Mark the consumer as sleeping (consumer only). Checks the ring
+ * once the mark is set, so a racing shmring_put() is never missed.
+ * @param r The ring
+ * @return 0 if the consumer may sleep, -1 if there are entries to take
+ */
+extern int shmring_sleep(shmring *r);
+
+/**
+ * Check if the consumer must be woken up (producer only). Called
+ * after putting entries in, and clears the mark set by shmring_sleep().
+ * @param r The ring
+ * @return 1 if the consumer was sleeping, 0 otherwise
+ */
+extern int shmring_wake(shmring *r);
+
+/**
+ * Mark the ring as blocked (producer only), after an entry didn't
+ * fit. A consumer that's busy draining the ring at the time may miss
+ * it, so the producer should also retry on its own now and then.
+ * @param r The ring
+ */
+extern void shmring_block(shmring *r);
+
+/**
+ * Check if the producer must be told there's room (consumer only).
+ * Clears the mark set by shmring_block().
+ * @param r The ring
+ * @return 1 if the producer was blocked, 0 otherwise
+ */
+extern int shmring_unblock(shmring *r);
+/** @} */
+#endif
@@ -0,0 +1,226 @@
+/*
+ * size-class allocator for merlin_event buffers
+ *
+ * Every event read from or encrypted for a node used to get a
+ * malloc()'d buffer of its own, which was freed again as soon as
+ * the event had been handled. With thousands of checks per second
+ * that's a lot of churn for the allocator, and a single 128KiB
+ * event is enough to get glibc to mmap() and munmap() behind our
+ * backs for each packet.
+ *
+ * Instead, each node gets a slab cache. Objects come in power-of-two
+ * size classes and are carved out of mmap()'d chunks, each with a
+ * freelist of its own. Each class keeps a list of the chunks that
+ * have room left and a single spare chunk, so a node that's busy
+ * recycles the same handful of buffers and one that isn't doesn't
+ * hold on to more than a chunk per size class it has used.
+ *
+ * Every object is preceded by a small header pointing at its chunk,
+ * which in turn points at its cache, so freeing only needs the
+ * pointer itself.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+struct slab_object {
+	struct slab_chunk *chunk;
+	union {
+		struct slab_object *next; /* while on a freelist */
+		size_t size;              /* while handed out */
+	} u;
+};
+
+#define OBJ_HDR_SIZE (sizeof(struct slab_object))
+#define CHUNK_HDR_SIZE ((sizeof(struct slab_chunk) + 63) & ~(size_t)63)
+#define class_size(cls) ((size_t)1 << ((cls) + SLAB_MIN_SHIFT))
+#define class_stride(cls) (OBJ_HDR_SIZE + class_size(cls))
+
+static unsigned int size_class(size_t size)
+{
+	unsigned int cls = 0;
+
+	while (cls < SLAB_CLASSES && class_size(cls) < size)
+		cls++;
+
+	return cls;
+}
+
+static void partial_add(struct slab_class *sc, struct slab_chunk *c)
+{
+	c->prev = NULL;
+	c->next = sc->partial;
+	if (sc->partial)
+		sc->partial->prev = c;
+	sc->partial = c;
+}
+
+static void partial_remove(struct slab_class *sc, struct slab_chunk *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		sc->partial = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	c->prev = c->next = NULL;
+}
+
+static void chunk_unmap(struct slab_chunk *c)
+{
+	struct slab_cache *cache = c->cache;
+
+	cache->stats.mapped -= c->size;
+	cache->stats.chunks--;
+	munmap(c, c->size);
+}
+
+static void chunk_reset(struct slab_chunk *c)
+{
+	c->free = NULL;
+	c->unused = (char *)c + CHUNK_HDR_SIZE;
+	c->used = 0;
+}
+
+static struct slab_chunk *chunk_create(slab_cache *cache, unsigned int cls)
+{
+	struct slab_chunk *c;
+	size_t size = SLAB_CHUNK_SIZE;
+
+	/* the larger classes get room for at least two objects */
+	if (size < CHUNK_HDR_SIZE + 2 * class_stride(cls))
+		size = CHUNK_HDR_SIZE + 2 * class_stride(cls);
+
+	c = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED)
+		return NULL;
+
+	c->cache = cache;
+	c->prev = c->next = NULL;
+	c->cls = cls;
+	c->total = (size - CHUNK_HDR_SIZE) / class_stride(cls);
+	c->size = size;
+	chunk_reset(c);
+	cache->stats.mapped += size;
+	cache->stats.chunks++;
+
+	return c;
+}
+
+static void *fallback_alloc(slab_cache *cache, size_t size)
+{
+	struct slab_object *obj;
+
+	if (!(obj = malloc(OBJ_HDR_SIZE + size)))
+		return NULL;
+
+	cache->fallback.cache = cache;
+	cache->fallback.cls = SLAB_CLASSES;
+	obj->chunk = &cache->fallback;
+	obj->u.size = size;
+	cache->stats.fallbacks++;
+	cache->stats.allocs++;
+	cache->stats.in_use += size;
+
+	return obj + 1;
+}
+
+void *slab_alloc(slab_cache *cache, size_t size)
+{
+	struct slab_class *sc;
+	struct slab_chunk *c;
+	struct slab_object *obj;
+	unsigned int cls;
+
+	cls = size_class(size);
+	if (cls >= SLAB_CLASSES)
+		return fallback_alloc(cache, size);
+
+	sc = &cache->class[cls];
+	if (!(c = sc->partial)) {
+		if ((c = sc->spare))
+			sc->spare = NULL;
+		else if (!(c = chunk_create(cache, cls)))
+			return fallback_alloc(cache, size);
+		partial_add(sc, c);
+	}
+
+	if ((obj = c->free)) {
+		c->free = obj->u.next;
+	} else {
+		obj = (struct slab_object *)c->unused;
+		c->unused += class_stride(cls);
+	}
+
+	/* full chunks are dropped from the list until something is freed */
+	if (++c->used == c->total)
+		partial_remove(sc, c);
+
+	obj->chunk = c;
+	obj->u.size = size;
+	cache->stats.allocs++;
+	cache->stats.in_use += size;
+
+	return obj + 1;
+}
+
+void slab_free(void *ptr)
+{
+	struct slab_object *obj;
+	struct slab_chunk *c;
+	struct slab_class *sc;
+	slab_cache *cache;
+
+	if (!ptr)
+		return;
+
+	obj = (struct slab_object *)ptr - 1;
+	c = obj->chunk;
+	cache = c->cache;
+	cache->stats.frees++;
+	cache->stats.in_use -= obj->u.size;
+
+	if (c == &cache->fallback) {
+		free(obj);
+		return;
+	}
+
+	sc = &cache->class[c->cls];
+	if (c->used-- == c->total)
+		partial_add(sc, c);
+
+	if (!c->used) {
+		partial_remove(sc, c);
+		if (sc->spare) {
+			chunk_unmap(c);
+		} else {
+			chunk_reset(c);
+			sc->spare = c;
+		}
+		return;
+	}
+
+	obj->u.next = c->free;
+	c->free = obj;
+}
+
+void slab_destroy(slab_cache *cache)
+{
+	unsigned int cls;
+
+	for (cls = 0; cls < SLAB_CLASSES; cls++) {
+		struct slab_class *sc = &cache->class[cls];
+
+		if (sc->spare) {
+			chunk_unmap(sc->spare);
+			sc->spare = NULL;
+		}
+	}
+}
+
+const struct slab_stats *slab_stats(const slab_cache *cache)
+{
+	return &cache->stats;
+}
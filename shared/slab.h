@@ -0,0 +1,93 @@
+#ifndef INCLUDE_slab_h
+#define INCLUDE_slab_h
+#include <stddef.h>
+
+/**
+ * @file slab.h
+ * @brief size-class allocator for merlin_event buffers
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * Objects are handed out from power-of-two size classes, from
+ * 1 << SLAB_MIN_SHIFT to 1 << SLAB_MAX_SHIFT bytes, so the largest
+ * class fits a full merlin_event. Each class carves its objects out
+ * of mmap()'d chunks of at least SLAB_CHUNK_SIZE bytes and recycles
+ * them through a per-chunk freelist, so a steady stream of events
+ * never touches malloc(). Anything larger than the largest class is
+ * passed on to malloc().
+ *
+ * A cache isn't thread safe. It's meant to be embedded in whatever
+ * owns the buffers (each merlin_node has one) and is ready for use
+ * when zeroed.
+ */
+#define SLAB_MIN_SHIFT 9
+#define SLAB_MAX_SHIFT 18
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_CHUNK_SIZE (64 << 10)
+
+struct slab_cache;
+
+/** a run of objects from one size class, or the malloc() fallback */
+struct slab_chunk {
+	struct slab_cache *cache;
+	struct slab_chunk *prev, *next; /* chunks with free objects */
+	struct slab_object *free;       /* objects returned to this chunk */
+	char *unused;                   /* objects never handed out */
+	unsigned int cls;               /* size class, or SLAB_CLASSES */
+	unsigned int used, total;       /* objects handed out / fitting */
+	size_t size;                    /* bytes mapped */
+};
+
+struct slab_class {
+	struct slab_chunk *partial; /* chunks with free objects */
+	struct slab_chunk *spare;   /* one empty chunk kept around */
+};
+
+struct slab_stats {
+	unsigned long long int allocs;    /* objects handed out */
+	unsigned long long int frees;     /* objects returned */
+	unsigned long long int fallbacks; /* allocations passed on to malloc() */
+	size_t in_use;                    /* bytes requested and not yet freed */
+	size_t mapped;                    /* bytes mapped for chunks */
+	unsigned int chunks;              /* chunks currently mapped */
+};
+
+struct slab_cache {
+	struct slab_class class[SLAB_CLASSES];
+	struct slab_chunk fallback;
+	struct slab_stats stats;
+};
+typedef struct slab_cache slab_cache;
+
+/**
+ * Allocate size bytes from the cache. The memory isn't zeroed.
+ * @param cache The cache to allocate from
+ * @param size The number of bytes wanted
+ * @return A pointer to the memory, or NULL if it couldn't be had
+ */
+extern void *slab_alloc(slab_cache *cache, size_t size);
+
+/**
+ * Return memory from slab_alloc() to the cache it came from.
+ * @param ptr The memory to free. NULL is ignored.
+ */
+extern void slab_free(void *ptr);
+
+/**
+ * Unmap all chunks of a cache that have no objects handed out.
+ * Chunks with objects still in use stay around until those are
+ * freed, so this is safe to call at any time.
+ * @param cache The cache to shrink
+ */
+extern void slab_destroy(slab_cache *cache);
+
+/**
+ * Get allocation statistics for a cache
+ * @param cache The cache
+ * @return The cache's statistics
+ */
+extern const struct slab_stats *slab_stats(const slab_cache *cache);
+/** @} */
+#endif
@@ -0,0 +1,303 @@
+/*
+ * streaming compression of node connections
+ *
+ * Compression works on the byte stream of a connection rather than
+ * on each event, so it gets to see everything sent before. That's
+ * what makes it worth doing for the chatty, repetitive traffic of a
+ * poller, where a single check result has little to compress on its
+ * own. Each call to zstream_compress() turns into a self-contained
+ * block on the wire (see struct zstream_block), so nothing is held
+ * back waiting for more data and the receiving end can decompress
+ * whatever blocks it has in full.
+ *
+ * Encrypted connections don't compress, so there each event's body is
+ * compressed into a block of its own before it's encrypted, with the
+ * same stream for all of them.
+ *
+ * zstd keeps its history across flushes by itself. LZ4's block API
+ * needs the last 64KiB of the stream as a dictionary, which both
+ * ends keep a copy of.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#ifdef HAVE_LIBLZ4
+# include <lz4.h>
+#endif
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+#endif
+#include "binlog.h"
+#include "zstream.h"
+
+#define LZ4_DICT_SIZE (64 << 10)
+
+struct zstream {
+	int method;
+	int decompress;
+	char *in;            /* gathered input, or a partial block read */
+	size_t in_len;       /* bytes in "in" (decompression only) */
+	char *out;           /* the block built, or the data it held */
+	size_t out_size;
+	char *dict;          /* the last LZ4_DICT_SIZE bytes of the stream */
+	int dict_len;
+	void *ctx;           /* LZ4_stream_t, the dictionary, ZSTD_CCtx or ZSTD_DCtx */
+};
+
+static size_t zstream_bound(int method, size_t len)
+{
+	switch (method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+	}
+	return 0;
+}
+
+int zstream_supported(int method)
+{
+	return zstream_bound(method, 1) > 0;
+}
+
+zstream *zstream_create(int method, int decompress)
+{
+	zstream *z;
+	size_t bound = zstream_bound(method, ZSTREAM_BLOCK_MAX);
+
+	if (!bound || !(z = calloc(1, sizeof(*z))))
+		return NULL;
+
+	z->method = method;
+	z->decompress = decompress;
+	z->out_size = decompress ? ZSTREAM_BLOCK_MAX : sizeof(struct zstream_block) + bound;
+	z->in = malloc(decompress ? sizeof(struct zstream_block) + bound : ZSTREAM_BLOCK_MAX);
+	z->out = malloc(z->out_size);
+
+	switch (method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		/* decompression only needs the dictionary */
+		if ((z->dict = malloc(LZ4_DICT_SIZE)))
+			z->ctx = decompress ? (void *)z->dict : (void *)LZ4_createStream();
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD:
+		if (!decompress) {
+			if ((z->ctx = ZSTD_createCCtx()))
+				ZSTD_CCtx_setParameter(z->ctx, ZSTD_c_compressionLevel, 1);
+		} else {
+			z->ctx = ZSTD_createDCtx();
+		}
+		break;
+#endif
+	}
+
+	if (!z->in || !z->out || !z->ctx) {
+		zstream_destroy(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+void zstream_destroy(zstream *z)
+{
+	if (!z)
+		return;
+
+	switch (z->method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		if (!z->decompress && z->ctx)
+			LZ4_freeStream(z->ctx);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD:
+		if (z->decompress)
+			ZSTD_freeDCtx(z->ctx);
+		else
+			ZSTD_freeCCtx(z->ctx);
+		break;
+#endif
+	}
+	free(z->dict);
+	free(z->in);
+	free(z->out);
+	free(z);
+}
+
+#ifdef HAVE_LIBLZ4
+/* remember the tail of what's been decompressed for the next block */
+static void lz4_keep_history(zstream *z, const char *data, int len)
+{
+	if (len >= LZ4_DICT_SIZE) {
+		memcpy(z->dict, data + len - LZ4_DICT_SIZE, LZ4_DICT_SIZE);
+		z->dict_len = LZ4_DICT_SIZE;
+		return;
+	}
+	if (z->dict_len + len > LZ4_DICT_SIZE) {
+		int drop = z->dict_len + len - LZ4_DICT_SIZE;
+		memmove(z->dict, z->dict + drop, z->dict_len - drop);
+		z->dict_len -= drop;
+	}
+	memcpy(z->dict + z->dict_len, data, len);
+	z->dict_len += len;
+}
+#endif
+
+/* returns the compressed size, or 0 on errors */
+static size_t compress_block(zstream *z, const char *src, size_t len, char *dst, size_t dst_len)
+{
+	switch (z->method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4: {
+		int ret = LZ4_compress_fast_continue(z->ctx, src, dst, len, dst_len, 1);
+
+		/* "src" gets reused, so the dictionary can't point into it */
+		if (ret > 0)
+			LZ4_saveDict(z->ctx, z->dict, LZ4_DICT_SIZE);
+		return ret > 0 ? (size_t)ret : 0;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD: {
+		ZSTD_inBuffer in = { src, len, 0 };
+		ZSTD_outBuffer out = { dst, dst_len, 0 };
+		size_t ret;
+
+		/* flushing makes all of it decompressible from this block on */
+		do {
+			ret = ZSTD_compressStream2(z->ctx, &out, &in, ZSTD_e_flush);
+			if (ZSTD_isError(ret))
+				return 0;
+		} while (ret && out.pos < out.size);
+		return ret ? 0 : out.pos;
+		}
+#endif
+	}
+	return 0;
+}
+
+/* returns 0 if exactly "len" bytes were restored, -1 otherwise */
+static int decompress_block(zstream *z, const char *src, size_t zlen, char *dst, size_t len)
+{
+	switch (z->method) {
+#ifdef HAVE_LIBLZ4
+	case BINLOG_COMPRESS_LZ4:
+		if (LZ4_decompress_safe_usingDict(src, dst, zlen, len, z->dict, z->dict_len) != (int)len)
+			return -1;
+		lz4_keep_history(z, dst, len);
+		return 0;
+#endif
+#ifdef HAVE_LIBZSTD
+	case BINLOG_COMPRESS_ZSTD: {
+		ZSTD_inBuffer in = { src, zlen, 0 };
+		ZSTD_outBuffer out = { dst, len, 0 };
+
+		while (in.pos < in.size) {
+			size_t prev = out.pos, ret = ZSTD_decompressStream(z->ctx, &out, &in);
+			if (ZSTD_isError(ret) || (out.pos == prev && out.pos == out.size))
+				return -1;
+		}
+		return out.pos == len ? 0 : -1;
+		}
+#endif
+	}
+	return -1;
+}
+
+int zstream_compress(zstream *z, const struct iovec *iov, int iovcnt, const void **block)
+{
+	struct zstream_block *hdr = (struct zstream_block *)z->out;
+	size_t len = 0, zlen;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (len + iov[i].iov_len > ZSTREAM_BLOCK_MAX)
+			return -1;
+		memcpy(z->in + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	zlen = compress_block(z, z->in, len, z->out + sizeof(*hdr), z->out_size - sizeof(*hdr));
+	if (!zlen)
+		return -1;
+
+	hdr->magic = ZSTREAM_MAGIC;
+	hdr->method = z->method;
+	hdr->zlen = zlen;
+	hdr->len = len;
+	*block = z->out;
+
+	return sizeof(*hdr) + zlen;
+}
+
+int zstream_decompress(zstream *z, const void *buf, size_t len, nm_bufferqueue *bq)
+{
+	const char *data = buf;
+
+	while (len) {
+		struct zstream_block hdr;
+		size_t want = sizeof(hdr), n;
+
+		if (z->in_len >= sizeof(hdr)) {
+			memcpy(&hdr, z->in, sizeof(hdr));
+			want += hdr.zlen;
+		}
+
+		n = want - z->in_len < len ? want - z->in_len : len;
+		memcpy(z->in + z->in_len, data, n);
+		z->in_len += n;
+		data += n;
+		len -= n;
+
+		if (z->in_len < want)
+			continue;
+
+		if (want == sizeof(hdr)) {
+			/* we've just got the header, so check it out */
+			memcpy(&hdr, z->in, sizeof(hdr));
+			if (hdr.magic != ZSTREAM_MAGIC || hdr.method != z->method ||
+			    !hdr.zlen || hdr.len > ZSTREAM_BLOCK_MAX ||
+			    hdr.zlen > zstream_bound(z->method, hdr.len))
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		if (decompress_block(z, z->in + sizeof(hdr), hdr.zlen, z->out, hdr.len) < 0)
+			return -1;
+		if (nm_bufferqueue_push(bq, z->out, hdr.len))
+			return -1;
+		z->in_len = 0;
+	}
+
+	return 0;
+}
+
+int zstream_decompress_block(zstream *z, const void *buf, size_t len, void *out, size_t out_size)
+{
+	struct zstream_block hdr;
+
+	if (len < sizeof(hdr))
+		return -1;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != ZSTREAM_MAGIC || hdr.method != z->method || !hdr.zlen ||
+	    hdr.zlen != len - sizeof(hdr) || hdr.len > out_size || hdr.len > ZSTREAM_BLOCK_MAX)
+	{
+		return -1;
+	}
+
+	if (decompress_block(z, (const char *)buf + sizeof(hdr), hdr.zlen, out, hdr.len) < 0)
+		return -1;
+	return hdr.len;
+}
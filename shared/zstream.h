@@ -0,0 +1,98 @@
+#ifndef INCLUDE_zstream_h
+#define INCLUDE_zstream_h
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <naemon/naemon.h>
+
+/**
+ * @file zstream.h
+ * @brief streaming compression of node connections
+ * @ingroup Merlin utility functions
+ * @{
+ */
+
+/**
+ * Once compression has been negotiated, everything a node sends us
+ * comes in blocks, each made up of this header followed by "zlen"
+ * bytes of compressed data, which decompress to "len" bytes of the
+ * regular stream of events. Every block is compressed with the
+ * history of the ones before it on the same connection, so repeated
+ * check output and performance data compresses a lot better than it
+ * would one event at a time, while each block can still be
+ * decompressed as soon as it has arrived.
+ * The magic can't start an event, so the receiving end can tell
+ * where the compressed part of the stream begins.
+ */
+#define ZSTREAM_MAGIC 0xc5
+#define ZSTREAM_BLOCK_MAX (256 << 10) /* largest "len" we send or accept */
+
+struct zstream_block {
+	uint8_t magic;   /* ZSTREAM_MAGIC */
+	uint8_t method;  /* BINLOG_COMPRESS_* */
+	uint32_t zlen;   /* bytes of compressed data that follow */
+	uint32_t len;    /* bytes they decompress to */
+} __attribute__((packed));
+
+struct zstream;
+typedef struct zstream zstream;
+
+/**
+ * Check if merlin was built with support for a compression method
+ * @param method The BINLOG_COMPRESS_* value
+ * @return 1 if it was, 0 otherwise
+ */
+extern int zstream_supported(int method);
+
+/**
+ * Create a compression or decompression stream
+ * @param method The BINLOG_COMPRESS_* method to use
+ * @param decompress 0 to compress data, 1 to decompress it
+ * @return The stream, or NULL on errors
+ */
+extern zstream *zstream_create(int method, int decompress);
+
+/**
+ * Free a stream created with zstream_create(). NULL is ignored.
+ * @param z The stream to free
+ */
+extern void zstream_destroy(zstream *z);
+
+/**
+ * Compress data into a single block
+ * @param z The compression stream
+ * @param iov The data to compress, at most ZSTREAM_BLOCK_MAX bytes
+ * @param iovcnt The number of entries in iov
+ * @param block Set to point to the block, which is valid until the
+ *              stream is used again
+ * @return The size of the block, or -1 on errors
+ */
+extern int zstream_compress(zstream *z, const struct iovec *iov, int iovcnt, const void **block);
+
+/**
+ * Feed data read from the wire to a decompression stream. Whatever
+ * complete blocks there are are decompressed and pushed onto bq, and
+ * the rest kept until the next call.
+ * @param z The decompression stream
+ * @param buf The data read
+ * @param len The number of bytes read
+ * @param bq The bufferqueue to push decompressed data to
+ * @return 0 on success, -1 if the data is corrupt
+ */
+extern int zstream_decompress(zstream *z, const void *buf, size_t len, nm_bufferqueue *bq);
+
+/**
+ * Decompress a single block that was sent on its own, such as the
+ * body of an event for an encrypted node. Blocks must still be
+ * decompressed in the order they were compressed in.
+ * @param z The decompression stream
+ * @param buf The block, header and all
+ * @param len The size of the block
+ * @param out Where to put the decompressed data
+ * @param out_size The room there is at out
+ * @return The number of bytes decompressed, or -1 if the block is
+ *         corrupt or doesn't fit
+ */
+extern int zstream_decompress_block(zstream *z, const void *buf, size_t len, void *out, size_t out_size);
+/** @} */
+#endif
@@ -6,6 +6,8 @@ DROP INDEX rd_state ON report_data;
 DROP INDEX pd_time ON perfdata;
 DROP INDEX pd_host_name ON perfdata;
 DROP INDEX pd_service_name ON perfdata;
+DROP INDEX pdv_time ON perfdata_values;
+DROP INDEX pdv_service_label ON perfdata_values;
 DROP INDEX n_host_name ON notification;
 DROP INDEX n_service_name ON notification;
 DROP INDEX n_contact_name ON notification;
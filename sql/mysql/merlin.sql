@@ -152,6 +152,22 @@ CREATE TABLE IF NOT EXISTS perfdata(
 	perfdata TEXT NOT NULL
 );
 
+--
+-- The same, a value per row. Limits that aren't set are NULL.
+--
+CREATE TABLE IF NOT EXISTS perfdata_values(
+	timestamp  int(11) NOT NULL,
+	host_name  varchar(255) NOT NULL,
+	service_description varchar(255),
+	label      varchar(255) NOT NULL,
+	value      double NOT NULL,
+	uom        varchar(16) NOT NULL DEFAULT '',
+	warn       double,
+	crit       double,
+	min        double,
+	max        double
+);
+
 --
 -- When doing a yum upgrade, there are usually two restarts of merlin with the
 -- db wipe inbetween. Thus, don't recreate this, as that would render this
@@ -1,3 +1,5 @@
 CREATE INDEX pd_time ON perfdata(timestamp);
 CREATE INDEX pd_host_name ON perfdata(host_name);
 CREATE INDEX pd_service_name ON perfdata(host_name, service_description);
+CREATE INDEX pdv_time ON perfdata_values(timestamp);
+CREATE INDEX pdv_service_label ON perfdata_values(host_name, service_description, label);
@@ -134,7 +134,9 @@ class MerlinPktNodeInfo(MerlinPkt):
 		("L", "configured_masters", 0),
 		("L", "host_checks_handled", 0),
 		("L", "service_checks_handled", 0),
-		("L", "monitored_object_state_size", 0)
+		("L", "monitored_object_state_size", 0),
+		("L", "capabilities", 0), # MERLIN_CAP_* bits
+		("16s", "session", ""), # nonce prefix for what's sent to us
 		]
 
 	def __init__(self):
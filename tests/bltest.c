@@ -8,6 +8,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
 
 /* autogenerated message list, produced by fortune */
@@ -543,7 +546,7 @@ static char *msg_list[] = {
 	"Thou art That...",
 	"The chain which can be yanked is not the eternal chain.",
 	"You can't survive by sucking the juice from a wet mitten.",
-	"Der bestirnte Himmel ber mir und das moralische Gesetz in mir",
+	"Der bestirnte Himmel �ber mir und das moralische Gesetz in mir",
 	"The starry sky above me, and the Moral Law inside me.",
 	"At least they're ___________EXPERIENCED incompetents",
 	"But don't you worry, its for a cause -- feeding global corporations' paws.",
@@ -716,60 +719,635 @@ static void test_binlog_leakage(void)
 }
 
 
+/*
+ * Test borrowing batches of entries, as done when draining a backlog
+ */
+static void test_binlog_peekv(void)
+{
+	struct binlog *bl;
+	struct iovec iov[16];
+	uint i, ok = 0;
+	int n;
+
+	bl = binlog_create("/tmp/peekv-binlog", 1 << 20, 0, 0);
+	if (!bl) {
+		t_fail("Failed to create binlog");
+		return;
+	}
+	for (i = 0; i < ARRAY_SIZE(msg_list); i++)
+		binlog_add(bl, msg_list[i], strlen(msg_list[i]) + 1);
+
+	n = binlog_peekv(bl, iov, ARRAY_SIZE(iov), 1 << 20);
+	for (i = 0; (int)i < n; i++) {
+		if (iov[i].iov_len == strlen(msg_list[i]) + 1 && !strcmp(iov[i].iov_base, msg_list[i]))
+			ok++;
+	}
+	if (n == ARRAY_SIZE(iov) && ok == ARRAY_SIZE(iov))
+		t_pass("binlog_peekv() hands out a full batch in order");
+	else
+		t_fail("binlog_peekv() returned %d entries, %u correct", n, ok);
+
+	n = binlog_peekv(bl, iov, ARRAY_SIZE(iov), 1);
+	if (n == 1 && binlog_num_entries(bl) == ARRAY_SIZE(msg_list))
+		t_pass("binlog_peekv() always hands out one entry and consumes none");
+	else
+		t_fail("binlog_peekv() with a tiny byte limit returned %d entries", n);
+
+	binlog_consume(bl);
+	n = binlog_peekv(bl, iov, 1, 1 << 20);
+	if (n == 1 && !strcmp(iov[0].iov_base, msg_list[1]))
+		t_pass("binlog_consume() drops the first entry");
+	else
+		t_fail("binlog_consume() didn't drop the first entry");
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
+/*
+ * Keyed updates for the same object supersede each other, except
+ * for the first unread one, while unkeyed entries are all kept.
+ */
+static void test_binlog_compaction(void)
+{
+	struct binlog *bl;
+	char buf[64], *p;
+	uint i, round, len, nobj = 100, nrounds = 50, saw_change = 0, bad = 0;
+	uint seen[100], added = 0;
+
+	bl = binlog_create("/tmp/compact-binlog", 16 << 10, 64 << 20, BINLOG_UNLINK);
+	if (!bl) {
+		t_fail("Failed to create binlog");
+		return;
+	}
+	for (round = 0; round < nrounds; round++) {
+		for (i = 0; i < nobj; i++) {
+			len = sprintf(buf, "obj %u round %u", i, round) + 1;
+			added += len - binlog_add_keyed(bl, buf, len, i + 1);
+			if (i == 7 && round == 10) {
+				binlog_add(bl, "state change", sizeof("state change"));
+				added += sizeof("state change");
+			}
+		}
+	}
+	if (binlog_num_entries(bl) == nobj + 2 && binlog_fsize(bl))
+		t_pass("%u keyed updates compact to %u entries", nobj * nrounds, nobj + 2);
+	else
+		t_fail("%u keyed updates left %u entries", nobj * nrounds, binlog_num_entries(bl));
+	ok_uint(binlog_available(bl), added, "Superseded updates are accounted for when added");
+
+	ok_int(binlog_save(bl), 0, "Saving compacted binlog");
+	ok_int(binlog_adopt_saved(bl), nobj + 2, "Adopting compacted binlog");
+
+	memset(seen, 0, sizeof(seen));
+	while (!binlog_read(bl, (void **)&p, &len)) {
+		if (!strcmp(p, "state change")) {
+			saw_change = 1;
+			bad += seen[7] != 0;
+		} else if (sscanf(p, "obj %u round %u", &i, &round) == 2 && i < nobj) {
+			bad += i && round != nrounds - 1;
+			seen[i]++;
+		} else {
+			bad++;
+		}
+		free(p);
+	}
+	for (i = 0; i < nobj; i++)
+		bad += seen[i] != (i ? 1U : 2U);
+	if (saw_change && !bad)
+		t_pass("Only the latest update per key survives, in order");
+	else
+		t_fail("Compacted binlog had %u bad entries", bad + !saw_change);
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
+/* read everything a reader has, checking it's "event <n>" with n in sequence */
+static uint drain_reader(binlog *bl, uint first, uint step)
+{
+	char *p;
+	uint n, len, bad = 0;
+
+	for (n = first; !binlog_read(bl, (void **)&p, &len); n += step) {
+		uint i;
+		if (sscanf(p, "event %u", &i) != 1 || i != n)
+			bad++;
+		free(p);
+	}
+	return bad;
+}
+
+static void test_binlog_shared(void)
+{
+	binlog *bl, *a, *b, *c;
+	char buf[32];
+	uint i, len, bad = 0;
+	char *p;
+
+	bl = binlog_create_shared("/tmp/shared-binlog", 16 << 10, 64 << 20, BINLOG_UNLINK);
+	a = binlog_create_reader(bl, "a");
+	b = binlog_create_reader(bl, "b");
+	c = binlog_create_reader(bl, "c");
+	if (!bl || !a || !b || !c) {
+		t_fail("Failed to create shared binlog");
+		return;
+	}
+
+	/* a gets even events, b odd ones and c every third */
+	for (i = 0; i < 2000; i++) {
+		len = sprintf(buf, "event %u", i) + 1;
+		binlog_add(i % 2 ? b : a, buf, len);
+		if (!(i % 3))
+			binlog_add(c, buf, len);
+	}
+	if (binlog_entries(a) == 1000 && binlog_entries(b) == 1000 && binlog_entries(c) == 667 &&
+	    binlog_entries(bl) == 2000 && binlog_fsize(bl))
+	{
+		t_pass("Events added by several readers are stored once");
+	} else {
+		t_fail("Readers have %u, %u and %u entries, sharing %u",
+		       binlog_entries(a), binlog_entries(b), binlog_entries(c), binlog_entries(bl));
+	}
+
+	for (i = 0; i < 100; i++) {
+		uint n;
+		if (binlog_read(b, (void **)&p, &len) < 0) {
+			bad++;
+			continue;
+		}
+		if (sscanf(p, "event %u", &n) != 1 || n != i * 2 + 1)
+			bad++;
+		free(p);
+	}
+	ok_uint(bad, 0, "Reader sees only its own events, in order");
+
+	ok_int(binlog_save(c), 0, "Saving shared binlog");
+	binlog_destroy(a, 0);
+	binlog_destroy(b, 0);
+	binlog_destroy(c, 0);
+	binlog_destroy(bl, 0);
+
+	/* c is gone, and the others come back in another order */
+	bl = binlog_create_shared("/tmp/shared-binlog", 16 << 10, 64 << 20, 0);
+	b = binlog_create_reader(bl, "b");
+	a = binlog_create_reader(bl, "a");
+	ok_int(binlog_adopt_saved(b), 900, "Adopting shared binlog for one reader");
+	ok_int(binlog_adopt_saved(a), 1000, "Adopting shared binlog for another");
+
+	binlog_add(a, "event 2000", sizeof("event 2000"));
+	bad = drain_reader(a, 0, 2) + drain_reader(b, 201, 2);
+	if (!bad && !binlog_entries(bl))
+		t_pass("Adopted readers get their own events, and those of a gone one are dropped");
+	else
+		t_fail("Adopted readers got %u bad entries and left %u behind", bad, binlog_entries(bl));
+
+	binlog_destroy(a, BINLOG_UNLINK);
+	binlog_destroy(b, BINLOG_UNLINK);
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
+/*
+ * Build something resembling a check result event with long plugin
+ * output; a 128-byte header followed by text and perfdata.
+ */
+#define BENCH_EVENTS 5000
+static unsigned int bench_event(char *buf, unsigned int i)
+{
+	unsigned int len = 128, k;
+
+	memset(buf, 0, len);
+	memcpy(buf, &i, sizeof(i));
+	len += sprintf(buf + len, "host-%u;service-%u;OK - load average: 0.%02u, 0.%02u\n",
+	               i / 20, i % 20, i % 100, (i * 7) % 100);
+	for (k = 0; k < 16; k++) {
+		const char *msg = msg_list[(i + k * 13) % ARRAY_SIZE(msg_list)];
+		len += sprintf(buf + len, "%s\n", msg);
+	}
+	len += sprintf(buf + len, "|load1=0.%02u;5;10;0; load5=0.%02u;5;10;0; procs=%u;;;0;",
+	               i % 100, (i * 7) % 100, 100 + i % 37);
+	return len + 1;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Compare the on-disk footprint and read throughput of the
+ * available compression methods
+ */
+static void test_binlog_compression(void)
+{
+	int methods[] = { BINLOG_COMPRESS_NONE, BINLOG_COMPRESS_LZ4, BINLOG_COMPRESS_ZSTD };
+	unsigned long long int raw_fsize = 0;
+	static char buf[8192];
+	uint i, m;
+
+	for (m = 0; m < ARRAY_SIZE(methods); m++) {
+		const char *name = binlog_compression_name(methods[m]);
+		unsigned long long int bytes = 0, fsize;
+		struct binlog *bl;
+		struct timespec start;
+		double secs;
+		uint ok = 0;
+
+		bl = binlog_create("/tmp/bench-binlog", 0, 64 << 20, BINLOG_UNLINK);
+		if (!bl) {
+			t_fail("Failed to create binlog");
+			return;
+		}
+		if (binlog_set_compression(bl, methods[m]) < 0) {
+			t_diag("%s compression isn't available; skipping", name);
+			binlog_destroy(bl, BINLOG_UNLINK);
+			continue;
+		}
+
+		for (i = 0; i < BENCH_EVENTS; i++) {
+			uint len = bench_event(buf, i);
+			if (binlog_add(bl, buf, len) < 0)
+				break;
+			bytes += len;
+		}
+		/* let the background writer finish compressing */
+		binlog_sync(bl);
+		fsize = binlog_fsize(bl);
+		if (methods[m] == BINLOG_COMPRESS_NONE)
+			raw_fsize = fsize;
+
+		/* read it back after a restart, as that's the worst case */
+		if (binlog_save(bl) < 0 || binlog_adopt_saved(bl) != BENCH_EVENTS) {
+			t_fail("%s: Failed to save and restore binlog", name);
+			binlog_destroy(bl, BINLOG_UNLINK);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < BENCH_EVENTS; i++) {
+			void *view;
+			uint len;
+
+			if (binlog_peek(bl, &view, &len) < 0)
+				break;
+			if (len == bench_event(buf, i) && !memcmp(view, buf, len))
+				ok++;
+			binlog_consume(bl);
+		}
+		secs = elapsed(&start);
+
+		if (ok == BENCH_EVENTS)
+			t_pass("%s: all events read back intact", name);
+		else
+			t_fail("%s: %u of %u events read back intact", name, ok, BENCH_EVENTS);
+		if (methods[m] != BINLOG_COMPRESS_NONE) {
+			if (fsize < raw_fsize)
+				t_pass("%s: on-disk size shrinks from %llu to %llu bytes", name, raw_fsize, fsize);
+			else
+				t_fail("%s: on-disk size %llu, uncompressed %llu", name, fsize, raw_fsize);
+		}
+		t_diag("%s: %.0f events/GB on disk, read %.1f MB/s (%.0f events/s)",
+		       name, fsize ? BENCH_EVENTS * (1073741824.0 / fsize) : 0.0,
+		       secs > 0 ? bytes / secs / 1048576 : 0.0, secs > 0 ? BENCH_EVENTS / secs : 0.0);
+
+		binlog_destroy(bl, BINLOG_UNLINK);
+	}
+}
+
+/*
+ * The background writer compresses and syncs the file, and results
+ * for segments that are read before it gets to them are thrown away
+ */
+static void test_binlog_writer(void)
+{
+	const struct binlog_io_stats *io;
+	static char buf[8192];
+	struct binlog *bl;
+	uint i, len, ok = 0;
+
+	bl = binlog_create("/tmp/writer-binlog", 0, 64 << 20, BINLOG_UNLINK);
+	if (!bl) {
+		t_fail("Failed to create binlog");
+		return;
+	}
+	binlog_set_compression(bl, binlog_compression_by_name("lz4"));
+	binlog_set_compression(bl, binlog_compression_by_name("zstd"));
+	binlog_set_sync_interval(bl, 1);
+	io = binlog_io_stats(bl);
+
+	for (i = 0; i < BENCH_EVENTS; i++) {
+		len = bench_event(buf, i);
+		binlog_add(bl, buf, len);
+		/* read half of it while it's being worked on */
+		if (i % 2) {
+			void *view;
+			uint vlen;
+			if (!binlog_peek(bl, &view, &vlen) && vlen == bench_event(buf, i / 2) && !memcmp(view, buf, vlen))
+				ok++;
+			binlog_consume(bl);
+		}
+	}
+	ok_int(binlog_sync(bl), 0, "Waiting for the background writer");
+	ok_uint(io->queued, 0, "Background writer has nothing left to do");
+	if (io->syncs > 0)
+		t_pass("File was synced in the background (%llu usecs)", io->sync_usecs);
+	else
+		t_fail("File was never synced in the background");
+	if (bl->compression && !io->compressed)
+		t_fail("No segments were compressed in the background");
+
+	for (i = BENCH_EVENTS / 2; i < BENCH_EVENTS; i++) {
+		void *view;
+		uint vlen;
+		len = bench_event(buf, i);
+		if (!binlog_peek(bl, &view, &vlen) && vlen == len && !memcmp(view, buf, len))
+			ok++;
+		binlog_consume(bl);
+	}
+	ok_uint(ok, BENCH_EVENTS, "Events read back intact around the background writer");
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+	binlog_writer_stop();
+}
+
+/*
+ * Test that unread() and save/restore keep entries in order, also
+ * when they span several segments and both memory and disk
+ */
+static void test_binlog_persist(void)
+{
+#define PERSIST_PATH "/tmp/persist-binlog"
+	struct binlog *bl;
+	uint i, len, ok = 0, entries = 40 * ARRAY_SIZE(msg_list);
+	char *p;
+
+	bl = binlog_create(PERSIST_PATH, 64 << 10, 10 << 20, BINLOG_UNLINK);
+	if (!bl) {
+		t_fail("Failed to create binlog");
+		return;
+	}
+	for (i = 0; i < entries; i++) {
+		char *msg = msg_list[i % ARRAY_SIZE(msg_list)];
+		binlog_add(bl, msg, strlen(msg) + 1);
+	}
+	if (binlog_read(bl, (void **)&p, &len) || binlog_unread(bl, p, len))
+		t_fail("read + unread of first entry");
+	else
+		t_pass("read + unread of first entry");
+	if (binlog_fsize(bl) && binlog_num_entries(bl) == entries)
+		t_pass("binlog spilled to disk with %u entries", entries);
+	else
+		t_fail("binlog has %u entries, %u bytes on disk",
+		       binlog_num_entries(bl), binlog_fsize(bl));
+
+	if (binlog_save(bl)) {
+		t_fail("binlog_save() failed");
+		binlog_destroy(bl, BINLOG_UNLINK);
+		return;
+	}
+	binlog_destroy(bl, BINLOG_UNLINK);
+
+	bl = binlog_create(PERSIST_PATH, 64 << 10, 10 << 20, BINLOG_UNLINK);
+	/* depending on where the damage is, it's found now or when read */
+	if (binlog_adopt_saved(bl) <= 0) {
+		t_fail("binlog_adopt_saved() didn't adopt anything");
+		binlog_destroy(bl, BINLOG_UNLINK);
+		return;
+	}
+	for (i = 0; !binlog_peek(bl, (void **)&p, &len); i++) {
+		char *msg = msg_list[i % ARRAY_SIZE(msg_list)];
+		if (len == strlen(msg) + 1 && !strcmp(p, msg))
+			ok++;
+		binlog_consume(bl);
+	}
+	if (ok == entries && i == entries)
+		t_pass("saved binlog restores all entries in order");
+	else
+		t_fail("saved binlog restored %u entries, %u in order, expected %u", i, ok, entries);
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
+/*
+ * A process that dies without saving leaves the file behind, with
+ * the read cursor telling us where it got to
+ */
+static void test_binlog_crash(void)
+{
+	struct binlog *bl;
+	uint i, len, ok = 0, entries = 40 * ARRAY_SIZE(msg_list);
+	int status;
+	pid_t pid;
+	char *p;
+
+	pid = fork();
+	if (!pid) {
+		bl = binlog_create(PERSIST_PATH, 64 << 10, 10 << 20, BINLOG_UNLINK);
+		for (i = 0; i < entries; i++) {
+			char *msg = msg_list[i % ARRAY_SIZE(msg_list)];
+			binlog_add(bl, msg, strlen(msg) + 1);
+		}
+		for (i = 0; i < entries / 3; i++)
+			binlog_consume(bl);
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+
+	bl = binlog_create(PERSIST_PATH, 64 << 10, 10 << 20, 0);
+	if (binlog_adopt_saved(bl) == (int)(entries - entries / 3))
+		t_pass("binlog left behind by a crash is adopted from the read cursor");
+	else
+		t_fail("binlog left behind by a crash has %u entries, expected %u",
+		       binlog_num_entries(bl), entries - entries / 3);
+	for (i = entries / 3; !binlog_peek(bl, (void **)&p, &len); i++) {
+		char *msg = msg_list[i % ARRAY_SIZE(msg_list)];
+		if (len == strlen(msg) + 1 && !strcmp(p, msg))
+			ok++;
+		binlog_consume(bl);
+	}
+	if (ok == entries - entries / 3 && i == entries)
+		t_pass("binlog left behind by a crash has the unread entries in order");
+	else
+		t_fail("binlog left behind by a crash handed out %u entries, %u in order", i - entries / 3, ok);
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
+/*
+ * Damage a record in the middle of a saved binlog. Everything before
+ * it must survive, and nothing after it may be handed out.
+ */
+static void test_binlog_recovery(void)
+{
+	struct binlog *bl;
+	uint i, len, entries = 100 * ARRAY_SIZE(msg_list), ok = 0;
+	char *p, *buf, *hit;
+	struct stat st;
+	FILE *f;
+
+	bl = binlog_create(PERSIST_PATH, 64 << 10, 10 << 20, BINLOG_UNLINK);
+	for (i = 0; i < entries; i++) {
+		char *msg = msg_list[i % ARRAY_SIZE(msg_list)];
+		binlog_add(bl, msg, strlen(msg) + 1);
+	}
+	binlog_save(bl);
+
+	/* flip a byte in an entry somewhere in the middle */
+	f = fopen(PERSIST_PATH ".save", "r+");
+	if (!f || fstat(fileno(f), &st) < 0 || !(buf = malloc(st.st_size))) {
+		t_fail("Failed to open saved binlog");
+		if (f)
+			fclose(f);
+		binlog_destroy(bl, BINLOG_UNLINK);
+		return;
+	}
+	if (fread(buf, st.st_size, 1, f) != 1)
+		t_fail("Failed to read saved binlog");
+	hit = memmem(buf + st.st_size / 2, st.st_size / 2, msg_list[7], strlen(msg_list[7]));
+	if (hit) {
+		fseek(f, hit - buf, SEEK_SET);
+		fputc(*hit ^ 0x20, f);
+	}
+	fclose(f);
+	free(buf);
+
+	/* depending on where the damage is, it's found now or when read */
+	if (binlog_adopt_saved(bl) <= 0) {
+		t_fail("binlog_adopt_saved() didn't adopt anything");
+		binlog_destroy(bl, BINLOG_UNLINK);
+		return;
+	}
+	for (i = 0; !binlog_peek(bl, (void **)&p, &len); i++) {
+		char *msg = msg_list[i % ARRAY_SIZE(msg_list)];
+		if (len == strlen(msg) + 1 && !strcmp(p, msg))
+			ok++;
+		binlog_consume(bl);
+	}
+	if (hit && ok == i && i > 0 && i < entries && i % ARRAY_SIZE(msg_list) == 7)
+		t_pass("damaged binlog is truncated at the last good entry (%u of %u)", i, entries);
+	else
+		t_fail("damaged binlog handed out %u entries, %u intact", i, ok);
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
+/*
+ * A crash between writing the compressed copy of a segment and freeing
+ * the uncompressed one leaves both of them in the file. We get there by
+ * bringing the freed slots back to life, and every event must still be
+ * handed out exactly once.
+ */
+static void test_binlog_compress_crash(void)
+{
+	static char buf[8192];
+	struct binlog *bl;
+	uint i, len, ok = 0, revived = 0;
+	uint32_t magic;
+	off_t off;
+	int fd, status;
+	pid_t pid;
+
+	pid = fork();
+	if (!pid) {
+		bl = binlog_create(PERSIST_PATH, 0, 64 << 20, BINLOG_UNLINK);
+		if (binlog_set_compression(bl, binlog_compression_by_name("lz4")) < 0 &&
+		    binlog_set_compression(bl, binlog_compression_by_name("zstd")) < 0)
+			_exit(1);
+		for (i = 0; i < BENCH_EVENTS; i++)
+			binlog_add(bl, buf, bench_event(buf, i));
+		binlog_sync(bl);
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		t_diag("No compression available; skipping crash mid-compression test");
+		unlink(PERSIST_PATH);
+		return;
+	}
+
+	/* these are the BINLOG_SEG_FREE and BINLOG_SEG_MAGIC of binlog.c */
+	fd = open(PERSIST_PATH, O_RDWR);
+	for (off = 0; fd >= 0 && pread(fd, &magic, sizeof(magic), off) == sizeof(magic); off += getpagesize()) {
+		if (magic != 0x6d627366)
+			continue;
+		magic = 0x6d627367;
+		if (pwrite(fd, &magic, sizeof(magic), off) == sizeof(magic))
+			revived++;
+	}
+	if (fd >= 0)
+		close(fd);
+	if (!revived) {
+		t_diag("No freed segments to revive; skipping crash mid-compression test");
+		unlink(PERSIST_PATH);
+		return;
+	}
+
+	bl = binlog_create(PERSIST_PATH, 0, 64 << 20, 0);
+	ok_int(binlog_adopt_saved(bl), BENCH_EVENTS, "Segments left twice by a crash mid-compression are adopted once");
+	for (i = 0; i < BENCH_EVENTS; i++) {
+		void *view;
+		uint vlen;
+
+		if (binlog_peek(bl, &view, &vlen) < 0)
+			break;
+		len = bench_event(buf, i);
+		if (vlen == len && !memcmp(view, buf, len))
+			ok++;
+		binlog_consume(bl);
+	}
+	ok_uint(ok, BENCH_EVENTS, "and their events are read back once, in order");
+	ok_int(binlog_num_entries(bl), 0, "with nothing left over");
+
+	binlog_destroy(bl, BINLOG_UNLINK);
+}
+
 /*
  * Test the binlog api for empty binlog file
  */
 static void test_binlog_empty(void)
 {
 #define FILE_BLOG "/tmp/empty-binlog"
-#define FILE_META "/tmp/empty-binlog.meta"
 #define FILE_SAVE "/tmp/empty-binlog.save"
-	struct binlog *bl, *saved_binlog;
-	FILE *meta, *save;
-	unsigned long long int binlog_max_memory_size = 500;
-	unsigned long long int binlog_max_file_size = 5000;
-
-	/* Create empty files */
-	meta = fopen(FILE_META, "w");
-	if (!meta) {
-		t_fail("Failed to open %s", FILE_META);
-		return;
-	}
+	struct binlog *bl;
+	FILE *save;
+	unsigned long long int max_memory_size = 500;
+	unsigned long long int max_file_size = 5000;
+
+	/* Create an empty file */
 	save = fopen(FILE_SAVE, "w");
 	if (!save) {
 		t_fail("Failed to open %s", FILE_SAVE);
-		fclose(meta);
 		return;
 	}
-	fclose(meta);
 	fclose(save);
 
-	bl = binlog_create(FILE_BLOG, binlog_max_memory_size * 1024 * 1024, binlog_max_file_size * 1024 * 1024, BINLOG_UNLINK);
+	bl = binlog_create(FILE_BLOG, max_memory_size * 1024 * 1024, max_file_size * 1024 * 1024, BINLOG_UNLINK);
 	if (!bl) {
 		t_fail("Failed to create binlog");
 		return;
 	}
 
-	saved_binlog = binlog_get_saved(bl);
-	if (saved_binlog) {
-		t_fail("Unexpected saved binlog returned");
+	if (binlog_adopt_saved(bl) > 0 || binlog_num_entries(bl)) {
+		t_fail("Unexpected saved binlog adopted");
 		binlog_destroy(bl, BINLOG_UNLINK);
 		return;
 	} else {
-		t_pass("No saved binlog returned");
+		t_pass("No saved binlog adopted");
 	}
 
-	if( access( bl->file_metadata_path, F_OK ) == 0 ) {
-		t_fail("Metadata file should not exist");
+	if( access( bl->file_save_path, F_OK ) == 0 ) {
+		t_fail("Save file should not exist");
 		return;
 	}
 
-	if( access( bl->file_save_path, F_OK ) == 0 ) {
-		t_fail("Save file should not exist");
+	if( access( FILE_BLOG, F_OK ) == 0 ) {
+		t_fail("Binlog file should not exist");
 		return;
 	}
 
-	t_pass("Metadata handling is correct");
+	t_pass("Save file handling is correct");
+	binlog_destroy(bl, BINLOG_UNLINK);
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
@@ -813,6 +1391,15 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
 	}
 
 	test_binlog_leakage();
+	test_binlog_peekv();
+	test_binlog_compaction();
+	test_binlog_shared();
+	test_binlog_persist();
+	test_binlog_crash();
+	test_binlog_recovery();
+	test_binlog_compression();
+	test_binlog_writer();
+	test_binlog_compress_crash();
 	test_binlog_empty();
 	return t_end();
 }
@@ -1,6 +1,286 @@
 #include "codec.h"
 #include "logging.c"
 #include <check.h>
+#include <time.h>
+
+/*
+ * The table-driven codec that codec.c's generated one replaced. It's
+ * kept here as a reference that the generated code has to match byte
+ * for byte, and as a baseline for the benchmark.
+ */
+static struct hook_info_struct {
+	int cb_type;
+	int strings;
+	off_t offset, ptrs[7];
+} hook_info[NEBCALLBACK_NUMITEMS] = {
+	{ NEBCALLBACK_PROCESS_DATA, 0, sizeof(nebstruct_process_data),
+		{ 0, 0, 0, 0, 0 },
+	},
+	{ NEBCALLBACK_TIMED_EVENT_DATA, 0, sizeof(nebstruct_timed_event_data),
+		{ 0, 0, 0, 0, 0 },
+	},
+	{ NEBCALLBACK_LOG_DATA, 1, sizeof(nebstruct_log_data),
+		{
+			offsetof(nebstruct_log_data, data),
+			0, 0, 0, 0
+		},
+	},
+	{ NEBCALLBACK_SYSTEM_COMMAND_DATA, 2, sizeof(nebstruct_system_command_data),
+		{
+			offsetof(nebstruct_system_command_data, command_line),
+			offsetof(nebstruct_system_command_data, output),
+			0, 0, 0
+		},
+	},
+	{ NEBCALLBACK_EVENT_HANDLER_DATA, 4, sizeof(nebstruct_event_handler_data),
+		{
+			offsetof(nebstruct_event_handler_data, host_name),
+			offsetof(nebstruct_event_handler_data, service_description),
+			offsetof(nebstruct_event_handler_data, command_line),
+			offsetof(nebstruct_event_handler_data, output),
+			0
+		},
+	},
+	{ NEBCALLBACK_NOTIFICATION_DATA, 5, sizeof(nebstruct_notification_data),
+		{
+			offsetof(nebstruct_notification_data, host_name),
+			offsetof(nebstruct_notification_data, service_description),
+			offsetof(nebstruct_notification_data, output),
+			offsetof(nebstruct_notification_data, ack_author),
+			offsetof(nebstruct_notification_data, ack_data),
+		},
+	},
+	{ NEBCALLBACK_SERVICE_CHECK_DATA, 5, sizeof(merlin_service_status),
+		{
+			offsetof(merlin_service_status, host_name),
+			offsetof(merlin_service_status, service_description),
+			offsetof(merlin_service_status, state.plugin_output),
+			offsetof(merlin_service_status, state.long_plugin_output),
+			offsetof(merlin_service_status, state.perf_data),
+		}
+	},
+	{ NEBCALLBACK_HOST_CHECK_DATA, 4, sizeof(merlin_host_status),
+		{
+			offsetof(merlin_host_status, name),
+			offsetof(merlin_host_status, state.plugin_output),
+			offsetof(merlin_host_status, state.long_plugin_output),
+			offsetof(merlin_host_status, state.perf_data),
+			0
+		},
+	},
+	{ NEBCALLBACK_COMMENT_DATA, 4, sizeof(nebstruct_comment_data),
+		{
+			offsetof(nebstruct_comment_data, host_name),
+			offsetof(nebstruct_comment_data, service_description),
+			offsetof(nebstruct_comment_data, author_name),
+			offsetof(nebstruct_comment_data, comment_data),
+			0,
+		},
+	},
+	{ NEBCALLBACK_DOWNTIME_DATA, 4, sizeof(nebstruct_downtime_data),
+		{
+			offsetof(nebstruct_downtime_data, host_name),
+			offsetof(nebstruct_downtime_data, service_description),
+			offsetof(nebstruct_downtime_data, author_name),
+			offsetof(nebstruct_downtime_data, comment_data),
+			0,
+		},
+	},
+	{ NEBCALLBACK_FLAPPING_DATA, 2, sizeof(nebstruct_flapping_data),
+		{
+			offsetof(nebstruct_flapping_data, host_name),
+			offsetof(nebstruct_flapping_data, service_description),
+			0, 0, 0
+		},
+	},
+	{ NEBCALLBACK_PROGRAM_STATUS_DATA, 2, sizeof(nebstruct_program_status_data),
+		{
+			offsetof(nebstruct_program_status_data, global_host_event_handler),
+			offsetof(nebstruct_program_status_data, global_service_event_handler),
+			0, 0, 0
+		},
+	},
+	{ NEBCALLBACK_HOST_STATUS_DATA, 4, sizeof(merlin_host_status),
+		{
+			offsetof(merlin_host_status, name),
+			offsetof(merlin_host_status, state.plugin_output),
+			offsetof(merlin_host_status, state.long_plugin_output),
+			offsetof(merlin_host_status, state.perf_data),
+			0
+		},
+	},
+	{ NEBCALLBACK_SERVICE_STATUS_DATA, 5, sizeof(merlin_service_status),
+		{
+			offsetof(merlin_service_status, host_name),
+			offsetof(merlin_service_status, service_description),
+			offsetof(merlin_service_status, state.plugin_output),
+			offsetof(merlin_service_status, state.long_plugin_output),
+			offsetof(merlin_service_status, state.perf_data),
+		}
+	},
+	{ NEBCALLBACK_ADAPTIVE_PROGRAM_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+	{ NEBCALLBACK_ADAPTIVE_HOST_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+	{ NEBCALLBACK_ADAPTIVE_SERVICE_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+	{ NEBCALLBACK_EXTERNAL_COMMAND_DATA, 2, sizeof(nebstruct_external_command_data),
+		{
+			offsetof(nebstruct_external_command_data, command_string),
+			offsetof(nebstruct_external_command_data, command_args),
+			0, 0, 0
+		},
+	},
+	{ NEBCALLBACK_AGGREGATED_STATUS_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+	{ NEBCALLBACK_RETENTION_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+	{ NEBCALLBACK_CONTACT_NOTIFICATION_DATA, 6, sizeof(nebstruct_contact_notification_data),
+		{
+			offsetof(nebstruct_contact_notification_data, host_name),
+			offsetof(nebstruct_contact_notification_data, service_description),
+			offsetof(nebstruct_contact_notification_data, contact_name),
+			offsetof(nebstruct_contact_notification_data, output),
+			offsetof(nebstruct_contact_notification_data, ack_author),
+			offsetof(nebstruct_contact_notification_data, ack_data),
+		},
+	},
+	{ NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA, 7, sizeof(nebstruct_contact_notification_method_data),
+		{
+			offsetof(nebstruct_contact_notification_method_data, host_name),
+			offsetof(nebstruct_contact_notification_method_data, service_description),
+			offsetof(nebstruct_contact_notification_method_data, contact_name),
+			offsetof(nebstruct_contact_notification_method_data, command_name),
+			offsetof(nebstruct_contact_notification_method_data, output),
+			offsetof(nebstruct_contact_notification_method_data, ack_author),
+			offsetof(nebstruct_contact_notification_method_data, ack_data),
+		},
+	},
+	{ NEBCALLBACK_ACKNOWLEDGEMENT_DATA, 4, sizeof(nebstruct_acknowledgement_data),
+		{
+			offsetof(nebstruct_acknowledgement_data, host_name),
+			offsetof(nebstruct_acknowledgement_data, service_description),
+			offsetof(nebstruct_acknowledgement_data, author_name),
+			offsetof(nebstruct_acknowledgement_data, comment_data),
+			0
+		},
+	},
+	{ NEBCALLBACK_STATE_CHANGE_DATA, 3, sizeof(nebstruct_statechange_data),
+		{
+			offsetof(nebstruct_statechange_data, host_name),
+			offsetof(nebstruct_statechange_data, service_description),
+			offsetof(nebstruct_statechange_data, output),
+			0, 0
+		},
+	},
+	{ NEBCALLBACK_CONTACT_STATUS_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+	{ NEBCALLBACK_ADAPTIVE_CONTACT_DATA, 0, 0, { 0, 0, 0, 0, 0 }, },
+};
+
+static int table_encode(void *data, int cb_type, char *buf, int buflen)
+{
+	int i, len, num_strings;
+	off_t offset, *ptrs;
+	off_t runcmd_ptrs[7] = { offsetof(merlin_runcmd, content) };
+
+	if (cb_type == RUNCMD_PACKET) {
+		offset = sizeof(merlin_runcmd);
+		num_strings = 1;
+		ptrs = runcmd_ptrs;
+	} else {
+		offset = hook_info[cb_type].offset;
+		num_strings = hook_info[cb_type].strings;
+		ptrs = hook_info[cb_type].ptrs;
+	}
+	memcpy(buf, data, offset);
+
+	for (i = 0; i < num_strings; i++) {
+		char *sp = NULL;
+
+		memcpy(&sp, (char *)buf + ptrs[i], sizeof(sp));
+		if (!sp)
+			continue;
+		if (buflen <= offset) {
+			for (; i < num_strings; i++)
+				memset(buf + ptrs[i], 0, sizeof(char *));
+			break;
+		}
+		len = strlen(sp);
+		if (len > buflen - offset - 1)
+			len = buflen - offset - 1;
+		if (len)
+			memcpy(buf + offset, sp, len);
+		buf[offset + len] = '\0';
+		memcpy(buf + ptrs[i], &offset, sizeof(offset));
+		offset += len + 1;
+	}
+
+	if (offset % 8)
+		offset += 8 - offset % 8;
+	return offset;
+}
+
+static int table_decode(void *ds, off_t len, int cb_type)
+{
+	off_t *ptrs;
+	off_t runcmd_ptrs[7] = { offsetof(merlin_runcmd, content) };
+	int num_strings, i, ret = 0;
+
+	if (cb_type == RUNCMD_PACKET) {
+		num_strings = 1;
+		ptrs = runcmd_ptrs;
+	} else {
+		num_strings = hook_info[cb_type].strings;
+		ptrs = hook_info[cb_type].ptrs;
+	}
+
+	for (i = 0; i < num_strings; i++) {
+		char *ptr;
+
+		memcpy(&ptr, (char *)ds + ptrs[i], sizeof(ptr));
+		if (!ptr)
+			continue;
+		if ((off_t)ptr > len) {
+			ptr = NULL;
+			ret |= (1 << i);
+		} else {
+			ptr += (off_t)ds;
+		}
+		memcpy((char *)ds + ptrs[i], &ptr, sizeof(ptr));
+	}
+	return ret;
+}
+
+/*
+ * Fill in an event of the given type the way the table says it
+ * looks, with its strings pointing to the samples in turn
+ */
+static void fill_event(char *ev, int cb_type, int variant, const char **samples, int num_samples)
+{
+	const struct hook_info_struct *hi = &hook_info[cb_type];
+	off_t runcmd_ptrs[7] = { offsetof(merlin_runcmd, content) };
+	const off_t *ptrs = cb_type == RUNCMD_PACKET ? runcmd_ptrs : hi->ptrs;
+	off_t i, size = cb_type == RUNCMD_PACKET ? (off_t)sizeof(merlin_runcmd) : hi->offset;
+	int strings = cb_type == RUNCMD_PACKET ? 1 : hi->strings;
+
+	for (i = 0; i < size; i++)
+		ev[i] = (char)(i * 7 + cb_type);
+	for (i = 0; i < strings; i++) {
+		const char *sp = samples[(i + variant) % num_samples];
+		memcpy(ev + ptrs[i], &sp, sizeof(sp));
+	}
+}
+
+/* every type the table knows how to encode */
+static int codec_types[NEBCALLBACK_NUMITEMS + 1];
+static int num_codec_types;
+
+static void find_codec_types(void)
+{
+	int i;
+
+	num_codec_types = 0;
+	for (i = 0; i < NEBCALLBACK_NUMITEMS; i++) {
+		if (hook_info[i].offset)
+			codec_types[num_codec_types++] = i;
+	}
+	codec_types[num_codec_types++] = RUNCMD_PACKET;
+}
 
 void general_setup(void)
 {
@@ -74,6 +354,39 @@ START_TEST(test_encode_too_long)
 }
 END_TEST
 
+START_TEST(test_encode_matches_table)
+{
+	static char ev[64 << 10], gen[128 << 10], ref[128 << 10];
+	char *big = calloc(200 << 10, 1);
+	const char *samples[] = { "foo", "", NULL, "some plugin output", NULL, big };
+	int t, variant, buflen;
+
+	memset(big, 'b', (200 << 10) - 1);
+	find_codec_types();
+	for (t = 0; t < num_codec_types; t++) {
+		int cb_type = codec_types[t];
+
+		for (variant = 0; variant < (int)ARRAY_SIZE(samples); variant++) {
+			for (buflen = 1 << 10; buflen <= (int)sizeof(gen); buflen *= 128) {
+				int gen_len, ref_len;
+
+				fill_event(ev, cb_type, variant, samples, ARRAY_SIZE(samples));
+				memset(gen, 0, sizeof(gen));
+				memset(ref, 0, sizeof(ref));
+				gen_len = merlin_encode(ev, cb_type, gen, buflen);
+				ref_len = table_encode(ev, cb_type, ref, buflen);
+				ck_assert_int_eq(gen_len, ref_len);
+				ck_assert_msg(!memcmp(gen, ref, gen_len), "%s encodes differently with %d bytes of room",
+				              callback_name(cb_type), buflen);
+
+				ck_assert_int_eq(merlin_decode(gen, gen_len, cb_type), table_decode(ref, ref_len, cb_type));
+			}
+		}
+	}
+	free(big);
+}
+END_TEST
+
 Suite *
 check_codec_suite(void)
 {
@@ -83,15 +396,78 @@ check_codec_suite(void)
 	tcase_add_checked_fixture (tc, general_setup, general_teardown);
 	tcase_add_test(tc, test_encode_serviceevent);
 	tcase_add_test(tc, test_encode_too_long);
+	tcase_add_test(tc, test_encode_matches_table);
 	suite_add_tcase(s, tc);
 
 	return s;
 }
 
-int main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[]) {
+static double bench_ns(int generated, int cb_type, const char *ev, int iterations)
+{
+	static merlin_event pkt;
+	struct timespec start, stop;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		int len;
+
+		if (generated) {
+			len = merlin_encode((void *)ev, cb_type, pkt.body, sizeof(pkt.body));
+			merlin_decode(pkt.body, len, cb_type);
+		} else {
+			len = table_encode((void *)ev, cb_type, pkt.body, sizeof(pkt.body));
+			table_decode(pkt.body, len, cb_type);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	return ((stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+/*
+ * "codectest bench [iterations]" times encoding and decoding each
+ * type of event, with strings the size of a typical check result,
+ * with the generated codec and with the table-driven one
+ */
+static int benchmark(int iterations)
+{
+	static char ev[64 << 10];
+	const char *samples[] = {
+		"a-host.example.com", "PING", "PING OK - Packet loss = 0%, RTA = 0.80 ms",
+		"", "rta=0.800000ms;3000.000000;5000.000000;0.000000 pl=0%;80;100;0",
+	};
+	double total[2] = { 0, 0 };
+	int t;
+
+	find_codec_types();
+	printf("%-40s %12s %12s\n", "event", "table ns", "generated ns");
+	for (t = 0; t < num_codec_types; t++) {
+		int cb_type = codec_types[t];
+		double ns[2];
+
+		fill_event(ev, cb_type, 0, samples, ARRAY_SIZE(samples));
+		bench_ns(1, cb_type, ev, iterations / 10);
+		ns[0] = bench_ns(0, cb_type, ev, iterations);
+		ns[1] = bench_ns(1, cb_type, ev, iterations);
+		total[0] += ns[0];
+		total[1] += ns[1];
+		printf("%-40s %12.1f %12.1f\n", cb_type == RUNCMD_PACKET ? "RUNCMD_PACKET" : callback_name(cb_type), ns[0], ns[1]);
+	}
+	printf("%-40s %12.1f %12.1f\n", "average", total[0] / num_codec_types, total[1] / num_codec_types);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
 		int number_failed;
-	Suite *s = check_codec_suite();
-	SRunner *sr = srunner_create(s);
+	Suite *s;
+	SRunner *sr;
+
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return benchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+
+	s = check_codec_suite();
+	sr = srunner_create(s);
 	srunner_run_all(sr, CK_NORMAL);
 	number_failed = srunner_ntests_failed(sr);
 	srunner_free(sr);
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "shared.h"
+#include "codec.h"
+#include "intern.h"
+#include "delta.h"
+#include "test_utils.h"
+
+static int encode_service(const char *output, time_t last_check, char *buf)
+{
+	merlin_service_status st;
+
+	memset(&st, 0, sizeof(st));
+	st.host_name = "web01";
+	st.service_description = "HTTP";
+	st.state.current_state = 2;
+	st.state.last_check = last_check;
+	st.state.next_check = last_check + 300;
+	st.state.plugin_output = (char *)output;
+	st.state.perf_data = "time=0.1s;;;0";
+	memset(buf, 0, 4096);
+	return merlin_encode(&st, NEBCALLBACK_SERVICE_CHECK_DATA, buf, 4096);
+}
+
+/* send an interned event through both tables and check it comes out as it went in */
+static uint32_t round_trip(delta_table *out, delta_table *in, const char *buf, uint32_t len, const char *what)
+{
+	const struct monitored_object_state *state;
+	char delta[4096], expanded[4096];
+	uint32_t dlen;
+	int elen;
+
+	dlen = delta_encode(out, 0, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, delta, len);
+	if (!dlen) {
+		t_fail("%s: no delta was made", what);
+		return 0;
+	}
+	elen = delta_lookup(in, 0, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, &state);
+	if (elen != (int)len) {
+		t_fail("%s: event is %d bytes with the state put back, not %u", what, elen, len);
+		return 0;
+	}
+	delta_expand(NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, state, expanded);
+	ok_int(memcmp(expanded, buf, len), 0, what);
+	return dlen;
+}
+
+static void test_delta_round_trip(void)
+{
+	intern_table *names = intern_create(NULL);
+	delta_table *out = delta_create(), *in = delta_create();
+	char buf[4096], interned[4096];
+	uint32_t ilen, snapshot, delta, same;
+	int len;
+
+	len = encode_service("HTTP CRITICAL", 1000, buf);
+	ilen = intern_encode(names, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	snapshot = round_trip(out, in, interned, ilen, "the first event is sent in full");
+	ok_int(snapshot <= ilen, 1, "and is no bigger for it");
+
+	len = encode_service("HTTP CRITICAL", 1060, buf);
+	ilen = intern_encode(names, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	delta = round_trip(out, in, interned, ilen, "the next only with what changed");
+	ok_uint(delta, sizeof(struct delta_header) + 2 * sizeof(time_t), "which is the check times");
+
+	same = round_trip(out, in, interned, ilen, "an event with nothing new");
+	ok_uint(same, sizeof(struct delta_header), "is just the header");
+
+	len = encode_service("HTTP OK - back again", 1120, buf);
+	ilen = intern_encode(names, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	round_trip(out, in, interned, ilen, "new output is sent along");
+
+	/* a delta that doesn't fit isn't counted as sent */
+	len = encode_service("HTTP OK", 1180, buf);
+	ilen = intern_encode(names, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	ok_uint(delta_encode(out, 0, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, buf, 16), 0,
+	        "deltas are only made if they fit");
+	round_trip(out, in, interned, ilen, "and the next one is made against what was sent");
+
+	intern_destroy(names);
+	delta_destroy(out);
+	delta_destroy(in);
+}
+
+static void test_delta_errors(void)
+{
+	const struct monitored_object_state *state;
+	intern_table *names = intern_create(NULL);
+	delta_table *out = delta_create(), *in = delta_create(), *fresh = delta_create();
+	char buf[4096], interned[4096], delta[4096];
+	struct delta_header hdr;
+	uint32_t ilen, dlen;
+	int len;
+
+	len = encode_service("HTTP OK", 1000, buf);
+	ilen = intern_encode(names, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	dlen = delta_encode(out, 0, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, delta, sizeof(delta));
+	ok_int(delta_lookup(in, 1, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, &state) > 0, 1,
+	       "a snapshot is taken with either kind of ids");
+
+	len = encode_service("HTTP OK", 1060, buf);
+	ilen = intern_encode(names, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	dlen = delta_encode(out, 0, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, delta, sizeof(delta));
+	ok_int(delta_lookup(fresh, 0, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, &state), -1,
+	       "deltas for objects we have no state for are rejected");
+	ok_int(delta_lookup(in, 0, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, &state), -1,
+	       "and so are those with the other kind of ids");
+	ok_int(delta_lookup(in, 1, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen - 8, &state), -1,
+	       "truncated deltas are rejected");
+
+	memcpy(&hdr, delta, sizeof(hdr));
+	hdr.mask |= 1ULL << 63;
+	memcpy(delta, &hdr, sizeof(hdr));
+	ok_int(delta_lookup(in, 1, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, &state), -1,
+	       "deltas with fields we don't know of are rejected");
+	ok_uint(delta_encode(out, 0, NEBCALLBACK_COMMENT_DATA, interned, ilen, delta, sizeof(delta)), 0,
+	        "events of other types get no deltas");
+
+	intern_destroy(names);
+	delta_destroy(out);
+	delta_destroy(in);
+	delta_destroy(fresh);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	t_set_colors(0);
+	t_start("status update delta tests");
+	test_delta_round_trip();
+	test_delta_errors();
+	return t_end();
+}
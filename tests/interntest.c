@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "shared.h"
+#include "codec.h"
+#include "intern.h"
+#include "test_utils.h"
+
+/* objects the receiving end knows about */
+static struct {
+	const char *host_name, *service_description;
+} objects[] = {
+	{ "web01", NULL },
+	{ "web01", "HTTP" },
+	{ "web01", "PING" },
+	{ "db01", NULL },
+};
+
+static void *find_object(int kind, const char *host_name, const char *service_description)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(objects); i++) {
+		if (strcmp(objects[i].host_name, host_name))
+			continue;
+		if (kind == INTERN_HOST && !objects[i].service_description)
+			return &objects[i];
+		if (kind == INTERN_SERVICE && objects[i].service_description &&
+		    !strcmp(objects[i].service_description, service_description))
+		{
+			return &objects[i];
+		}
+	}
+	return NULL;
+}
+
+/* nodes with the same object config number the objects the same way */
+static int number_object(int kind, const char *host_name, const char *service_description)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(objects); i++) {
+		if (find_object(kind, host_name, service_description) == &objects[i])
+			return i;
+	}
+	return -1;
+}
+
+static void *find_numbered(int kind, uint32_t id, struct intern_names *names)
+{
+	if (id >= ARRAY_SIZE(objects) || (kind == INTERN_SERVICE) != !!objects[id].service_description)
+		return NULL;
+	names->host_name = objects[id].host_name;
+	names->service_description = objects[id].service_description;
+	return &objects[id];
+}
+
+static int encode_service(const char *host_name, const char *service_description, const char *output, char *buf)
+{
+	merlin_service_status st;
+
+	memset(&st, 0, sizeof(st));
+	st.host_name = (char *)host_name;
+	st.service_description = (char *)service_description;
+	st.state.current_state = 2;
+	st.state.plugin_output = (char *)output;
+	st.state.perf_data = "time=0.1s;;;0";
+	memset(buf, 0, 4096);
+	return merlin_encode(&st, NEBCALLBACK_SERVICE_CHECK_DATA, buf, 4096);
+}
+
+static int encode_host(const char *name, char *buf)
+{
+	merlin_host_status st;
+
+	memset(&st, 0, sizeof(st));
+	st.name = (char *)name;
+	st.state.plugin_output = "PING OK";
+	memset(buf, 0, 4096);
+	return merlin_encode(&st, NEBCALLBACK_HOST_STATUS_DATA, buf, 4096);
+}
+
+/* send an event through both tables and check it comes out as it went in */
+static uint32_t round_trip(intern_table *out, intern_table *in, int type, const char *buf, int len,
+                           void *object, const char *what)
+{
+	char interned[4096], expanded[4096];
+	struct intern_names names;
+	uint32_t ilen;
+	int elen;
+
+	memset(interned, 0, sizeof(interned));
+	ilen = intern_encode(out, type, buf, len, interned);
+	if (!ilen) {
+		t_fail("%s: event wasn't interned", what);
+		return 0;
+	}
+	if (ilen > (uint32_t)len)
+		t_fail("%s: interned event is bigger than it was (%u > %d)", what, ilen, len);
+
+	elen = intern_lookup(in, type, interned, ilen, &names);
+	if (elen != len) {
+		t_fail("%s: event is %d bytes with names put back, not %d", what, elen, len);
+		return 0;
+	}
+	memset(expanded, 0, sizeof(expanded));
+	intern_expand(type, interned, ilen, &names, expanded);
+	ok_int(memcmp(expanded, buf, len), 0, what);
+	ok_int(names.object == object, 1, "the ids resolve to the right object");
+	return ilen;
+}
+
+static void test_intern_round_trip(void)
+{
+	intern_table *out = intern_create(NULL), *in = intern_create(find_object);
+	char buf[4096], copy[4096];
+	merlin_service_status *st = (merlin_service_status *)copy;
+	uint32_t first, again, other;
+	int len;
+
+	ok_int(intern_type(NEBCALLBACK_SERVICE_CHECK_DATA), 1, "service check results have names to intern");
+	ok_int(intern_type(NEBCALLBACK_COMMENT_DATA), 0, "comments don't");
+
+	len = encode_service("web01", "HTTP", "HTTP OK", buf);
+	first = round_trip(out, in, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, &objects[1],
+	                   "a service with new names is sent along with them");
+	again = round_trip(out, in, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, &objects[1],
+	                   "a service with names sent before is sent with ids only");
+	ok_int(again < first, 1, "and is smaller");
+	ok_uint(first - again, 16, "by the names, nuls and all");
+
+	len = encode_service("web01", "HTTP", "HTTP CRITICAL - something else entirely", buf);
+	round_trip(out, in, NEBCALLBACK_SERVICE_STATUS_DATA, buf, len, &objects[1],
+	           "the rest of the event changes as it pleases");
+
+	len = encode_service("web01", "PING", "PING OK", buf);
+	other = round_trip(out, in, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, &objects[2],
+	                   "a new service on a known host only gives the service");
+	ok_uint(other, again + 8, "so only the description is sent");
+
+	len = encode_host("web01", buf);
+	round_trip(out, in, NEBCALLBACK_HOST_STATUS_DATA, buf, len, &objects[0],
+	           "a host given along with a service is known by id");
+
+	len = encode_host("db01", buf);
+	round_trip(out, in, NEBCALLBACK_HOST_STATUS_DATA, buf, len, &objects[3],
+	           "hosts get ids of their own");
+
+	len = encode_service("nosuchhost", "HTTP", "HTTP OK", buf);
+	round_trip(out, in, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, NULL,
+	           "names unknown to the receiver are still put back");
+
+	/* decoding the event that comes out gets the names back */
+	len = encode_service("web01", "PING", "PING OK", buf);
+	round_trip(out, in, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, &objects[2],
+	           "the same service again is sent with ids only");
+	memcpy(copy, buf, len);
+	ok_int(merlin_decode(copy, len, NEBCALLBACK_SERVICE_CHECK_DATA), 0, "the event decodes");
+	ok_str(st->host_name, "web01", "host name is put back");
+	ok_str(st->service_description, "PING", "service description is put back");
+	ok_str(st->state.plugin_output, "PING OK", "plugin output survives");
+
+	intern_destroy(out);
+	intern_destroy(in);
+}
+
+static void test_intern_errors(void)
+{
+	intern_table *out = intern_create(NULL), *in = intern_create(find_object), *fresh = intern_create(find_object);
+	char buf[4096], interned[4096];
+	struct intern_names names;
+	merlin_service_status st;
+	uint32_t ilen;
+	int len;
+
+	len = encode_service("web01", "HTTP", "HTTP OK", buf);
+	ilen = intern_encode(out, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, &names) > 0, 1,
+	       "the first event is accepted");
+	ilen = intern_encode(out, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	ok_int(intern_lookup(fresh, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, &names), -1,
+	       "ids that were given on another connection are rejected");
+	ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, interned, 16, &names), -1,
+	       "truncated events are rejected");
+
+	/* point the service description past the end of the event */
+	memcpy(&st, interned, sizeof(st));
+	st.service_description = (char *)(uintptr_t)INTERN_REF(2, ilen + 100);
+	memcpy(interned, &st, sizeof(st));
+	ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, &names), -1,
+	       "names given past the end of the event are rejected");
+
+	memset(&st, 0, sizeof(st));
+	st.host_name = "web01";
+	len = merlin_encode(&st, NEBCALLBACK_SERVICE_CHECK_DATA, buf, sizeof(buf));
+	ok_uint(intern_encode(out, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned), 0,
+	        "events without all their names are sent as they are");
+	len = encode_host("web01", buf);
+	ok_uint(intern_encode(out, NEBCALLBACK_COMMENT_DATA, buf, len, interned), 0,
+	        "and so are events of other types");
+
+	intern_destroy(out);
+	intern_destroy(in);
+	intern_destroy(fresh);
+}
+
+static void test_intern_numbered(void)
+{
+	intern_table *out = intern_create_numbered(number_object, NULL);
+	intern_table *in = intern_create_numbered(NULL, find_numbered);
+	char buf[4096], interned[4096];
+	struct intern_names names;
+	merlin_service_status st;
+	uint32_t ilen;
+	int len;
+
+	ok_int(intern_numbered(out), 1, "numbered tables say so");
+	ok_int(intern_numbered(NULL), 0, "no table isn't numbered");
+
+	len = encode_service("web01", "PING", "PING OK", buf);
+	ilen = round_trip(out, in, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, &objects[2],
+	                  "a service is sent by its object id");
+	ok_uint(ilen, len - 16, "and its names are never sent");
+	len = encode_host("db01", buf);
+	round_trip(out, in, NEBCALLBACK_HOST_STATUS_DATA, buf, len, &objects[3],
+	           "so is a host");
+
+	len = encode_service("nosuchhost", "HTTP", "HTTP OK", buf);
+	ok_uint(intern_encode(out, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned), 0,
+	        "objects without ids are sent as they are");
+
+	/* a host id where a service is expected */
+	len = encode_host("web01", buf);
+	ilen = intern_encode(out, NEBCALLBACK_HOST_STATUS_DATA, buf, len, interned);
+	ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, &names), -1,
+	       "host ids aren't taken for services");
+
+	len = encode_service("web01", "HTTP", "HTTP OK", buf);
+	ilen = intern_encode(out, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+	memcpy(&st, interned, sizeof(st));
+	st.service_description = (char *)(uintptr_t)INTERN_REF(ARRAY_SIZE(objects) + 1, 0);
+	memcpy(interned, &st, sizeof(st));
+	ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, &names), -1,
+	       "ids of objects we don't have are rejected");
+	st.service_description = (char *)(uintptr_t)INTERN_REF(2, 0);
+	st.host_name = (char *)(uintptr_t)INTERN_REF(1, 0);
+	memcpy(interned, &st, sizeof(st));
+	ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, &names), -1,
+	       "service events with a host id are rejected");
+
+	intern_destroy(out);
+	intern_destroy(in);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	t_set_colors(0);
+	t_start("host and service name interning tests");
+	test_intern_round_trip();
+	test_intern_errors();
+	test_intern_numbered();
+	return t_end();
+}
@@ -266,6 +266,8 @@ event_structs = {
 		'uint:host_checks_handled',
 		'uint:service_checks_handled',
 		'uint:monitored_object_state_size',
+		'uint:capabilities',
+		'byte[16]:session',
 	],
 	'merlin_runcmd': [
 		'int:sd',
@@ -37,9 +37,83 @@ gsize merlinreader_add_data(MerlinReader *mr, gpointer data, gsize size) {
 	mr->bufsize += size;
 	return size;
 }
+
+/*
+ * Read the LEB128 varint at *pos, moving pos past it. Returns FALSE
+ * if the buffer ends before it does.
+ */
+static gboolean read_varint(MerlinReader *mr, gsize *pos, guint64 *value) {
+	guint shift;
+	*value = 0;
+	for (shift = 0; *pos < mr->bufsize && shift < 64; shift += 7) {
+		guchar byte = mr->buffer.raw[(*pos)++];
+		*value |= (guint64)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Protocol version 4 events can come with a compact header instead,
+ * see MERLIN_COMPACT_MAGIC in shared/node.h. They're handed out with
+ * a full header, just like the rest.
+ */
+static merlin_event *merlinreader_get_compact_event(MerlinReader *mr) {
+	merlin_event *event_storage;
+	guint64 value[6];
+	gsize pos = 1, i;
+	guchar flags;
+
+	if (mr->bufsize < 2)
+		return NULL;
+	flags = mr->buffer.raw[pos++];
+
+	/* type, code, selection, len, sent.tv_sec, sent.tv_usec */
+	for (i = 0; i < G_N_ELEMENTS(value); i++) {
+		if (!read_varint(mr, &pos, &value[i]))
+			return NULL;
+	}
+	if (flags & MERLIN_COMPACT_CRYPT) {
+		pos += sizeof(event_storage->hdr.authtag) + sizeof(event_storage->hdr.nonce);
+	}
+	if (value[3] > sizeof(event_storage->body))
+		return NULL;
+
+	/* Is the event to short for the buffer? */
+	if (mr->bufsize < pos + value[3])
+		return NULL;
+
+	event_storage = g_malloc0(sizeof(merlin_header) + value[3]);
+	event_storage->hdr.sig.id = MERLIN_SIGNATURE;
+	event_storage->hdr.protocol = MERLIN_PROTOCOL_COMPACT;
+	event_storage->hdr.type = value[0];
+	event_storage->hdr.code = value[1];
+	event_storage->hdr.selection = value[2];
+	event_storage->hdr.len = value[3];
+	event_storage->hdr.sent.tv_sec = value[4];
+	event_storage->hdr.sent.tv_usec = value[5];
+	if (flags & MERLIN_COMPACT_CRYPT) {
+		gsize crypt = pos - sizeof(event_storage->hdr.authtag) - sizeof(event_storage->hdr.nonce);
+		memcpy(event_storage->hdr.authtag, &mr->buffer.raw[crypt], sizeof(event_storage->hdr.authtag));
+		crypt += sizeof(event_storage->hdr.authtag);
+		memcpy(event_storage->hdr.nonce, &mr->buffer.raw[crypt], sizeof(event_storage->hdr.nonce));
+	}
+	memcpy(event_storage->body, &mr->buffer.raw[pos], value[3]);
+
+	mr->bufsize -= pos + value[3];
+	memmove(mr->buffer.raw, mr->buffer.raw + pos + value[3], mr->bufsize);
+
+	return event_storage;
+}
+
 merlin_event *merlinreader_get_event(MerlinReader *mr) {
 	gsize event_size;
 	merlin_event *event_storage = NULL;
+
+	if (mr->bufsize && (guchar)mr->buffer.raw[0] == MERLIN_COMPACT_MAGIC)
+		return merlinreader_get_compact_event(mr);
+
 	/* We need at least a header to be able to read anything at all */
 	if (mr->bufsize < sizeof(merlin_header))
 		return NULL;
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "mpscq.h"
+#include "test_utils.h"
+
+#define NUM_PRODUCERS 4
+#define NUM_ENTRIES 200000
+
+struct item {
+	struct mpscq_entry entry; /* first, so entries are items */
+	unsigned int producer;
+	unsigned int seq;
+};
+
+static void test_mpscq_basic(void)
+{
+	struct item items[5];
+	struct mpscq_entry *e;
+	mpscq q;
+	unsigned int i, k = 0;
+
+	mpscq_init(&q);
+	ok_int(mpscq_empty(&q), 1, "a new queue is empty");
+	ok_int(mpscq_pop(&q) == NULL, 1, "and nothing comes out of it");
+
+	for (i = 0; i < 3; i++) {
+		items[i].seq = i;
+		mpscq_push(&q, &items[i].entry);
+	}
+	ok_int(mpscq_empty(&q), 0, "the queue isn't empty once entries are pushed");
+	while (k < 2 && (e = mpscq_pop(&q)))
+		ok_uint(((struct item *)e)->seq, k++, "entries come out in the order they went in");
+
+	/* the last one left is handed out while others are pushed behind it */
+	for (i = 3; i < 5; i++) {
+		items[i].seq = i;
+		mpscq_push(&q, &items[i].entry);
+	}
+	while ((e = mpscq_pop(&q)))
+		ok_uint(((struct item *)e)->seq, k++, "entries come out in the order they went in");
+	ok_uint(k, 5, "every entry came out");
+	ok_int(mpscq_empty(&q), 1, "the queue is empty again");
+
+	mpscq_push(&q, &items[0].entry);
+	ok_int(mpscq_pop(&q) == &items[0].entry, 1, "an entry can be pushed again once it's popped");
+	ok_int(mpscq_empty(&q), 1, "and the queue ends up empty");
+}
+
+static mpscq q;
+static struct item *all_items;
+
+static void *producer(void *arg)
+{
+	unsigned int p = (unsigned int)(unsigned long)arg, i;
+
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		struct item *it = &all_items[p * NUM_ENTRIES + i];
+
+		it->producer = p;
+		it->seq = i;
+		mpscq_push(&q, &it->entry);
+	}
+	return NULL;
+}
+
+static void test_mpscq_threads(void)
+{
+	pthread_t tid[NUM_PRODUCERS];
+	unsigned int next[NUM_PRODUCERS] = { 0 };
+	unsigned int i, got = 0, bad = 0;
+	struct mpscq_entry *e;
+
+	all_items = calloc(NUM_PRODUCERS * NUM_ENTRIES, sizeof(*all_items));
+	if (!all_items) {
+		t_fail("Failed to allocate %u items", NUM_PRODUCERS * NUM_ENTRIES);
+		return;
+	}
+	mpscq_init(&q);
+
+	for (i = 0; i < NUM_PRODUCERS; i++)
+		pthread_create(&tid[i], NULL, producer, (void *)(unsigned long)i);
+	while (got < NUM_PRODUCERS * NUM_ENTRIES) {
+		struct item *it;
+
+		if (!(e = mpscq_pop(&q)))
+			continue;
+		it = (struct item *)e;
+		if (it->producer >= NUM_PRODUCERS || it->seq != next[it->producer])
+			bad++;
+		else
+			next[it->producer]++;
+		got++;
+	}
+	for (i = 0; i < NUM_PRODUCERS; i++)
+		pthread_join(tid[i], NULL);
+
+	ok_uint(bad, 0, "entries from each producer come out in the order they went in");
+	ok_int(mpscq_empty(&q), 1, "and the queue ends up empty");
+	free(all_items);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	t_set_colors(0);
+	t_start("multi-producer, single-consumer queue tests");
+	test_mpscq_basic();
+	test_mpscq_threads();
+	return t_end();
+}
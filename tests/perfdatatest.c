@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "shared.h"
+#include "codec.h"
+#include "intern.h"
+#include "delta.h"
+#include "perfdata.h"
+#include "test_utils.h"
+
+/* a service check result with its perfdata trailer */
+static int encode_service(const char *perf_data, char *buf)
+{
+	merlin_service_status st;
+	int len;
+
+	memset(&st, 0, sizeof(st));
+	st.host_name = "web01";
+	st.service_description = "HTTP";
+	st.state.current_state = 1;
+	st.state.plugin_output = "HTTP WARNING";
+	st.state.perf_data = (char *)perf_data;
+	memset(buf, 0, 4096);
+	len = merlin_encode(&st, NEBCALLBACK_SERVICE_CHECK_DATA, buf, 4096);
+	return len + perfdata_encode(perf_data, buf + len, 4096 - len);
+}
+
+static void test_perfdata_parse(void)
+{
+	char buf[4096];
+	struct perfdata pd;
+	struct perfdata_value v;
+	uint32_t len;
+
+	len = perfdata_encode("time=0.25s;1;2;0;10 'disk ''root'''=50%;80:;90 size=U;; load=1.5", buf, sizeof(buf));
+	ok_int(len > 0, 1, "performance data is parsed");
+	ok_uint(len & 7, 0, "into a trailer that's a multiple of 8 bytes");
+	ok_int(perfdata_find(buf, len, &pd), 1, "which is found");
+	ok_uint(pd.num, 3, "values that aren't numbers are left out");
+
+	perfdata_get(&pd, 0, &v);
+	ok_str(perfdata_string(&pd, v.label), "time", "label is kept");
+	ok_str(perfdata_string(&pd, v.uom), "s", "and so is the unit");
+	ok_int(v.value == 0.25, 1, "value is parsed");
+	ok_int(v.flags, PERFDATA_WARN | PERFDATA_CRIT | PERFDATA_MIN | PERFDATA_MAX, "all the limits are set");
+	ok_int(v.warn == 1 && v.crit == 2 && v.min == 0 && v.max == 10, 1, "and parsed");
+
+	perfdata_get(&pd, 1, &v);
+	ok_str(perfdata_string(&pd, v.label), "disk 'root'", "quoted labels have their quotes put back");
+	ok_str(perfdata_string(&pd, v.uom), "%", "percentages are a unit");
+	ok_int(v.flags, PERFDATA_CRIT, "ranges don't count as limits");
+
+	perfdata_get(&pd, 2, &v);
+	ok_str(perfdata_string(&pd, v.label), "load", "values after skipped ones are parsed");
+	ok_str(perfdata_string(&pd, v.uom), "", "values without a unit have an empty one");
+	ok_int(v.flags, 0, "and no limits unless given");
+
+	len = perfdata_encode("a=1s b=2s c=3s", buf, sizeof(buf));
+	ok_int(perfdata_find(buf, len, &pd), 1, "units given many times are parsed");
+	ok_uint(pd.strings_len, 8, "and kept once");
+
+	ok_uint(perfdata_encode("", buf, sizeof(buf)), 0, "no performance data makes no trailer");
+	ok_uint(perfdata_encode(NULL, buf, sizeof(buf)), 0, "and neither does none at all");
+	ok_uint(perfdata_encode("garbage and=nothing else", buf, sizeof(buf)), 0, "nor does garbage");
+	ok_uint(perfdata_encode("time=0.1s", buf, 16), 0, "trailers are only made if they fit");
+}
+
+static void test_perfdata_find(void)
+{
+	char buf[4096], copy[4096];
+	merlin_service_status st;
+	struct perfdata pd;
+	struct perfdata_value v;
+	int len, plain;
+
+	memset(&st, 0, sizeof(st));
+	st.host_name = "web01";
+	st.service_description = "HTTP";
+	st.state.current_state = 1;
+	st.state.plugin_output = "HTTP WARNING";
+	st.state.perf_data = "time=0.1s;;;0";
+	plain = merlin_encode(&st, NEBCALLBACK_SERVICE_CHECK_DATA, buf, sizeof(buf));
+	ok_int(perfdata_find(buf, plain, &pd), 0, "events without a trailer have none");
+
+	len = encode_service("time=0.1s;;;0", buf);
+	ok_int(perfdata_find(buf, len, &pd), 1, "the trailer is found at the end of an event");
+	ok_uint(pd.len, len - plain, "and is all that was added");
+	memcpy(copy, buf, len);
+	ok_int(merlin_decode(copy, len, NEBCALLBACK_SERVICE_CHECK_DATA), 0, "events with one still decode");
+
+	perfdata_get(&pd, 0, &v);
+	ok_int(perfdata_find(buf, len - 8, &pd), 0, "truncated trailers are rejected");
+	v.label = pd.strings_len;
+	memcpy(buf + len - pd.len, &v, sizeof(v));
+	ok_int(perfdata_find(buf, len, &pd), 0, "labels past the strings are rejected");
+}
+
+/* the trailer survives interning and deltas */
+static void test_perfdata_carried(void)
+{
+	intern_table *out = intern_create(NULL), *in = intern_create(NULL);
+	delta_table *dout = delta_create(), *din = delta_create();
+	const struct monitored_object_state *state;
+	char buf[4096], interned[4096], delta[4096], expanded[4096], event[4096];
+	struct intern_names names;
+	struct perfdata pd;
+	uint32_t ilen, dlen;
+	int len, i;
+
+	for (i = 0; i < 2; i++) {
+		len = encode_service(i ? "time=0.2s;;;0 size=10B" : "time=0.1s;;;0", buf);
+		ilen = intern_encode(out, NEBCALLBACK_SERVICE_CHECK_DATA, buf, len, interned);
+		ok_int(perfdata_find(interned, ilen, &pd), 1, "interned events keep the trailer");
+		dlen = delta_encode(dout, 0, NEBCALLBACK_SERVICE_CHECK_DATA, interned, ilen, delta, ilen);
+		ok_int(dlen > 0, 1, "deltas are made of events with a trailer");
+
+		ok_int(delta_lookup(din, 0, NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, &state), (int)ilen,
+		       "deltas with a trailer are accepted");
+		delta_expand(NEBCALLBACK_SERVICE_CHECK_DATA, delta, dlen, state, expanded);
+		ok_int(memcmp(expanded, interned, ilen), 0, "and put back with it");
+
+		ok_int(intern_lookup(in, NEBCALLBACK_SERVICE_CHECK_DATA, expanded, ilen, &names), len,
+		       "interned events with a trailer are accepted");
+		intern_expand(NEBCALLBACK_SERVICE_CHECK_DATA, expanded, ilen, &names, event);
+		ok_int(memcmp(event, buf, len), 0, "and come out as they went in");
+	}
+
+	intern_destroy(out);
+	intern_destroy(in);
+	delta_destroy(dout);
+	delta_destroy(din);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	t_set_colors(0);
+	t_start("binary perfdata tests");
+	test_perfdata_parse();
+	test_perfdata_find();
+	test_perfdata_carried();
+	return t_end();
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "shmring.h"
+#include "test_utils.h"
+
+#define RING_PATH "/tmp/shmringtest.ring"
+#define NUM_ENTRIES 200000
+
+static void test_shmring_basic(void)
+{
+	shmring *prod, *cons;
+	char buf[3000], *p;
+	unsigned int len, i, k = 0, max_used = 0;
+	void *entry;
+
+	prod = shmring_create(RING_PATH, 16 << 10);
+	if (!prod) {
+		t_fail("Failed to create ring at %s", RING_PATH);
+		return;
+	}
+	cons = shmring_attach(RING_PATH);
+	if (!cons) {
+		t_fail("Failed to attach to ring at %s", RING_PATH);
+		shmring_destroy(prod, 1);
+		return;
+	}
+	ok_uint(shmring_size(cons), 16 << 10, "both ends agree on the size");
+	ok_int(shmring_peek(cons, &entry, &len), -1, "a new ring is empty");
+	ok_int(shmring_wake(prod), 0, "a consumer that isn't sleeping needn't be woken up");
+	ok_int(shmring_sleep(cons), 0, "the consumer may sleep on an empty ring");
+
+	/* odd sizes, so entries end up wrapping around at all sorts of offsets */
+	for (i = 0; shmring_put(prod, memset(buf, i & 0xff, 1 + (i * 37) % sizeof(buf)), 1 + (i * 37) % sizeof(buf)) == 0; i++)
+		;
+	ok_int(i > 4, 1, "a bunch of entries fit before the ring is full");
+	ok_int(shmring_wake(prod), 1, "the producer is told to wake the consumer");
+	ok_int(shmring_wake(prod), 0, "and only once");
+	shmring_block(prod);
+
+	for (;;) {
+		while (!shmring_peek(cons, &entry, &len)) {
+			p = entry;
+			if (((uintptr_t)entry & 7) || len != 1 + (k * 37) % sizeof(buf) ||
+			    p[0] != (char)(k & 0xff) || p[len - 1] != (char)(k & 0xff))
+			{
+				t_fail("Entry %u was mangled", k);
+				shmring_destroy(cons, 0);
+				shmring_destroy(prod, 1);
+				return;
+			}
+			shmring_consume(cons);
+			k++;
+		}
+		if (k >= 1000)
+			break;
+		while (!shmring_put(prod, memset(buf, i & 0xff, 1 + (i * 37) % sizeof(buf)), 1 + (i * 37) % sizeof(buf))) {
+			if (shmring_used(prod) > max_used)
+				max_used = shmring_used(prod);
+			i++;
+		}
+	}
+	ok_uint(k, i, "every entry came out in order, aligned and intact");
+	ok_uint(shmring_used(prod), 0, "the ring is empty once everything is consumed");
+	ok_int(max_used <= (16 << 10), 1, "the ring never holds more than its size");
+	ok_int(shmring_unblock(cons), 1, "the consumer is told the producer was blocked");
+	ok_int(shmring_unblock(cons), 0, "and only once");
+
+	ok_int(shmring_put(prod, buf, 1), 0, "entries can be put in after that");
+	ok_int(shmring_sleep(cons), -1, "the consumer mustn't sleep with entries waiting");
+	ok_int(shmring_wake(prod), 0, "so it needn't be woken up");
+	ok_int(shmring_put(prod, NULL, 0), 0, "empty entries are fine");
+	ok_int(shmring_peek(cons, &entry, &len) == 0 && len == 1, 1, "the first one comes out first");
+	shmring_consume(cons);
+	ok_int(shmring_peek(cons, &entry, &len) == 0 && len == 0, 1, "empty entries come out empty");
+	shmring_consume(cons);
+	ok_int(shmring_put(prod, buf, 20 << 10), -1, "entries larger than the ring are refused");
+
+	shmring_destroy(cons, 0);
+	shmring_destroy(prod, 1);
+	ok_int(access(RING_PATH, F_OK), -1, "the ring is unlinked when asked to");
+}
+
+static void *producer(void *arg)
+{
+	shmring *r = arg;
+	unsigned int i;
+	uint64_t v[8];
+
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		v[0] = i;
+		while (shmring_put(r, v, sizeof(uint64_t) * (1 + i % 8)))
+			;
+	}
+	return NULL;
+}
+
+static void test_shmring_threads(void)
+{
+	shmring *prod, *cons;
+	pthread_t tid;
+	unsigned int len, k = 0, bad = 0;
+	void *entry;
+
+	prod = shmring_create(RING_PATH, 4096);
+	cons = prod ? shmring_attach(RING_PATH) : NULL;
+	if (!cons) {
+		t_fail("Failed to set up ring at %s", RING_PATH);
+		shmring_destroy(prod, 1);
+		return;
+	}
+
+	pthread_create(&tid, NULL, producer, prod);
+	while (k < NUM_ENTRIES) {
+		if (shmring_peek(cons, &entry, &len))
+			continue;
+		if (*(uint64_t *)entry != k || len != sizeof(uint64_t) * (1 + k % 8))
+			bad++;
+		shmring_consume(cons);
+		k++;
+	}
+	pthread_join(tid, NULL);
+	ok_uint(bad, 0, "entries put in by another thread come out in order");
+	ok_uint(shmring_used(cons), 0, "and the ring ends up empty");
+
+	shmring_destroy(cons, 0);
+	shmring_destroy(prod, 1);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	t_set_colors(0);
+	t_start("shared memory ring tests");
+	test_shmring_basic();
+	test_shmring_threads();
+	return t_end();
+}
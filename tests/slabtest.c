@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "slab.h"
+#include "test_utils.h"
+
+#define ARRAY_SIZE(ary) (sizeof(ary) / sizeof(ary[0]))
+#define NUM_OBJS 500
+
+static void test_slab_classes(void)
+{
+	slab_cache cache;
+	static const size_t sizes[] = {
+		1, 128, 512, 513, 4096, 70000, 128 << 10, (128 << 10) + 128, 1 << 18,
+	};
+	char *p[ARRAY_SIZE(sizes)];
+	uint i;
+
+	memset(&cache, 0, sizeof(cache));
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		p[i] = slab_alloc(&cache, sizes[i]);
+		if (!p[i]) {
+			t_fail("Failed to allocate %zu bytes", sizes[i]);
+			return;
+		}
+		/* scribble all over it to make sure it's ours */
+		memset(p[i], i + 1, sizes[i]);
+	}
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if (p[i][0] != (char)(i + 1) || p[i][sizes[i] - 1] != (char)(i + 1))
+			t_fail("Object %u of %zu bytes was overwritten", i, sizes[i]);
+	}
+	ok_uint(cache.stats.fallbacks, 0, "events up to the largest class come from chunks");
+	ok_uint(cache.stats.allocs, ARRAY_SIZE(sizes), "allocations are counted");
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++)
+		slab_free(p[i]);
+	ok_uint(cache.stats.frees, ARRAY_SIZE(sizes), "frees are counted");
+	ok_uint(cache.stats.in_use, 0, "nothing is in use after freeing everything");
+
+	p[0] = slab_alloc(&cache, (1 << 18) + 1);
+	ok_uint(cache.stats.fallbacks, 1, "oversized allocations are passed on to malloc()");
+	memset(p[0], 0, (1 << 18) + 1);
+	slab_free(p[0]);
+	ok_uint(cache.stats.in_use, 0, "oversized allocations are freed");
+
+	slab_destroy(&cache);
+	ok_uint(cache.stats.chunks, 0, "destroying an idle cache unmaps all chunks");
+	ok_uint(cache.stats.mapped, 0, "destroying an idle cache leaves nothing mapped");
+}
+
+static void test_slab_reuse(void)
+{
+	slab_cache cache;
+	char *p[NUM_OBJS];
+	unsigned int chunks;
+	uint i, round;
+
+	memset(&cache, 0, sizeof(cache));
+	for (i = 0; i < NUM_OBJS; i++) {
+		p[i] = slab_alloc(&cache, 1000);
+		snprintf(p[i], 1000, "object %u", i);
+	}
+	chunks = cache.stats.chunks;
+	if (chunks < 2) {
+		t_fail("%u objects should need more than one chunk", NUM_OBJS);
+	}
+	for (i = 0; i < NUM_OBJS; i++) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "object %u", i);
+		if (strcmp(p[i], buf))
+			t_fail("Object %u was overwritten: %s", i, p[i]);
+	}
+
+	/* free every other object, then fill the holes again */
+	for (round = 0; round < 10; round++) {
+		for (i = round & 1; i < NUM_OBJS; i += 2)
+			slab_free(p[i]);
+		for (i = round & 1; i < NUM_OBJS; i += 2)
+			p[i] = slab_alloc(&cache, 1000);
+	}
+	ok_uint(cache.stats.chunks, chunks, "freed objects are reused");
+
+	/* the steady state of handling one event at a time */
+	for (i = 0; i < NUM_OBJS; i++)
+		slab_free(p[i]);
+	ok_uint(cache.stats.chunks, 1, "one spare chunk is kept when everything is freed");
+	for (i = 0; i < 10000; i++)
+		slab_free(slab_alloc(&cache, 513 + i % 500));
+	ok_uint(cache.stats.chunks, 1, "alloc/free cycles don't map more chunks");
+	ok_uint(cache.stats.in_use, 0, "no bytes in use after alloc/free cycles");
+	ok_uint(cache.stats.allocs, cache.stats.frees, "every allocation was freed");
+
+	/* objects outliving slab_destroy() keep their chunk alive */
+	p[0] = slab_alloc(&cache, 1000);
+	slab_destroy(&cache);
+	ok_uint(cache.stats.chunks, 1, "chunks in use survive slab_destroy()");
+	slab_free(p[0]);
+	slab_destroy(&cache);
+	ok_uint(cache.stats.chunks, 0, "and are unmapped once freed");
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	t_set_colors(0);
+	t_start("slab allocator tests");
+	test_slab_classes();
+	test_slab_reuse();
+	return t_end();
+}
@@ -1,7 +1,10 @@
 #include "codec.h"
+#include "encryption.h"
 #include "hooks.c"
 #include "node.h"
 #include <check.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 
 #include <naemon/naemon.h>
 
@@ -75,6 +78,9 @@ int ipc_send_event(merlin_event *pkt) {
 	return 0;
 }
 int ipc_grok_var(__attribute__((unused)) char *var, __attribute__((unused)) char *val) {return 1;}
+int ipc_ring_offer(void) { return 0; }
+void ipc_ring_resume(void) {}
+void ipc_ring_close(void) {}
 
 #include "module.c"
 #include "pgroup.c"
@@ -266,6 +272,567 @@ START_TEST(multiple_host_expire)
 }
 END_TEST
 
+static int send_encoded(merlin_node *node, int type, void *data)
+{
+	merlin_event pkt;
+
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.type = type;
+	pkt.hdr.len = merlin_encode_event(&pkt, data);
+	node_send_event(node, &pkt);
+	return packet_size(&pkt);
+}
+
+START_TEST(priority_lane)
+{
+	merlin_node *node = node_table[0];
+	merlin_host_status hst = { .name = "host0" };
+	nebstruct_downtime_data dt0 = { .host_name = "host0" };
+	nebstruct_downtime_data dt1 = { .host_name = "host1" };
+
+	/* not actually connected, so everything goes in the backlog */
+	binlog_dir = strdup("/tmp");
+	ck_assert(node->sock < 0);
+
+	send_encoded(node, NEBCALLBACK_DOWNTIME_DATA, &dt1);
+	ck_assert_msg(binlog_num_entries(node->prio_binlog) == 1, "Downtime should go in the priority lane");
+	ck_assert_msg(binlog_num_entries(node->binlog) == 0, "Downtime should not go in the bulk lane");
+
+	send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(binlog_num_entries(node->binlog) == 1, "Check results should go in the bulk lane");
+
+	send_encoded(node, NEBCALLBACK_DOWNTIME_DATA, &dt0);
+	ck_assert_msg(binlog_num_entries(node->binlog) == 2, "Downtime should stay behind pending results for its host");
+	ck_assert_msg(binlog_num_entries(node->prio_binlog) == 1, "Downtime should stay behind pending results for its host");
+
+	send_encoded(node, NEBCALLBACK_DOWNTIME_DATA, &dt1);
+	ck_assert_msg(binlog_num_entries(node->prio_binlog) == 2, "Downtime for other hosts should go in the priority lane");
+
+	binlog_wipe(node->binlog, BINLOG_UNLINK);
+	binlog_wipe(node->prio_binlog, BINLOG_UNLINK);
+	send_encoded(node, NEBCALLBACK_DOWNTIME_DATA, &dt0);
+	ck_assert_msg(binlog_num_entries(node->prio_binlog) == 1, "Nothing should be pending once the bulk lane is empty");
+
+	binlog_wipe(node->prio_binlog, BINLOG_UNLINK);
+	safe_free(binlog_dir);
+}
+END_TEST
+
+START_TEST(output_buffer)
+{
+	merlin_node *node = node_table[0];
+	merlin_host_status hst = { .name = "host0" };
+	int sv[2], sndbuf = 4096, i, size = 0;
+	size_t bytes = 0;
+	ssize_t len;
+	char buf[65536];
+
+	binlog_dir = strdup("/tmp");
+	binlog_outbuf_size = 4;
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+
+	/* nobody's reading, so this is more than the socket will take */
+	for (i = 0; i < 200; i++)
+		size = send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(node_outbuf_pending(node) > 0, "What the socket won't take should be queued");
+	ck_assert_msg(node_outbuf_pending(node) < binlog_outbuf_size * 1024 + size, "The output buffer shouldn't grow past its limit");
+	ck_assert_msg(binlog_num_entries(node->binlog) > 0, "Events should go in the backlog once the output buffer is full");
+	ck_assert_msg(node_wants_output(node), "The socket should be polled for writability");
+
+	/* the queue and then the backlog go out as the socket drains */
+	for (i = 0; i < 10000 && node_wants_output(node); i++) {
+		while ((len = read(sv[1], buf, sizeof(buf))) > 0)
+			bytes += len;
+		iobroker_poll(nagios_iobs, 10);
+	}
+	while ((len = read(sv[1], buf, sizeof(buf))) > 0)
+		bytes += len;
+	ck_assert_msg(!node_wants_output(node), "Everything should have been sent");
+	ck_assert_msg(bytes == (size_t)size * 200, "Expected %d bytes, got %zu", size * 200, bytes);
+
+	node_disconnect(node, "Test done");
+	close(sv[1]);
+	binlog_outbuf_size = 256;
+	safe_free(binlog_dir);
+}
+END_TEST
+
+START_TEST(frames)
+{
+	merlin_node *node = node_table[0], *peer = node_table[1];
+	merlin_host_status hst = { .name = "host0" };
+	nebstruct_downtime_data dt = { .host_name = "host1" };
+	int expect[] = {
+		NEBCALLBACK_HOST_CHECK_DATA, NEBCALLBACK_HOST_CHECK_DATA,
+		NEBCALLBACK_DOWNTIME_DATA, NEBCALLBACK_HOST_CHECK_DATA,
+	};
+	merlin_event *pkt;
+	int sv[2];
+	unsigned int i;
+
+	node->info.capabilities = MERLIN_CAP_FRAMES;
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+	peer->sock = sv[1];
+
+	send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(node->frame_out_events == 2, "Check results should be batched up");
+	send_encoded(node, NEBCALLBACK_DOWNTIME_DATA, &dt);
+	ck_assert_msg(node->frame_out_events == 0, "Priority events should be sent on their own, after the batch");
+	send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	node_frame_flush(node);
+	ck_assert_msg(node->stats.frames.sent == 2, "Expected 2 frames sent, got %llu", node->stats.frames.sent);
+
+	ck_assert(node_recv(peer) > 0);
+	for (i = 0; i < ARRAY_SIZE(expect); i++) {
+		pkt = node_get_event(peer);
+		ck_assert_msg(pkt != NULL, "Event %u should have been received", i);
+		ck_assert_msg(pkt->hdr.type == expect[i], "Event %u has type %u, expected %d", i, pkt->hdr.type, expect[i]);
+		slab_free(pkt);
+	}
+	ck_assert_msg(node_get_event(peer) == NULL, "There should be no more events");
+	ck_assert_msg(peer->stats.frames.read == 2, "Expected 2 frames read, got %llu", peer->stats.frames.read);
+
+	node->info.capabilities = 0;
+	node_disconnect(node, "Test done");
+	node_disconnect(peer, "Test done");
+}
+END_TEST
+
+START_TEST(compact_header)
+{
+	merlin_node *node = node_table[0], *peer = node_table[1];
+	merlin_host_status hst = { .name = "host0" };
+	merlin_event *pkt;
+	unsigned long long sent = node->stats.bytes.sent;
+	unsigned char c;
+	int sv[2], size;
+
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+	peer->sock = sv[1];
+	node->protocol = MERLIN_PROTOCOL_VERSION;
+
+	size = send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(recv(sv[1], &c, 1, MSG_PEEK) == 1 && c == MERLIN_COMPACT_MAGIC, "Events should get a compact header");
+	ck_assert_msg(node->stats.bytes.sent - sent < (unsigned long long)size - 64, "The compact header should be smaller");
+	node_send_ctrl_active(node, 0, &ipc.info);
+
+	ck_assert(node_recv(peer) > 0);
+	pkt = node_get_event(peer);
+	ck_assert_msg(pkt != NULL, "The event should have been received");
+	ck_assert_msg(pkt->hdr.type == NEBCALLBACK_HOST_CHECK_DATA, "Event has type %u", pkt->hdr.type);
+	ck_assert_msg(packet_size(pkt) == size, "Event has size %d, expected %d", packet_size(pkt), size);
+	slab_free(pkt);
+	pkt = node_get_event(peer);
+	ck_assert_msg(pkt != NULL, "CTRL_ACTIVE should have been received");
+	ck_assert_msg(pkt->hdr.code == CTRL_ACTIVE, "Expected CTRL_ACTIVE, got code %u", pkt->hdr.code);
+	ck_assert_msg(!strcmp(pkt->hdr.from_uuid, ipc.uuid), "CTRL_ACTIVE should carry our UUID");
+	slab_free(pkt);
+
+	node_disconnect(node, "Test done");
+	node_disconnect(peer, "Test done");
+	ck_assert_msg(node->protocol == 0, "The next connection should start out with full headers");
+}
+END_TEST
+
+START_TEST(compression)
+{
+	merlin_node *node = node_table[0], *peer = node_table[1];
+	merlin_host_status hst = { .name = "host0" };
+	merlin_nodeinfo info = { .capabilities = MERLIN_CAP_LZ4 | MERLIN_CAP_ZSTD };
+	merlin_event *pkt, active;
+	unsigned char c;
+	int sv[2], i, size = 0;
+
+	if (zstream_supported(BINLOG_COMPRESS_ZSTD))
+		node->compression = BINLOG_COMPRESS_ZSTD;
+	else if (zstream_supported(BINLOG_COMPRESS_LZ4))
+		node->compression = BINLOG_COMPRESS_LZ4;
+	else
+		return;
+
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+	peer->sock = sv[1];
+
+	/* the peer tells us it can decompress what we send */
+	memset(&active.hdr, 0, HDR_SIZE);
+	active.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	active.hdr.len = sizeof(info);
+	memcpy(active.body, &info, sizeof(info));
+	node_set_info(node, &active);
+	ck_assert_msg(node->zout != NULL, "Compression should have been negotiated");
+
+	for (i = 0; i < 20; i++)
+		size = send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(recv(sv[1], &c, 1, MSG_PEEK) == 1 && c == ZSTREAM_MAGIC, "Events should be compressed");
+	ck_assert_msg(node->stats.compress.wire < node->stats.compress.raw,
+	              "Compressed %llu bytes into %llu", node->stats.compress.raw, node->stats.compress.wire);
+
+	for (i = 0; i < 20; i++) {
+		if (!(pkt = node_get_event(peer)))
+			ck_assert(node_recv(peer) > 0 && (pkt = node_get_event(peer)));
+		ck_assert_msg(pkt->hdr.type == NEBCALLBACK_HOST_CHECK_DATA, "Event %d has type %u", i, pkt->hdr.type);
+		ck_assert_msg(packet_size(pkt) == size, "Event %d has size %d, expected %d", i, packet_size(pkt), size);
+		slab_free(pkt);
+	}
+	ck_assert_msg(peer->stats.decompress.raw == node->stats.compress.raw, "Everything sent should be decompressed");
+
+	node_disconnect(node, "Test done");
+	node_disconnect(peer, "Test done");
+	ck_assert_msg(node->zout == NULL && peer->zin == NULL, "The next connection should start out uncompressed");
+	node->compression = BINLOG_COMPRESS_NONE;
+}
+END_TEST
+
+START_TEST(flow_control)
+{
+	merlin_node *node = node_table[0], *peer = node_table[1];
+	merlin_host_status hst = { .name = "host0" };
+	merlin_event *pkt;
+	int sv[2];
+
+	binlog_dir = strdup("/tmp");
+	node->info.capabilities = peer->info.capabilities = MERLIN_CAP_CREDIT;
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+	peer->sock = sv[1];
+
+	/* the first window is used up, so this has to wait */
+	node->credit.sent = MERLIN_CREDIT_WINDOW;
+	send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(binlog_num_entries(node->binlog) == 1, "Events should wait in the backlog for credit");
+	ck_assert_msg(!node_wants_output(node), "There's nothing to send until we get more credit");
+
+	/* once half the window has been processed, the peer grants more */
+	peer->credit.read = MERLIN_CREDIT_WINDOW / 2;
+	ck_assert(node_get_event(peer) == NULL);
+	ck_assert_msg(peer->credit.granted == MERLIN_CREDIT_WINDOW * 3 / 2,
+	              "Expected %d events granted, got %llu", MERLIN_CREDIT_WINDOW * 3 / 2,
+	              (unsigned long long)peer->credit.granted);
+
+	ck_assert(node_recv(node) > 0);
+	ck_assert_msg(node_get_event(node) == NULL, "CTRL_CREDIT shouldn't be handed to the caller");
+	ck_assert_msg(node->credit.limit == MERLIN_CREDIT_WINDOW * 3 / 2, "The grant should have been received");
+	ck_assert_msg(binlog_num_entries(node->binlog) == 0, "The backlog should be sent once there's credit");
+
+	ck_assert(node_recv(peer) > 0);
+	pkt = node_get_event(peer);
+	ck_assert_msg(pkt != NULL, "The event should have been received");
+	ck_assert_msg(pkt->hdr.type == NEBCALLBACK_HOST_CHECK_DATA, "Event has type %u", pkt->hdr.type);
+	slab_free(pkt);
+	ck_assert_msg(peer->credit.read == MERLIN_CREDIT_WINDOW / 2 + 1, "The event should be counted");
+
+	node_disconnect(node, "Test done");
+	node_disconnect(peer, "Test done");
+	ck_assert_msg(node->credit.sent == 0 && peer->credit.read == 0, "The next connection should start over");
+	safe_free(binlog_dir);
+}
+END_TEST
+
+START_TEST(interning)
+{
+	merlin_node *node = node_table[0], *peer = node_table[1];
+	merlin_host_status hst = { .name = "host0" };
+	merlin_service_status svc = { .host_name = "host0", .service_description = "service0" };
+	merlin_nodeinfo info = { .capabilities = MERLIN_CAP_INTERN };
+	merlin_event *pkt, active;
+	unsigned long long sent;
+	int sv[2], i, size;
+
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+	peer->sock = sv[1];
+
+	/* the peer tells us it takes ids for names */
+	memset(&active.hdr, 0, HDR_SIZE);
+	active.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	active.hdr.len = sizeof(info);
+	memcpy(active.body, &info, sizeof(info));
+	node_set_info(node, &active);
+	ck_assert_msg(node->intern_out != NULL, "Interning should have been negotiated");
+
+	size = send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	sent = node->stats.bytes.sent;
+	send_encoded(node, NEBCALLBACK_HOST_CHECK_DATA, &hst);
+	ck_assert_msg(node->stats.bytes.sent - sent < (unsigned long long)size, "The name should only be sent once");
+
+	/* frames are interned event by event */
+	node->info.capabilities |= MERLIN_CAP_FRAMES;
+	for (i = 0; i < 3; i++)
+		send_encoded(node, NEBCALLBACK_SERVICE_CHECK_DATA, &svc);
+	node_frame_flush(node);
+	ck_assert_msg(node->stats.intern.sent == 5, "Expected 5 interned events, got %llu", node->stats.intern.sent);
+
+	ck_assert(node_recv(peer) > 0);
+	for (i = 0; i < 5; i++) {
+		pkt = node_get_event(peer);
+		ck_assert_msg(pkt != NULL, "Event %d should have been received", i);
+		ck_assert_msg(pkt->hdr.code == 0, "Event %d should have its names back", i);
+		ck_assert(!merlin_decode_event(peer, pkt));
+		if (i < 2) {
+			merlin_host_status *st = (merlin_host_status *)pkt->body;
+			ck_assert_msg(packet_size(pkt) == size, "Event %d has size %d, expected %d", i, packet_size(pkt), size);
+			ck_assert_msg(!strcmp(st->name, "host0"), "Event %d is for host '%s'", i, st->name);
+			ck_assert_msg(peer->object == find_host("host0"), "Event %d should come with its host", i);
+		} else {
+			merlin_service_status *st = (merlin_service_status *)pkt->body;
+			ck_assert_msg(!strcmp(st->host_name, "host0") && !strcmp(st->service_description, "service0"),
+			              "Event %d is for service '%s;%s'", i, st->host_name, st->service_description);
+			ck_assert_msg(peer->object == find_service("host0", "service0"), "Event %d should come with its service", i);
+		}
+		slab_free(pkt);
+	}
+	ck_assert_msg(peer->stats.intern.read == 5, "Expected 5 interned events read, got %llu", peer->stats.intern.read);
+
+	node->info.capabilities = 0;
+	node_disconnect(node, "Test done");
+	node_disconnect(peer, "Test done");
+	ck_assert_msg(node->intern_out == NULL && peer->intern_in == NULL, "The next connection should start over");
+}
+END_TEST
+
+/*
+ * Not much of a test, but a benchmark of sending one event to many
+ * encrypted nodes, which should cost about the same per node no
+ * matter how many there are, since the event is never copied.
+ */
+START_TEST(encrypted_fanout)
+{
+	static merlin_event pkt;
+	merlin_header hdr;
+	merlin_host_status hst = { .name = "host0" };
+	merlin_node *nodes, *peers, *ntable[50];
+	unsigned char pk[crypto_box_PUBLICKEYBYTES], sk[crypto_box_SECRETKEYBYTES];
+	unsigned int fanout[] = { 1, 10, 50 }, i, f, rounds = 200;
+	char buf[65536];
+
+	binlog_dir = strdup("/tmp");
+	nodes = calloc(ARRAY_SIZE(ntable), sizeof(*nodes));
+	peers = calloc(ARRAY_SIZE(ntable), sizeof(*peers));
+	ck_assert(nodes && peers && !crypto_box_keypair(pk, sk));
+	for (i = 0; i < ARRAY_SIZE(ntable); i++) {
+		int sv[2];
+
+		ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+		fcntl(sv[1], F_SETFL, O_NONBLOCK);
+		nodes[i].name = peers[i].name = "fanout";
+		nodes[i].type = peers[i].type = MODE_POLLER;
+		nodes[i].state = peers[i].state = STATE_CONNECTED;
+		nodes[i].encrypted = peers[i].encrypted = 1;
+		ck_assert(!crypto_box_beforenm(nodes[i].sharedkey, pk, sk));
+		memcpy(peers[i].sharedkey, nodes[i].sharedkey, sizeof(peers[i].sharedkey));
+		nodes[i].sock = sv[0];
+		peers[i].sock = sv[1];
+		peers[i].bq = nm_bufferqueue_create();
+		ntable[i] = &nodes[i];
+	}
+
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.type = NEBCALLBACK_HOST_CHECK_DATA;
+	pkt.hdr.len = merlin_encode_event(&pkt, &hst);
+
+	for (f = 0; f < ARRAY_SIZE(fanout); f++) {
+		struct timeval start, stop;
+		double usecs = 0;
+		unsigned int r;
+
+		for (r = 0; r < rounds; r++) {
+			gettimeofday(&start, NULL);
+			net_sendto_many(ntable, fanout[f], &pkt);
+			gettimeofday(&stop, NULL);
+			usecs += (stop.tv_sec - start.tv_sec) * 1000000.0 + stop.tv_usec - start.tv_usec;
+			for (i = 0; i < fanout[f]; i++)
+				while (read(peers[i].sock, buf, sizeof(buf)) > 0)
+					;
+		}
+		printf("encrypted fanout: %2u nodes: %.2f usecs per event and node\n",
+		       fanout[f], usecs / rounds / fanout[f]);
+	}
+
+	/* every node gets the same plaintext, encrypted for it */
+	memcpy(&hdr, &pkt.hdr, HDR_SIZE);
+	net_sendto_many(ntable, ARRAY_SIZE(ntable), &pkt);
+	ck_assert_msg(!memcmp(&hdr, &pkt.hdr, HDR_SIZE), "The event itself should be left alone");
+	for (i = 0; i < ARRAY_SIZE(ntable); i++) {
+		merlin_event *got;
+
+		ck_assert(node_recv(&peers[i]) > 0);
+		got = node_get_event(&peers[i]);
+		ck_assert_msg(got != NULL, "Node %u should have got the event", i);
+		ck_assert_msg(got->hdr.len == pkt.hdr.len && !memcmp(got->body, pkt.body, pkt.hdr.len),
+		              "Node %u should have got the event as it was sent", i);
+		slab_free(got);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ntable); i++) {
+		nodes[i].state = peers[i].state = STATE_NONE;
+		node_disconnect(&nodes[i], NULL);
+		node_disconnect(&peers[i], NULL);
+		nm_bufferqueue_destroy(nodes[i].bq);
+		nm_bufferqueue_destroy(peers[i].bq);
+	}
+	free(nodes);
+	free(peers);
+	safe_free(binlog_dir);
+}
+END_TEST
+
+START_TEST(replay)
+{
+	static merlin_event pkt;
+	static merlin_nodeinfo info;
+	merlin_node a = { .name = "a", .type = MODE_PEER, .state = STATE_CONNECTED, .encrypted = 1 };
+	merlin_node b = { .name = "b", .type = MODE_PEER, .state = STATE_CONNECTED, .encrypted = 1 };
+	unsigned char pk[crypto_box_PUBLICKEYBYTES], sk[crypto_box_SECRETKEYBYTES];
+	unsigned char rec[4096];
+	merlin_event *got;
+	ssize_t rec_len;
+	int sv[2], i;
+
+	binlog_dir = strdup("/tmp");
+	ck_assert(!crypto_box_keypair(pk, sk));
+	ck_assert(!crypto_box_beforenm(a.sharedkey, pk, sk));
+	memcpy(b.sharedkey, a.sharedkey, sizeof(b.sharedkey));
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	a.sock = sv[0];
+	b.sock = sv[1];
+	b.bq = nm_bufferqueue_create();
+
+	/* a learns the session b wants from b's CTRL_ACTIVE */
+	info.capabilities = MERLIN_CAP_SEQNONCE;
+	ck_assert(!seq_session(&b, &info));
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.sig.id = MERLIN_SIGNATURE;
+	pkt.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	pkt.hdr.len = sizeof(info);
+	memcpy(pkt.body, &info, sizeof(info));
+	node_set_info(&a, &pkt);
+	ck_assert_msg(seq_nonces(&a), "a should use counter nonces for b's session");
+
+	for (i = 0; i < 10; i++) {
+		memset(&pkt.hdr, 0, HDR_SIZE);
+		pkt.hdr.type = NEBCALLBACK_SERVICE_CHECK_DATA;
+		pkt.hdr.len = 100;
+		memset(pkt.body, i, pkt.hdr.len);
+		ck_assert(!node_send_event(&a, &pkt));
+		if (!i) {
+			rec_len = recv(sv[1], rec, sizeof(rec), MSG_PEEK);
+			ck_assert_msg(rec_len > 0 && rec[0] == MERLIN_COMPACT_MAGIC && (rec[1] & MERLIN_COMPACT_SEQ),
+			              "The nonce should be left out of the header");
+		}
+	}
+	ck_assert(node_recv(&b) > 0);
+	for (i = 0; i < 10; i++) {
+		got = node_get_event(&b);
+		ck_assert_msg(got != NULL && got->hdr.len == 100 && got->body[0] == i,
+		              "Event %d should decrypt as it was sent", i);
+		slab_free(got);
+	}
+
+	/* sending the first one again mustn't get it accepted */
+	ck_assert(write(sv[0], rec, rec_len) == rec_len);
+	node_recv(&b);
+	ck_assert_msg(node_get_event(&b) == NULL && b.state != STATE_CONNECTED,
+	              "A replayed packet should get the node disconnected");
+
+	a.state = STATE_NONE;
+	node_disconnect(&a, NULL);
+	nm_bufferqueue_destroy(a.bq);
+	nm_bufferqueue_destroy(b.bq);
+	safe_free(binlog_dir);
+}
+END_TEST
+
+/*
+ * Encrypted data doesn't compress, so encrypted nodes get each body
+ * compressed before it's encrypted
+ */
+START_TEST(encrypted_compression)
+{
+	static merlin_event pkt;
+	static merlin_nodeinfo info;
+	merlin_node a = { .name = "a", .type = MODE_PEER, .state = STATE_CONNECTED, .encrypted = 1 };
+	merlin_node b = { .name = "b", .type = MODE_PEER, .state = STATE_CONNECTED, .encrypted = 1 };
+	unsigned char pk[crypto_box_PUBLICKEYBYTES], sk[crypto_box_SECRETKEYBYTES];
+	unsigned char rec[2];
+	merlin_event *got;
+	int sv[2], i;
+
+	if (zstream_supported(BINLOG_COMPRESS_ZSTD))
+		a.compression = BINLOG_COMPRESS_ZSTD;
+	else if (zstream_supported(BINLOG_COMPRESS_LZ4))
+		a.compression = BINLOG_COMPRESS_LZ4;
+	else
+		return;
+
+	binlog_dir = strdup("/tmp");
+	ck_assert(!crypto_box_keypair(pk, sk));
+	ck_assert(!crypto_box_beforenm(a.sharedkey, pk, sk));
+	memcpy(b.sharedkey, a.sharedkey, sizeof(b.sharedkey));
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	a.sock = sv[0];
+	b.sock = sv[1];
+	b.bq = nm_bufferqueue_create();
+
+	/* b tells a it can decompress what a sends */
+	info.capabilities = MERLIN_CAP_SEQNONCE | MERLIN_CAP_LZ4 | MERLIN_CAP_ZSTD;
+	ck_assert(!seq_session(&b, &info));
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.sig.id = MERLIN_SIGNATURE;
+	pkt.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	pkt.hdr.len = sizeof(info);
+	memcpy(pkt.body, &info, sizeof(info));
+	node_set_info(&a, &pkt);
+	ck_assert_msg(a.zout != NULL, "Compression should have been negotiated with an encrypted node");
+
+	for (i = 0; i < 10; i++) {
+		memset(&pkt.hdr, 0, HDR_SIZE);
+		pkt.hdr.type = NEBCALLBACK_SERVICE_CHECK_DATA;
+		pkt.hdr.len = 1000;
+		memset(pkt.body, i, pkt.hdr.len);
+		ck_assert(!node_send_event(&a, &pkt));
+		if (!i) {
+			ck_assert_msg(recv(sv[1], rec, sizeof(rec), MSG_PEEK) == sizeof(rec) &&
+			              rec[0] == MERLIN_COMPACT_MAGIC && (rec[1] & MERLIN_COMPACT_ZBODY),
+			              "The body should be compressed before it's encrypted");
+		}
+	}
+	ck_assert_msg(a.stats.compress.wire < a.stats.compress.raw,
+	              "Compressed %llu bytes into %llu", a.stats.compress.raw, a.stats.compress.wire);
+
+	ck_assert(node_recv(&b) > 0);
+	for (i = 0; i < 10; i++) {
+		got = node_get_event(&b);
+		ck_assert_msg(got != NULL && got->hdr.len == 1000 && got->body[0] == i && got->body[999] == i,
+		              "Event %d should decrypt and decompress as it was sent", i);
+		slab_free(got);
+	}
+	ck_assert_msg(b.stats.decompress.raw == a.stats.compress.raw, "Everything sent should be decompressed");
+
+	a.state = b.state = STATE_NONE;
+	node_disconnect(&a, NULL);
+	node_disconnect(&b, NULL);
+	ck_assert_msg(a.zout == NULL && b.zbody_in == NULL, "The next connection should start out uncompressed");
+	nm_bufferqueue_destroy(a.bq);
+	nm_bufferqueue_destroy(b.bq);
+	safe_free(binlog_dir);
+}
+END_TEST
+
 Suite *
 check_hooks_suite(void)
 {
@@ -280,6 +847,20 @@ check_hooks_suite(void)
 	tcase_add_test(tc, multiple_svc_expire);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("backlog");
+	tcase_add_checked_fixture (tc, expiration_setup, expiration_teardown);
+	tcase_add_test(tc, priority_lane);
+	tcase_add_test(tc, output_buffer);
+	tcase_add_test(tc, frames);
+	tcase_add_test(tc, compact_header);
+	tcase_add_test(tc, compression);
+	tcase_add_test(tc, flow_control);
+	tcase_add_test(tc, interning);
+	tcase_add_test(tc, encrypted_fanout);
+	tcase_add_test(tc, replay);
+	tcase_add_test(tc, encrypted_compression);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 